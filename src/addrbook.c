@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 #include "addrbook.h"
 #include "util.h"
@@ -13,155 +14,960 @@
 #define LGPFX "ADDR:"
 
 
+/*
+ * Entries we never connected to are in the "new" table (0). Once a
+ * handshake completes, an entry moves to one of the "tried" tables according
+ * to its handshake latency, and moves again when its latency changes.
+ */
+#define ADDRBOOK_TABLE_NEW      0
+#define ADDRBOOK_NUM_TABLES     5
+
+/*
+ * A tried entry is evicted after that many failed attempts more than
+ * successful ones.
+ */
+#define ADDRBOOK_MAX_FAILURES   10
+
+/*
+ * Each table is a dense vector so that a random entry can be picked in
+ * O(1). 'hash_addr' maps an ip to its entry, and each entry records its
+ * table and slot: removal moves the last entry of the table into the hole.
+ */
+struct addrbook_table {
+   struct peer_addr      **addrs;
+   uint32                  num;
+   uint32                  size;
+};
+
+/*
+ * peers.dat is a log: a header followed by fixed-size records. ADD and
+ * TOUCH records carry the full entry and replace any previous version, a
+ * REMOVE record only needs the ip. Records are batched in memory and
+ * appended; once the file holds more than twice as many records as the book
+ * has entries, it is rewritten with one ADD per entry.
+ *
+ * Files without the magic are the older format: a plain array of
+ * btc_msg_address. They are converted when opened.
+ */
+#define ADDRBOOK_MAGIC          0x6b626461      // 'adbk'
+#define ADDRBOOK_VERSION        1
+#define ADDRBOOK_LOG_BATCH      1000
+#define ADDRBOOK_COMPACT_MIN    4096
+
+/*
+ * The last-seen time of an entry is logged again once it moved by that
+ * many seconds.
+ */
+#define ADDRBOOK_SEEN_PERIOD    (20 * 60)
+
+enum addrbook_op {
+   ADDRBOOK_OP_ADD    = 1,
+   ADDRBOOK_OP_REMOVE = 2,
+   ADDRBOOK_OP_TOUCH  = 3,
+};
+
+struct addrbook_file_header {
+   uint32          magic;
+   uint32          version;
+};
+
+struct addrbook_record {
+   btc_msg_address addr;
+   uint32          latency;
+   uint16          numAttempts;
+   uint16          numSuccess;
+   uint32          op;
+   uint32          unused;
+};
+
 struct addrbook {
    struct file_descriptor *desc;
    struct hashtable       *hash_addr;
+   struct addrbook_table   tables[ADDRBOOK_NUM_TABLES];
+   uint32                  numAddrs;
    char                   *filename;
-   int                     unsaved;
+
+   struct addrbook_record *log;         // records not written yet
+   uint32                  logLen;
+   uint32                  logSize;
+   uint64                  fileSize;
+   uint32                  numRecords;  // records in the file
 };
 
+static int addrbook_flush(struct addrbook *book);
+
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_table_add --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+addrbook_table_add(struct addrbook *book,
+                   uint32 tableIdx,
+                   struct peer_addr *paddr)
+{
+   struct addrbook_table *t = &book->tables[tableIdx];
+
+   if (t->num == t->size) {
+      t->size = MAX(1024, 2 * t->size);
+      t->addrs = safe_realloc(t->addrs, t->size * sizeof *t->addrs);
+   }
+   paddr->table = tableIdx;
+   paddr->idx = t->num;
+   t->addrs[t->num++] = paddr;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_table_del --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+addrbook_table_del(struct addrbook *book,
+                   const struct peer_addr *paddr)
+{
+   struct addrbook_table *t = &book->tables[paddr->table];
+   struct peer_addr *last;
+   uint32 idx = paddr->idx;
+
+   ASSERT(idx < t->num);
+   ASSERT(t->addrs[idx] == paddr);
+
+   last = t->addrs[--t->num];
+   t->addrs[idx] = last;
+   last->idx = idx;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_log --
+ *
+ *      Queues a record describing the current state of 'paddr'. Books that
+ *      are not backed by a file (benchmarks) do not log.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+addrbook_log(struct addrbook *book,
+             enum addrbook_op op,
+             const struct peer_addr *paddr)
+{
+   struct addrbook_record *rec;
+
+   if (book->desc == NULL) {
+      return;
+   }
+
+   if (book->logLen == book->logSize) {
+      book->logSize = MAX(64, 2 * book->logSize);
+      book->log = safe_realloc(book->log, book->logSize * sizeof *book->log);
+   }
+   rec = book->log + book->logLen++;
+
+   memset(rec, 0, sizeof *rec);
+   rec->addr        = paddr->addr;
+   rec->latency     = paddr->latency;
+   rec->numAttempts = paddr->numAttempts;
+   rec->numSuccess  = paddr->numSuccess;
+   rec->op          = op;
+
+   if (book->logLen >= ADDRBOOK_LOG_BATCH) {
+      addrbook_flush(book);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_add_entry_int --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+addrbook_add_entry_int(struct addrbook *book,
+                       struct peer_addr *paddr)
+{
+   bool s;
+
+   s = hashtable_insert(book->hash_addr, paddr->addr.ip,
+                        sizeof paddr->addr.ip, paddr);
+   if (s == 0) {
+      return 0;
+   }
+
+   addrbook_table_add(book, ADDRBOOK_TABLE_NEW, paddr);
+   book->numAddrs++;
+
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_get_count --
+ *
+ *------------------------------------------------------------------------
+ */
+
+uint32
+addrbook_get_count(const struct addrbook *book)
+{
+   return book->numAddrs;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_replace_entry --
+ *
+ *      The new entry inherits the history of the one it replaces.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+addrbook_replace_entry(struct addrbook *book,
+                       struct peer_addr *paddr)
+{
+   struct peer_addr *paddr0;
+   uint32 tableIdx;
+   bool s;
+
+   s = hashtable_lookup(book->hash_addr, paddr->addr.ip,
+                        sizeof paddr->addr.ip, (void*)&paddr0);
+   ASSERT(s);
+   paddr->numAttempts = paddr0->numAttempts;
+   paddr->numSuccess  = paddr0->numSuccess;
+   paddr->latency     = paddr0->latency;
+   tableIdx           = paddr0->table;
+   addrbook_remove_entry(book, paddr0);
+   free(paddr0);
+
+   /*
+    * Back in the tried table it was in, as addrbook_load_record() would.
+    */
+   s = addrbook_add_entry_int(book, paddr);
+   ASSERT(s);
+   if (tableIdx != ADDRBOOK_TABLE_NEW) {
+      addrbook_table_del(book, paddr);
+      addrbook_table_add(book, tableIdx, paddr);
+   }
+   addrbook_log(book, ADDRBOOK_OP_ADD, paddr);
+}
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_remove_entry_int --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+addrbook_remove_entry_int(struct addrbook *book,
+                          const struct peer_addr *paddr)
+{
+   bool s;
+
+   s = hashtable_remove(book->hash_addr, paddr->addr.ip,
+                        sizeof paddr->addr.ip);
+   ASSERT(s);
+   addrbook_table_del(book, paddr);
+   book->numAddrs--;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_remove_entry --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+addrbook_remove_entry(struct addrbook *book,
+                      const struct peer_addr *paddr)
+{
+   addrbook_log(book, ADDRBOOK_OP_REMOVE, paddr);
+   addrbook_remove_entry_int(book, paddr);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_get_rand_addr --
+ *
+ *      Uniform over all tables.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+struct peer_addr *
+addrbook_get_rand_addr(const struct addrbook *book)
+{
+   uint32 idx;
+   uint32 i;
+
+   if (book->numAddrs == 0) {
+      return NULL;
+   }
+   idx = random() % book->numAddrs;
+
+   for (i = 0; i < ADDRBOOK_NUM_TABLES; i++) {
+      const struct addrbook_table *t = &book->tables[i];
+
+      if (idx < t->num) {
+         return t->addrs[idx];
+      }
+      idx -= t->num;
+   }
+   NOT_REACHED();
+   return NULL;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_tried_table --
+ *
+ *      Tried table for a given handshake latency in msec.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static uint32
+addrbook_tried_table(uint32 latency)
+{
+   if (latency < 100) {
+      return 1;
+   } else if (latency < 300) {
+      return 2;
+   } else if (latency < 1000) {
+      return 3;
+   }
+   return 4;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_mark_attempt --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+addrbook_mark_attempt(struct addrbook *book,
+                      struct peer_addr *paddr)
+{
+   if (paddr->numAttempts < 0xffff) {
+      paddr->numAttempts++;
+   }
+   addrbook_log(book, ADDRBOOK_OP_TOUCH, paddr);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_mark_good --
+ *
+ *      The handshake with this peer completed 'latency' usec after we
+ *      started connecting to it.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+addrbook_mark_good(struct addrbook *book,
+                   struct peer_addr *paddr,
+                   mtime_t latency)
+{
+   uint32 msec = MIN(latency / 1000, 0xffffffffULL);
+   uint32 tableIdx;
+
+   if (paddr->numSuccess < paddr->numAttempts) {
+      paddr->numSuccess++;
+   }
+   if (paddr->table == ADDRBOOK_TABLE_NEW) {
+      paddr->latency = msec;
+   } else {
+      paddr->latency = (3ULL * paddr->latency + msec) / 4;
+   }
+
+   tableIdx = addrbook_tried_table(paddr->latency);
+   if (tableIdx != paddr->table) {
+      addrbook_table_del(book, paddr);
+      addrbook_table_add(book, tableIdx, paddr);
+   }
+   addrbook_log(book, ADDRBOOK_OP_TOUCH, paddr);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_mark_seen --
+ *
+ *      We just heard from this peer. The new time is only logged when the
+ *      previous one is more than ADDRBOOK_SEEN_PERIOD old.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+addrbook_mark_seen(struct addrbook *book,
+                   struct peer_addr *paddr,
+                   time_t now)
+{
+   struct peer_addr *cur;
+   bool log;
+
+   log = now >= (time_t)paddr->addr.time + ADDRBOOK_SEEN_PERIOD;
+   paddr->addr.time = now;
+
+   /*
+    * Entries dropped from the book must not come back on replay.
+    */
+   if (log == 0 ||
+       !hashtable_lookup(book->hash_addr, paddr->addr.ip,
+                         sizeof paddr->addr.ip, (void *)&cur) ||
+       cur != paddr) {
+      return;
+   }
+   addrbook_log(book, ADDRBOOK_OP_TOUCH, paddr);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_can_evict --
+ *
+ *      Whether a failure to connect to this peer should remove it from the
+ *      book. Peers that worked before get a few more chances.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+bool
+addrbook_can_evict(const struct peer_addr *paddr)
+{
+   return paddr->table == ADDRBOOK_TABLE_NEW ||
+          paddr->numAttempts - paddr->numSuccess >= ADDRBOOK_MAX_FAILURES;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_accept --
+ *
+ *      Filters a candidate drawn by addrbook_select_peer(). Tried entries
+ *      pass with probability (successes + 1) / (attempts + 1). New entries
+ *      that failed before are halved per failure, and so are the ones not
+ *      seen for a week.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static bool
+addrbook_accept(const struct peer_addr *paddr,
+                time_t now)
+{
+   uint32 failures;
+
+   if (paddr->connected || paddr->triedalready) {
+      return 0;
+   }
+   if ((paddr->addr.services & BTC_SERVICE_NODE_NETWORK) == 0) {
+      return 0;
+   }
+
+   if (paddr->table != ADDRBOOK_TABLE_NEW) {
+      return random() % (paddr->numAttempts + 1) <= paddr->numSuccess;
+   }
+
+   failures = MIN(paddr->numAttempts, 8);
+   if (paddr->addr.time + 7 * 24 * 3600 < now) {
+      failures++;
+   }
+   return (random() & ((1 << failures) - 1)) == 0;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_select_peer --
+ *
+ *      Picks an address to connect to. 3 times out of 4 the candidate comes
+ *      from the tried tables if there are any, where each entry of a table is
+ *      twice as likely to be drawn as one of the next slower table. Returns
+ *      NULL if no acceptable candidate was found.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+struct peer_addr *
+addrbook_select_peer(const struct addrbook *book)
+{
+   const struct addrbook_table *newTable = &book->tables[ADDRBOOK_TABLE_NEW];
+   time_t now = time(NULL);
+   uint32 numTried;
+   uint32 weight;
+   uint32 i;
+   uint32 n;
+
+   numTried = book->numAddrs - newTable->num;
+
+   weight = 0;
+   for (i = 1; i < ADDRBOOK_NUM_TABLES; i++) {
+      weight += book->tables[i].num << (ADDRBOOK_NUM_TABLES - 1 - i);
+   }
+
+   for (n = 0; n < 64; n++) {
+      struct peer_addr *paddr;
+
+      if (numTried > 0 && (newTable->num == 0 || random() % 4 != 0)) {
+         uint32 w = random() % weight;
+
+         for (i = 1; i < ADDRBOOK_NUM_TABLES; i++) {
+            const struct addrbook_table *t = &book->tables[i];
+            uint32 tw = t->num << (ADDRBOOK_NUM_TABLES - 1 - i);
+
+            if (w < tw) {
+               break;
+            }
+            w -= tw;
+         }
+         ASSERT(i < ADDRBOOK_NUM_TABLES);
+         paddr = book->tables[i].addrs[random() % book->tables[i].num];
+      } else if (newTable->num > 0) {
+         paddr = newTable->addrs[random() % newTable->num];
+      } else {
+         return NULL;
+      }
+
+      if (addrbook_accept(paddr, now)) {
+         return paddr;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_get_path --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static char *
+addrbook_get_path(struct config *config)
+{
+   char path[PATH_MAX];
+   char *dir;
+
+   dir = bitc_get_directory();
+   snprintf(path, sizeof path, "%s/peers.dat", dir);
+   free(dir);
+
+   return config_getstring(config, path, "peers.filename");
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_alloc --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct addrbook *
+addrbook_alloc(void)
+{
+   struct addrbook *book;
+
+   book = safe_calloc(1, sizeof *book);
+   book->hash_addr = hashtable_create();
+
+   return book;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_free --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+addrbook_free(struct addrbook *book)
+{
+   uint32 i;
+   uint32 j;
+
+   for (i = 0; i < ADDRBOOK_NUM_TABLES; i++) {
+      struct addrbook_table *t = &book->tables[i];
+
+      for (j = 0; j < t->num; j++) {
+         free(t->addrs[j]);
+      }
+      free(t->addrs);
+   }
+   free(book->log);
+   hashtable_clear(book->hash_addr);
+   hashtable_destroy(book->hash_addr);
+   free(book->filename);
+   free(book);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_compact --
+ *
+ *      Rewrites the whole file with one ADD record per entry, through a
+ *      temporary file so that a crash leaves either version intact. Pending
+ *      records are folded in.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+addrbook_compact(struct addrbook *book)
+{
+   struct addrbook_file_header *hdr;
+   struct addrbook_record *recs;
+   struct file_descriptor *desc;
+   size_t numWritten;
+   char *tmpFile;
+   uint8 *buf;
+   size_t len;
+   uint32 i;
+   uint32 j;
+   uint32 n;
+   int res;
+
+   len = sizeof *hdr + book->numAddrs * sizeof *recs;
+   buf = safe_calloc(1, len);
+   hdr = (void *)buf;
+   recs = (void *)(hdr + 1);
+
+   hdr->magic   = ADDRBOOK_MAGIC;
+   hdr->version = ADDRBOOK_VERSION;
+
+   n = 0;
+   for (i = 0; i < ADDRBOOK_NUM_TABLES; i++) {
+      const struct addrbook_table *t = &book->tables[i];
+
+      for (j = 0; j < t->num; j++) {
+         const struct peer_addr *paddr = t->addrs[j];
+
+         recs[n].addr        = paddr->addr;
+         recs[n].latency     = paddr->latency;
+         recs[n].numAttempts = paddr->numAttempts;
+         recs[n].numSuccess  = paddr->numSuccess;
+         recs[n].op          = ADDRBOOK_OP_ADD;
+         n++;
+      }
+   }
+   ASSERT(n == book->numAddrs);
+
+   desc = NULL;
+   tmpFile = safe_asprintf("%s.tmp", book->filename);
+   res = file_create(tmpFile);
+   if (res) {
+      goto exit;
+   }
+   res = file_open(tmpFile, 0 /* R/W */, 0 /* !unbuf */, &desc);
+   if (res) {
+      goto exit;
+   }
+   res = file_pwrite(desc, 0, buf, len, &numWritten);
+   if (res == 0 && numWritten != len) {
+      res = EIO;
+   }
+   if (res == 0) {
+      res = file_sync(desc);
+   }
+   if (res == 0) {
+      file_chmod(tmpFile, 0600);
+      res = file_rename(tmpFile, book->filename);
+   }
+   if (res) {
+      file_close(desc);
+      goto exit;
+   }
+
+   file_close(book->desc);
+   book->desc       = desc;
+   book->fileSize   = len;
+   book->numRecords = n;
+   book->logLen     = 0;
 
-struct savebook {
-   btc_msg_address *addrs;
-   int              idx;
-};
+   Log(LGPFX" compacted addrbook: %u addrs.\n", n);
 
+exit:
+   if (res) {
+      Warning(LGPFX" failed to write addrbook '%s': %s\n",
+              book->filename, strerror(res));
+      file_unlink(tmpFile);
+   }
+   free(tmpFile);
+   free(buf);
+   return res;
+}
 
 
 /*
  *------------------------------------------------------------------------
  *
- * addrbook_add_entry_int --
+ * addrbook_flush --
+ *
+ *      Appends the pending records, or compacts the file if the log has
+ *      grown too long compared to the book. If the compaction fails we
+ *      still try to append.
  *
  *------------------------------------------------------------------------
  */
 
-static bool
-addrbook_add_entry_int(struct addrbook *book,
-                       struct peer_addr *paddr)
+static int
+addrbook_flush(struct addrbook *book)
 {
-   return hashtable_insert(book->hash_addr, paddr->addr.ip,
-                           sizeof paddr->addr.ip, paddr);
-}
+   size_t numWritten;
+   size_t len;
+   int res;
 
+   if (book->logLen == 0) {
+      return 0;
+   }
 
-/*
- *------------------------------------------------------------------------
- *
- * addrbook_get_count --
- *
- *------------------------------------------------------------------------
- */
+   if (book->numRecords + book->logLen > ADDRBOOK_COMPACT_MIN &&
+       book->numRecords + book->logLen > 2 * book->numAddrs &&
+       addrbook_compact(book) == 0) {
+      return 0;
+   }
 
-uint32
-addrbook_get_count(const struct addrbook *book)
-{
-   return hashtable_getnumentries(book->hash_addr);
-}
+   len = book->logLen * sizeof *book->log;
 
+   Log(LGPFX" appending %u records.\n", book->logLen);
 
-/*
- *------------------------------------------------------------------------
- *
- * addrbook_replace_entry --
- *
- *------------------------------------------------------------------------
- */
+   res = file_pwrite(book->desc, book->fileSize, book->log, len, &numWritten);
+   if (res == 0 && numWritten != len) {
+      res = EIO;
+   }
+   if (res) {
+      Warning(LGPFX" failed to append to addrbook: %s\n", strerror(res));
+      /*
+       * Do not leave a partial record behind.
+       */
+      file_truncate(book->desc, book->fileSize);
+      return res;
+   }
 
-void
-addrbook_replace_entry(struct addrbook *book,
-                       struct peer_addr *paddr)
-{
-   struct peer_addr *paddr0;
-   bool s;
+   book->fileSize   += len;
+   book->numRecords += book->logLen;
+   book->logLen      = 0;
 
-   s = hashtable_lookup(book->hash_addr, paddr->addr.ip,
-                        sizeof paddr->addr.ip, (void*)&paddr0);
-   ASSERT(s);
-   addrbook_remove_entry(book, paddr0);
-   free(paddr0);
-   s = addrbook_add_entry(book, paddr);
-   ASSERT(s);
+   return 0;
 }
 
+
 /*
  *------------------------------------------------------------------------
  *
- * addrbook_remove_entry --
+ * addrbook_load_record --
  *
  *------------------------------------------------------------------------
  */
 
-void
-addrbook_remove_entry(struct addrbook *book,
-                      const struct peer_addr *paddr)
+static void
+addrbook_load_record(struct addrbook *book,
+                     const struct addrbook_record *rec)
 {
-   bool s;
+   struct peer_addr *paddr;
+   uint32 tableIdx;
 
-   s = hashtable_remove(book->hash_addr, paddr->addr.ip,
-                        sizeof paddr->addr.ip);
-   ASSERT(s);
+   if (!hashtable_lookup(book->hash_addr, rec->addr.ip,
+                         sizeof rec->addr.ip, (void *)&paddr)) {
+      paddr = NULL;
+   }
+
+   if (rec->op == ADDRBOOK_OP_REMOVE) {
+      if (paddr) {
+         addrbook_remove_entry_int(book, paddr);
+         free(paddr);
+      }
+      return;
+   }
+
+   if (rec->op != ADDRBOOK_OP_ADD && rec->op != ADDRBOOK_OP_TOUCH) {
+      Warning(LGPFX" unknown record type %u.\n", rec->op);
+      return;
+   }
+
+   if (paddr == NULL) {
+      bool s;
+
+      paddr = safe_calloc(1, sizeof *paddr);
+      memcpy(paddr->addr.ip, rec->addr.ip, sizeof paddr->addr.ip);
+      s = addrbook_add_entry_int(book, paddr);
+      ASSERT(s);
+   }
+   paddr->addr        = rec->addr;
+   paddr->latency     = rec->latency;
+   paddr->numAttempts = rec->numAttempts;
+   paddr->numSuccess  = rec->numSuccess;
+
+   tableIdx = ADDRBOOK_TABLE_NEW;
+   if (paddr->numSuccess > 0) {
+      tableIdx = addrbook_tried_table(paddr->latency);
+   }
+   if (tableIdx != paddr->table) {
+      addrbook_table_del(book, paddr);
+      addrbook_table_add(book, tableIdx, paddr);
+   }
 }
 
 
 /*
- *-------------------------------------------------------------------------
+ *------------------------------------------------------------------------
  *
- * addrbook_get_rand_addr --
+ * addrbook_load_legacy --
  *
- *-------------------------------------------------------------------------
+ *      Older books are a plain array of btc_msg_address.
+ *
+ *------------------------------------------------------------------------
  */
 
-struct peer_addr *
-addrbook_get_rand_addr(const struct addrbook *book)
+static int
+addrbook_load_legacy(struct addrbook *book,
+                     uint64 size)
 {
-   struct peer_addr *addr;
-   const uint8 *key;
-   size_t keyLen;
-   uint32 count;
-   uint32 idx;
+   btc_msg_address *buf;
+   uint64 offset;
+   int res = 0;
 
-   count = addrbook_get_count(book);
-   if (count == 0) {
-      return NULL;
-   }
+   Warning(LGPFX" converting addrbook -- %llu addrs.\n",
+           size / sizeof(btc_msg_address));
 
-   idx = random() % count;
+   buf = safe_malloc(1024 * sizeof *buf);
 
-   addr = NULL;
-   key = NULL;
-   keyLen = 0;
+   offset = 0;
+   while (offset < size) {
+      size_t numRead;
+      size_t numBytes;
+      size_t i;
 
-   hashtable_get_entry_idx(book->hash_addr, idx, (void *)&key,
-                           &keyLen, (void**)&addr);
+      numBytes = MIN(size - offset, 1024 * sizeof *buf);
+
+      res = file_pread(book->desc, offset, buf, numBytes, &numRead);
+      if (res != 0 || numRead == 0) {
+         break;
+      }
+      for (i = 0; i < numRead / sizeof *buf; i++) {
+         struct peer_addr *a = safe_calloc(1, sizeof *a);
 
-   ASSERT(addr);
-   ASSERT(key);
-   ASSERT(keyLen == 16);
+         memcpy(&a->addr, buf + i, sizeof(btc_msg_address));
+         if (!addrbook_add_entry_int(book, a)) {
+            free(a);
+         }
+      }
+      offset += numRead;
+   }
+   free(buf);
 
-   return addr;
+   if (res == 0) {
+      res = addrbook_compact(book);
+   }
+   return res;
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * addrbook_get_path --
+ * addrbook_load_log --
+ *
+ *      Replays the records of the file, a chunk at a time. A torn record at
+ *      the end, from a crash during an append, is dropped.
  *
  *------------------------------------------------------------------------
  */
 
-static char *
-addrbook_get_path(struct config *config)
+static int
+addrbook_load_log(struct addrbook *book,
+                  uint64 size)
 {
-   char path[PATH_MAX];
-   char *dir;
+   struct addrbook_record *buf;
+   uint64 offset;
+   uint64 end;
+   int res = 0;
+
+   offset = sizeof(struct addrbook_file_header);
+   end = offset + (size - offset) / sizeof *buf * sizeof *buf;
+
+   if (end != size) {
+      Warning(LGPFX" dropping %llu bytes at the end of the addrbook.\n",
+              size - end);
+      res = file_truncate(book->desc, end);
+      if (res) {
+         return res;
+      }
+   }
 
-   dir = bitc_get_directory();
-   snprintf(path, sizeof path, "%s/peers.dat", dir);
-   free(dir);
+   buf = safe_malloc(1024 * sizeof *buf);
 
-   return config_getstring(config, path, "peers.filename");
+   while (offset < end) {
+      size_t numRead;
+      size_t numBytes;
+      size_t i;
+
+      numBytes = MIN(end - offset, 1024 * sizeof *buf);
+
+      res = file_pread(book->desc, offset, buf, numBytes, &numRead);
+      if (res != 0 || numRead == 0) {
+         break;
+      }
+      for (i = 0; i < numRead / sizeof *buf; i++) {
+         addrbook_load_record(book, buf + i);
+      }
+      book->numRecords += numRead / sizeof *buf;
+      offset += numRead;
+   }
+   free(buf);
+
+   book->fileSize = offset;
+
+   return res;
 }
 
 
@@ -177,15 +983,17 @@ int
 addrbook_open(struct config *config,
               struct addrbook **bookOut)
 {
+   struct addrbook_file_header hdr;
    struct addrbook *book;
-   uint64 offset;
+   size_t numRead;
    int64 size;
    int res;
 
-   book = safe_malloc(sizeof *book);
-   book->hash_addr = hashtable_create();
+   ASSERT_ON_COMPILE(sizeof(struct addrbook_file_header) == 8);
+   ASSERT_ON_COMPILE(sizeof(struct addrbook_record) == 48);
+
+   book = addrbook_alloc();
    book->filename  = addrbook_get_path(config);
-   book->unsaved   = 0;
 
    if (!file_exists(book->filename)) {
       Warning(LGPFX" creating new addrbook: %s.\n", book->filename);
@@ -219,39 +1027,50 @@ addrbook_open(struct config *config,
       char *s = print_size(size);
       char *name = file_getname(book->filename);
 
-      Warning(LGPFX" reading file %s -- %s -- %llu addrs.\n",
-              name, s, size / sizeof(btc_msg_address));
+      Warning(LGPFX" reading file %s -- %s.\n", name, s);
       free(name);
       free(s);
    }
 
-   offset = 0;
-   while (offset < size) {
-      btc_msg_address buf[10000];
-      size_t numRead;
-      size_t numBytes;
-      int numAddrs;
-      int i;
-
-      numBytes = MIN(size - offset, sizeof buf);
-
-      res = file_pread(book->desc, offset, buf, numBytes, &numRead);
-      if (res != 0) {
-         break;
+   memset(&hdr, 0, sizeof hdr);
+   if (size >= sizeof hdr) {
+      res = file_pread(book->desc, 0, &hdr, sizeof hdr, &numRead);
+      if (res) {
+         goto exit;
       }
-      numAddrs = numRead / sizeof(btc_msg_address);
-      for (i = 0; i < numAddrs; i++) {
-         struct peer_addr *a = safe_calloc(1, sizeof *a);
-         bool s;
+   }
 
-         memcpy(&a->addr, buf + i, sizeof(btc_msg_address));
-         s = addrbook_add_entry_int(book, a);
-         ASSERT(s);
+   if (size == 0) {
+      size_t numWritten;
+
+      /*
+       * A new or empty file: start a log right away.
+       */
+      hdr.magic   = ADDRBOOK_MAGIC;
+      hdr.version = ADDRBOOK_VERSION;
+      res = file_pwrite(book->desc, 0, &hdr, sizeof hdr, &numWritten);
+      if (res == 0 && numWritten != sizeof hdr) {
+         res = EIO;
       }
-
-      offset += numRead;
+      book->fileSize = sizeof hdr;
+   } else if (hdr.magic == ADDRBOOK_MAGIC && hdr.version == ADDRBOOK_VERSION) {
+      res = addrbook_load_log(book, size);
+      if (res == 0 && book->numRecords > ADDRBOOK_COMPACT_MIN &&
+          book->numRecords > 2 * book->numAddrs) {
+         res = addrbook_compact(book);
+      }
+   } else if (hdr.magic == ADDRBOOK_MAGIC) {
+      Warning(LGPFX" unsupported addrbook version %u.\n", hdr.version);
+      res = EINVAL;
+   } else {
+      res = addrbook_load_legacy(book, size);
+   }
+   if (res) {
+      goto exit;
    }
 
+   Log(LGPFX" %u addrs, %u records.\n", book->numAddrs, book->numRecords);
+
    *bookOut = book;
 exit:
    return res;
@@ -284,97 +1103,254 @@ addrbook_zap(struct config *config)
 /*
  *------------------------------------------------------------------------
  *
- * addrbook_save --
+ * addrbook_close --
  *
  *------------------------------------------------------------------------
  */
 
-static int
-addrbook_save(struct addrbook *book)
+int
+addrbook_close(struct addrbook *book)
 {
-   btc_msg_address *addrs = NULL;
-   size_t numWritten;
-   size_t len;
-   uint32 count;
-   int res;
+   if (book == NULL) {
+      return 0;
+   }
+   addrbook_flush(book);
+   file_close(book->desc);
+   hashtable_printstats(book->hash_addr, "addr");
+   addrbook_free(book);
+   return 0;
+}
+
 
-   count = addrbook_get_count(book);
-   ASSERT(count > 0);
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_add_entry --
+ *
+ *------------------------------------------------------------------------
+ */
 
-   hashtable_linearize(book->hash_addr, sizeof(btc_msg_address), (void *)&addrs);
-   ASSERT(addrs);
-   len = count * sizeof *addrs;
+bool
+addrbook_add_entry(struct addrbook *book,
+                   struct peer_addr *paddr)
+{
+   bool s;
 
-   res = file_truncate(book->desc, 0);
-   if (res != 0) {
-      Warning(LGPFX" failed to truncate addrbook: %s\n",
-              strerror(res));
+   s = addrbook_add_entry_int(book, paddr);
+   if (s == 0) {
+      return 0;
    }
+   addrbook_log(book, ADDRBOOK_OP_ADD, paddr);
+   return s;
+}
 
-   Log(LGPFX" saving %u addr.\n", count);
 
-   res = file_pwrite(book->desc, 0, addrs, len, &numWritten);
-   if (res || numWritten != len) {
-      Warning(LGPFX" Failed to write addrbook: %s\n",
-              strerror(res));
-   } else {
-      book->unsaved = 0;
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_bench_refill --
+ *
+ *      Mimics the initial peergroup_refill(): picks random entries until 50
+ *      peers would be connected or 2000 picks were made. With 'walk', picks
+ *      go through hashtable_get_entry_idx() as they used to.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static mtime_t
+addrbook_bench_refill(struct addrbook *book,
+                      bool walk,
+                      uint32 *numPicks)
+{
+   struct peer_addr *picked[50];
+   uint32 numPicked = 0;
+   uint32 numTried = 0;
+   mtime_t ts;
+   uint32 i;
+
+   ts = time_get();
+   while (numTried < 2000 && numPicked < ARRAYSIZE(picked)) {
+      struct peer_addr *paddr;
+
+      numTried++;
+      if (walk) {
+         const void *key;
+         size_t keyLen;
+
+         hashtable_get_entry_idx(book->hash_addr, random() % book->numAddrs,
+                                 &key, &keyLen, (void **)&paddr);
+      } else {
+         paddr = addrbook_get_rand_addr(book);
+      }
+      if (paddr->triedalready || paddr->connected) {
+         continue;
+      }
+      if ((paddr->addr.services & BTC_SERVICE_NODE_NETWORK) == 0) {
+         continue;
+      }
+      paddr->connected = 1;
+      picked[numPicked++] = paddr;
    }
+   ts = time_get() - ts;
 
-   free(addrs);
-   return res;
+   for (i = 0; i < numPicked; i++) {
+      picked[i]->connected = 0;
+   }
+   *numPicks = numTried;
+   return ts;
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * addrbook_close --
+ * addrbook_bench_sessions --
+ *
+ *      Simulates successive refills of 20 peers from a book of 'n' addresses
+ *      where only 3 in 10 are reachable, with handshake latencies between
+ *      50ms and 2s. The others time out and stay in the book. Reports the
+ *      connection attempts each refill needed and the average latency of
+ *      the peers it got.
  *
  *------------------------------------------------------------------------
  */
 
-int
-addrbook_close(struct addrbook *book)
+static void
+addrbook_bench_sessions(uint32 n,
+                        bool scored)
 {
-   if (book == NULL) {
-      return 0;
+   struct addrbook *book = addrbook_alloc();
+   time_t now = time(NULL);
+   char str[256];
+   size_t len;
+   uint32 session;
+   uint32 i;
+
+   for (i = 0; i < n; i++) {
+      struct peer_addr *a = safe_calloc(1, sizeof *a);
+      bool s;
+
+      a->addr.ip[10] = 0xff;
+      a->addr.ip[11] = 0xff;
+      memcpy(a->addr.ip + 12, &i, sizeof i);
+      a->addr.services = BTC_SERVICE_NODE_NETWORK;
+      a->addr.time = now;
+
+      s = addrbook_add_entry_int(book, a);
+      ASSERT(s);
    }
-   if (book->unsaved > 0) {
-      addrbook_save(book);
+
+   len = snprintf(str, sizeof str, "%-7s:", scored ? "scored" : "uniform");
+
+   for (session = 0; session < 10; session++) {
+      struct peer_addr *picked[20];
+      uint32 numPicked = 0;
+      uint32 numAttempts = 0;
+      uint32 numIter = 0;
+      uint64 latency = 0;
+
+      while (numPicked < ARRAYSIZE(picked) && numIter++ < 100000) {
+         struct peer_addr *paddr;
+         uint32 ip;
+
+         if (scored) {
+            paddr = addrbook_select_peer(book);
+            if (paddr == NULL) {
+               continue;
+            }
+         } else {
+            paddr = addrbook_get_rand_addr(book);
+            if (paddr->triedalready || paddr->connected) {
+               continue;
+            }
+         }
+         paddr->triedalready = 1;
+         addrbook_mark_attempt(book, paddr);
+         numAttempts++;
+
+         memcpy(&ip, paddr->addr.ip + 12, sizeof ip);
+         if (ip % 10 < 3) {
+            uint32 msec = 50 + (ip * 7919) % 1950;
+
+            addrbook_mark_good(book, paddr, msec * 1000ULL);
+            paddr->connected = 1;
+            picked[numPicked++] = paddr;
+            latency += msec;
+         }
+      }
+
+      len += snprintf(str + len, sizeof str - len, " %5u att %4llums",
+                      numAttempts, latency / MAX(1, numPicked));
+
+      /*
+       * Next refill: all the peers went away.
+       */
+      for (i = 0; i < ARRAYSIZE(book->tables); i++) {
+         uint32 j;
+
+         for (j = 0; j < book->tables[i].num; j++) {
+            book->tables[i].addrs[j]->triedalready = 0;
+            book->tables[i].addrs[j]->connected = 0;
+         }
+      }
    }
-   file_close(book->desc);
-   hashtable_printstats(book->hash_addr, "addr");
-   hashtable_clear_with_free(book->hash_addr);
-   hashtable_destroy(book->hash_addr);
-   free(book->filename);
-   free(book);
-   return 0;
+   Warning(LGPFX" %s\n", str);
+   addrbook_free(book);
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * addrbook_add_entry --
+ * addrbook_bench --
+ *
+ *      Time to pick the initial set of peers from books of increasing size.
+ *      3 out of 4 entries are marked as already tried, as in a book that
+ *      has been in use for a while. Then compares uniform and scored peer
+ *      selection.
  *
  *------------------------------------------------------------------------
  */
 
-bool
-addrbook_add_entry(struct addrbook *book,
-                   struct peer_addr *paddr)
+void
+addrbook_bench(volatile int *stop)
 {
-   bool s;
+   static const uint32 sizes[] = { 1000, 10000, 100000 };
+   uint32 j;
 
-   s = addrbook_add_entry_int(book, paddr);
-   if (s == 0) {
-      return 0;
-   }
+   for (j = 0; *stop == 0 && j < ARRAYSIZE(sizes); j++) {
+      struct addrbook *book = addrbook_alloc();
+      char *walkStr;
+      char *vecStr;
+      uint32 numPicks;
+      uint32 i;
+
+      for (i = 0; i < sizes[j]; i++) {
+         struct peer_addr *a = safe_calloc(1, sizeof *a);
+         bool s;
 
-   book->unsaved++;
-   if (book->unsaved >= 1000) {
-      addrbook_save(book);
+         a->addr.ip[10] = 0xff;
+         a->addr.ip[11] = 0xff;
+         memcpy(a->addr.ip + 12, &i, sizeof i);
+         a->addr.services = BTC_SERVICE_NODE_NETWORK;
+         a->triedalready = (i % 4) != 0;
+
+         s = addrbook_add_entry_int(book, a);
+         ASSERT(s);
+      }
+
+      walkStr = print_latency(addrbook_bench_refill(book, 1, &numPicks));
+      vecStr  = print_latency(addrbook_bench_refill(book, 0, &numPicks));
+
+      Warning(LGPFX" refill from %6u addrs: ~%u picks -- "
+              "index walk %s, vector %s\n",
+              sizes[j], numPicks, walkStr, vecStr);
+      free(walkStr);
+      free(vecStr);
+      addrbook_free(book);
    }
-   return s;
+
+   Warning(LGPFX" 10 refills of 20 peers from 10000 addrs, 30%% reachable:\n");
+   addrbook_bench_sessions(10000, 0);
+   addrbook_bench_sessions(10000, 1);
 }
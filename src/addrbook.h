@@ -6,11 +6,20 @@
 
 struct addrbook;
 
+/*
+ * 'table' is 0 for addresses we never managed to connect to. The others are
+ * in one of the "tried" tables, bucketed by handshake latency.
+ */
 struct peer_addr {
    btc_msg_address addr;
    uint32          connected:1;
    uint32          triedalready:1;
-   uint32          unused:30;
+   uint32          table:3;
+   uint32          unused:27;
+   uint32          idx;             // slot in the addrbook table
+   uint16          numAttempts;
+   uint16          numSuccess;
+   uint32          latency;         // msec, connect to handshake, averaged
 };
 
 
@@ -20,7 +29,15 @@ uint32 addrbook_get_count(const struct addrbook *book);
 bool addrbook_add_entry(struct addrbook *book, struct peer_addr *paddr);
 void addrbook_zap(struct config *config);
 struct peer_addr* addrbook_get_rand_addr(const struct addrbook *book);
+struct peer_addr *addrbook_select_peer(const struct addrbook *book);
+void addrbook_mark_attempt(struct addrbook *book, struct peer_addr *paddr);
+void addrbook_mark_good(struct addrbook *book, struct peer_addr *paddr,
+                        mtime_t latency);
+void addrbook_mark_seen(struct addrbook *book, struct peer_addr *paddr,
+                        time_t now);
+bool addrbook_can_evict(const struct peer_addr *paddr);
 void addrbook_remove_entry(struct addrbook *book, const struct peer_addr *paddr);
 void addrbook_replace_entry(struct addrbook *book, struct peer_addr *paddr);
+void addrbook_bench(volatile int *stop);
 
 #endif /* __ADDRBOOK_H__ */
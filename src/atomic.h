@@ -83,6 +83,24 @@ atomic_add(atomic_uint32 *var,
 }
 
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * atomic_add_return --
+ *
+ *      Returns the new value.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static inline uint32
+atomic_add_return(atomic_uint32 *var,
+                  uint32 val)
+{
+   return __sync_add_and_fetch(&var->value, val);
+}
+
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -536,7 +536,7 @@ bitcui_init(void)
    int res;
 
    bitcui_set_status("ui starting..");
-   btcui->poll = poll_create();
+   btcui->poll = poll_create(btc->config);
 
    res = bitcui_notify_init(&btcui->eventFd, &btcui->notifyFd);
    ASSERT(res == 0);
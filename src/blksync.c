@@ -0,0 +1,1265 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "blksync.h"
+#include "btc-message.h"
+#include "hash.h"
+#include "hashtable.h"
+#include "poll.h"
+#include "util.h"
+
+#define LGPFX "BSYNC:"
+
+static int verbose = 0;
+
+
+/*
+ * Filtered block download manager.
+ *
+ * The hashes of the blocks to fetch are split in chunks of 'chunkSize'
+ * consecutive blocks. Each chunk is requested from a single peer with a
+ * getdata followed by a ping: the peer sends the merkleblocks it has, each one
+ * followed by the transactions matching our filter, then answers the ping.
+ *
+ * Only the chunks within 'windowSize' of the first one not yet delivered may
+ * be requested, which bounds what has to be buffered while waiting for a slow
+ * chunk. A peer has at most 'maxPerPeer' chunks outstanding so that it always
+ * has the next one queued when it is done with the current one.
+ *
+ * Blocks are handed over to the caller in chain order, once all the
+ * transactions that matched in them have arrived -- or once the peer moved on
+ * to something else since it won't send any more of them.
+ *
+ * A chunk whose owner did not send anything for 'stallTimeout' usec is
+ * released and the owner is not given more work until it answers. A pong that
+ * leaves blocks of its chunk missing releases the chunk to another peer, and
+ * so does a peer going away.
+ */
+
+#define BLKSYNC_NONCE_MAGIC     0xb10c500000000000ULL
+#define BLKSYNC_NONCE_MASK      0xfffff00000000000ULL
+
+struct blksync_slot {
+   btc_msg_merkleblock *blk;           // NULL until received
+   struct blksync_tx   *txs;           // indexed as blk->matchedTxHash
+   int                  numTx;
+   void                *peer;          // who sent the block
+   bool                 final;         // no more tx to wait for
+};
+
+struct blksync_chunk {
+   int                  first;         // index of the first block
+   int                  num;
+   struct blksync_slot *slots;         // allocated on first use
+   int                  numRecv;
+   int                  numDelivered;
+
+   void                *peer;          // owner of the outstanding request
+   void                *lastPeer;      // last owner that left it incomplete
+   uint64               nonce;
+   mtime_t              reqTS;         // last sign of progress
+};
+
+struct blksync_peer {
+   void                *peer;
+   int                  numReq;
+   int                  lastIdx;       // last block received, -1 when final
+   bool                 dup;           // .. and we already had it
+   bool                 stalled;
+   mtime_t              lastTS;
+};
+
+struct blksync {
+   uint256              *hashes;
+   int                   numHashes;
+   struct hashtable     *hash_idx;
+
+   struct blksync_chunk *chunks;
+   int                   numChunks;
+   int                   head;         // first chunk not entirely delivered
+   int                   chunkSize;
+   int                   windowSize;
+   int                   maxPerPeer;
+
+   struct blksync_peer  *peers;
+   int                   numPeers;
+   int                   peersSize;
+
+   mtime_t               stallTimeout;
+   uint64                nonceSeq;
+
+   blksync_request_cb   *requestCb;
+   blksync_deliver_cb   *deliverCb;
+   void                 *clientData;
+
+   uint32                numRequests;
+   uint32                numStalls;
+   uint32                numDups;
+};
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_create --
+ *
+ *      'hashes' are the blocks to download, in chain order.
+ *
+ *------------------------------------------------------------------------
+ */
+
+struct blksync *
+blksync_create(const uint256 *hashes,
+               int numHashes,
+               int chunkSize,
+               int windowSize,
+               int maxPerPeer,
+               mtime_t stallTimeout,
+               blksync_request_cb *requestCb,
+               blksync_deliver_cb *deliverCb,
+               void *clientData)
+{
+   struct blksync *bs;
+   int i;
+
+   ASSERT(requestCb);
+   ASSERT(deliverCb);
+   ASSERT(chunkSize > 0 && chunkSize <= BTC_MSG_GETDATA_MAX_ENTRIES);
+   ASSERT(windowSize > 0);
+   ASSERT(maxPerPeer > 0);
+
+   bs = safe_calloc(1, sizeof *bs);
+   bs->hashes       = safe_malloc(MAX(numHashes, 1) * sizeof *bs->hashes);
+   bs->numHashes    = numHashes;
+   bs->hash_idx     = hashtable_create_fixed(sizeof(uint256));
+   bs->numChunks    = (numHashes + chunkSize - 1) / chunkSize;
+   bs->chunks       = safe_calloc(MAX(bs->numChunks, 1), sizeof *bs->chunks);
+   bs->chunkSize    = chunkSize;
+   bs->windowSize   = windowSize;
+   bs->maxPerPeer   = maxPerPeer;
+   bs->stallTimeout = stallTimeout;
+   bs->requestCb    = requestCb;
+   bs->deliverCb    = deliverCb;
+   bs->clientData   = clientData;
+
+   memcpy(bs->hashes, hashes, numHashes * sizeof *hashes);
+   for (i = 0; i < numHashes; i++) {
+      hashtable_insert(bs->hash_idx, bs->hashes + i, sizeof bs->hashes[i],
+                       (void *)(uintptr_t)i);
+   }
+   for (i = 0; i < bs->numChunks; i++) {
+      bs->chunks[i].first = i * chunkSize;
+      bs->chunks[i].num   = MIN(chunkSize, numHashes - i * chunkSize);
+   }
+
+   Log(LGPFX" %d block%s in %d chunk%s of %d, window: %d.\n",
+       numHashes, numHashes > 1 ? "s" : "",
+       bs->numChunks, bs->numChunks > 1 ? "s" : "", chunkSize, windowSize);
+
+   return bs;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_slot_reset --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_slot_reset(struct blksync_slot *s)
+{
+   int i;
+
+   if (s->blk) {
+      for (i = 0; i < s->blk->matchedTxCount; i++) {
+         free(s->txs[i].buf);
+      }
+      btc_msg_merkleblock_free(s->blk);
+   }
+   free(s->txs);
+   memset(s, 0, sizeof *s);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_destroy --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+blksync_destroy(struct blksync *bs)
+{
+   int i;
+   int j;
+
+   if (bs == NULL) {
+      return;
+   }
+
+   Log(LGPFX" %u getdata sent, %u stall%s, %u duplicate%s.\n",
+       bs->numRequests, bs->numStalls, bs->numStalls != 1 ? "s" : "",
+       bs->numDups, bs->numDups != 1 ? "s" : "");
+
+   for (i = 0; i < bs->numChunks; i++) {
+      struct blksync_chunk *c = bs->chunks + i;
+
+      if (c->slots == NULL) {
+         continue;
+      }
+      for (j = 0; j < c->num; j++) {
+         blksync_slot_reset(c->slots + j);
+      }
+      free(c->slots);
+   }
+   hashtable_clear(bs->hash_idx);
+   hashtable_destroy(bs->hash_idx);
+   free(bs->chunks);
+   free(bs->hashes);
+   free(bs->peers);
+   free(bs);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_is_complete --
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+blksync_is_complete(const struct blksync *bs)
+{
+   return bs->head == bs->numChunks;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_window_end --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blksync_window_end(const struct blksync *bs)
+{
+   return MIN(bs->numChunks, bs->head + bs->windowSize);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_lookup_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct blksync_peer *
+blksync_lookup_peer(const struct blksync *bs,
+                    const void *peer)
+{
+   int i;
+
+   for (i = 0; i < bs->numPeers; i++) {
+      if (bs->peers[i].peer == peer) {
+         return bs->peers + i;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_get_slot --
+ *
+ *      Returns NULL if the block was already delivered.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct blksync_slot *
+blksync_get_slot(struct blksync *bs,
+                 int idx)
+{
+   struct blksync_chunk *c = bs->chunks + idx / bs->chunkSize;
+
+   if (idx / bs->chunkSize < bs->head ||
+       idx - c->first < c->numDelivered) {
+      return NULL;
+   }
+   if (c->slots == NULL) {
+      c->slots = safe_calloc(c->num, sizeof *c->slots);
+   }
+   return c->slots + idx - c->first;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_release_chunk --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_release_chunk(struct blksync *bs,
+                      struct blksync_chunk *c)
+{
+   struct blksync_peer *p;
+
+   ASSERT(c->peer);
+
+   p = blksync_lookup_peer(bs, c->peer);
+   ASSERT(p);
+   ASSERT(p->numReq > 0);
+
+   p->numReq--;
+   c->peer = NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_peer_finalize --
+ *
+ *      The peer moved on: the last block it sent won't get more tx.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_peer_finalize(struct blksync *bs,
+                      struct blksync_peer *p)
+{
+   struct blksync_slot *s;
+
+   if (p->lastIdx < 0) {
+      return;
+   }
+   s = blksync_get_slot(bs, p->lastIdx);
+   if (s && s->blk && s->peer == p->peer) {
+      s->final = 1;
+   }
+   p->lastIdx = -1;
+   p->dup     = 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_peer_drop_last --
+ *
+ *      The peer won't finish sending the tx of its last block: forget about
+ *      the block so that it gets requested again.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_peer_drop_last(struct blksync *bs,
+                       struct blksync_peer *p)
+{
+   struct blksync_slot *s;
+
+   if (p->lastIdx < 0) {
+      return;
+   }
+   s = blksync_get_slot(bs, p->lastIdx);
+   if (s && s->blk && s->peer == p->peer && s->final == 0) {
+      LOG(1, (LGPFX" block #%d: dropped.\n", p->lastIdx));
+      blksync_slot_reset(s);
+      bs->chunks[p->lastIdx / bs->chunkSize].numRecv--;
+   }
+   p->lastIdx = -1;
+   p->dup     = 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_request --
+ *
+ *      Asks for the blocks of the chunk we do not have yet.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blksync_request(struct blksync *bs,
+                struct blksync_peer *p,
+                int ci)
+{
+   struct blksync_chunk *c = bs->chunks + ci;
+   uint256 *hashes;
+   int res;
+   int n = 0;
+   int i;
+
+   ASSERT(c->peer == NULL);
+   ASSERT(c->numRecv < c->num);
+
+   hashes = safe_malloc((c->num - c->numRecv) * sizeof *hashes);
+   for (i = 0; i < c->num; i++) {
+      if (c->slots == NULL || c->slots[i].blk == NULL) {
+         hashes[n++] = bs->hashes[c->first + i];
+      }
+   }
+   ASSERT(n == c->num - c->numRecv);
+
+   c->peer  = p->peer;
+   c->nonce = BLKSYNC_NONCE_MAGIC | (bs->nonceSeq++ & ~BLKSYNC_NONCE_MASK);
+   c->reqTS = time_get();
+   p->numReq++;
+
+   LOG(1, (LGPFX" chunk #%d: requesting %d block%s.\n",
+           ci, n, n > 1 ? "s" : ""));
+
+   bs->numRequests++;
+
+   res = bs->requestCb(p->peer, hashes, n, c->nonce, bs->clientData);
+   free(hashes);
+
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_next_chunk --
+ *
+ *      Lowest chunk in the window nobody is working on. Unless 'any' is set,
+ *      skip the ones this peer already left incomplete.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blksync_next_chunk(const struct blksync *bs,
+                   const struct blksync_peer *p,
+                   bool any)
+{
+   int end = blksync_window_end(bs);
+   int i;
+
+   for (i = bs->head; i < end; i++) {
+      const struct blksync_chunk *c = bs->chunks + i;
+
+      if (c->peer || c->numRecv == c->num) {
+         continue;
+      }
+      if (any || c->lastPeer != p->peer) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_dispatch --
+ *
+ *      Hands out the chunks of the window one at a time to each peer with
+ *      room for more, so that the work gets spread over all of them. A chunk
+ *      only goes back to the peer that left it incomplete when no one else
+ *      can take it.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_dispatch(struct blksync *bs)
+{
+   int pass;
+
+   for (pass = 0; pass < 2; pass++) {
+      bool progress;
+
+      do {
+         int i;
+
+         progress = 0;
+         for (i = 0; i < bs->numPeers; i++) {
+            struct blksync_peer *p = bs->peers + i;
+            int ci;
+
+            if (p->stalled || p->numReq >= bs->maxPerPeer) {
+               continue;
+            }
+            ci = blksync_next_chunk(bs, p, pass == 1);
+            if (ci < 0) {
+               continue;
+            }
+            blksync_request(bs, p, ci);
+            progress = 1;
+         }
+      } while (progress);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_deliver --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_deliver(struct blksync *bs,
+                struct blksync_slot *s)
+{
+   int n = 0;
+   int i;
+
+   /*
+    * Squeeze out the tx that never came, keeping the block order.
+    */
+   for (i = 0; i < s->blk->matchedTxCount; i++) {
+      if (s->txs[i].buf) {
+         s->txs[n++] = s->txs[i];
+      }
+   }
+   ASSERT(n == s->numTx);
+
+   bs->deliverCb(s->blk, s->txs, n, bs->clientData);
+
+   for (i = 0; i < n; i++) {
+      free(s->txs[i].buf);
+   }
+   btc_msg_merkleblock_free(s->blk);
+   free(s->txs);
+   memset(s, 0, sizeof *s);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_flush --
+ *
+ *      Delivers the blocks that are now in sequence.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_flush(struct blksync *bs)
+{
+   while (bs->head < bs->numChunks) {
+      struct blksync_chunk *c = bs->chunks + bs->head;
+
+      while (c->numDelivered < c->num) {
+         struct blksync_slot *s;
+
+         if (c->slots == NULL) {
+            return;
+         }
+         s = c->slots + c->numDelivered;
+         if (s->blk == NULL || s->final == 0) {
+            return;
+         }
+         blksync_deliver(bs, s);
+         c->numDelivered++;
+      }
+      ASSERT(c->peer == NULL);
+      free(c->slots);
+      c->slots = NULL;
+      bs->head++;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_add_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+blksync_add_peer(struct blksync *bs,
+                 void *peer)
+{
+   struct blksync_peer *p;
+
+   if (blksync_lookup_peer(bs, peer)) {
+      return;
+   }
+   if (bs->numPeers == bs->peersSize) {
+      bs->peersSize = MAX(8, 2 * bs->peersSize);
+      bs->peers = safe_realloc(bs->peers, bs->peersSize * sizeof *bs->peers);
+   }
+   p = bs->peers + bs->numPeers++;
+   memset(p, 0, sizeof *p);
+   p->peer    = peer;
+   p->lastIdx = -1;
+   p->lastTS  = time_get();
+
+   blksync_dispatch(bs);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_remove_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+blksync_remove_peer(struct blksync *bs,
+                    void *peer)
+{
+   struct blksync_peer *p;
+   int end;
+   int i;
+
+   p = blksync_lookup_peer(bs, peer);
+   if (p == NULL) {
+      return;
+   }
+
+   end = blksync_window_end(bs);
+   for (i = bs->head; i < end; i++) {
+      if (bs->chunks[i].peer == peer) {
+         LOG(1, (LGPFX" chunk #%d: owner going away.\n", i));
+         blksync_release_chunk(bs, bs->chunks + i);
+      }
+   }
+   ASSERT(p->numReq == 0);
+   blksync_peer_drop_last(bs, p);
+
+   *p = bs->peers[--bs->numPeers];
+
+   blksync_dispatch(bs);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_handle_merkleblock --
+ *
+ *      Returns TRUE if the block is one of ours. Its content is copied.
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+blksync_handle_merkleblock(struct blksync *bs,
+                           void *peer,
+                           const btc_msg_merkleblock *blk)
+{
+   struct blksync_chunk *c;
+   struct blksync_peer *p;
+   struct blksync_slot *s;
+   void *ptr;
+   int idx;
+
+   p = blksync_lookup_peer(bs, peer);
+   if (p == NULL) {
+      return 0;
+   }
+   blksync_peer_finalize(bs, p);
+   p->lastTS = time_get();
+
+   if (!hashtable_lookup(bs->hash_idx, &blk->blkHash, sizeof blk->blkHash,
+                         &ptr)) {
+      blksync_flush(bs);
+      return 0;
+   }
+   idx = (int)(uintptr_t)ptr;
+   c = bs->chunks + idx / bs->chunkSize;
+
+   s = blksync_get_slot(bs, idx);
+   if (s == NULL || s->blk) {
+      /*
+       * Late answer to a chunk that went to someone else in the meantime.
+       */
+      bs->numDups++;
+      if (s) {
+         p->lastIdx = idx;
+         p->dup = 1;
+      }
+      blksync_flush(bs);
+      return 1;
+   }
+
+   s->blk = safe_calloc(1, sizeof *s->blk);
+   s->blk->header         = blk->header;
+   s->blk->blkHash        = blk->blkHash;
+   s->blk->txCount        = blk->txCount;
+   s->blk->matchedTxCount = blk->matchedTxCount;
+   if (blk->matchedTxCount > 0) {
+      size_t len = blk->matchedTxCount * sizeof *blk->matchedTxHash;
+
+      s->blk->matchedTxHash = safe_malloc(len);
+      memcpy(s->blk->matchedTxHash, blk->matchedTxHash, len);
+      s->txs = safe_calloc(blk->matchedTxCount, sizeof *s->txs);
+   }
+   s->peer  = peer;
+   s->final = blk->matchedTxCount == 0;
+   if (s->final == 0) {
+      p->lastIdx = idx;
+   }
+
+   c->numRecv++;
+   if (c->peer == peer) {
+      c->reqTS = p->lastTS;
+   }
+   if (c->numRecv == c->num && c->peer) {
+      blksync_release_chunk(bs, c);
+   }
+
+   blksync_flush(bs);
+   blksync_dispatch(bs);
+
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_handle_tx --
+ *
+ *      Returns TRUE if the tx matched in the last block sent by this peer.
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+blksync_handle_tx(struct blksync *bs,
+                  void *peer,
+                  const uint256 *txHash,
+                  const uint8 *buf,
+                  size_t len)
+{
+   struct blksync_peer *p;
+   struct blksync_slot *s;
+   int i;
+
+   p = blksync_lookup_peer(bs, peer);
+   if (p == NULL || p->lastIdx < 0) {
+      return 0;
+   }
+   s = blksync_get_slot(bs, p->lastIdx);
+   if (s == NULL || s->blk == NULL) {
+      return 0;
+   }
+   for (i = 0; i < s->blk->matchedTxCount; i++) {
+      if (uint256_issame(s->blk->matchedTxHash + i, txHash)) {
+         break;
+      }
+   }
+   if (i == s->blk->matchedTxCount) {
+      return 0;
+   }
+   p->lastTS = time_get();
+   if (p->dup || s->txs[i].buf) {
+      return 1;
+   }
+
+   s->txs[i].buf = safe_malloc(len);
+   s->txs[i].len = len;
+   memcpy(s->txs[i].buf, buf, len);
+   s->numTx++;
+
+   if (s->numTx == s->blk->matchedTxCount) {
+      blksync_peer_finalize(bs, p);
+      blksync_flush(bs);
+   }
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_handle_pong --
+ *
+ *      Returns TRUE if the nonce is one of ours.
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+blksync_handle_pong(struct blksync *bs,
+                    void *peer,
+                    uint64 nonce)
+{
+   struct blksync_peer *p;
+   int end;
+   int i;
+
+   if ((nonce & BLKSYNC_NONCE_MASK) != BLKSYNC_NONCE_MAGIC) {
+      return 0;
+   }
+   p = blksync_lookup_peer(bs, peer);
+   if (p == NULL) {
+      return 1;
+   }
+   blksync_peer_finalize(bs, p);
+   p->lastTS  = time_get();
+   p->stalled = 0;
+
+   end = blksync_window_end(bs);
+   for (i = bs->head; i < end; i++) {
+      struct blksync_chunk *c = bs->chunks + i;
+
+      if (c->peer != peer || c->nonce != nonce) {
+         continue;
+      }
+      /*
+       * This peer doesn't have the rest of the chunk: let another one try.
+       */
+      Log(LGPFX" chunk #%d: %d block%s missing.\n",
+          i, c->num - c->numRecv, c->num - c->numRecv > 1 ? "s" : "");
+      c->lastPeer = peer;
+      blksync_release_chunk(bs, c);
+      break;
+   }
+
+   blksync_flush(bs);
+   blksync_dispatch(bs);
+
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_check_stalls --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+blksync_check_stalls(struct blksync *bs)
+{
+   mtime_t now = time_get();
+   int end = blksync_window_end(bs);
+   int i;
+
+   for (i = bs->head; i < end; i++) {
+      struct blksync_chunk *c = bs->chunks + i;
+      struct blksync_peer *p;
+
+      if (c->peer == NULL || now - c->reqTS < bs->stallTimeout) {
+         continue;
+      }
+      Log(LGPFX" chunk #%d: no progress after %llu msec, reassigning.\n",
+          i, (now - c->reqTS) / 1000);
+      p = blksync_lookup_peer(bs, c->peer);
+      bs->numStalls++;
+      c->lastPeer = c->peer;
+      blksync_release_chunk(bs, c);
+      blksync_peer_drop_last(bs, p);
+      p->stalled = 1;
+   }
+
+   /*
+    * A peer that went quiet in the middle of the tx of a block.
+    */
+   for (i = 0; i < bs->numPeers; i++) {
+      struct blksync_peer *p = bs->peers + i;
+
+      if (p->lastIdx >= 0 && now - p->lastTS >= bs->stallTimeout) {
+         blksync_peer_drop_last(bs, p);
+      }
+   }
+
+   blksync_dispatch(bs);
+}
+
+
+/*
+ * Benchmark: a synthetic chain served by mock peers living on a private poll
+ * loop. A mock peer serves its requests one after the other at a fixed cost
+ * per block, and the answer to each one reaches us after a round-trip.
+ */
+
+#define BLKSYNC_BENCH_RTT       (20 * 1000)     // usec
+#define BLKSYNC_BENCH_BLOCK     20              // usec per block served
+#define BLKSYNC_BENCH_STALL     (200 * 1000)    // usec
+#define BLKSYNC_BENCH_TX_EVERY  50              // one matching tx per N blocks
+
+struct blksync_bench;
+struct blksync_mock_peer;
+
+struct blksync_mock_req {
+   struct blksync_mock_peer *mp;
+   struct poll_timer         answer;
+   struct blksync_mock_req  *next;
+   int                      *idx;
+   int                       num;
+   uint64                    nonce;
+};
+
+struct blksync_mock_peer {
+   struct blksync_bench     *bench;
+   struct blksync_mock_req  *reqs;         // pending answers
+   bool                      unresponsive;
+   mtime_t                   busyUntil;
+};
+
+struct blksync_bench {
+   struct poll_loop         *poll;
+   struct blksync           *bs;
+   struct hashtable         *hash_idx;
+   const uint256            *hashes;       // hashes[0] is the starting point
+   int                       numBlocks;
+   int                       height;       // last block delivered
+   uint32                    numTx;
+   int                       exit;
+   volatile int             *stop;
+};
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_bench_tx --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_bench_tx(int idx,
+                 uint8 *tx,
+                 size_t len,
+                 uint256 *hash)
+{
+   memset(tx, 0, len);
+   memcpy(tx, &idx, sizeof idx);
+   hash256_calc(tx, len, hash);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_bench_free_req --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_bench_free_req(struct blksync_mock_req *req)
+{
+   struct blksync_mock_req **prev = &req->mp->reqs;
+
+   while (*prev != req) {
+      prev = &(*prev)->next;
+   }
+   *prev = req->next;
+   free(req->idx);
+   free(req);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_bench_answer_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_bench_answer_cb(void *clientData)
+{
+   struct blksync_mock_req *req = clientData;
+   struct blksync_mock_peer *mp = req->mp;
+   struct blksync_bench *b = mp->bench;
+   int i;
+
+   for (i = 0; i < req->num; i++) {
+      btc_msg_merkleblock blk;
+      uint256 txHash;
+      uint8 tx[64];
+      int idx = req->idx[i];
+
+      memset(&blk, 0, sizeof blk);
+      blk.header.prevBlock = b->hashes[idx - 1];
+      blk.blkHash = b->hashes[idx];
+      if (idx % BLKSYNC_BENCH_TX_EVERY == 0) {
+         blksync_bench_tx(idx, tx, sizeof tx, &txHash);
+         blk.matchedTxCount = 1;
+         blk.matchedTxHash  = &txHash;
+      }
+      blksync_handle_merkleblock(b->bs, mp, &blk);
+      if (blk.matchedTxCount > 0) {
+         blksync_handle_tx(b->bs, mp, &txHash, tx, sizeof tx);
+      }
+   }
+   blksync_handle_pong(b->bs, mp, req->nonce);
+   blksync_bench_free_req(req);
+
+   if (blksync_is_complete(b->bs)) {
+      b->exit = 1;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_bench_request_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blksync_bench_request_cb(void *peer,
+                         const uint256 *hashes,
+                         int n,
+                         uint64 nonce,
+                         void *clientData)
+{
+   struct blksync_mock_peer *mp = peer;
+   struct blksync_bench *b = clientData;
+   struct blksync_mock_req *req;
+   mtime_t now;
+   int i;
+
+   if (mp->unresponsive) {
+      return 0;
+   }
+
+   req = safe_calloc(1, sizeof *req);
+   req->mp    = mp;
+   req->idx   = safe_malloc(n * sizeof *req->idx);
+   req->num   = n;
+   req->nonce = nonce;
+   for (i = 0; i < n; i++) {
+      void *ptr;
+      bool s;
+
+      s = hashtable_lookup(b->hash_idx, hashes + i, sizeof hashes[i], &ptr);
+      ASSERT(s);
+      req->idx[i] = (int)(uintptr_t)ptr;
+   }
+   req->next = mp->reqs;
+   mp->reqs  = req;
+
+   now = time_get();
+   mp->busyUntil = MAX(mp->busyUntil, now + BLKSYNC_BENCH_RTT / 2)
+                 + n * BLKSYNC_BENCH_BLOCK;
+   req->answer = poll_callback_time(b->poll,
+                                    mp->busyUntil + BLKSYNC_BENCH_RTT / 2 - now,
+                                    0, blksync_bench_answer_cb, req);
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_bench_deliver_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_bench_deliver_cb(const btc_msg_merkleblock *blk,
+                         const struct blksync_tx *txs,
+                         int numTx,
+                         void *clientData)
+{
+   struct blksync_bench *b = clientData;
+
+   ASSERT(b->height < b->numBlocks);
+   ASSERT(uint256_issame(&blk->header.prevBlock, b->hashes + b->height));
+   ASSERT(uint256_issame(&blk->blkHash, b->hashes + b->height + 1));
+   ASSERT(numTx == ((b->height + 1) % BLKSYNC_BENCH_TX_EVERY == 0));
+
+   b->height++;
+   b->numTx += numTx;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_bench_tick_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_bench_tick_cb(void *clientData)
+{
+   struct blksync_bench *b = clientData;
+
+   blksync_check_stalls(b->bs);
+   if (*b->stop) {
+      b->exit = 1;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_bench_run --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blksync_bench_run(struct blksync_bench *b,
+                  int chunkSize,
+                  int windowSize,
+                  int maxPerPeer,
+                  int numPeers,
+                  int numUnresponsive)
+{
+   struct blksync_mock_peer *peers;
+   struct poll_timer tick;
+   mtime_t ts;
+   char *str;
+   int i;
+
+   b->poll   = poll_create(NULL);
+   b->height = 0;
+   b->numTx  = 0;
+   b->exit   = 0;
+   b->bs = blksync_create(b->hashes + 1, b->numBlocks, chunkSize, windowSize,
+                          maxPerPeer, BLKSYNC_BENCH_STALL,
+                          blksync_bench_request_cb,
+                          blksync_bench_deliver_cb, b);
+
+   tick = poll_callback_time(b->poll, 10 * 1000, 1 /* permanent */,
+                             blksync_bench_tick_cb, b);
+
+   ts = time_get();
+
+   /*
+    * The unresponsive ones first so that they get the head of the window.
+    */
+   peers = safe_calloc(numPeers, sizeof *peers);
+   for (i = 0; i < numPeers; i++) {
+      peers[i].bench        = b;
+      peers[i].unresponsive = i < numUnresponsive;
+      blksync_add_peer(b->bs, peers + i);
+   }
+
+   poll_runloop(b->poll, &b->exit);
+
+   ts = time_get() - ts;
+   str = print_latency(ts);
+
+   if (blksync_is_complete(b->bs)) {
+      ASSERT(b->height == b->numBlocks);
+      Warning(LGPFX" %d peer%s (%d unresponsive), chunk %4d, window %2d: "
+              "%u blocks %u tx in %s -- %.0f blk/sec, %u getdata, %u stalls\n",
+              numPeers, numPeers > 1 ? "s" : "", numUnresponsive,
+              chunkSize, windowSize, b->height, b->numTx, str,
+              b->height * 1000.0 * 1000.0 / ts,
+              b->bs->numRequests, b->bs->numStalls);
+   }
+   free(str);
+
+   /*
+    * Only when interrupted: nothing is in flight once the download completes.
+    */
+   for (i = 0; i < numPeers; i++) {
+      while (peers[i].reqs) {
+         poll_callback_time_cancel(b->poll, peers[i].reqs->answer);
+         blksync_bench_free_req(peers[i].reqs);
+      }
+   }
+   poll_callback_time_cancel(b->poll, tick);
+   blksync_destroy(b->bs);
+   b->bs = NULL;
+   free(peers);
+   poll_destroy(b->poll);
+   b->poll = NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blksync_bench --
+ *
+ *      Wall-clock time to download 'numBlocks' filtered blocks, from a single
+ *      peer doing stop-and-wait on 1000 blocks (the old behavior) to several
+ *      peers each with a couple of chunks in flight, one of them not
+ *      answering.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+blksync_bench(uint32 numBlocks,
+              volatile int *stop)
+{
+   static const struct {
+      int chunkSize;
+      int windowSize;
+      int maxPerPeer;
+      int numPeers;
+      int numUnresponsive;
+   } runs[] = {
+      { 1000,  1, 1, 1, 0 },
+      {  500, 32, 2, 1, 0 },
+      {  500, 32, 2, 4, 0 },
+      {  500, 32, 2, 8, 0 },
+      {  500, 32, 2, 8, 1 },
+   };
+   struct blksync_bench b;
+   uint256 *hashes;
+   uint32 i;
+
+   memset(&b, 0, sizeof b);
+   hashes = safe_malloc((numBlocks + 1) * sizeof *hashes);
+   b.hash_idx  = hashtable_create_fixed(sizeof(uint256));
+   b.hashes    = hashes;
+   b.numBlocks = numBlocks;
+   b.stop      = stop;
+
+   for (i = 0; i <= numBlocks; i++) {
+      bool s;
+
+      hash256_calc(&i, sizeof i, hashes + i);
+      s = hashtable_insert(b.hash_idx, hashes + i, sizeof hashes[i],
+                           (void *)(uintptr_t)i);
+      ASSERT(s);
+   }
+
+   for (i = 0; *stop == 0 && i < ARRAYSIZE(runs); i++) {
+      blksync_bench_run(&b, runs[i].chunkSize, runs[i].windowSize,
+                        runs[i].maxPerPeer, runs[i].numPeers,
+                        runs[i].numUnresponsive);
+   }
+
+   hashtable_clear(b.hash_idx);
+   hashtable_destroy(b.hash_idx);
+   free(hashes);
+}
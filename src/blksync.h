@@ -0,0 +1,48 @@
+#ifndef __BLKSYNC_H__
+#define __BLKSYNC_H__
+
+#include "basic_defs.h"
+#include "bitc-defs.h"
+
+struct blksync;
+
+struct blksync_tx {
+   uint8       *buf;
+   size_t       len;
+};
+
+/*
+ * 'peer' is opaque to the download manager. The request is expected to be
+ * followed by a ping carrying 'nonce': its pong tells that the peer is done
+ * sending the blocks and transactions it had for us.
+ */
+typedef int (blksync_request_cb)(void *peer, const uint256 *hashes, int n,
+                                 uint64 nonce, void *clientData);
+
+/*
+ * Filtered blocks are handed over strictly in chain order, each one along
+ * with the transactions that followed it.
+ */
+typedef void (blksync_deliver_cb)(const btc_msg_merkleblock *blk,
+                                  const struct blksync_tx *txs, int numTx,
+                                  void *clientData);
+
+struct blksync *blksync_create(const uint256 *hashes, int numHashes,
+                               int chunkSize, int windowSize, int maxPerPeer,
+                               mtime_t stallTimeout,
+                               blksync_request_cb *requestCb,
+                               blksync_deliver_cb *deliverCb,
+                               void *clientData);
+void blksync_destroy(struct blksync *bs);
+void blksync_add_peer(struct blksync *bs, void *peer);
+void blksync_remove_peer(struct blksync *bs, void *peer);
+bool blksync_handle_merkleblock(struct blksync *bs, void *peer,
+                                const btc_msg_merkleblock *blk);
+bool blksync_handle_tx(struct blksync *bs, void *peer, const uint256 *txHash,
+                       const uint8 *buf, size_t len);
+bool blksync_handle_pong(struct blksync *bs, void *peer, uint64 nonce);
+void blksync_check_stalls(struct blksync *bs);
+bool blksync_is_complete(const struct blksync *bs);
+void blksync_bench(uint32 numBlocks, volatile int *stop);
+
+#endif /* __BLKSYNC_H__ */
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include "block-store.h"
 #include "hash.h"
@@ -51,31 +53,73 @@ static const struct block_cpt_entry_str cpt_main[] = {
 static struct block_cpt_entry block_cpt_testnet[ARRAYSIZE(cpt_testnet)];
 static struct block_cpt_entry block_cpt_main[ARRAYSIZE(cpt_main)];
 
+/*
+ * Headers that are not on the best chain: orphans and stale forks.
+ */
 struct blockentry {
-   struct blockentry   *prev;
-   struct blockentry   *next;
    btc_block_header     header;
-   int                  height;
+   uint256              hash;
    bool                 written;
 };
 
 
+/*
+ * headers.dat is a flat array of 80-byte headers. Next to it we keep an index
+ * file with the hash and height of each of these headers so that a restart
+ * does not have to recompute hundreds of thousands of double-SHA256. The index
+ * is written on clean shutdown and covers a prefix of headers.dat: anything
+ * appended after that is hashed when loading.
+ */
+
+#define BLOCKSET_IDX_MAGIC      0x78646968      // 'hidx'
+#define BLOCKSET_IDX_VERSION    1
+
+struct blockset_idx_header {
+   uint32   magic;
+   uint32   version;
+   uint64   numHeaders;
+   uint256  checksum;      // sha256 of the entries
+};
+
+struct blockset_idx_entry {
+   uint256  hash;
+   int32    height;        // -1 if not on the best chain
+};
+
+
 struct blockset {
    char                   *filename;
+   char                   *idxFilename;
    struct file_descriptor *desc;
    int64                   filesize;
+
+   uint32                  numHeaders;  // headers in the file
+   uint32                  numIndexed;  // covered by the index on disk
+   uint32                  numLoaded;   // headers read when opening the file
+   int64                   loadedSize;  // where the first write went
 };
 
 
+/*
+ * The best chain is kept in two arrays indexed by height: the headers and
+ * their hashes. 'hash_blk' maps a hash to its height in these arrays, while
+ * 'hash_orphans' holds a blockentry for every header not on the best chain.
+ *
+ * Block timestamps are not monotonic, so 'tsMax' holds the running maximum
+ * of the timestamps along the chain: this one can be binary searched.
+ */
 struct blockstore {
    struct blockset       *blockSet;
    uint256                genesis_hash;
    uint256                best_hash;
 
-   struct blockentry     *best_chain;
-   struct blockentry     *genesis;
+   btc_block_header      *headers;
+   uint256               *hashes;
+   uint32                *tsMax;
+   uint32                 chainSize;
+   int                    height;       // -1 when empty
+   int                    numWritten;   // chain prefix stored in headers.dat
 
-   int                    height;
    struct hashtable      *hash_blk;
    struct hashtable      *hash_orphans;
 };
@@ -84,14 +128,39 @@ struct blockstore {
 /*
  *------------------------------------------------------------------------
  *
- * blockstore_lookup --
+ * blockstore_lookup_height --
+ *
+ *      Returns the height of a block on the best chain, -1 otherwise.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blockstore_lookup_height(const struct blockstore *bs,
+                         const uint256           *hash)
+{
+   void *ptr;
+   bool s;
+
+   s = hashtable_lookup(bs->hash_blk, hash, sizeof *hash, &ptr);
+   if (s == 0) {
+      return -1;
+   }
+   return (int)(uintptr_t)ptr;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_lookup_orphan --
  *
  *------------------------------------------------------------------------
  */
 
 static struct blockentry *
-blockstore_lookup(const struct blockstore *bs,
-                  const uint256           *hash)
+blockstore_lookup_orphan(const struct blockstore *bs,
+                         const uint256           *hash)
 {
    struct blockentry *be;
    bool s;
@@ -100,10 +169,6 @@ blockstore_lookup(const struct blockstore *bs,
    if (s) {
       return be;
    }
-   s = hashtable_lookup(bs->hash_blk, hash, sizeof *hash, (void *)&be);
-   if (s) {
-      return be;
-   }
    return NULL;
 }
 
@@ -119,11 +184,10 @@ blockstore_lookup(const struct blockstore *bs,
 time_t
 blockstore_get_timestamp(const struct blockstore *bs)
 {
-   if (bs->best_chain == NULL) {
+   if (bs->height < 0) {
       return 1231006505; //  2009-01-03 18:15:05
    }
-   ASSERT(bs->height == bs->best_chain->height);
-   return bs->best_chain->header.timestamp;
+   return bs->headers[bs->height].timestamp;
 }
 
 
@@ -138,10 +202,9 @@ blockstore_get_timestamp(const struct blockstore *bs)
 int
 blockstore_get_height(const struct blockstore *bs)
 {
-   if (bs->best_chain == NULL) {
+   if (bs->height < 0) {
       return 0;
    }
-   ASSERT(bs->height == bs->best_chain->height);
    return bs->height;
 }
 
@@ -197,15 +260,14 @@ int
 blockstore_get_block_height(struct blockstore *bs,
                             const uint256 *hash)
 {
-   struct blockentry *be;
-   bool s;
+   int height;
 
    if (uint256_iszero(hash)) {
       return 0;
    }
 
-   s = hashtable_lookup(bs->hash_blk, hash, sizeof *hash, (void*)&be);
-   if (s == 0) {
+   height = blockstore_lookup_height(bs, hash);
+   if (height < 0) {
       char hashStr[80];
 
       uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
@@ -214,7 +276,7 @@ blockstore_get_block_height(struct blockstore *bs,
       return 0;
    }
 
-   return be->height;
+   return height;
 }
 
 
@@ -262,66 +324,102 @@ blockstore_validate_chkpt(const uint256 *hash,
 /*
  *------------------------------------------------------------------------
  *
- * blockstore_set_chain_links --
+ * blockstore_get_checkpoint --
+ *
+ *      Returns the 'idx'-th checkpoint of the current network, in increasing
+ *      height order. FALSE once past the last one.
  *
  *------------------------------------------------------------------------
  */
 
-static int
-blockstore_set_chain_links(struct blockstore *bs,
-                           struct blockentry *be)
+bool
+blockstore_get_checkpoint(int idx,
+                          int *height,
+                          uint256 *hash)
 {
-   struct blockentry *prev;
-   char hashStr[80];
-   uint256 hash;
-   bool s;
+   const struct block_cpt_entry *array;
+   size_t n;
 
-   hash256_calc(&be->header, sizeof be->header, &hash);
-   uint256_snprintf_reverse(hashStr, sizeof hashStr, &hash);
+   if (btc->testnet) {
+      array = block_cpt_testnet;
+      n = ARRAYSIZE(block_cpt_testnet);
+   } else {
+      array = block_cpt_main;
+      n = ARRAYSIZE(block_cpt_main);
+   }
 
-   if (be->height >= 0) {
-      struct blockentry *li;
-      /*
-       * We've reached the junction with the current/old best chain. All the
-       * entries from now on need to be made orphans.
-       */
+   if (idx < 0 || idx >= n) {
+      return 0;
+   }
+   *height = array[idx].height;
+   *hash   = array[idx].hash;
 
-      Log(LGPFX" Reached block %s\n", hashStr);
-
-      li = be->next;
-      while (li) {
-         hash256_calc(&li->header, sizeof li->header, &hash);
-         uint256_snprintf_reverse(hashStr, sizeof hashStr, &hash);
-         Log(LGPFX" moving #%d %s from blk -> orphan\n", li->height, hashStr);
-         s = hashtable_remove(bs->hash_blk, &hash, sizeof hash);
-         ASSERT(s);
-         li->height = -1;
-         s = hashtable_insert(bs->hash_orphans, &hash, sizeof hash, li);
-         ASSERT(s);
-         li = li->next;
-      }
+   return 1;
+}
 
-      return be->height;
-   }
 
-   ASSERT(be->height == -1); // orphan
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_alloc_entry --
+ *
+ *------------------------------------------------------------------------
+ */
 
-   prev = blockstore_lookup(bs, &be->header.prevBlock);
-   ASSERT(prev);
+static struct blockentry *
+blockstore_alloc_entry(const btc_block_header *hdr,
+                       const uint256 *hash,
+                       bool written)
+{
+   struct blockentry *be;
 
-   be->height = 1 + blockstore_set_chain_links(bs, prev);
+   be = safe_malloc(sizeof *be);
+   be->written = written;
+   memcpy(&be->header, hdr, sizeof *hdr);
+   memcpy(&be->hash, hash, sizeof *hash);
 
-   Log(LGPFX" moving #%d %s from orphan -> blk\n", be->height, hashStr);
+   return be;
+}
 
-   prev->next = be;
-   be->prev = prev;
 
-   s = hashtable_remove(bs->hash_orphans, &hash, sizeof hash);
-   ASSERT(s);
-   s = hashtable_insert(bs->hash_blk, &hash, sizeof hash, be);
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_chain_append --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_chain_append(struct blockstore      *bs,
+                        const btc_block_header *hdr,
+                        const uint256          *hash)
+{
+   int height = bs->height + 1;
+   bool s;
+
+   if (height == bs->chainSize) {
+      bs->chainSize = MAX(4096, 2 * bs->chainSize);
+      bs->headers = safe_realloc(bs->headers,
+                                 bs->chainSize * sizeof *bs->headers);
+      bs->hashes  = safe_realloc(bs->hashes,
+                                 bs->chainSize * sizeof *bs->hashes);
+      bs->tsMax   = safe_realloc(bs->tsMax,
+                                 bs->chainSize * sizeof *bs->tsMax);
+   }
+
+   s = hashtable_insert(bs->hash_blk, hash, sizeof *hash,
+                        (void *)(uintptr_t)height);
    ASSERT(s);
 
-   return be->height;
+   memcpy(bs->headers + height, hdr, sizeof *hdr);
+   memcpy(bs->hashes + height, hash, sizeof *hash);
+   memcpy(&bs->best_hash, hash, sizeof *hash);
+   bs->tsMax[height] = hdr->timestamp;
+   if (height > 0) {
+      bs->tsMax[height] = MAX(bs->tsMax[height - 1], hdr->timestamp);
+   }
+   bs->height = height;
 }
 
 
@@ -330,29 +428,112 @@ blockstore_set_chain_links(struct blockstore *bs,
  *
  * blockstore_find_alternate_chain_height --
  *
- *      Returns the height of an alternate chain starting at 'be'.
+ *      Returns the height of an alternate chain ending with the orphan
+ *      'hash', or 0 if it does not connect to the best chain. On success,
+ *      'junction' is the height at which it forks off the best chain.
  *
  *------------------------------------------------------------------------
  */
 
 static int
-blockstore_find_alternate_chain_height(struct blockstore *bs,
-                                       struct blockentry *be)
+blockstore_find_alternate_chain_height(const struct blockstore *bs,
+                                       const uint256 *hash,
+                                       int *junction)
 {
-   struct blockentry *prev;
+   const struct blockentry *be;
+   const uint256 *h = hash;
+   int count = 0;
 
-   if (be->height > 0) {
-      return be->height;
+   while ((be = blockstore_lookup_orphan(bs, h)) != NULL) {
+      count++;
+      h = &be->header.prevBlock;
    }
 
-   ASSERT(be->height == -1); // orphan
-
-   prev = blockstore_lookup(bs, &be->header.prevBlock);
-   if (prev == NULL) {
+   *junction = blockstore_lookup_height(bs, h);
+   if (*junction < 0) {
       return 0;
    }
+   return *junction + count;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_set_chain_links --
+ *
+ *      Switch the best chain to the alternate chain ending with 'hash' and
+ *      forking off at height 'junction'. The entries of the current chain
+ *      above the junction become orphans.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_set_chain_links(struct blockstore *bs,
+                           const uint256 *hash,
+                           int junction,
+                           int height)
+{
+   struct blockentry **branch;
+   char hashStr[80];
+   int num;
+   int i;
+   bool s;
+
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, bs->hashes + junction);
+   Log(LGPFX" Reached block %s\n", hashStr);
+
+   /*
+    * Collect the orphans of the new branch, from the tip down.
+    */
+   num = height - junction;
+   branch = safe_malloc(num * sizeof *branch);
+
+   for (i = num - 1; i >= 0; i--) {
+      branch[i] = blockstore_lookup_orphan(bs, hash);
+      ASSERT(branch[i]);
+      hash = &branch[i]->header.prevBlock;
+   }
+
+   for (i = bs->height; i > junction; i--) {
+      struct blockentry *be;
+
+      uint256_snprintf_reverse(hashStr, sizeof hashStr, bs->hashes + i);
+      Log(LGPFX" moving #%d %s from blk -> orphan\n", i, hashStr);
+
+      be = blockstore_alloc_entry(bs->headers + i, bs->hashes + i,
+                                  i < bs->numWritten);
+      s = hashtable_remove(bs->hash_blk, bs->hashes + i, sizeof bs->hashes[i]);
+      ASSERT(s);
+      s = hashtable_insert(bs->hash_orphans, bs->hashes + i,
+                           sizeof bs->hashes[i], be);
+      ASSERT(s);
+   }
+   bs->height = junction;
+   bs->numWritten = MIN(bs->numWritten, junction + 1);
+
+   for (i = 0; i < num; i++) {
+      struct blockentry *be = branch[i];
+
+      uint256_snprintf_reverse(hashStr, sizeof hashStr, &be->hash);
+      Log(LGPFX" moving #%d %s from orphan -> blk\n", bs->height + 1, hashStr);
 
-   return 1 + blockstore_find_alternate_chain_height(bs, prev);
+      s = hashtable_remove(bs->hash_orphans, &be->hash, sizeof be->hash);
+      ASSERT(s);
+      blockstore_chain_append(bs, &be->header, &be->hash);
+
+      /*
+       * A header that used to be on the best chain may already be on disk.
+       */
+      if (be->written && bs->numWritten == bs->height) {
+         bs->numWritten++;
+      }
+      free(be);
+   }
+   ASSERT(bs->height == height);
+
+   free(branch);
 }
 
 
@@ -366,12 +547,12 @@ blockstore_find_alternate_chain_height(struct blockstore *bs,
 
 static void
 blockstore_set_best_chain(struct blockstore *bs,
-                          struct blockentry *be,
                           const uint256 *hash)
 {
+   int junction;
    int height;
 
-   height = blockstore_find_alternate_chain_height(bs, be);
+   height = blockstore_find_alternate_chain_height(bs, hash, &junction);
 
    Log(LGPFX" orphan block: alternate chain height is %d vs current %d\n",
        height, bs->height);
@@ -383,12 +564,7 @@ blockstore_set_best_chain(struct blockstore *bs,
    /*
     * Properly wire the new chain.
     */
-   blockstore_set_chain_links(bs, be);
-
-   bs->best_chain = be;
-   bs->height = height;
-
-   memcpy(&bs->best_hash, hash, sizeof *hash);
+   blockstore_set_chain_links(bs, hash, junction, height);
 }
 
 
@@ -397,60 +573,47 @@ blockstore_set_best_chain(struct blockstore *bs,
  *
  * blockstore_add_entry --
  *
+ *      Returns whether the header ended up on the best chain.
+ *
  *------------------------------------------------------------------------
  */
 
-static void
+static bool
 blockstore_add_entry(struct blockstore *bs,
-                     struct blockentry *be,
-                     const uint256 *hash)
+                     const btc_block_header *hdr,
+                     const uint256 *hash,
+                     bool written)
 {
+   struct blockentry *be;
+   char hashStr[80];
+   uint32 count;
    bool s;
 
-   if (bs->best_chain == NULL) {
-
-      s = hashtable_insert(bs->hash_blk, hash, sizeof *hash, be);
-
-      ASSERT(s);
+   if (bs->height < 0) {
       ASSERT(uint256_issame(hash, &bs->genesis_hash));
-      ASSERT(be->prev == NULL);
-      ASSERT(bs->height);
 
-      bs->best_chain = be;
-      bs->genesis = be;
-      bs->height  = 0;
-      be->height  = 0;
-
-      memcpy(&bs->best_hash, hash, sizeof *hash);
-   } else if (uint256_issame(&be->header.prevBlock, &bs->best_hash)) {
-
-      s = hashtable_insert(bs->hash_blk, hash, sizeof *hash, be);
-      ASSERT(s);
-
-      bs->height++;
-      be->height = bs->height;
+      blockstore_chain_append(bs, hdr, hash);
+      return 1;
+   }
 
-      bs->best_chain->next = be;
-      be->prev = bs->best_chain;
-      bs->best_chain = be;
+   if (uint256_issame(&hdr->prevBlock, &bs->best_hash)) {
+      blockstore_chain_append(bs, hdr, hash);
+      return 1;
+   }
 
-      memcpy(&bs->best_hash, hash, sizeof *hash);
-   } else {
-      char hashStr[80];
-      uint32 count;
+   count = hashtable_getnumentries(bs->hash_orphans);
 
-      be->height = -1;
-      count = hashtable_getnumentries(bs->hash_orphans);
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
+   Log(LGPFX" block %s orphaned. %u orphan%s total.\n",
+       hashStr, count, count > 1 ? "s" : "");
 
-      uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
-      Log(LGPFX" block %s orphaned. %u orphan%s total.\n",
-          hashStr, count, count > 1 ? "s" : "");
+   be = blockstore_alloc_entry(hdr, hash, written);
+   s = hashtable_insert(bs->hash_orphans, hash, sizeof *hash, be);
+   ASSERT(s);
 
-      s = hashtable_insert(bs->hash_orphans, hash, sizeof *hash, be);
-      ASSERT(s);
+   blockstore_set_best_chain(bs, hash);
 
-      blockstore_set_best_chain(bs, be, hash);
-   }
+   return blockstore_lookup_height(bs, hash) >= 0;
 }
 
 
@@ -503,30 +666,6 @@ blockstore_is_block_known(const struct blockstore *bs,
 }
 
 
-/*
- *------------------------------------------------------------------------
- *
- * blockstore_alloc_entry --
- *
- *------------------------------------------------------------------------
- */
-
-static struct blockentry *
-blockstore_alloc_entry(const btc_block_header *hdr)
-{
-   struct blockentry *be;
-
-   be = safe_malloc(sizeof *be);
-   be->prev = NULL;
-   be->next = NULL;
-   be->height = 0;
-   be->written = 0;
-   memcpy(&be->header, hdr, sizeof *hdr);
-
-   return be;
-}
-
-
 /*
  *------------------------------------------------------------------------
  *
@@ -538,49 +677,32 @@ blockstore_alloc_entry(const btc_block_header *hdr)
 void
 blockstore_write_headers(struct blockstore *bs)
 {
-   btc_block_header *buf;
-   struct blockentry *e;
+   struct blockset *bset = bs->blockSet;
    size_t numWritten;
-   uint32 count;
    uint32 numhdr;
    int res;
 
-   e = bs->best_chain;
-   count = 0;
-   while (e && e->written == 0) {
-      e = e->prev;
-      count++;
-   }
-   ASSERT(count < 2048);
-   numhdr = count;
-   if (count == 0) {
+   ASSERT(bs->numWritten <= bs->height + 1);
+   numhdr = bs->height + 1 - bs->numWritten;
+   ASSERT(numhdr < 2048);
+   if (numhdr == 0) {
       return;
    }
 
-   buf = safe_malloc(count * sizeof *buf);
-
-   e = bs->best_chain;
-   while (e && e->written == 0) {
-      count--;
-      memcpy(buf + count, &e->header, sizeof e->header);
-      e->written = 1;
-      e = e->prev;
-   }
+   ASSERT(bset);
+   ASSERT_ON_COMPILE(sizeof *bs->headers == 80);
 
-   ASSERT(count == 0);
-   ASSERT(bs->blockSet);
-   ASSERT_ON_COMPILE(sizeof *buf == 80);
+   res = file_pwrite(bset->desc, bset->filesize, bs->headers + bs->numWritten,
+                     numhdr * sizeof *bs->headers, &numWritten);
 
-   res = file_pwrite(bs->blockSet->desc, bs->blockSet->filesize,
-                     buf, numhdr * sizeof *buf, &numWritten);
-   free(buf);
-
-   if (res != 0 || numWritten != numhdr * sizeof *buf) {
+   if (res != 0 || numWritten != numhdr * sizeof *bs->headers) {
       Warning(LGPFX" failed to write %u block entries.\n", numhdr);
       return;
    }
 
-   bs->blockSet->filesize += numWritten;
+   bset->numHeaders += numhdr;
+   bset->filesize += numWritten;
+   bs->numWritten += numhdr;
 }
 
 
@@ -599,7 +721,6 @@ blockstore_add_header(struct blockstore      *bs,
                       bool                   *orphan)
 {
    static unsigned int count;
-   struct blockentry *be;
 
    *orphan = 0;
 
@@ -614,18 +735,14 @@ blockstore_add_header(struct blockstore      *bs,
       ASSERT(uint256_issame(hash, &hash0));
    }
 
-   be = blockstore_lookup(bs, hash);
-   if (be) {
+   if (blockstore_is_block_known(bs, hash)) {
       return 0;
    }
 
    ASSERT(blockstore_validate_chkpt(hash, bs->height + 1));
-   ASSERT(bs->best_chain || uint256_issame(hash, &bs->genesis_hash));
-
-   be = blockstore_alloc_entry(hdr);
-   blockstore_add_entry(bs, be, hash);
+   ASSERT(bs->height >= 0 || uint256_issame(hash, &bs->genesis_hash));
 
-   *orphan = be->height == -1;
+   *orphan = !blockstore_add_entry(bs, hdr, hash, 0);
 
    return 1;
 }
@@ -646,11 +763,304 @@ blockset_close(struct blockset *bset)
       file_close(bset->desc);
    }
 
+   free(bset->idxFilename);
    free(bset->filename);
    free(bset);
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_load_index --
+ *
+ *      Maps the index file and validates it against the headers file.
+ *      Returns the number of leading headers whose hash can be taken from
+ *      the index, 0 if the index is missing or stale. The hashes are copied
+ *      to '*hashes', to be freed by the caller once loading is done.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static uint32
+blockset_load_index(struct blockset *bset,
+                    const btc_block_header *hdrs,
+                    uint32 numHeaders,
+                    uint256 **hashes,
+                    int *height)
+{
+   const struct blockset_idx_header *hdr;
+   const struct blockset_idx_entry *entries;
+   struct file_descriptor *desc;
+   uint256 checksum;
+   uint256 hash;
+   int64 size;
+   void *ptr;
+   uint32 n;
+   uint32 i;
+   int res;
+
+   *height = -1;
+   *hashes = NULL;
+
+   if (!file_exists(bset->idxFilename)) {
+      return 0;
+   }
+   res = file_open(bset->idxFilename, 1 /* R/O */, 0 /* !unbuf */, &desc);
+   if (res) {
+      return 0;
+   }
+
+   n = 0;
+   size = file_getsize(desc);
+   if (size < (int64)sizeof *hdr) {
+      goto exit;
+   }
+   res = file_mmap(desc, size, &ptr);
+   if (res) {
+      goto exit;
+   }
+
+   hdr = ptr;
+   entries = (const void *)(hdr + 1);
+
+   if (hdr->magic != BLOCKSET_IDX_MAGIC ||
+       hdr->version != BLOCKSET_IDX_VERSION ||
+       hdr->numHeaders == 0 ||
+       hdr->numHeaders > numHeaders ||
+       size != sizeof *hdr + hdr->numHeaders * sizeof *entries) {
+      Log(LGPFX" index '%s' does not match headers file.\n",
+          bset->idxFilename);
+      goto unmap;
+   }
+
+   sha256_calc(entries, hdr->numHeaders * sizeof *entries, &checksum);
+   if (!uint256_issame(&checksum, &hdr->checksum)) {
+      Warning(LGPFX" index '%s' checksum mismatch.\n", bset->idxFilename);
+      goto unmap;
+   }
+
+   /*
+    * The index must describe this very headers file: check the last header
+    * it covers.
+    */
+   hash256_calc(hdrs + hdr->numHeaders - 1, sizeof *hdrs, &hash);
+   if (!uint256_issame(&hash, &entries[hdr->numHeaders - 1].hash)) {
+      Warning(LGPFX" index '%s' is stale.\n", bset->idxFilename);
+      goto unmap;
+   }
+
+   n = hdr->numHeaders;
+   bset->numIndexed = n;
+   *hashes = safe_malloc(n * sizeof **hashes);
+   for (i = 0; i < n; i++) {
+      memcpy(*hashes + i, &entries[i].hash, sizeof entries[i].hash);
+      *height = MAX(*height, entries[i].height);
+   }
+
+unmap:
+   file_munmap(ptr, size);
+exit:
+   file_close(desc);
+
+   return n;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_read_index_hashes --
+ *
+ *      Reads back the hashes covered by the index validated at load time.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blockset_read_index_hashes(const struct blockset *bset,
+                           struct blockset_idx_entry *entries)
+{
+   const struct blockset_idx_header *hdr;
+   const struct blockset_idx_entry *idx;
+   struct file_descriptor *desc;
+   int64 size;
+   void *ptr;
+   uint32 i;
+   int res;
+
+   res = file_open(bset->idxFilename, 1 /* R/O */, 0 /* !unbuf */, &desc);
+   if (res) {
+      return res;
+   }
+   size = file_getsize(desc);
+   if (size != sizeof *hdr + bset->numIndexed * sizeof *idx) {
+      res = EINVAL;
+      goto exit;
+   }
+   res = file_mmap(desc, size, &ptr);
+   if (res) {
+      goto exit;
+   }
+   hdr = ptr;
+   idx = (const void *)(hdr + 1);
+   for (i = 0; i < bset->numIndexed; i++) {
+      memcpy(&entries[i].hash, &idx[i].hash, sizeof entries[i].hash);
+   }
+   file_munmap(ptr, size);
+exit:
+   file_close(desc);
+
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_hash_headers --
+ *
+ *      Computes the hash of the headers in the file starting at 'first'.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blockset_hash_headers(const struct blockset *bset,
+                      uint32 first,
+                      struct blockset_idx_entry *entries)
+{
+   const uint8 *base;
+   void *ptr;
+   uint32 i;
+   int res;
+
+   res = file_mmap(bset->desc, bset->filesize, &ptr);
+   if (res) {
+      return res;
+   }
+   base = ptr;
+   for (i = first; i < bset->numHeaders; i++) {
+      int64 off;
+
+      /*
+       * A partial header at the end of the loaded file shifts the ones
+       * appended afterwards.
+       */
+      if (i < bset->numLoaded) {
+         off = i * (int64)sizeof(btc_block_header);
+      } else {
+         off = bset->loadedSize +
+               (i - bset->numLoaded) * (int64)sizeof(btc_block_header);
+      }
+      hash256_calc(base + off, sizeof(btc_block_header), &entries[i].hash);
+   }
+   file_munmap(ptr, bset->filesize);
+
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_write_index --
+ *
+ *      Only called on clean shutdown, once all headers have been written.
+ *      The index is written to a temporary file and renamed in place so that
+ *      a crash never leaves a partial index behind.
+ *
+ *      The hashes are not kept around once the file is loaded: the ones
+ *      covered by the previous index are read back from it, the others are
+ *      recomputed from the headers file.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockset_write_index(struct blockstore *blockStore)
+{
+   struct blockset *bset = blockStore->blockSet;
+   struct blockset_idx_header *hdr;
+   struct blockset_idx_entry *entries;
+   struct file_descriptor *desc;
+   size_t numWritten;
+   char *tmpFile;
+   uint32 first;
+   uint8 *buf;
+   size_t len;
+   uint32 i;
+   int res;
+
+   if (bset->numHeaders == bset->numIndexed) {
+      return;
+   }
+
+   len = sizeof *hdr + bset->numHeaders * sizeof *entries;
+   buf = safe_calloc(1, len);
+   hdr = (void *)buf;
+   entries = (void *)(hdr + 1);
+   tmpFile = NULL;
+
+   first = bset->numIndexed;
+   if (first > 0 && blockset_read_index_hashes(bset, entries) != 0) {
+      first = 0;
+   }
+   res = blockset_hash_headers(bset, first, entries);
+   if (res) {
+      goto exit;
+   }
+   for (i = 0; i < bset->numHeaders; i++) {
+      entries[i].height = blockstore_lookup_height(blockStore,
+                                                   &entries[i].hash);
+   }
+
+   hdr->magic      = BLOCKSET_IDX_MAGIC;
+   hdr->version    = BLOCKSET_IDX_VERSION;
+   hdr->numHeaders = bset->numHeaders;
+   sha256_calc(entries, bset->numHeaders * sizeof *entries, &hdr->checksum);
+
+   tmpFile = safe_asprintf("%s.tmp", bset->idxFilename);
+   res = file_create(tmpFile);
+   if (res) {
+      goto exit;
+   }
+   res = file_open(tmpFile, 0 /* R/W */, 0 /* !unbuf */, &desc);
+   if (res) {
+      goto exit;
+   }
+   res = file_pwrite(desc, 0, buf, len, &numWritten);
+   if (res == 0 && numWritten != len) {
+      res = EIO;
+   }
+   if (res == 0) {
+      res = file_truncate(desc, len);
+   }
+   if (res == 0) {
+      res = file_sync(desc);
+   }
+   file_close(desc);
+   if (res) {
+      goto exit;
+   }
+   file_chmod(tmpFile, 0600);
+   res = file_rename(tmpFile, bset->idxFilename);
+
+exit:
+   if (res) {
+      Warning(LGPFX" failed to write index '%s': %s\n",
+              bset->idxFilename, strerror(res));
+      if (tmpFile) {
+         file_unlink(tmpFile);
+      }
+   } else {
+      Log(LGPFX" wrote index for %u headers.\n", bset->numHeaders);
+   }
+   free(tmpFile);
+   free(buf);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -663,8 +1073,13 @@ static int
 blockset_open_file(struct blockstore *blockStore,
                    struct blockset *bs)
 {
-   uint64 offset;
+   const btc_block_header *hdrs;
+   uint256 *idxHashes;
+   uint32 numHeaders;
+   uint32 numIndexed;
+   int idxHeight;
    mtime_t ts;
+   uint32 i;
    int res;
 
    res = file_open(bs->filename, 0 /* R/O */, 0 /* !unbuf */, &bs->desc);
@@ -677,79 +1092,94 @@ blockset_open_file(struct blockstore *blockStore,
       return errno;
    }
 
-   if (bs->filesize > 0) {
-      char *s = print_size(bs->filesize);
-      char *name = file_getname(bs->filename);
-      Log(LGPFX" reading file %s -- %s -- %llu headers.\n",
-          name, s, bs->filesize / sizeof(btc_block_header));
-      free(name);
-      free(s);
+   numHeaders = bs->filesize / sizeof(btc_block_header);
+   bs->numHeaders = numHeaders;
+   bs->numLoaded  = numHeaders;
+   bs->loadedSize = bs->filesize;
+   if (numHeaders == 0) {
+      return 0;
    }
 
-   ts = time_get();
-   offset = 0;
-   while (offset < bs->filesize) {
-      btc_block_header buf[10000];
-      size_t numRead;
-      size_t numBytes;
-      int numHeaders;
-      int i;
+   char *s = print_size(bs->filesize);
+   char *name = file_getname(bs->filename);
+   Log(LGPFX" reading file %s -- %s -- %u headers.\n", name, s, numHeaders);
+   free(name);
+   free(s);
 
-      numBytes = MIN(bs->filesize - offset, sizeof buf);
+   /*
+    * A partial header at the end of the file is ignored: the next write
+    * appends after it, as it always did.
+    */
+   res = file_mmap(bs->desc, numHeaders * sizeof *hdrs, (void **)&hdrs);
+   if (res) {
+      return res;
+   }
 
-      res = file_pread(bs->desc, offset, buf, numBytes, &numRead);
-      if (res != 0) {
-         break;
-      }
+   ts = time_get();
+   numIndexed = blockset_load_index(bs, hdrs, numHeaders, &idxHashes,
+                                    &idxHeight);
 
-      if (btc->stop != 0) {
+   for (i = 0; i < numHeaders; i++) {
+      uint256 hash;
+
+      if ((i % 10000) == 0 && btc->stop != 0) {
          res = 1;
          NOT_TESTED();
          break;
       }
 
-      numHeaders = numRead / sizeof(btc_block_header);
-      for (i = 0; i < numHeaders; i++) {
-         struct blockentry *be;
-         uint256 hash;
-
-         be = blockstore_alloc_entry(buf + i);
-         be->written = 1;
-         hash256_calc(buf + i, sizeof buf[0], &hash);
+      if (i < numIndexed) {
+         memcpy(&hash, idxHashes + i, sizeof hash);
+      } else {
+         hash256_calc(hdrs + i, sizeof *hdrs, &hash);
+      }
 
-         if (!blockstore_validate_chkpt(&hash, blockStore->height + 1)) {
-            return 1;
-         }
+      if (!blockstore_validate_chkpt(&hash, blockStore->height + 1)) {
+         res = 1;
+         break;
+      }
 
-         blockstore_add_entry(blockStore, be, &hash);
+      /*
+       * A stale header that became part of the best chain again may have
+       * been written twice.
+       */
+      if (!blockstore_is_block_known(blockStore, &hash)) {
+         blockstore_add_entry(blockStore, hdrs + i, &hash, 1 /* written */);
+         blockStore->numWritten = blockStore->height + 1;
+      }
 
-         if (i == numHeaders - 1) {
+      if ((i % 10000) == 9999 || i == numHeaders - 1) {
 #ifdef WITHUI
-            bitcui_set_status("loading headers .. %llu%%",
-                             (offset + numBytes) * 100 / bs->filesize);
+         bitcui_set_status("loading headers .. %llu%%",
+                           (i + 1) * 100ULL / numHeaders);
 #endif
-         }
-         if (i == numHeaders - 1 ||
-             (numBytes < sizeof buf && i > numHeaders - 256)) {
+      }
+      if ((i % 10000) == 9999 || i + 256 > numHeaders) {
 #ifdef WITHUI
-            bitcui_set_last_block_info(&hash, blockStore->height,
-                                      be->header.timestamp);
+         bitcui_set_last_block_info(&hash, blockStore->height,
+                                    hdrs[i].timestamp);
 #endif
-         }
       }
-
-      offset += numRead;
    }
 
+   file_munmap((void *)hdrs, numHeaders * sizeof *hdrs);
+   free(idxHashes);
+
    ts = time_get() - ts;
 
+   if (res == 0 && numIndexed == numHeaders &&
+       idxHeight != blockStore->height) {
+      Warning(LGPFX" index height %d vs %d.\n", idxHeight, blockStore->height);
+   }
+
    char hashStr[80];
    char *latStr;
 
    uint256_snprintf_reverse(hashStr, sizeof hashStr, &blockStore->best_hash);
    Log(LGPFX" loaded blocks up to %s\n", hashStr);
    latStr = print_latency(ts);
-   Log(LGPFX" this took %s\n", latStr);
+   Log(LGPFX" this took %s -- %u/%u hashes from index.\n",
+       latStr, numIndexed, numHeaders);
    free(latStr);
 
    return res;
@@ -772,6 +1202,7 @@ blockset_open(struct blockstore *blockStore,
 
    bs = safe_calloc(1, sizeof *bs);
    bs->filename = safe_strdup(filename);
+   bs->idxFilename = safe_asprintf("%s.idx", filename);
 
    blockStore->blockSet = bs;
 
@@ -812,12 +1243,18 @@ blockstore_get_filename(struct config *config)
 void
 blockstore_zap(struct config *config)
 {
+   char *idxFile;
    char *file;
 
    file = blockstore_get_filename(config);
 
    Warning(LGPFX" removing blockset '%s'.\n", file);
    file_unlink(file);
+   idxFile = safe_asprintf("%s.idx", file);
+   if (file_exists(idxFile)) {
+      file_unlink(idxFile);
+   }
+   free(idxFile);
    free(file);
 }
 
@@ -864,8 +1301,8 @@ blockstore_init(struct config *config,
 
    bs = safe_calloc(1, sizeof *bs);
    bs->height       = -1;
-   bs->hash_blk     = hashtable_create();
-   bs->hash_orphans = hashtable_create();
+   bs->hash_blk     = hashtable_create_fixed(sizeof(uint256));
+   bs->hash_orphans = hashtable_create_fixed(sizeof(uint256));
 
    const struct block_cpt_entry_str *arrayStr;
    struct block_cpt_entry *array;
@@ -923,6 +1360,7 @@ blockstore_exit(struct blockstore *blockStore)
    }
 
    blockstore_write_headers(blockStore);
+   blockset_write_index(blockStore);
 
    if (blockStore->height > 0) {
       Log(LGPFX" closing blockstore w/ height=%d\n", blockStore->height);
@@ -931,10 +1369,13 @@ blockstore_exit(struct blockstore *blockStore)
    blockset_close(blockStore->blockSet);
 
    hashtable_printstats(blockStore->hash_blk, "blocks");
-   hashtable_clear_with_free(blockStore->hash_blk);
+   hashtable_clear(blockStore->hash_blk);
    hashtable_clear_with_free(blockStore->hash_orphans);
    hashtable_destroy(blockStore->hash_blk);
    hashtable_destroy(blockStore->hash_orphans);
+   free(blockStore->headers);
+   free(blockStore->hashes);
+   free(blockStore->tsMax);
 
    memset(blockStore, 0, sizeof *blockStore);
    free(blockStore);
@@ -946,6 +1387,11 @@ blockstore_exit(struct blockstore *blockStore)
  *
  * blockstore_get_hash_from_birth --
  *
+ *      Returns the highest block such that it and all the blocks before it
+ *      are older than 'birth'. A block slightly past the birth may have an
+ *      earlier timestamp: we may rescan a few blocks more than necessary, but
+ *      never miss one.
+ *
  *-------------------------------------------------------------------------
  */
 
@@ -954,19 +1400,31 @@ blockstore_get_hash_from_birth(const struct blockstore *bs,
                                time_t                   birth,
                                uint256                 *hash)
 {
-   struct blockentry *e;
+   int lo = 1;
+   int hi = bs->height + 1;
 
-   for (e = bs->best_chain; e != bs->genesis; e = e->prev)  {
-      if (e->header.timestamp < birth) {
-         char hashStr[80];
-         uint64 ts = birth;
+   /*
+    * Look for the first block with tsMax >= birth.
+    */
+   while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
 
-         hash256_calc(&e->header, sizeof e->header, hash);
-         uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
-         Log(LGPFX" birth %llu --> block %s.\n", ts, hashStr);
-         return;
+      if ((time_t)bs->tsMax[mid] < birth) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
       }
    }
+
+   if (lo > 1) {
+      char hashStr[80];
+      uint64 ts = birth;
+
+      memcpy(hash, bs->hashes + lo - 1, sizeof *hash);
+      uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
+      Log(LGPFX" birth %llu --> block %s.\n", ts, hashStr);
+      return;
+   }
    memcpy(hash, &bs->genesis_hash, sizeof *hash);
 }
 
@@ -985,64 +1443,94 @@ blockstore_is_next(struct blockstore *bs,
                    const uint256 *prev,
                    const uint256 *next)
 {
-   struct blockentry *be;
-   uint256 hash;
-   bool s;
+   int height;
 
-   s = hashtable_lookup(bs->hash_blk, prev, sizeof *prev, (void*)&be);
-   if (s == 0 || be->next == NULL) {
+   height = blockstore_lookup_height(bs, prev);
+   if (height < 0 || height == bs->height) {
       return 0;
    }
 
-   hash256_calc(&be->next->header, sizeof be->next->header, &hash);
-   return uint256_issame(&hash, next);
+   return uint256_issame(bs->hashes + height + 1, next);
 }
 
 
 /*
  *-------------------------------------------------------------------------
  *
- * blockstore_get_next_hashes --
+ * blockstore_copy_hashes --
+ *
+ *      Copies up to 'max' hashes following 'start' on the best chain.
  *
  *-------------------------------------------------------------------------
  */
 
-void
-blockstore_get_next_hashes(struct blockstore *bs,
-                           const uint256 *start,
-                           uint256 **hash,
-                           int *n)
+static void
+blockstore_copy_hashes(struct blockstore *bs,
+                       const uint256 *start,
+                       int max,
+                       uint256 **hash,
+                       int *n)
 {
-   struct blockentry *be;
    uint256 *table;
+   int height;
    int num;
-   bool s;
-   int i;
 
-   i = 0;
+   num = 0;
    table = NULL;
 
-   s = hashtable_lookup(bs->hash_blk, start, sizeof *start, (void*)&be);
-   if (s == 0 || be->next == NULL) {
+   height = blockstore_lookup_height(bs, start);
+   if (height < 0 || height == bs->height) {
       goto exit;
    }
 
-   be = be->next;
-   num = 1000;
+   num = MIN(max, bs->height - height);
    table = safe_malloc(num * sizeof *table);
-
-   while (be && i < num) {
-      hash256_calc(&be->header, sizeof be->header, table + i);
-      i++;
-      be = be->next;
-   }
+   memcpy(table, bs->hashes + height + 1, num * sizeof *table);
 
 exit:
-   *n = i;
+   *n = num;
    *hash = table;
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * blockstore_get_next_hashes --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+blockstore_get_next_hashes(struct blockstore *bs,
+                           const uint256 *start,
+                           uint256 **hash,
+                           int *n)
+{
+   blockstore_copy_hashes(bs, start, 1000, hash, n);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * blockstore_get_hashes_after --
+ *
+ *      All the hashes from 'start' (excluded) up to the tip.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+blockstore_get_hashes_after(struct blockstore *bs,
+                            const uint256 *start,
+                            uint256 **hash,
+                            int *n)
+{
+   blockstore_copy_hashes(bs, start, INT_MAX, hash, n);
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -1055,7 +1543,7 @@ void
 blockstore_get_best_hash(const struct blockstore *bs,
                          uint256 *hash)
 {
-   if (bs->best_chain == NULL) {
+   if (bs->height < 0) {
       memset(hash, 0, sizeof *hash);
    } else {
       memcpy(hash, &bs->best_hash, sizeof *hash);
@@ -1076,27 +1564,23 @@ blockstore_get_locator_hashes(const struct blockstore *bs,
                               uint256 **hash,
                               int *num)
 {
-   volatile struct blockentry *be;
    uint256 h[64];
    uint32 step = 1;
+   int height;
    int n = 0;
 
    *hash = NULL;
    *num = 0;
 
-   be = bs->best_chain;
-   while (be) {
-      int i;
-
+   height = bs->height;
+   while (height >= 0) {
       ASSERT(n < ARRAYSIZE(h));
-      hash256_calc((void *)&be->header, sizeof be->header, h + n);
+      memcpy(h + n, bs->hashes + height, sizeof h[n]);
       n++;
       if (n >= 10) {
          step *= 2;
       }
-      for (i = 0; i < step && be; i++) {
-         be = be->prev;
-      }
+      height -= step;
    }
    *num = n;
    if (n > 0) {
@@ -1135,12 +1619,18 @@ blockstore_get_block_timestamp(const struct blockstore *bs,
                                const uint256 *hash)
 {
    struct blockentry *be;
+   int height;
 
    if (uint256_iszero(hash)) {
       return 0;
    }
 
-   be = blockstore_lookup(bs, hash);
+   height = blockstore_lookup_height(bs, hash);
+   if (height >= 0) {
+      return bs->headers[height].timestamp;
+   }
+
+   be = blockstore_lookup_orphan(bs, hash);
    if (be == NULL) {
       char hashStr[80];
 
@@ -1152,3 +1642,103 @@ blockstore_get_block_timestamp(const struct blockstore *bs,
 
    return be->header.timestamp;
 }
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * blockstore_bench --
+ *
+ *      Builds an in-memory chain of 'numHeaders' synthetic headers and
+ *      compares the cost of a 1000-hash getdata window when the hashes
+ *      are recomputed from the headers vs. taken from the chain.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+blockstore_bench(uint32 numHeaders,
+                 volatile int *stop)
+{
+   struct blockstore *bs;
+   btc_block_header hdr;
+   mtime_t tsRehash;
+   mtime_t tsCached;
+   mtime_t ts;
+   char *str0;
+   char *str1;
+   uint32 numBatches;
+   uint32 i;
+
+   ASSERT(numHeaders > 1000);
+
+   bs = safe_calloc(1, sizeof *bs);
+   bs->height       = -1;
+   bs->hash_blk     = hashtable_create_fixed(sizeof(uint256));
+   bs->hash_orphans = hashtable_create_fixed(sizeof(uint256));
+
+   Warning(LGPFX" building chain of %u headers.\n", numHeaders);
+   memset(&hdr, 0, sizeof hdr);
+   hdr.version = 1;
+   for (i = 0; *stop == 0 && i < numHeaders; i++) {
+      uint256 hash;
+
+      hdr.timestamp = 1231006505 + i * 600;
+      hdr.nonce = i;
+      hash256_calc(&hdr, sizeof hdr, &hash);
+      if (i == 0) {
+         memcpy(&bs->genesis_hash, &hash, sizeof hash);
+      }
+      blockstore_add_entry(bs, &hdr, &hash, 1);
+      memcpy(&hdr.prevBlock, &hash, sizeof hash);
+   }
+
+   numBatches = 200;
+   tsRehash = 0;
+   tsCached = 0;
+   for (i = 0; *stop == 0 && i < numBatches; i++) {
+      uint256 *table;
+      int start;
+      int n;
+      int j;
+
+      start = random() % (bs->height - 1000);
+
+      /*
+       * What a window used to cost: walk the chain and hash each header.
+       */
+      ts = time_get();
+      table = safe_malloc(1000 * sizeof *table);
+      for (j = 0; j < 1000; j++) {
+         hash256_calc(bs->headers + start + 1 + j, sizeof hdr, table + j);
+      }
+      tsRehash += time_get() - ts;
+      ASSERT(uint256_issame(table + 999, bs->hashes + start + 1000));
+      free(table);
+
+      ts = time_get();
+      blockstore_get_next_hashes(bs, bs->hashes + start, &table, &n);
+      tsCached += time_get() - ts;
+      ASSERT(n == 1000);
+      ASSERT(uint256_issame(table + 999, bs->hashes + start + 1000));
+      free(table);
+   }
+
+   if (i > 0) {
+      str0 = print_latency(tsRehash / i);
+      str1 = print_latency(tsCached / i);
+      Warning(LGPFX" getdata window of 1000 hashes: rehash=%s cached=%s\n",
+              str0, str1);
+      free(str0);
+      free(str1);
+   }
+
+   hashtable_clear(bs->hash_blk);
+   hashtable_clear_with_free(bs->hash_orphans);
+   hashtable_destroy(bs->hash_blk);
+   hashtable_destroy(bs->hash_orphans);
+   free(bs->headers);
+   free(bs->hashes);
+   free(bs->tsMax);
+   free(bs);
+}
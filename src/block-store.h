@@ -16,6 +16,8 @@ void blockstore_get_genesis(const struct blockstore *bs, uint256 *hash);
 void blockstore_get_best_hash(const struct blockstore *bs, uint256 *hash);
 void blockstore_get_next_hashes(struct blockstore *bs, const uint256 *start,
                                 uint256 **hash, int *n);
+void blockstore_get_hashes_after(struct blockstore *bs, const uint256 *start,
+                                 uint256 **hash, int *n);
 bool blockstore_add_header(struct blockstore *bs, const btc_block_header *hdr,
                            const uint256 *hash, bool *orphan);
 void blockstore_write_headers(struct blockstore *bs);
@@ -35,5 +37,7 @@ void blockstore_get_highest(struct blockstore *bs,
                             uint256 *hash);
 void blockstore_get_locator_hashes(const struct blockstore *bs,
                                    uint256 **hash, int *num);
+bool blockstore_get_checkpoint(int idx, int *height, uint256 *hash);
+void blockstore_bench(uint32 numHeaders, volatile int *stop);
 
 #endif /* __BLOCK_STORE_H__ */
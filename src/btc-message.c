@@ -319,12 +319,18 @@ btcmsg_payload_valid(const struct buff *buf,
  */
 
 int
-btcmsg_parse_notfound(struct buff *buf)
+btcmsg_parse_notfound(struct buff  *buf,
+                      btc_msg_inv **invOut,
+                      int          *num)
 {
+   btc_msg_inv *inv;
    uint64 n;
    uint64 i;
    int res;
 
+   *invOut = NULL;
+   *num = 0;
+
    res = deserialize_varint(buf, &n);
    if (res) {
       NOT_TESTED();
@@ -336,20 +342,27 @@ btcmsg_parse_notfound(struct buff *buf)
       return 1;
    }
 
+   inv = safe_malloc(n * sizeof *inv);
+
    for (i = 0; i < n; i++) {
       char str[128];
-      btc_msg_inv inv;
-
-      res = deserialize_inv(buf, &inv);
-      ASSERT(res == 0);
 
-      uint256_snprintf_reverse(str, sizeof str, &inv.hash);
-      Warning(LGPFX" NOTFOUND: inv: %s %s\n", str, btc_inv_type2str(inv.type));
+      res = deserialize_inv(buf, inv + i);
+      if (res) {
+         free(inv);
+         NOT_TESTED();
+         return res;
+      }
+      uint256_snprintf_reverse(str, sizeof str, &inv[i].hash);
+      Warning(LGPFX" NOTFOUND: inv: %s %s\n", str, btc_inv_type2str(inv[i].type));
    }
 
    ASSERT(buff_space_left(buf) == 0);
 
-   return res;
+   *num = n;
+   *invOut = inv;
+
+   return 0;
 }
 
 
@@ -722,9 +735,9 @@ btcmsg_parse_pingpong(uint32       protversion,
  */
 
 static int
-btcmsg_craft_msgheader(struct buff **bufOut,
-                       const char   *message,
-                       struct buff  *bufData)
+btcmsg_craft_msgheader(struct buff       **bufOut,
+                       const char         *message,
+                       const struct buff  *bufData)
 {
    struct buff *buf;
    btc_msg_header h;
@@ -756,7 +769,7 @@ btcmsg_craft_msgheader(struct buff **bufOut,
  */
 
 int
-btcmsg_craft_tx(struct buff *txBuf,
+btcmsg_craft_tx(const struct buff *txBuf,
                 struct buff **bufOut)
 {
    btcmsg_craft_msgheader(bufOut, "tx", txBuf);
@@ -952,6 +965,7 @@ int
 btcmsg_craft_getheaders(const uint256 *hashes,
                         int            num,
                         const uint256 *genesis,
+                        const uint256 *stop,
                         struct buff  **bufOut)
 {
    btc_block_locator *bl;
@@ -963,7 +977,7 @@ btcmsg_craft_getheaders(const uint256 *hashes,
     * However, it works. So until more time frees up..
     */
    if (num > 0) {
-      bl = btcmsg_prepare_blocklocator(hashes, num, NULL);
+      bl = btcmsg_prepare_blocklocator(hashes, num, stop);
    } else {
       bl = btcmsg_prepare_blocklocator(NULL, 0, genesis);
    }
@@ -1055,6 +1069,41 @@ btcmsg_craft_getdata(struct buff     **bufOut,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * btcmsg_craft_getdata_inv --
+ *
+ *      Same as btcmsg_craft_getdata() but each entry carries its own
+ *      inventory type, so that txs and blocks can share a single message.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+btcmsg_craft_getdata_inv(struct buff      **bufOut,
+                         const btc_msg_inv *inv,
+                         int                n)
+{
+   struct buff *buf;
+   int i;
+
+   ASSERT(n <= BTC_MSG_GETDATA_MAX_ENTRIES);
+
+   buf = buff_alloc();
+   serialize_varint(buf, n);
+
+   for (i = 0; i < n; i++) {
+      serialize_inv(buf, inv + i);
+   }
+
+   btcmsg_craft_msgheader(bufOut, "getdata", buf);
+   buff_free(buf);
+
+   return 0;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
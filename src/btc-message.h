@@ -25,18 +25,20 @@ int btcmsg_craft_mempool(struct buff **buf);
 int btcmsg_craft_getblocks(const uint256 *hashes, int n, struct buff **bufOut);
 int btcmsg_craft_pong(uint32 protversion, uint64 nonce, struct buff **buf);
 int btcmsg_craft_ping(uint32 protversion, uint64 nonce, struct buff **buf);
-int btcmsg_craft_tx(struct buff *txBuf, struct buff **bufOut);
+int btcmsg_craft_tx(const struct buff *txBuf, struct buff **bufOut);
 int btcmsg_craft_addr(uint32 protversion, const struct btc_msg_address *addrs,
                       size_t numAddrs, struct buff **buf);
 int btcmsg_craft_getheaders(const uint256 *hashes, int n,
-                            const uint256 *genesis,
+                            const uint256 *genesis, const uint256 *stop,
                             struct buff **buf);
 int btcmsg_craft_getdata(struct buff **bufOut, enum btc_inv_type type,
                          const uint256 *hash, int numHash);
+int btcmsg_craft_getdata_inv(struct buff **bufOut, const btc_msg_inv *inv,
+                             int numInv);
 int btcmsg_craft_inv(struct buff **bufOut, enum btc_inv_type type,
                      const uint256 *hash, int n);
 
-int btcmsg_parse_notfound(struct buff *buf);
+int btcmsg_parse_notfound(struct buff *buf, btc_msg_inv **inv, int *num);
 int btcmsg_parse_version(struct buff *buf, btc_msg_version *version);
 int btcmsg_parse_alert(struct buff *buf);
 int btcmsg_parse_pingpong(uint32 protversion, struct buff *buf, uint64 *nonce);
@@ -385,4 +385,86 @@ buff_dup(const struct buff *buf)
 }
 
 
+/*
+ * Immutable, reference-counted message: serialized once, it can be handed
+ * to netasync_send_shared() for any number of sockets and is freed when the
+ * last reference goes away. Only used from the main poll loop.
+ */
+
+struct buff_shared {
+   int        refCount;
+   uint8     *base;
+   size_t     len;
+};
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * buff_shared_from_buff --
+ *
+ *      Takes ownership of 'buf' and of its content: no copy is made.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static inline struct buff_shared *
+buff_shared_from_buff(struct buff *buf)
+{
+   struct buff_shared *bs;
+
+   ASSERT(buf);
+
+   bs = safe_malloc(sizeof *bs);
+   bs->refCount = 1;
+   bs->base     = buf->base;
+   bs->len      = buff_curlen(buf);
+   free(buf);
+
+   return bs;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * buff_shared_ref --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static inline struct buff_shared *
+buff_shared_ref(struct buff_shared *bs)
+{
+   ASSERT(bs->refCount > 0);
+   bs->refCount++;
+
+   return bs;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * buff_shared_unref --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static inline void
+buff_shared_unref(struct buff_shared *bs)
+{
+   if (bs == NULL) {
+      return;
+   }
+   ASSERT(bs->refCount > 0);
+   bs->refCount--;
+   if (bs->refCount > 0) {
+      return;
+   }
+   free(bs->base);
+   free(bs);
+}
+
+
 #endif /* __BUFF_H__ */
@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "basic_defs.h"
 #include "util.h"
@@ -510,6 +511,56 @@ file_getsize(const struct file_descriptor *desc)
 }
 
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * file_mmap --
+ *
+ *      Maps the first 'len' bytes of the file read-only.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int
+file_mmap(const struct file_descriptor *desc,
+          size_t len,
+          void **ptr)
+{
+   void *p;
+
+   *ptr = NULL;
+
+   p = mmap(NULL, len, PROT_READ, MAP_SHARED, desc->fd, 0);
+   if (p == MAP_FAILED) {
+      int err = errno;
+      Log(LGPFX" failed to mmap %zu bytes of '%s': %s (%d)\n",
+          len, desc->name, strerror(err), err);
+      return err;
+   }
+   *ptr = p;
+   return 0;
+}
+
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * file_munmap --
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void
+file_munmap(void *ptr,
+            size_t len)
+{
+   int res;
+
+   res = munmap(ptr, len);
+   ASSERT(res == 0);
+}
+
+
 /*
  *---------------------------------------------------------------------------
  *
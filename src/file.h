@@ -29,6 +29,8 @@ int file_pread(const struct file_descriptor *desc,
                uint64 offset, void *buf, size_t len, size_t *num);
 int file_pwrite(const struct file_descriptor *desc,
                 uint64 offset, const void *buf, size_t len, size_t *num);
+int file_mmap(const struct file_descriptor *desc, size_t len, void **ptr);
+void file_munmap(void *ptr, size_t len);
 int file_open(const char *name,
               bool readOnly,
               bool unbuf,
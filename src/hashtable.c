@@ -13,6 +13,27 @@ static bool verbose = 0;
 #define HASH_DEFAULT_NUM_BUCKETS        256
 #define HASH_DEFAULT_FACTOR             4
 
+/*
+ * Fixed-size keys: open addressing with robin hood probing. Tables are kept
+ * at most 7/8th full. A table in which an entry would land further than
+ * HASH_FIXED_MAX_DIST from its home slot is grown on the spot.
+ */
+#define HASH_FIXED_MAX_LOAD(_n)         ((_n) - (_n) / 8)
+#define HASH_FIXED_MAX_DIST             255
+
+/*
+ * Number of buckets of the old table migrated by each operation while a
+ * resize is in progress.
+ */
+#define HASH_REHASH_STEP                64
+
+/*
+ * Resize latency histogram: bucket i counts the operations whose resize work
+ * took less than 2^i usec. Only one rehash step in HASH_LAT_SAMPLE is timed.
+ */
+#define HASH_LAT_BUCKETS                16
+#define HASH_LAT_SAMPLE                 16
+
 struct hashtable_linearize_info {
    void         *buf;
    size_t       entry_size;
@@ -27,14 +48,92 @@ struct hashtable_entry {
 };
 
 
-struct hashtable {
+/*
+ * When keyLen is 0, keys can be of any length and each bucket is a chain of
+ * malloc'd entries. Otherwise all keys are 'keyLen' bytes long and are stored
+ * inline in 'slots' along with the clientData. 'dist' holds the probe
+ * distance + 1 of the entry in each slot, 0 for an empty slot.
+ */
+struct hashtable_table {
    uint32                   numBuckets;
    uint32                   count;
    uint8                    numBits;
    struct hashtable_entry **buckets;
+   uint8                   *slots;
+   uint8                   *dist;
+};
+
+
+/*
+ * A resize does not rehash everything at once: 'old' keeps the previous
+ * table and each lookup, insert or remove migrates a few of its buckets into
+ * 'cur', starting at 'rehashIdx'. Lookups check both tables until 'old' is
+ * empty.
+ */
+struct hashtable {
+   size_t                   keyLen;
+   size_t                   slotSize;
+   struct hashtable_table   cur;
+   struct hashtable_table   old;
+   uint32                   rehashIdx;
+   uint32                   numSteps;
+   uint32                   resizeLat[HASH_LAT_BUCKETS];
 };
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_rehashing --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static inline bool
+hashtable_rehashing(const struct hashtable *ht)
+{
+   return ht->old.numBuckets != 0;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_latency_str --
+ *
+ *      Formats the non-empty buckets of the resize latency histogram.
+ *      Returns NULL if no resize happened.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static char *
+hashtable_latency_str(const struct hashtable *ht)
+{
+   char *str = NULL;
+   uint32 i;
+
+   for (i = 0; i < HASH_LAT_BUCKETS; i++) {
+      uint64 bound = 1ULL << i;
+      char *s;
+
+      if (ht->resizeLat[i] == 0) {
+         continue;
+      }
+      if (bound < 1000) {
+         s = safe_asprintf("%s%s<%lluus:%u", str ? str : "", str ? " " : "",
+                           bound, ht->resizeLat[i]);
+      } else {
+         s = safe_asprintf("%s%s<%.1fms:%u", str ? str : "", str ? " " : "",
+                           bound / 1000.0, ht->resizeLat[i]);
+      }
+      free(str);
+      str = s;
+   }
+   return str;
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -50,43 +149,589 @@ hashtable_printstats(const struct hashtable *ht,
    uint32 count = hashtable_getnumentries(ht);
    uint32 depth = hashtable_getmaxdepth(ht);
    uint32 empty = hashtable_getemptybuckets(ht);
+   char *latStr;
+   char *memStr;
 
    if (count == 0) {
       return;
    }
 
-   Log("HASH %s: count=%u maxdepth=%u empty=%u\n",
-       pfx, count, depth, empty);
+   memStr = print_size(hashtable_getmemsize(ht));
+   Log("HASH %s: count=%u maxdepth=%u empty=%u mem=%s\n",
+       pfx, count, depth, empty, memStr);
+   free(memStr);
+
+   latStr = hashtable_latency_str(ht);
+   if (latStr) {
+      Log("HASH %s: resize latency (sampled) %s\n", pfx, latStr);
+      free(latStr);
+   }
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_table_memsize --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static uint64
+hashtable_table_memsize(const struct hashtable *ht,
+                        const struct hashtable_table *t)
+{
+   uint64 size;
+   uint32 i;
+
+   if (ht->keyLen) {
+      return (uint64)t->numBuckets * (ht->slotSize + 1);
+   }
+
+   size = (uint64)t->numBuckets * sizeof *t->buckets;
+   for (i = 0; i < t->numBuckets; i++) {
+      const struct hashtable_entry *e = t->buckets[i];
+
+      while (e) {
+         size += sizeof *e + e->keyLen;
+         e = e->next;
+      }
+   }
+   return size;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_getmemsize --
+ *
+ *      Memory used by the table, not counting the allocator overhead.
+ *
+ *---------------------------------------------------------------------
+ */
+
+uint64
+hashtable_getmemsize(const struct hashtable *ht)
+{
+   return sizeof *ht + hashtable_table_memsize(ht, &ht->cur)
+                     + hashtable_table_memsize(ht, &ht->old);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_fixed_hash --
+ *
+ *      Fixed-size keys are hashes or start with one: their bytes are
+ *      already uniformly distributed. Fold in the tail of the key so that
+ *      keys sharing a prefix (txHash + outIdx) still spread.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static inline uint32
+hashtable_fixed_hash(const struct hashtable *ht,
+                     const struct hashtable_table *t,
+                     const void *key)
+{
+   uint64 a;
+   uint64 b;
+
+   memcpy(&a, key, sizeof a);
+   memcpy(&b, (const uint8 *)key + ht->keyLen - sizeof b, sizeof b);
+
+   a ^= b * 0x9e3779b97f4a7c15ULL;
+
+   return (uint32)(a ^ (a >> 32)) & (t->numBuckets - 1);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_fixed_slot --
+ *
+ *      A slot holds the clientData followed by the key.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static inline uint8 *
+hashtable_fixed_slot(const struct hashtable *ht,
+                     const struct hashtable_table *t,
+                     uint32 idx)
+{
+   return t->slots + (size_t)idx * ht->slotSize;
+}
+
+
+static inline void *
+hashtable_fixed_slot_data(const struct hashtable *ht,
+                          const struct hashtable_table *t,
+                          uint32 idx)
+{
+   void *clientData;
+
+   memcpy(&clientData, hashtable_fixed_slot(ht, t, idx), sizeof clientData);
+   return clientData;
+}
+
+
+static inline uint8 *
+hashtable_fixed_slot_key(const struct hashtable *ht,
+                         const struct hashtable_table *t,
+                         uint32 idx)
+{
+   return hashtable_fixed_slot(ht, t, idx) + sizeof(void *);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_fixed_find --
+ *
+ *      Returns the slot holding 'key', or -1. With robin hood probing an
+ *      entry never sits further from its home slot than the one we are
+ *      looking for, so the probe stops as soon as it meets one closer to
+ *      home.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static int64
+hashtable_fixed_find(const struct hashtable *ht,
+                     const struct hashtable_table *t,
+                     const void *key)
+{
+   uint32 mask = t->numBuckets - 1;
+   uint32 idx;
+   uint32 d;
+
+   idx = hashtable_fixed_hash(ht, t, key);
+
+   for (d = 1; d <= HASH_FIXED_MAX_DIST; d++) {
+      uint32 dist = t->dist[idx];
+
+      if (dist < d) {
+         return -1;
+      }
+      if (dist == d &&
+          memcmp(hashtable_fixed_slot_key(ht, t, idx), key, ht->keyLen) == 0) {
+         return idx;
+      }
+      idx = (idx + 1) & mask;
+   }
+   return -1;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_fixed_place_slot --
+ *
+ *      Inserts the entry held in 'slot', known not to be in the table yet.
+ *      Entries closer to their home slot are displaced by the ones further
+ *      away. Returns FALSE if the entry being carried would end up too far
+ *      from home: it is then left in 'slot', and the table holds the same
+ *      number of entries as before.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static bool
+hashtable_fixed_place_slot(const struct hashtable *ht,
+                           struct hashtable_table *t,
+                           uint8 *slot)
+{
+   uint8 tmp[ht->slotSize];
+   uint32 mask = t->numBuckets - 1;
+   uint32 idx;
+   uint32 d;
+
+   idx = hashtable_fixed_hash(ht, t, slot + sizeof(void *));
+   d = 1;
+
+   while (t->dist[idx] != 0) {
+      if (t->dist[idx] < d) {
+         uint32 dist = t->dist[idx];
+
+         memcpy(tmp, hashtable_fixed_slot(ht, t, idx), ht->slotSize);
+         memcpy(hashtable_fixed_slot(ht, t, idx), slot, ht->slotSize);
+         memcpy(slot, tmp, ht->slotSize);
+         t->dist[idx] = d;
+         d = dist;
+      }
+      idx = (idx + 1) & mask;
+      d++;
+      if (d > HASH_FIXED_MAX_DIST) {
+         return 0;
+      }
+   }
+
+   memcpy(hashtable_fixed_slot(ht, t, idx), slot, ht->slotSize);
+   t->dist[idx] = d;
+   t->count++;
+
+   return 1;
 }
 
 
-/*
- *---------------------------------------------------------------------
- *
- * hashtable_compute_hash --
- *
- *      http://murmurhash.googlepages.com/
- *
- *---------------------------------------------------------------------
- */
+static void hashtable_table_alloc(const struct hashtable *ht,
+                                  struct hashtable_table *t,
+                                  uint32 numBuckets);
+static void hashtable_table_free(struct hashtable_table *t);
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_fixed_grow --
+ *
+ *      Rebuilds 't' at twice its size, in one go. Only needed when a probe
+ *      sequence gets too long for 'dist', which takes a poor spread of the
+ *      keys: the regular resizes keep the load well below that.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_fixed_grow(const struct hashtable *ht,
+                     struct hashtable_table *t)
+{
+   struct hashtable_table nt;
+   uint32 i;
+
+   Log(LGPFX" probe distance over %u with %u/%u buckets used: growing.\n",
+       HASH_FIXED_MAX_DIST, t->count, t->numBuckets);
+
+   hashtable_table_alloc(ht, &nt, t->numBuckets * 2);
+
+   for (i = 0; i < t->numBuckets; i++) {
+      uint8 *slot = hashtable_fixed_slot(ht, t, i);
+
+      if (t->dist[i] == 0) {
+         continue;
+      }
+      while (!hashtable_fixed_place_slot(ht, &nt, slot)) {
+         hashtable_fixed_grow(ht, &nt);
+      }
+   }
+
+   t->count = 0;
+   hashtable_table_free(t);
+   *t = nt;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_fixed_place --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_fixed_place(const struct hashtable *ht,
+                      struct hashtable_table *t,
+                      const void *key,
+                      void *clientData)
+{
+   uint8 slot[ht->slotSize];
+
+   memcpy(slot, &clientData, sizeof clientData);
+   memcpy(slot + sizeof clientData, key, ht->keyLen);
+
+   while (!hashtable_fixed_place_slot(ht, t, slot)) {
+      hashtable_fixed_grow(ht, t);
+   }
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_fixed_remove_idx --
+ *
+ *      Backward-shift deletion: the entries following the removed one are
+ *      moved one slot closer to home, so no tombstone is needed.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_fixed_remove_idx(const struct hashtable *ht,
+                           struct hashtable_table *t,
+                           uint32 idx)
+{
+   uint32 mask = t->numBuckets - 1;
+   uint32 next = (idx + 1) & mask;
+
+   while (t->dist[next] > 1) {
+      memcpy(hashtable_fixed_slot(ht, t, idx),
+             hashtable_fixed_slot(ht, t, next), ht->slotSize);
+      t->dist[idx] = t->dist[next] - 1;
+      idx = next;
+      next = (next + 1) & mask;
+   }
+   t->dist[idx] = 0;
+   t->count--;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_compute_hash --
+ *
+ *      http://murmurhash.googlepages.com/
+ *
+ *---------------------------------------------------------------------
+ */
+
+static uint32
+hashtable_compute_hash(uint32 numBuckets,
+                       uint8 numBits,
+                       const void *key,
+                       size_t keyLen)
+{
+   uint32 mask;
+   uint32 h;
+
+   h = MurmurHash3(key, keyLen, 0x5678);
+   mask = numBuckets - 1;
+
+   while (h > mask) {
+      h = (h & mask) ^ (h >> numBits);
+   }
+   ASSERT(h < numBuckets);
+   return h;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_table_alloc --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_table_alloc(const struct hashtable *ht,
+                      struct hashtable_table *t,
+                      uint32 numBuckets)
+{
+   ASSERT((numBuckets & (numBuckets - 1)) == 0);
+
+   memset(t, 0, sizeof *t);
+   t->numBuckets = numBuckets;
+   t->numBits    = util_log2(numBuckets);
+
+   if (ht->keyLen) {
+      t->slots = safe_malloc((size_t)numBuckets * ht->slotSize);
+      t->dist  = safe_calloc(numBuckets, sizeof *t->dist);
+   } else {
+      t->buckets = safe_calloc(numBuckets, sizeof *t->buckets);
+   }
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_table_free --
+ *
+ *      Releases the bucket arrays of an empty table.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_table_free(struct hashtable_table *t)
+{
+   ASSERT(t->count == 0);
+
+   free(t->buckets);
+   free(t->slots);
+   free(t->dist);
+   memset(t, 0, sizeof *t);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_rehash --
+ *
+ *      Moves the entries of up to 'n' buckets of the old table to the
+ *      current one. Releases the old table once it has been drained.
+ *
+ *      In fixed mode, the entry in slot 'rehashIdx' is taken out with a
+ *      backward shift, which may pull the next entries of its run into the
+ *      slot: we keep migrating until the slot is empty. After that, no entry
+ *      left in the old table has its home slot before 'rehashIdx', so the
+ *      probe sequences of the remaining entries stay intact.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_rehash(struct hashtable *ht,
+                 uint32 n)
+{
+   struct hashtable_table *old = &ht->old;
+   struct hashtable_table *cur = &ht->cur;
+
+   while (n > 0 && ht->rehashIdx < old->numBuckets) {
+      uint32 idx = ht->rehashIdx;
+
+      if (ht->keyLen) {
+         while (old->dist[idx] != 0) {
+            uint8 *slot = hashtable_fixed_slot(ht, old, idx);
+            uint8 key[ht->keyLen];
+            void *clientData;
+
+            memcpy(&clientData, slot, sizeof clientData);
+            memcpy(key, slot + sizeof clientData, ht->keyLen);
+            hashtable_fixed_remove_idx(ht, old, idx);
+            hashtable_fixed_place(ht, cur, key, clientData);
+         }
+      } else {
+         struct hashtable_entry *e = old->buckets[idx];
+
+         old->buckets[idx] = NULL;
+         while (e) {
+            struct hashtable_entry *next = e->next;
+            uint32 hash;
+
+            hash = hashtable_compute_hash(cur->numBuckets, cur->numBits,
+                                          e->key, e->keyLen);
+            e->next = cur->buckets[hash];
+            cur->buckets[hash] = e;
+            old->count--;
+            cur->count++;
+            e = next;
+         }
+      }
+      ht->rehashIdx++;
+      n--;
+   }
+
+   if (ht->rehashIdx == old->numBuckets) {
+      LOG(1, (LGPFX" resize to %u buckets done.\n", cur->numBuckets));
+      hashtable_table_free(old);
+      ht->rehashIdx = 0;
+   }
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_target_size --
+ *
+ *      Number of buckets the table should have for its current count.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static uint32
+hashtable_target_size(const struct hashtable *ht)
+{
+   uint32 numBuckets = ht->cur.numBuckets;
+   uint32 count = hashtable_getnumentries(ht);
+
+   if (ht->keyLen) {
+      if (count + 1 > HASH_FIXED_MAX_LOAD(numBuckets)) {
+         return numBuckets * 2;
+      }
+      if (count < numBuckets / 8 && numBuckets > HASH_DEFAULT_NUM_BUCKETS) {
+         return numBuckets / 2;
+      }
+      return numBuckets;
+   }
+
+   if (count > HASH_DEFAULT_FACTOR * numBuckets) {
+      numBuckets *= HASH_DEFAULT_FACTOR;
+   } else if (count < numBuckets / HASH_DEFAULT_FACTOR) {
+      numBuckets /= HASH_DEFAULT_FACTOR;
+   }
+   if (numBuckets <= HASH_DEFAULT_NUM_BUCKETS) {
+      return ht->cur.numBuckets;
+   }
+   return numBuckets;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_check_resize --
+ *
+ *      Called before each insert and remove. Starts a resize when the load
+ *      goes out of bounds and advances the one in progress, so that no
+ *      single operation pays for rehashing the whole table.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_check_resize(struct hashtable *ht)
+{
+   uint32 numBuckets;
+   uint32 n = HASH_REHASH_STEP;
+   mtime_t ts = 0;
+   bool timed;
+   uint32 i;
+
+   if (!hashtable_rehashing(ht) &&
+       hashtable_target_size(ht) == ht->cur.numBuckets) {
+      return;
+   }
+
+   /*
+    * An open-addressing table cannot go past its max load: if the current
+    * one fills up before the old one is drained, finish now.
+    */
+   if (hashtable_rehashing(ht) && ht->keyLen &&
+       hashtable_getnumentries(ht) + 1 >
+       HASH_FIXED_MAX_LOAD(ht->cur.numBuckets)) {
+      n = ht->old.numBuckets;
+   }
+
+   timed = ht->numSteps++ % HASH_LAT_SAMPLE == 0 || n != HASH_REHASH_STEP;
+   if (timed) {
+      ts = time_get();
+   }
+
+   if (hashtable_rehashing(ht)) {
+      hashtable_rehash(ht, n);
+   }
 
-static uint32
-hashtable_compute_hash(uint32 numBuckets,
-                       uint8 numBits,
-                       const void *key,
-                       size_t keyLen)
-{
-   uint32 mask;
-   uint32 h;
+   numBuckets = hashtable_target_size(ht);
+   if (!hashtable_rehashing(ht) && numBuckets != ht->cur.numBuckets) {
+      LOG(1, (LGPFX" resizing: %u -> %u buckets.\n",
+              ht->cur.numBuckets, numBuckets));
 
-   h = MurmurHash3(key, keyLen, 0x5678);
-   mask = numBuckets - 1;
+      ht->old = ht->cur;
+      ht->rehashIdx = 0;
+      hashtable_table_alloc(ht, &ht->cur, numBuckets);
+      hashtable_rehash(ht, HASH_REHASH_STEP);
+   }
 
-   while (h > mask) {
-      h = (h & mask) ^ (h >> numBits);
+   if (!timed) {
+      return;
    }
-   ASSERT(h < numBuckets);
-   return h;
+   ts = time_get() - ts;
+   for (i = 0; ts > 0 && i < HASH_LAT_BUCKETS - 1; i++) {
+      ts >>= 1;
+   }
+   ht->resizeLat[i]++;
 }
 
 
@@ -104,8 +749,12 @@ hashtable_getemptybuckets(const struct hashtable *ht)
    uint32 count = 0;
    uint32 i;
 
-   for (i = 0; i < ht->numBuckets; i++) {
-      if (ht->buckets[i] == 0) {
+   if (ht->keyLen) {
+      return ht->cur.numBuckets - ht->cur.count;
+   }
+
+   for (i = 0; i < ht->cur.numBuckets; i++) {
+      if (ht->cur.buckets[i] == 0) {
          count++;
       }
    }
@@ -116,19 +765,30 @@ hashtable_getemptybuckets(const struct hashtable *ht)
 /*
  *---------------------------------------------------------------------
  *
- * hashtable_getmaxdepth --
+ * hashtable_table_maxdepth --
  *
  *---------------------------------------------------------------------
  */
 
-uint32
-hashtable_getmaxdepth(const struct hashtable *ht)
+static uint32
+hashtable_table_maxdepth(const struct hashtable *ht,
+                         const struct hashtable_table *t)
 {
    uint32 depth = 0;
    uint32 i;
 
-   for (i = 0; i < ht->numBuckets; i++) {
-      const struct hashtable_entry *e = ht->buckets[i];
+   if (ht->keyLen) {
+      /*
+       * The longest probe sequence.
+       */
+      for (i = 0; i < t->numBuckets; i++) {
+         depth = MAX(depth, t->dist[i]);
+      }
+      return depth;
+   }
+
+   for (i = 0; i < t->numBuckets; i++) {
+      const struct hashtable_entry *e = t->buckets[i];
       uint32 count = 0;
 
       while (e) {
@@ -141,6 +801,22 @@ hashtable_getmaxdepth(const struct hashtable *ht)
 }
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_getmaxdepth --
+ *
+ *---------------------------------------------------------------------
+ */
+
+uint32
+hashtable_getmaxdepth(const struct hashtable *ht)
+{
+   return MAX(hashtable_table_maxdepth(ht, &ht->cur),
+              hashtable_table_maxdepth(ht, &ht->old));
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -152,7 +828,7 @@ hashtable_getmaxdepth(const struct hashtable *ht)
 uint32
 hashtable_getnumentries(const struct hashtable *ht)
 {
-   return ht->count;
+   return ht->cur.count + ht->old.count;
 }
 
 
@@ -171,19 +847,41 @@ hashtable_get_entry_idx(const struct hashtable *ht,
                         size_t *keyLen,
                         void **clientData)
 {
+   const struct hashtable_table *t = &ht->cur;
    uint32 count;
    uint32 i;
 
-   if (idx > ht->count) {
+   if (idx > hashtable_getnumentries(ht)) {
       *key = NULL;
       *keyLen = 0;
       *clientData = NULL;
       return;
    }
 
+   if (idx >= t->count) {
+      idx -= t->count;
+      t = &ht->old;
+   }
+
    count = 0;
-   for (i = 0; i < ht->numBuckets; i++) {
-      struct hashtable_entry *e = ht->buckets[i];
+   if (ht->keyLen) {
+      for (i = 0; i < t->numBuckets; i++) {
+         if (t->dist[i] == 0) {
+            continue;
+         }
+         if (count == idx) {
+            *key        = hashtable_fixed_slot_key(ht, t, i);
+            *keyLen     = ht->keyLen;
+            *clientData = hashtable_fixed_slot_data(ht, t, i);
+            return;
+         }
+         count++;
+      }
+      Panic("Should not get here.\n");
+   }
+
+   for (i = 0; i < t->numBuckets; i++) {
+      struct hashtable_entry *e = t->buckets[i];
       while (e) {
          if (count == idx) {
             *key        = e->key;
@@ -208,14 +906,14 @@ hashtable_get_entry_idx(const struct hashtable *ht,
  */
 
 static struct hashtable_entry *
-hashtable_lookup_entry(const struct hashtable *ht,
+hashtable_lookup_entry(const struct hashtable_table *t,
                        uint32 hash,
                        const void *key,
                        size_t keyLen)
 {
    struct hashtable_entry *e;
 
-   e = ht->buckets[hash];
+   e = t->buckets[hash];
    while (e) {
       if (keyLen == e->keyLen && memcmp(key, e->key, keyLen) == 0) {
          return e;
@@ -229,81 +927,74 @@ hashtable_lookup_entry(const struct hashtable *ht,
 /*
  *---------------------------------------------------------------------
  *
- * hashtable_lookup --
+ * hashtable_lookup_old --
+ *
+ *      Looks for 'key' in the table being drained by a resize.
  *
  *---------------------------------------------------------------------
  */
 
-bool
-hashtable_lookup(const struct hashtable *ht,
-                 const void *key,
-                 size_t keyLen,
-                 void **clientData)
+static struct hashtable_entry *
+hashtable_lookup_old(const struct hashtable *ht,
+                     const void *key,
+                     size_t keyLen)
 {
-   struct hashtable_entry *e;
+   const struct hashtable_table *old = &ht->old;
    uint32 hash;
 
-   hash = hashtable_compute_hash(ht->numBuckets, ht->numBits, key, keyLen);
-
-   e = hashtable_lookup_entry(ht, hash, key, keyLen);
-   if (e && clientData) {
-      *clientData = e->clientData;
+   if (old->count == 0) {
+      return NULL;
    }
-   return e != NULL;
+   hash = hashtable_compute_hash(old->numBuckets, old->numBits, key, keyLen);
+
+   return hashtable_lookup_entry(old, hash, key, keyLen);
 }
 
 
 /*
  *---------------------------------------------------------------------
  *
- * hashtable_check_resize --
+ * hashtable_lookup --
  *
  *---------------------------------------------------------------------
  */
 
-static void
-hashtable_check_resize(struct hashtable *ht)
+bool
+hashtable_lookup(const struct hashtable *ht,
+                 const void *key,
+                 size_t keyLen,
+                 void **clientData)
 {
-   struct hashtable_entry **buckets;
-   uint32 numBuckets = ht->numBuckets;
-   uint8 numBits;
-   uint32 i;
-
-   if (ht->count >  HASH_DEFAULT_FACTOR * ht->numBuckets) {
-      numBuckets *= HASH_DEFAULT_FACTOR;
-   } else if (ht->count < ht->numBuckets / HASH_DEFAULT_FACTOR) {
-      numBuckets /= HASH_DEFAULT_FACTOR;
-   }
-   if (numBuckets <= HASH_DEFAULT_NUM_BUCKETS) {
-      return;
-   }
-   if (numBuckets == ht->numBuckets) {
-      return;
-   }
+   struct hashtable_entry *e;
+   uint32 hash;
 
-   LOG(1, (LGPFX" resizing: %u -> %u buckets.\n", ht->numBuckets, numBuckets));
+   if (ht->keyLen) {
+      const struct hashtable_table *t = &ht->cur;
+      int64 idx;
 
-   buckets = safe_calloc(numBuckets, sizeof *buckets);
-   numBits = util_log2(numBuckets);
+      ASSERT(keyLen == ht->keyLen);
+      idx = hashtable_fixed_find(ht, t, key);
+      if (idx < 0 && hashtable_rehashing(ht)) {
+         t = &ht->old;
+         idx = hashtable_fixed_find(ht, t, key);
+      }
+      if (idx >= 0 && clientData) {
+         *clientData = hashtable_fixed_slot_data(ht, t, idx);
+      }
+      return idx >= 0;
+   }
 
-   for (i = 0; i < ht->numBuckets; i++) {
-      struct hashtable_entry *e = ht->buckets[i];
-      ht->buckets[i] = NULL;
-      while (e) {
-         struct hashtable_entry *next;
-         uint32 hash;
+   hash = hashtable_compute_hash(ht->cur.numBuckets, ht->cur.numBits,
+                                 key, keyLen);
 
-         next = e->next;
-         hash = hashtable_compute_hash(numBuckets, numBits, e->key, e->keyLen);
-         e->next = buckets[hash];
-         buckets[hash] = e;
-         e = next;
-      }
+   e = hashtable_lookup_entry(&ht->cur, hash, key, keyLen);
+   if (e == NULL) {
+      e = hashtable_lookup_old(ht, key, keyLen);
+   }
+   if (e && clientData) {
+      *clientData = e->clientData;
    }
-   free(ht->buckets);
-   ht->numBits = numBits;
-   ht->buckets = buckets;
-   ht->numBuckets = numBuckets;
+   return e != NULL;
 }
 
 
@@ -321,26 +1012,38 @@ hashtable_insert(struct hashtable *ht,
                  size_t keyLen,
                  void *clientData)
 {
+   struct hashtable_table *cur = &ht->cur;
    struct hashtable_entry *e;
    uint32 hash;
 
    hashtable_check_resize(ht);
 
-   hash = hashtable_compute_hash(ht->numBuckets, ht->numBits, key, keyLen);
+   if (ht->keyLen) {
+      ASSERT(keyLen == ht->keyLen);
+      if (hashtable_fixed_find(ht, cur, key) >= 0 ||
+          (hashtable_rehashing(ht) &&
+           hashtable_fixed_find(ht, &ht->old, key) >= 0)) {
+         return 0;
+      }
+      hashtable_fixed_place(ht, cur, key, clientData);
+      return 1;
+   }
+
+   hash = hashtable_compute_hash(cur->numBuckets, cur->numBits, key, keyLen);
 
-   e = hashtable_lookup_entry(ht, hash, key, keyLen);
-   if (e) {
+   if (hashtable_lookup_entry(cur, hash, key, keyLen) ||
+       hashtable_lookup_old(ht, key, keyLen)) {
       return 0;
    }
 
    e = safe_malloc(sizeof *e + keyLen);
    e->keyLen     = keyLen;
    e->clientData = clientData;
-   e->next       = ht->buckets[hash];
+   e->next       = cur->buckets[hash];
    memcpy(e->key, key, keyLen);
 
-   ht->buckets[hash] = e;
-   ht->count++;
+   cur->buckets[hash] = e;
+   cur->count++;
 
    return 1;
 }
@@ -360,11 +1063,35 @@ hashtable_create(void)
    struct hashtable *ht;
 
    ht = safe_calloc(1, sizeof *ht);
-   ht->numBuckets = HASH_DEFAULT_NUM_BUCKETS;
-   ht->numBits    = util_log2(ht->numBuckets);
-   ht->buckets    = safe_calloc(ht->numBuckets, sizeof *ht->buckets);
+   hashtable_table_alloc(ht, &ht->cur, HASH_DEFAULT_NUM_BUCKETS);
+
+   return ht;
+}
 
-   ASSERT((ht->numBuckets & (ht->numBuckets - 1)) == 0);
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_create_fixed --
+ *
+ *      For tables whose keys all have the same length and start with a
+ *      hash (uint256, uint160, ..). Entries are stored inline: no
+ *      allocation per entry and no hashing of the key.
+ *
+ *---------------------------------------------------------------------
+ */
+
+struct hashtable *
+hashtable_create_fixed(size_t keyLen)
+{
+   struct hashtable *ht;
+
+   ASSERT(keyLen >= sizeof(uint64));
+
+   ht = safe_calloc(1, sizeof *ht);
+   ht->keyLen   = keyLen;
+   ht->slotSize = ROUNDUP(sizeof(void *) + keyLen, sizeof(void *));
+   hashtable_table_alloc(ht, &ht->cur, HASH_DEFAULT_NUM_BUCKETS);
 
    return ht;
 }
@@ -373,22 +1100,31 @@ hashtable_create(void)
 /*
  *---------------------------------------------------------------------
  *
- * hashtable_for_each --
+ * hashtable_table_for_each --
  *
  *---------------------------------------------------------------------
  */
 
-void
-hashtable_for_each(const struct hashtable *ht,
-                   hashtable_for_each_callback callback,
-                   void *callbackData)
+static void
+hashtable_table_for_each(const struct hashtable *ht,
+                         const struct hashtable_table *t,
+                         hashtable_for_each_callback callback,
+                         void *callbackData)
 {
    uint32 i;
 
-   ASSERT(callback);
+   if (ht->keyLen) {
+      for (i = 0; i < t->numBuckets; i++) {
+         if (t->dist[i]) {
+            callback(hashtable_fixed_slot_key(ht, t, i), ht->keyLen,
+                     callbackData, hashtable_fixed_slot_data(ht, t, i));
+         }
+      }
+      return;
+   }
 
-   for (i = 0; i < ht->numBuckets; i++) {
-      struct hashtable_entry *e = ht->buckets[i];
+   for (i = 0; i < t->numBuckets; i++) {
+      struct hashtable_entry *e = t->buckets[i];
       while (e) {
          struct hashtable_entry *next = e->next;
          callback(e->key, e->keyLen, callbackData, e->clientData);
@@ -398,24 +1134,59 @@ hashtable_for_each(const struct hashtable *ht,
 }
 
 
-
 /*
  *---------------------------------------------------------------------
  *
- * hashtable_clear_with_callback --
+ * hashtable_for_each --
  *
  *---------------------------------------------------------------------
  */
 
 void
-hashtable_clear_with_callback(struct hashtable *ht,
-                              hashtable_callback callback)
+hashtable_for_each(const struct hashtable *ht,
+                   hashtable_for_each_callback callback,
+                   void *callbackData)
+{
+   ASSERT(callback);
+
+   hashtable_table_for_each(ht, &ht->cur, callback, callbackData);
+   hashtable_table_for_each(ht, &ht->old, callback, callbackData);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_table_clear --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_table_clear(const struct hashtable *ht,
+                      struct hashtable_table *t,
+                      hashtable_callback callback)
 {
    uint32 i;
 
-   for (i = 0; i < ht->numBuckets; i++) {
-      struct hashtable_entry *e = ht->buckets[i];
-      ht->buckets[i] = NULL;
+   if (ht->keyLen) {
+      for (i = 0; i < t->numBuckets; i++) {
+         if (t->dist[i] == 0) {
+            continue;
+         }
+         if (callback) {
+            callback(hashtable_fixed_slot_key(ht, t, i), ht->keyLen,
+                     hashtable_fixed_slot_data(ht, t, i));
+         }
+         t->dist[i] = 0;
+         t->count--;
+      }
+      return;
+   }
+
+   for (i = 0; i < t->numBuckets; i++) {
+      struct hashtable_entry *e = t->buckets[i];
+      t->buckets[i] = NULL;
       while (e) {
          struct hashtable_entry *next = e->next;
          if (callback) {
@@ -423,12 +1194,34 @@ hashtable_clear_with_callback(struct hashtable *ht,
          }
          free(e);
          e = next;
-         ht->count--;
+         t->count--;
       }
    }
 }
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_clear_with_callback --
+ *
+ *      Also abandons a resize in progress: the current table is empty and
+ *      the old one can go.
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+hashtable_clear_with_callback(struct hashtable *ht,
+                              hashtable_callback callback)
+{
+   hashtable_table_clear(ht, &ht->cur, callback);
+   hashtable_table_clear(ht, &ht->old, callback);
+   hashtable_table_free(&ht->old);
+   ht->rehashIdx = 0;
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -487,9 +1280,9 @@ hashtable_clear(struct hashtable *ht)
 void
 hashtable_destroy(struct hashtable *ht)
 {
-   ASSERT(ht->count == 0);
+   ASSERT(hashtable_getnumentries(ht) == 0);
    hashtable_clear(ht);
-   free(ht->buckets);
+   hashtable_table_free(&ht->cur);
    free(ht);
 }
 
@@ -497,51 +1290,142 @@ hashtable_destroy(struct hashtable *ht)
 /*
  *---------------------------------------------------------------------
  *
- * hashtable_remove --
+ * hashtable_table_remove --
  *
  *---------------------------------------------------------------------
  */
 
-bool
-hashtable_remove(struct hashtable *ht,
-                 const void *key,
-                 size_t keyLen)
+static bool
+hashtable_table_remove(const struct hashtable *ht,
+                       struct hashtable_table *t,
+                       const void *key,
+                       size_t keyLen)
 {
-   struct hashtable_entry *entry;
    struct hashtable_entry *prev;
    struct hashtable_entry *e;
    uint32 hash;
 
-   hashtable_check_resize(ht);
+   if (t->count == 0) {
+      return 0;
+   }
 
-   hash = hashtable_compute_hash(ht->numBuckets, ht->numBits, key, keyLen);
+   if (ht->keyLen) {
+      int64 idx = hashtable_fixed_find(ht, t, key);
 
-   entry = hashtable_lookup_entry(ht, hash, key, keyLen);
-   if (entry == NULL) {
-      return 0;
+      if (idx < 0) {
+         return 0;
+      }
+      hashtable_fixed_remove_idx(ht, t, idx);
+      return 1;
    }
-   e = ht->buckets[hash];
-   ASSERT(e);
+
+   hash = hashtable_compute_hash(t->numBuckets, t->numBits, key, keyLen);
+
+   e = t->buckets[hash];
    prev = NULL;
    while (e) {
-      if (e == entry) {
+      if (keyLen == e->keyLen && memcmp(key, e->key, keyLen) == 0) {
          if (prev) {
             prev->next = e->next;
          } else {
-            ht->buckets[hash] = e->next;
+            t->buckets[hash] = e->next;
          }
          free(e);
-         ht->count--;
+         t->count--;
          return 1;
       }
       prev = e;
       e = e->next;
    }
-   Panic("failed to remove entry.\n");
+   return 0;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_remove --
+ *
+ *---------------------------------------------------------------------
+ */
+
+bool
+hashtable_remove(struct hashtable *ht,
+                 const void *key,
+                 size_t keyLen)
+{
+   ASSERT(ht->keyLen == 0 || keyLen == ht->keyLen);
+
+   if (hashtable_table_remove(ht, &ht->cur, key, keyLen) == 0 &&
+       hashtable_table_remove(ht, &ht->old, key, keyLen) == 0) {
+      return 0;
+   }
+   hashtable_check_resize(ht);
    return 1;
 }
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_bench --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_bench(struct hashtable *ht,
+                const uint8 (*keys)[32],
+                uint32 n,
+                const char *pfx,
+                volatile int *stop)
+{
+   mtime_t tsInsert;
+   mtime_t tsLookup;
+   mtime_t tsRemove;
+   char *latStr;
+   uint64 mem;
+   uint32 i;
+   bool s;
+
+   tsInsert = time_get();
+   for (i = 0; *stop == 0 && i < n; i++) {
+      s = hashtable_insert(ht, keys[i], sizeof keys[i], NULL);
+      ASSERT(s);
+   }
+   tsInsert = time_get() - tsInsert;
+   mem = hashtable_getmemsize(ht);
+
+   tsLookup = time_get();
+   for (i = 0; *stop == 0 && i < n; i++) {
+      s = hashtable_lookup(ht, keys[i], sizeof keys[i], NULL);
+      ASSERT(s);
+   }
+   tsLookup = time_get() - tsLookup;
+
+   tsRemove = time_get();
+   for (i = 0; *stop == 0 && i < n; i++) {
+      s = hashtable_remove(ht, keys[i], sizeof keys[i]);
+      ASSERT(s);
+   }
+   tsRemove = time_get() - tsRemove;
+
+   Warning(LGPFX" %-7s: %u entries -- insert %.1f lookup %.1f remove %.1f "
+           "Mops/sec -- %llu bytes/entry%s\n",
+           pfx, n, n / (tsInsert + 1.0), n / (tsLookup + 1.0),
+           n / (tsRemove + 1.0), mem / n,
+           ht->keyLen ? "" : " + 1 malloc");
+
+   latStr = hashtable_latency_str(ht);
+   if (latStr) {
+      Warning(LGPFX" %-7s: resize latency %s\n", pfx, latStr);
+      free(latStr);
+   }
+
+   hashtable_destroy(ht);
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -586,6 +1470,45 @@ hashtable_insert_test(uint32 n,
    }
    hashtable_clear(ht);
    hashtable_destroy(ht);
+
+   /*
+    * Compare both flavors on 32-byte keys, the common case.
+    */
+   uint8 (*keys)[32];
+
+   keys = safe_malloc(n * sizeof *keys);
+   for (i = 0; i < n * sizeof *keys; i++) {
+      keys[0][i] = random();
+   }
+   hashtable_bench(hashtable_create(), keys, n, "chained", stop);
+   hashtable_bench(hashtable_create_fixed(sizeof *keys), keys, n, "fixed", stop);
+
+   /*
+    * Keys that only differ in bits the hash keeps above bit 16 all share
+    * their home slot in small tables: the probe distance overflows.
+    */
+   ht = hashtable_create_fixed(sizeof *keys);
+   memset(keys, 0, n * sizeof *keys);
+   for (i = 0; *stop == 0 && i < MIN(n, 512); i++) {
+      uint32 v = i << 16;
+
+      memcpy(keys[i], &v, sizeof v);
+      s = hashtable_insert(ht, keys[i], sizeof *keys, keys[i]);
+      ASSERT(s);
+   }
+   for (i = 0; *stop == 0 && i < MIN(n, 512); i++) {
+      void *data = NULL;
+
+      s = hashtable_lookup(ht, keys[i], sizeof *keys, &data);
+      ASSERT(s && data == keys[i]);
+   }
+   hashtable_printstats(ht, "colliding");
+   Warning(LGPFX" colliding: %u entries in %u buckets, maxDepth=%u\n",
+           hashtable_getnumentries(ht), ht->cur.numBuckets,
+           hashtable_getmaxdepth(ht));
+   hashtable_clear(ht);
+   hashtable_destroy(ht);
+   free(keys);
 }
 
 
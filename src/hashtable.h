@@ -12,6 +12,7 @@ typedef void (hashtable_for_each_callback)(const void *key, size_t keyLen,
                                            void *cbData, void *keyData);
 
 struct hashtable *hashtable_create(void);
+struct hashtable *hashtable_create_fixed(size_t keyLen);
 
 void hashtable_clear(struct hashtable *ht);
 void hashtable_clear_with_free(struct hashtable *ht);
@@ -24,6 +25,7 @@ void hashtable_printstats(const struct hashtable *ht, const char *pfx);
 uint32 hashtable_getnumentries(const struct hashtable *ht);
 uint32 hashtable_getmaxdepth(const struct hashtable *ht);
 uint32 hashtable_getemptybuckets(const struct hashtable *ht);
+uint64 hashtable_getmemsize(const struct hashtable *ht);
 
 void hashtable_for_each(const struct hashtable *ht,
                         hashtable_for_each_callback callback,
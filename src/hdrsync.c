@@ -0,0 +1,1242 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hdrsync.h"
+#include "atomic.h"
+#include "hash.h"
+#include "hashtable.h"
+#include "poll.h"
+#include "poolworker.h"
+#include "util.h"
+
+#define LGPFX "HSYNC:"
+
+static int verbose = 0;
+
+
+/*
+ * Header sync scheduler.
+ *
+ * The chain between the current tip and the last known checkpoint is split
+ * in ranges bounded by checkpoints, followed by an open-ended range up to the
+ * tip of the network. Since the hash at both ends of a checkpoint range is
+ * known in advance, each range can be fetched from a different peer with a
+ * getheaders whose locator is the checkpoint starting the range and whose
+ * hashStop is the one ending it.
+ *
+ * The range at the head of the chain hands its headers over to the caller as
+ * they arrive. The others buffer theirs until all the ranges below them are
+ * complete so that the caller only ever sees headers in chain order.
+ *
+ * The next getheaders of a range only needs the hash of the last header
+ * received: it goes out before the rest of the batch is hashed and handed
+ * over, so that this work overlaps with the round-trip. Hashing a batch and
+ * checking each header against its own nBits target is spread over the
+ * poolworker; only linking the headers to the chain stays on the loop.
+ * A header failing this check truncates the batch, releases the range and
+ * the peer that sent it is not given any more work.
+ *
+ * Each range has at most one outstanding getheaders. A request that has not
+ * been answered after 'stallTimeout' usec releases the range: the next idle
+ * peer picks it up, while the slow peer is not given any more work until it
+ * answers.
+ */
+
+struct hdrsync_range {
+   uint256              last;          // last header received, or the anchor
+   uint256              stop;          // checkpoint ending the range
+   int                  lastHeight;
+   int                  stopHeight;    // -1 for the open-ended range
+
+   btc_block_header    *hdrs;          // received while not at the head
+   uint256             *hashes;
+   int                  num;
+   int                  size;
+
+   void                *peer;          // owner of the outstanding request
+   mtime_t              reqTS;
+   bool                 done;
+};
+
+struct hdrsync_peer {
+   void                *peer;
+   int                  range;         // -1 when idle
+   bool                 stalled;
+   bool                 bogus;
+};
+
+struct hdrsync {
+   struct hdrsync_range *ranges;
+   int                   numRanges;
+   int                   head;         // first range not entirely delivered
+
+   struct hdrsync_peer  *peers;
+   int                   numPeers;
+   int                   peersSize;
+
+   int                   target;
+   mtime_t               stallTimeout;
+   struct poolworker_state *pw;
+
+   hdrsync_request_cb   *requestCb;
+   hdrsync_deliver_cb   *deliverCb;
+   void                 *clientData;
+
+   uint32                numRequests;
+   uint32                numStalls;
+};
+
+/*
+ * Headers hashed per slice handed to the poolworker: a getheaders answer is
+ * split in 8.
+ */
+#define HDRSYNC_HASH_SLICE      250
+
+struct hdrsync_hash_job {
+   const btc_block_header  *hdrs;
+   uint256                 *hashes;
+   atomic_uint32            firstBad;
+};
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_check_pow --
+ *
+ *      Whether 'hash' is at or below the target encoded in compact form in
+ *      the header's nBits. Whether nBits itself is right for this height is
+ *      for the chain-linking step to tell.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+hdrsync_check_pow(const btc_block_header *hdr,
+                  const uint256 *hash)
+{
+   uint8 target[sizeof hash->data];
+   uint32 mantissa = hdr->bits & 0x007fffff;
+   int exponent = hdr->bits >> 24;
+   bool nonZero = 0;
+   int i;
+
+   if (hdr->bits & 0x00800000) {
+      return 0; // negative
+   }
+
+   memset(target, 0, sizeof target);
+   for (i = 0; i < 3; i++) {
+      int pos = exponent - 3 + i;
+      uint8 b = mantissa >> (8 * i);
+
+      if (b == 0 || pos < 0) {
+         continue;
+      }
+      if (pos >= (int)sizeof target) {
+         return 0; // overflow
+      }
+      target[pos] = b;
+      nonZero = 1;
+   }
+   if (nonZero == 0) {
+      return 0;
+   }
+
+   for (i = sizeof target - 1; i >= 0; i--) {
+      if (hash->data[i] != target[i]) {
+         return hash->data[i] < target[i];
+      }
+   }
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_hash_slice_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_hash_slice_cb(void *clientData,
+                      int start,
+                      int end)
+{
+   struct hdrsync_hash_job *job = clientData;
+   int i;
+
+   for (i = start; i < end; i++) {
+      uint32 bad;
+
+      hash256_calc(job->hdrs + i, sizeof *job->hdrs, job->hashes + i);
+      if (hdrsync_check_pow(job->hdrs + i, job->hashes + i)) {
+         continue;
+      }
+      /*
+       * Only the first failure matters: the rest of the batch is dropped.
+       */
+      bad = atomic_read(&job->firstBad);
+      while ((uint32)i < bad) {
+         uint32 old = atomic_cmpxchg(&job->firstBad, bad, i);
+
+         if (old == bad) {
+            break;
+         }
+         bad = old;
+      }
+      return;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_hash_headers --
+ *
+ *      Computes the hash of 'hdrs' and checks their proof-of-work, using the
+ *      threads of 'pw' if not NULL. Returns the number of headers at the
+ *      beginning of the batch that passed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+hdrsync_hash_headers(struct poolworker_state *pw,
+                     const btc_block_header *hdrs,
+                     uint256 *hashes,
+                     int n)
+{
+   struct hdrsync_hash_job job;
+   int numHelpers;
+
+   job.hdrs   = hdrs;
+   job.hashes = hashes;
+   atomic_write(&job.firstBad, n);
+
+   numHelpers = pw ? poolworker_get_num_threads(pw) : 0;
+   poolworker_run_slices(pw, numHelpers, n, HDRSYNC_HASH_SLICE,
+                         hdrsync_hash_slice_cb, &job);
+
+   return atomic_read(&job.firstBad);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_create --
+ *
+ *      'anchorHeights' and 'anchorHashes' are the checkpoints, in increasing
+ *      height order. The ones at or below 'tipHeight' are ignored.
+ *
+ *------------------------------------------------------------------------
+ */
+
+struct hdrsync *
+hdrsync_create(int tipHeight,
+               const int *anchorHeights,
+               const uint256 *anchorHashes,
+               int numAnchors,
+               mtime_t stallTimeout,
+               struct poolworker_state *pw,
+               hdrsync_request_cb *requestCb,
+               hdrsync_deliver_cb *deliverCb,
+               void *clientData)
+{
+   struct hdrsync *hs;
+   int height = tipHeight;
+   int i;
+
+   ASSERT(requestCb);
+   ASSERT(deliverCb);
+
+   hs = safe_calloc(1, sizeof *hs);
+   hs->ranges       = safe_calloc(numAnchors + 1, sizeof *hs->ranges);
+   hs->target       = tipHeight;
+   hs->stallTimeout = stallTimeout;
+   hs->pw           = pw;
+   hs->requestCb    = requestCb;
+   hs->deliverCb    = deliverCb;
+   hs->clientData   = clientData;
+
+   /*
+    * The range at the head starts at the tip: the caller builds the locator.
+    */
+   for (i = 0; i < numAnchors; i++) {
+      struct hdrsync_range *r;
+
+      if (anchorHeights[i] <= height) {
+         continue;
+      }
+      r = hs->ranges + hs->numRanges;
+      r->lastHeight = height;
+      r->stopHeight = anchorHeights[i];
+      r->stop       = anchorHashes[i];
+      if (hs->numRanges > 0) {
+         r->last = hs->ranges[hs->numRanges - 1].stop;
+      }
+      height = anchorHeights[i];
+      hs->numRanges++;
+   }
+
+   hs->ranges[hs->numRanges].lastHeight = height;
+   hs->ranges[hs->numRanges].stopHeight = -1;
+   if (hs->numRanges > 0) {
+      hs->ranges[hs->numRanges].last = hs->ranges[hs->numRanges - 1].stop;
+   }
+   hs->numRanges++;
+
+   Log(LGPFX" %d range%s from height %d.\n",
+       hs->numRanges, hs->numRanges > 1 ? "s" : "", tipHeight);
+
+   return hs;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_destroy --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+hdrsync_destroy(struct hdrsync *hs)
+{
+   int i;
+
+   if (hs == NULL) {
+      return;
+   }
+
+   Log(LGPFX" %u getheaders sent, %u stall%s.\n",
+       hs->numRequests, hs->numStalls, hs->numStalls != 1 ? "s" : "");
+
+   for (i = 0; i < hs->numRanges; i++) {
+      free(hs->ranges[i].hdrs);
+      free(hs->ranges[i].hashes);
+   }
+   free(hs->ranges);
+   free(hs->peers);
+   free(hs);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_set_target --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+hdrsync_set_target(struct hdrsync *hs,
+                   int height)
+{
+   hs->target = MAX(hs->target, height);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_is_complete --
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+hdrsync_is_complete(const struct hdrsync *hs)
+{
+   return hs->head == hs->numRanges;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_lookup_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct hdrsync_peer *
+hdrsync_lookup_peer(const struct hdrsync *hs,
+                    const void *peer)
+{
+   int i;
+
+   for (i = 0; i < hs->numPeers; i++) {
+      if (hs->peers[i].peer == peer) {
+         return hs->peers + i;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_release_range --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_release_range(struct hdrsync *hs,
+                      struct hdrsync_peer *p)
+{
+   ASSERT(p->range >= 0);
+
+   hs->ranges[p->range].peer = NULL;
+   p->range = -1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_request --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+hdrsync_request(struct hdrsync *hs,
+                struct hdrsync_peer *p,
+                int idx)
+{
+   struct hdrsync_range *r = hs->ranges + idx;
+   const uint256 *from;
+   const uint256 *stop;
+
+   ASSERT(r->done == 0);
+   ASSERT(r->peer == NULL || r->peer == p->peer);
+
+   p->range = idx;
+   r->peer  = p->peer;
+   r->reqTS = time_get();
+
+   from = uint256_iszero(&r->last) ? NULL : &r->last;
+   stop = r->stopHeight >= 0 ? &r->stop : NULL;
+
+   LOG(1, (LGPFX" range #%d: requesting from height %d\n", idx, r->lastHeight));
+
+   hs->numRequests++;
+
+   return hs->requestCb(p->peer, from, stop, hs->clientData);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_dispatch --
+ *
+ *      Hands the ranges nobody is working on to the idle peers, lowest
+ *      first since that's what the caller is waiting for.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_dispatch(struct hdrsync *hs)
+{
+   int idx = hs->head;
+   int i;
+
+   for (i = 0; i < hs->numPeers; i++) {
+      struct hdrsync_peer *p = hs->peers + i;
+
+      if (p->range >= 0 || p->stalled || p->bogus) {
+         continue;
+      }
+      while (idx < hs->numRanges &&
+             (hs->ranges[idx].done || hs->ranges[idx].peer != NULL)) {
+         idx++;
+      }
+      if (idx == hs->numRanges) {
+         return;
+      }
+      hdrsync_request(hs, p, idx);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_flush --
+ *
+ *      Delivers the headers of the ranges that just reached the head, by
+ *      batches no larger than a getheaders answer.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_flush(struct hdrsync *hs)
+{
+   while (hs->head < hs->numRanges) {
+      struct hdrsync_range *r = hs->ranges + hs->head;
+
+      if (r->num > 0) {
+         int i;
+
+         for (i = 0; i < r->num; i += BTC_MSG_GETHEADERS_MAX_ENTRIES) {
+            int n = MIN(BTC_MSG_GETHEADERS_MAX_ENTRIES, r->num - i);
+
+            hs->deliverCb(r->hdrs + i, r->hashes + i, n, hs->clientData);
+         }
+         free(r->hdrs);
+         free(r->hashes);
+         r->hdrs   = NULL;
+         r->hashes = NULL;
+         r->num    = 0;
+         r->size   = 0;
+      }
+      if (r->done == 0) {
+         return;
+      }
+      hs->head++;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_range_append --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_range_append(struct hdrsync_range *r,
+                     const btc_block_header *hdrs,
+                     const uint256 *hashes,
+                     int n)
+{
+   if (r->num + n > r->size) {
+      r->size   = MAX(r->num + n, 2 * r->size);
+      r->hdrs   = safe_realloc(r->hdrs, r->size * sizeof *r->hdrs);
+      r->hashes = safe_realloc(r->hashes, r->size * sizeof *r->hashes);
+   }
+   memcpy(r->hdrs + r->num, hdrs, n * sizeof *hdrs);
+   memcpy(r->hashes + r->num, hashes, n * sizeof *hashes);
+   r->num += n;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_add_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+hdrsync_add_peer(struct hdrsync *hs,
+                 void *peer)
+{
+   struct hdrsync_peer *p;
+
+   if (hdrsync_lookup_peer(hs, peer)) {
+      return 0;
+   }
+   if (hs->numPeers == hs->peersSize) {
+      hs->peersSize = MAX(8, 2 * hs->peersSize);
+      hs->peers = safe_realloc(hs->peers, hs->peersSize * sizeof *hs->peers);
+   }
+   p = hs->peers + hs->numPeers++;
+   memset(p, 0, sizeof *p);
+   p->peer    = peer;
+   p->range   = -1;
+
+   hdrsync_dispatch(hs);
+
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_remove_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+hdrsync_remove_peer(struct hdrsync *hs,
+                    void *peer)
+{
+   struct hdrsync_peer *p;
+
+   p = hdrsync_lookup_peer(hs, peer);
+   if (p == NULL) {
+      return;
+   }
+   if (p->range >= 0) {
+      LOG(1, (LGPFX" range #%d: owner going away.\n", p->range));
+      hdrsync_release_range(hs, p);
+   }
+   *p = hs->peers[--hs->numPeers];
+
+   hdrsync_dispatch(hs);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_handle_headers --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+hdrsync_handle_headers(struct hdrsync *hs,
+                       void *peer,
+                       const btc_block_header *hdrs,
+                       int n)
+{
+   struct hdrsync_peer *p;
+   struct hdrsync_range *r;
+   uint256 *hashes;
+   uint256 prevLast;
+   int prevHeight;
+   bool lastValid = 0;
+   bool reachedStop = 0;
+   bool head;
+   int res = 0;
+   int numValid;
+   int idx;
+   int i;
+
+   p = hdrsync_lookup_peer(hs, peer);
+   if (p == NULL) {
+      return 0;
+   }
+   if (p->range < 0) {
+      /*
+       * Late answer: the range went to someone else in the meantime.
+       */
+      p->stalled = 0;
+      hdrsync_dispatch(hs);
+      return 0;
+   }
+
+   idx  = p->range;
+   r    = hs->ranges + idx;
+   head = idx == hs->head;
+
+   if (!head && n > 0 && !uint256_issame(&hdrs[0].prevBlock, &r->last)) {
+      Log(LGPFX" range #%d: headers do not connect.\n", idx);
+      n = 0;
+   }
+   if (r->stopHeight >= 0) {
+      n = MIN(n, r->stopHeight - r->lastHeight);
+   }
+
+   hashes = safe_malloc(MAX(n, 1) * sizeof *hashes);
+   if (n > 0) {
+      hash256_calc(hdrs + n - 1, sizeof *hdrs, hashes + n - 1);
+      lastValid = hdrsync_check_pow(hdrs + n - 1, hashes + n - 1);
+      if (lastValid && r->lastHeight + n == r->stopHeight) {
+         reachedStop = uint256_issame(hashes + n - 1, &r->stop);
+         if (reachedStop == 0) {
+            Log(LGPFX" range #%d: checkpoint mismatch.\n", idx);
+            n = 0;
+         }
+      }
+   }
+   prevLast   = r->last;
+   prevHeight = r->lastHeight;
+   if (n > 0 && lastValid) {
+      r->last = hashes[n - 1];
+      r->lastHeight += n;
+   }
+
+   if (n > 0 && lastValid == 0) {
+      /*
+       * What comes before the bad header is sorted out below.
+       */
+      hdrsync_release_range(hs, p);
+      p->bogus = 1;
+   } else if (reachedStop ||
+              (r->stopHeight < 0 && n < BTC_MSG_GETHEADERS_MAX_ENTRIES &&
+               r->lastHeight >= hs->target)) {
+      LOG(1, (LGPFX" range #%d: complete at height %d.\n", idx, r->lastHeight));
+      r->done = 1;
+      hdrsync_release_range(hs, p);
+   } else if (n < BTC_MSG_GETHEADERS_MAX_ENTRIES) {
+      /*
+       * This peer doesn't have the rest of the range: let another one try.
+       */
+      Log(LGPFX" range #%d: short answer at height %d.\n", idx, r->lastHeight);
+      hdrsync_release_range(hs, p);
+      p->stalled = 1;
+   } else {
+      res = hdrsync_request(hs, p, idx);
+   }
+
+   /*
+    * The next request is on its way: now hash and check the batch.
+    */
+   numValid = n > 0 ? hdrsync_hash_headers(hs->pw, hdrs, hashes, n - 1) : 0;
+   if (numValid == n - 1 && lastValid) {
+      numValid = n;
+   }
+   if (numValid < n) {
+      Log(LGPFX" range #%d: header at height %d fails proof-of-work.\n",
+          idx, prevHeight + numValid + 1);
+   }
+   /*
+    * Each header must build on the previous one: otherwise the peer could
+    * make any batch end on the hash we expect. Either side of a break may
+    * be the forged one, so neither is kept.
+    */
+   for (i = 1; i < numValid; i++) {
+      if (!uint256_issame(&hdrs[i].prevBlock, hashes + i - 1)) {
+         Log(LGPFX" range #%d: header at height %d does not connect.\n",
+             idx, prevHeight + i + 1);
+         numValid = i - 1;
+         break;
+      }
+   }
+   if (numValid < n) {
+      r->last       = numValid > 0 ? hashes[numValid - 1] : prevLast;
+      r->lastHeight = prevHeight + numValid;
+      r->done       = 0;
+      if (p->range == idx) {
+         hdrsync_release_range(hs, p);
+      }
+      p->bogus = 1;
+      n = numValid;
+   }
+
+   if (n > 0) {
+      if (head) {
+         hs->deliverCb(hdrs, hashes, n, hs->clientData);
+      } else {
+         hdrsync_range_append(r, hdrs, hashes, n);
+      }
+   }
+   free(hashes);
+
+   hdrsync_flush(hs);
+   hdrsync_dispatch(hs);
+
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_revive_peers --
+ *
+ *      When all the peers are either stalled or bogus, nobody would ever be
+ *      given work again: give the stalled ones another chance, and only if
+ *      there are none the bogus ones. A bogus peer keeps being checked, so
+ *      the worst it can do is waste our time until it's replaced.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_revive_peers(struct hdrsync *hs)
+{
+   int numStalled = 0;
+   int i;
+
+   if (hdrsync_is_complete(hs)) {
+      return;
+   }
+   for (i = 0; i < hs->numPeers; i++) {
+      const struct hdrsync_peer *p = hs->peers + i;
+
+      if (p->range >= 0 || (p->stalled == 0 && p->bogus == 0)) {
+         return;
+      }
+      numStalled += p->stalled && p->bogus == 0;
+   }
+   if (hs->numPeers == 0) {
+      return;
+   }
+
+   Log(LGPFX" no usable peer left: reviving %s ones.\n",
+       numStalled > 0 ? "stalled" : "bogus");
+   for (i = 0; i < hs->numPeers; i++) {
+      struct hdrsync_peer *p = hs->peers + i;
+
+      if (numStalled > 0) {
+         p->stalled = p->bogus ? p->stalled : 0;
+      } else {
+         p->stalled = 0;
+         p->bogus   = 0;
+      }
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_check_stalls --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+hdrsync_check_stalls(struct hdrsync *hs)
+{
+   mtime_t now = time_get();
+   int i;
+
+   for (i = 0; i < hs->numPeers; i++) {
+      struct hdrsync_peer *p = hs->peers + i;
+      struct hdrsync_range *r;
+
+      if (p->range < 0) {
+         continue;
+      }
+      r = hs->ranges + p->range;
+      if (now - r->reqTS < hs->stallTimeout) {
+         continue;
+      }
+      Log(LGPFX" range #%d: no answer after %llu msec, reassigning.\n",
+          p->range, (now - r->reqTS) / 1000);
+      hs->numStalls++;
+      hdrsync_release_range(hs, p);
+      p->stalled = 1;
+   }
+
+   hdrsync_revive_peers(hs);
+   hdrsync_dispatch(hs);
+}
+
+
+/*
+ * Benchmark: a synthetic chain served by mock peers living on a private poll
+ * loop. Each getheaders is answered after a fixed round-trip time, from the
+ * same locator/hashStop logic a real peer applies. Adding headers to the
+ * block-store is accounted for by a fixed cost per header delivered. The
+ * chain is mined against the easiest target, as on regtest.
+ */
+
+#define HDRSYNC_BENCH_RTT       (20 * 1000)     // usec
+#define HDRSYNC_BENCH_HDR_COST  2               // usec per header delivered
+#define HDRSYNC_BENCH_STALL     (200 * 1000)    // usec
+#define HDRSYNC_BENCH_BITS      0x207fffff
+
+struct hdrsync_bench;
+
+struct hdrsync_mock_peer {
+   struct hdrsync_bench *bench;
+   struct poll_timer     answer;       // pending answer, if any
+   bool                  unresponsive;
+   bool                  forging;      // answers with a broken chain
+   btc_block_header     *forged;
+   int                   start;
+   int                   num;
+};
+
+struct hdrsync_bench {
+   struct poll_loop         *poll;
+   struct poolworker_state  *pw;
+   struct hdrsync           *hs;
+   struct hashtable         *hash_idx;
+   const btc_block_header   *chain;
+   const uint256            *hashes;
+   int                       numHeaders;
+   int                       height;       // last header delivered
+   int                       exit;
+   volatile int             *stop;
+};
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_bench_answer_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_bench_answer_cb(void *clientData)
+{
+   struct hdrsync_mock_peer *mp = clientData;
+   struct hdrsync_bench *b = mp->bench;
+   const btc_block_header *hdrs = b->chain + mp->start;
+
+   mp->answer.entry = NULL;
+
+   /*
+    * Replace a header in the middle of the batch by one that passes its own
+    * proof-of-work but is not what the next header builds on.
+    */
+   if (mp->forging && mp->num > 2) {
+      btc_block_header *hdr;
+      uint256 hash;
+
+      memcpy(mp->forged, hdrs, mp->num * sizeof *hdrs);
+      hdr = mp->forged + mp->num / 2;
+      do {
+         hdr->nonce += 0x10000;
+         hash256_calc(hdr, sizeof *hdr, &hash);
+      } while (!hdrsync_check_pow(hdr, &hash));
+      hdrs = mp->forged;
+   }
+   hdrsync_handle_headers(b->hs, mp, hdrs, mp->num);
+   if (hdrsync_is_complete(b->hs)) {
+      b->exit = 1;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_bench_request_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+hdrsync_bench_request_cb(void *peer,
+                         const uint256 *from,
+                         const uint256 *stop,
+                         void *clientData)
+{
+   struct hdrsync_mock_peer *mp = peer;
+   struct hdrsync_bench *b = clientData;
+   int stopIdx = b->numHeaders - 1;
+   void *ptr;
+   bool s;
+
+   mp->start = b->height + 1;
+   if (from) {
+      s = hashtable_lookup(b->hash_idx, from, sizeof *from, &ptr);
+      ASSERT(s);
+      mp->start = (int)(uintptr_t)ptr + 1;
+   }
+   if (stop) {
+      s = hashtable_lookup(b->hash_idx, stop, sizeof *stop, &ptr);
+      ASSERT(s);
+      stopIdx = (int)(uintptr_t)ptr;
+   }
+   mp->num = MIN(BTC_MSG_GETHEADERS_MAX_ENTRIES, stopIdx - mp->start + 1);
+   mp->num = MAX(0, mp->num);
+
+   if (mp->unresponsive == 0) {
+      mp->answer = poll_callback_time(b->poll, HDRSYNC_BENCH_RTT, 0,
+                                      hdrsync_bench_answer_cb, mp);
+   }
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_bench_deliver_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_bench_deliver_cb(const btc_block_header *hdrs,
+                         const uint256 *hashes,
+                         int n,
+                         void *clientData)
+{
+   struct hdrsync_bench *b = clientData;
+   mtime_t ts = time_get();
+   int i;
+
+   ASSERT(b->height + n < b->numHeaders);
+   for (i = 0; i < n; i++) {
+      ASSERT(uint256_issame(hashes + i, b->hashes + b->height + i + 1));
+   }
+
+   b->height += n;
+
+   while (time_get() < ts + n * HDRSYNC_BENCH_HDR_COST) {
+      continue;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_bench_tick_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_bench_tick_cb(void *clientData)
+{
+   struct hdrsync_bench *b = clientData;
+
+   hdrsync_check_stalls(b->hs);
+   if (*b->stop) {
+      b->exit = 1;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_bench_run --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_bench_run(struct hdrsync_bench *b,
+                  const int *anchorHeights,
+                  const uint256 *anchorHashes,
+                  int numAnchors,
+                  int numPeers,
+                  int numUnresponsive,
+                  int numForging)
+{
+   struct hdrsync_mock_peer *peers;
+   struct poll_timer tick;
+   mtime_t ts;
+   char *str;
+   int i;
+
+   b->poll   = poll_create(NULL);
+   b->height = 0;
+   b->exit   = 0;
+   b->hs = hdrsync_create(0, anchorHeights, anchorHashes, numAnchors,
+                          HDRSYNC_BENCH_STALL, b->pw, hdrsync_bench_request_cb,
+                          hdrsync_bench_deliver_cb, b);
+   hdrsync_set_target(b->hs, b->numHeaders - 1);
+
+   tick = poll_callback_time(b->poll, 10 * 1000, 1 /* permanent */,
+                             hdrsync_bench_tick_cb, b);
+
+   ts = time_get();
+
+   peers = safe_calloc(numPeers, sizeof *peers);
+   for (i = 0; i < numPeers; i++) {
+      peers[i].bench        = b;
+      peers[i].unresponsive = i < numUnresponsive;
+      peers[i].forging      = i >= numPeers - numForging;
+      if (peers[i].forging) {
+         peers[i].forged = safe_malloc(BTC_MSG_GETHEADERS_MAX_ENTRIES *
+                                       sizeof *peers[i].forged);
+      }
+      hdrsync_add_peer(b->hs, peers + i);
+   }
+
+   poll_runloop(b->poll, &b->exit);
+
+   ts = time_get() - ts;
+   str = print_latency(ts);
+
+   if (hdrsync_is_complete(b->hs)) {
+      ASSERT(b->height == b->numHeaders - 1);
+      Warning(LGPFX" %d peer%s (%d unresponsive, %d forging), %2d ranges: "
+              "%u headers in %s -- %.0f hdrs/sec, %u getheaders, %u stalls\n",
+              numPeers, numPeers > 1 ? "s" : "", numUnresponsive, numForging,
+              numAnchors + 1, b->height, str,
+              b->height * 1000.0 * 1000.0 / ts,
+              b->hs->numRequests, b->hs->numStalls);
+   }
+   free(str);
+
+   /*
+    * Only when interrupted: nothing is in flight once the sync completes.
+    */
+   for (i = 0; i < numPeers; i++) {
+      if (peers[i].answer.entry) {
+         poll_callback_time_cancel(b->poll, peers[i].answer);
+      }
+      free(peers[i].forged);
+   }
+   poll_callback_time_cancel(b->poll, tick);
+   hdrsync_destroy(b->hs);
+   b->hs = NULL;
+   free(peers);
+   poll_destroy(b->poll);
+   b->poll = NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_bench_hash --
+ *
+ *      Hashing and proof-of-work throughput over the whole chain, by
+ *      batches of a getheaders answer, with 'numWorkers' threads including
+ *      the caller's.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+hdrsync_bench_hash(struct hdrsync_bench *b,
+                   int numWorkers)
+{
+   uint256 *hashes;
+   mtime_t ts;
+   char *str;
+   int i;
+
+   b->pw = numWorkers > 1 ? poolworker_create(numWorkers - 1) : NULL;
+   hashes = safe_malloc(BTC_MSG_GETHEADERS_MAX_ENTRIES * sizeof *hashes);
+
+   ts = time_get();
+   for (i = 0; *b->stop == 0 && i < b->numHeaders;
+        i += BTC_MSG_GETHEADERS_MAX_ENTRIES) {
+      int n = MIN(BTC_MSG_GETHEADERS_MAX_ENTRIES, b->numHeaders - i);
+      int numValid;
+
+      numValid = hdrsync_hash_headers(b->pw, b->chain + i, hashes, n);
+      ASSERT(numValid == n);
+      ASSERT(uint256_issame(hashes + n - 1, b->hashes + i + n - 1));
+   }
+   ts = time_get() - ts;
+   str = print_latency(ts);
+
+   Warning(LGPFX" %d worker%s: %u headers hashed and checked in %s"
+           " -- %.0f hdrs/sec\n", numWorkers, numWorkers > 1 ? "s" : "",
+           b->numHeaders, str, b->numHeaders * 1000.0 * 1000.0 / ts);
+
+   free(str);
+   free(hashes);
+   if (b->pw) {
+      poolworker_wait(b->pw);
+      poolworker_destroy(b->pw);
+      b->pw = NULL;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * hdrsync_bench --
+ *
+ *      Wall-clock time to sync 'numHeaders' headers, from a single peer
+ *      without anchors (the old behavior) to several peers fetching
+ *      checkpoint-bounded ranges in parallel, one of them not answering.
+ *      Before that, the raw throughput of hashing and checking headers for
+ *      1 to 8 worker threads.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+hdrsync_bench(uint32 numHeaders,
+              volatile int *stop)
+{
+   static const struct {
+      int numPeers;
+      int numUnresponsive;
+      int numForging;
+      bool anchors;
+   } runs[] = {
+      { 1, 0, 0, 0 },
+      { 1, 0, 0, 1 },
+      { 4, 0, 0, 1 },
+      { 8, 0, 0, 1 },
+      { 8, 1, 0, 1 },
+      { 8, 0, 1, 1 },
+   };
+   static const int workers[] = { 1, 2, 4, 8 };
+   struct hdrsync_bench b;
+   btc_block_header *chain;
+   btc_block_header hdr;
+   uint256 *hashes;
+   uint256 *anchorHashes;
+   int *anchorHeights;
+   int numAnchors;
+   uint32 i;
+
+   ASSERT(numHeaders > 2 * BTC_MSG_GETHEADERS_MAX_ENTRIES);
+
+   memset(&b, 0, sizeof b);
+   chain  = safe_malloc(numHeaders * sizeof *chain);
+   hashes = safe_malloc(numHeaders * sizeof *hashes);
+   b.hash_idx   = hashtable_create_fixed(sizeof(uint256));
+   b.chain      = chain;
+   b.hashes     = hashes;
+   b.numHeaders = numHeaders;
+   b.stop       = stop;
+
+   Warning(LGPFX" building chain of %u headers.\n", numHeaders);
+   memset(&hdr, 0, sizeof hdr);
+   hdr.version = 1;
+   hdr.bits    = HDRSYNC_BENCH_BITS;
+   for (i = 0; *stop == 0 && i < numHeaders; i++) {
+      bool s;
+
+      hdr.timestamp = 1231006505 + i * 600;
+      hdr.nonce = 0;
+      do {
+         hdr.nonce++;
+         hash256_calc(&hdr, sizeof hdr, hashes + i);
+      } while (!hdrsync_check_pow(&hdr, hashes + i));
+      chain[i] = hdr;
+      s = hashtable_insert(b.hash_idx, hashes + i, sizeof hashes[i],
+                           (void *)(uintptr_t)i);
+      ASSERT(s);
+      memcpy(&hdr.prevBlock, hashes + i, sizeof hashes[i]);
+   }
+
+   /*
+    * One checkpoint every 1/16th of the chain, the last one well below the
+    * tip as it is for the real ones.
+    */
+   numAnchors = 15;
+   anchorHeights = safe_malloc(numAnchors * sizeof *anchorHeights);
+   anchorHashes  = safe_malloc(numAnchors * sizeof *anchorHashes);
+   for (i = 0; i < numAnchors; i++) {
+      anchorHeights[i] = (i + 1) * (numHeaders / 16);
+      anchorHashes[i]  = hashes[anchorHeights[i]];
+   }
+
+   for (i = 0; *stop == 0 && i < ARRAYSIZE(workers); i++) {
+      hdrsync_bench_hash(&b, workers[i]);
+   }
+
+   /*
+    * The syncs themselves, with the most workers.
+    */
+   b.pw = poolworker_create(workers[ARRAYSIZE(workers) - 1] - 1);
+   for (i = 0; *stop == 0 && i < ARRAYSIZE(runs); i++) {
+      hdrsync_bench_run(&b, anchorHeights, anchorHashes,
+                        runs[i].anchors ? numAnchors : 0,
+                        runs[i].numPeers, runs[i].numUnresponsive,
+                        runs[i].numForging);
+   }
+
+   poolworker_wait(b.pw);
+   poolworker_destroy(b.pw);
+   free(anchorHeights);
+   free(anchorHashes);
+   hashtable_clear(b.hash_idx);
+   hashtable_destroy(b.hash_idx);
+   free(chain);
+   free(hashes);
+}
@@ -0,0 +1,44 @@
+#ifndef __HDRSYNC_H__
+#define __HDRSYNC_H__
+
+#include "basic_defs.h"
+#include "bitc-defs.h"
+
+struct hdrsync;
+struct poolworker_state;
+
+/*
+ * 'peer' is opaque to the scheduler. 'from' is NULL when the request starts at
+ * the current tip of the block-store, 'stop' is NULL for the open-ended range.
+ */
+typedef int (hdrsync_request_cb)(void *peer, const uint256 *from,
+                                 const uint256 *stop, void *clientData);
+
+/*
+ * Headers are handed over strictly in chain order, along with their hash.
+ */
+typedef void (hdrsync_deliver_cb)(const btc_block_header *hdrs,
+                                  const uint256 *hashes, int n,
+                                  void *clientData);
+
+struct hdrsync *hdrsync_create(int tipHeight, const int *anchorHeights,
+                               const uint256 *anchorHashes, int numAnchors,
+                               mtime_t stallTimeout,
+                               struct poolworker_state *pw,
+                               hdrsync_request_cb *requestCb,
+                               hdrsync_deliver_cb *deliverCb,
+                               void *clientData);
+void hdrsync_destroy(struct hdrsync *hs);
+void hdrsync_set_target(struct hdrsync *hs, int height);
+int  hdrsync_add_peer(struct hdrsync *hs, void *peer);
+void hdrsync_remove_peer(struct hdrsync *hs, void *peer);
+int  hdrsync_handle_headers(struct hdrsync *hs, void *peer,
+                            const btc_block_header *hdrs, int n);
+void hdrsync_check_stalls(struct hdrsync *hs);
+bool hdrsync_is_complete(const struct hdrsync *hs);
+int  hdrsync_hash_headers(struct poolworker_state *pw,
+                          const btc_block_header *hdrs, uint256 *hashes,
+                          int n);
+void hdrsync_bench(uint32 numHeaders, volatile int *stop);
+
+#endif /* __HDRSYNC_H__ */
@@ -740,7 +740,7 @@ bitc_poll_exit(void)
 static void
 bitc_poll_init(void)
 {
-   btc->poll = poll_create();
+   btc->poll = poll_create(btc->config);
 }
 
 
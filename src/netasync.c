@@ -3,7 +3,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -11,6 +13,7 @@
 
 #include "basic_defs.h"
 #include "util.h"
+#include "buff.h"
 #include "netasync.h"
 #include "poll.h"
 
@@ -24,9 +27,22 @@ static void netasync_send_ready_cb(void *clientData);
 #define CTX_MAGIC       0xcafebabe
 #define SOCK_MAGIC      0xdeadbeef
 
+/*
+ * Stream buffers shrink back to their initial size once drained if a large
+ * message made them grow past this many times that size.
+ */
+#define STREAM_SHRINK_FACTOR    8
+
+#ifdef IOV_MAX
+#define SEND_MAX_IOV    IOV_MAX
+#else
+#define SEND_MAX_IOV    1024
+#endif
+
 struct netasync_send_ctx {
    uint64                    magic;
    const void               *buf_orig;
+   struct buff_shared       *shared;
    const void               *buf;
    size_t                    len;
    netasync_callback        *callback;
@@ -55,7 +71,7 @@ struct netasync_socket {
    netasync_callback         *connectCb;
    void                      *connectCbData;
    time_t                     connectTS;
-   bool                       connect_timeout;
+   struct poll_timer          connect_timeout;
    bool                       connect_async;
 
    bool                       bind;
@@ -76,9 +92,25 @@ struct netasync_socket {
    netasync_recv_callback    *recvCb;
    void                      *recvCbData;
    bool                       recvPartial;
+   bool                       recvArmed;
+
+   /*
+    * Stream mode: a power-of-two ring filled by readv(2) and drained by the
+    * consumer through netasync_stream_peek/consume.
+    */
+   uint8                     *ring;
+   size_t                     ringSize;
+   size_t                     ringInitSize;
+   size_t                     ringHead;
+   size_t                     ringLen;
+   uint8                     *ringScratch;
+   size_t                     ringScratchSize;
+   netasync_stream_callback  *streamCb;
+   void                      *streamCbData;
 
    struct netasync_send_ctx  *sendCtxList;
    struct netasync_send_ctx **sendCtxTail;
+   bool                       sendArmed;
 };
 
 
@@ -86,6 +118,9 @@ static struct {
    struct poll_loop *poll;
    uint64            received;
    uint64            sent;
+   uint64            numReadCalls;
+   uint64            numWriteCalls;
+   uint64            numMsgSent;
    uint32            sockets;
 } netasync;
 
@@ -165,6 +200,10 @@ netasync_exit(void)
    if (netasync.sockets > 0) {
       Log(LGPFX" %u socks -- %llu / %s received -- %llu / %s sent.\n",
           netasync.sockets, netasync.received, s0, netasync.sent, s1);
+      Log(LGPFX" %llu reads -- %llu msgs sent in %llu writes (%.2f per call).\n",
+          netasync.numReadCalls, netasync.numMsgSent, netasync.numWriteCalls,
+          netasync.numWriteCalls ?
+             (double)netasync.numMsgSent / netasync.numWriteCalls : 0.0);
    }
    free(s0);
    free(s1);
@@ -198,8 +237,11 @@ void
 netasync_init(struct poll_loop *poll)
 {
    netasync.poll     = poll;
-   netasync.received = 0;
-   netasync.sent     = 0;
+   netasync.received      = 0;
+   netasync.sent          = 0;
+   netasync.numReadCalls  = 0;
+   netasync.numWriteCalls = 0;
+   netasync.numMsgSent    = 0;
 }
 
 
@@ -216,12 +258,11 @@ netasync_timeout_stop(struct netasync_socket *sock)
 {
    bool s;
 
-   ASSERT(sock->connect_timeout);
+   ASSERT(sock->connect_timeout.entry);
 
-   s = poll_callback_time_remove(netasync.poll, 0 /* !permanent */,
-                                 netasync_connect_timeout_cb, sock);
+   s = poll_callback_time_cancel(netasync.poll, sock->connect_timeout);
    ASSERT(s);
-   sock->connect_timeout = 0;
+   sock->connect_timeout.entry = NULL;
 }
 
 
@@ -263,11 +304,38 @@ netasync_send_stop(struct netasync_socket *sock)
 {
    LOG(2, (LGPFX" stop send on %p -- %s\n", sock, sock->hostname));
 
+   if (sock->sendArmed == 0) {
+      return;
+   }
    poll_callback_device_remove(netasync.poll, sock->fd,
                                0,  /* read */
                                1,  /* write */
                                0,  /* permanent */
                                netasync_send_ready_cb, sock);
+   sock->sendArmed = 0;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_send_arm --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_send_arm(struct netasync_socket *sock)
+{
+   if (sock->sendArmed) {
+      return;
+   }
+   poll_callback_device(netasync.poll, sock->fd,
+                        0,  /* read */
+                        1,  /* write */
+                        0,  /* permanent */
+                        netasync_send_ready_cb, sock);
+   sock->sendArmed = 1;
 }
 
 
@@ -284,11 +352,14 @@ netasync_receive_stop(struct netasync_socket *sock)
 {
    LOG(2, (LGPFX" stop receiving on %p -- %s\n", sock, sock->hostname));
 
+   ASSERT(sock->recvArmed);
+
    poll_callback_device_remove(netasync.poll, sock->fd,
                                1 /* read */,
                                0 /* write */,
                                1 /* permanent */,
                                netasync_receive_cb, sock);
+   sock->recvArmed = 0;
 }
 
 
@@ -694,7 +765,7 @@ netasync_connected(void *clientData)
 
    sock->connect_async = 0;
 
-   if (sock->connect_timeout) {
+   if (sock->connect_timeout.entry) {
       netasync_timeout_stop(sock);
    }
 
@@ -786,10 +857,10 @@ netasync_connect_timeout_cb(void *clientData)
    LOG(1, (LGPFX" connect-timeout on fd=%d -- %s\n", sock->fd, sock->hostname));
 
    ASSERT(sock->magic == SOCK_MAGIC);
-   ASSERT(sock->connect_timeout);
+   ASSERT(sock->connect_timeout.entry);
    ASSERT(sock->connect_async);
 
-   sock->connect_timeout = 0;
+   sock->connect_timeout.entry = NULL;
    sock->err = ETIMEDOUT;
 
    netasync_connect_stop(sock);
@@ -837,7 +908,7 @@ netasync_connect(struct netasync_socket   *sock,
    sock->connectCb       = cb;
    sock->connectCbData   = clientData;
    sock->connectTS       = time_get();
-   sock->connect_timeout = 0;
+   sock->connect_timeout.entry = NULL;
    sock->connect_async   = 0;
    ASSERT(sock->fd < 0);
 
@@ -887,10 +958,10 @@ netasync_connect(struct netasync_socket   *sock,
    }
 
    if (timeout_sec > 0) {
-      sock->connect_timeout = 1;
-      poll_callback_time(netasync.poll, timeout_sec * 1000 * 1000ULL,
-                         0 /* !permanent */,
-                         netasync_connect_timeout_cb, sock);
+      sock->connect_timeout =
+         poll_callback_time(netasync.poll, timeout_sec * 1000 * 1000ULL,
+                            0 /* !permanent */,
+                            netasync_connect_timeout_cb, sock);
    }
 
    sock->connect_async = 1;
@@ -951,6 +1022,281 @@ netasync_set_errorhandler(struct netasync_socket *sock,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_stream_read --
+ *
+ *      A single readv(2) into the free part of the ring, which may be split
+ *      in two by the wrap point. The consumer is called even if the ring is
+ *      full: it is the only one who can make room.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_stream_read(struct netasync_socket *sock)
+{
+   size_t mask = sock->ringSize - 1;
+   size_t space = sock->ringSize - sock->ringLen;
+   size_t tail = (sock->ringHead + sock->ringLen) & mask;
+   struct iovec iov[2];
+   int iovcnt = 0;
+   ssize_t len;
+
+   if (space > 0) {
+      iov[0].iov_base = sock->ring + tail;
+      iov[0].iov_len  = MIN(space, sock->ringSize - tail);
+      iovcnt = 1;
+      if (iov[0].iov_len < space) {
+         iov[1].iov_base = sock->ring;
+         iov[1].iov_len  = space - iov[0].iov_len;
+         iovcnt = 2;
+      }
+
+      len = readv(sock->fd, iov, iovcnt);
+      netasync.numReadCalls++;
+      if (len < 0) {
+         int res = errno;
+
+         if (res == EAGAIN || res == EINTR) {
+            return;
+         }
+         sock->err = res;
+         Log(LGPFX" %s: failed to read: %s (%d)\n",
+             sock->hostname, strerror(res), res);
+         netasync_fire_errorhandler(sock);
+         return;
+      }
+      if (len == 0) {
+         int err = netasync_getsocket_errno(sock);
+
+         Log(LGPFX" %s: socket closed by peer: %s (%d)\n",
+             sock->hostname, strerror(err), err);
+         netasync_fire_errorhandler(sock);
+         return;
+      }
+      sock->ringLen     += len;
+      netasync.received += len;
+
+      LOG(2, (LGPFX" %s: read %zd bytes, %zu buffered\n",
+              sock->hostname, len, sock->ringLen));
+   }
+
+   /*
+    * 'sock' may be gone once this returns.
+    */
+   sock->streamCb(sock, sock->streamCbData);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_stream_resize --
+ *
+ *      Moves the buffered bytes to the start of a ring of 'size' bytes.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_stream_resize(struct netasync_socket *sock,
+                       size_t size)
+{
+   uint8 *ring;
+   size_t n;
+
+   ASSERT((size & (size - 1)) == 0);
+   ASSERT(size >= sock->ringLen);
+
+   ring = safe_malloc(size);
+   n = MIN(sock->ringLen, sock->ringSize - sock->ringHead);
+   memcpy(ring, sock->ring + sock->ringHead, n);
+   memcpy(ring + n, sock->ring, sock->ringLen - n);
+
+   free(sock->ring);
+   sock->ring     = ring;
+   sock->ringSize = size;
+   sock->ringHead = 0;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_stream_avail --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+size_t
+netasync_stream_avail(const struct netasync_socket *sock)
+{
+   ASSERT(sock->magic == SOCK_MAGIC);
+
+   return sock->ringLen;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_stream_peek --
+ *
+ *      Returns a contiguous view of the first 'len' buffered bytes. This
+ *      points straight into the ring unless the range wraps around, in which
+ *      case it is copied to a per-socket scratch buffer. The view stays
+ *      valid until the next peek, consume or reserve.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+const void *
+netasync_stream_peek(struct netasync_socket *sock,
+                     size_t len)
+{
+   size_t n;
+
+   ASSERT(sock->magic == SOCK_MAGIC);
+   ASSERT(len <= sock->ringLen);
+
+   n = sock->ringSize - sock->ringHead;
+   if (len <= n) {
+      return sock->ring + sock->ringHead;
+   }
+
+   if (sock->ringScratchSize < len) {
+      free(sock->ringScratch);
+      sock->ringScratch     = safe_malloc(len);
+      sock->ringScratchSize = len;
+   }
+   memcpy(sock->ringScratch, sock->ring + sock->ringHead, n);
+   memcpy(sock->ringScratch + n, sock->ring, len - n);
+
+   return sock->ringScratch;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_stream_consume --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+netasync_stream_consume(struct netasync_socket *sock,
+                        size_t len)
+{
+   ASSERT(sock->magic == SOCK_MAGIC);
+   ASSERT(len <= sock->ringLen);
+
+   sock->ringHead = (sock->ringHead + len) & (sock->ringSize - 1);
+   sock->ringLen -= len;
+
+   if (sock->ringLen > 0) {
+      return;
+   }
+
+   /*
+    * Restart from the beginning of the ring so that the next messages are
+    * less likely to straddle the wrap point, and give back the memory taken
+    * by an unusually large message.
+    */
+   sock->ringHead = 0;
+   if (sock->ringSize > STREAM_SHRINK_FACTOR * sock->ringInitSize) {
+      netasync_stream_resize(sock, sock->ringInitSize);
+      free(sock->ringScratch);
+      sock->ringScratch     = NULL;
+      sock->ringScratchSize = 0;
+   }
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_stream_reserve --
+ *
+ *      Makes sure a message of 'len' bytes can be buffered in full.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+netasync_stream_reserve(struct netasync_socket *sock,
+                        size_t len)
+{
+   size_t size;
+
+   ASSERT(sock->magic == SOCK_MAGIC);
+
+   size = sock->ringSize;
+   while (size < len) {
+      size *= 2;
+   }
+   if (size != sock->ringSize) {
+      LOG(1, (LGPFX" %s: growing stream buffer %zu -> %zu\n",
+              sock->hostname, sock->ringSize, size));
+      netasync_stream_resize(sock, size);
+   }
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_receive_stream --
+ *
+ *      Switches the socket to stream mode: from now on, whatever is
+ *      available is read into a ring of at least 'bufLen' bytes and 'cb' is
+ *      called to consume it.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+int
+netasync_receive_stream(struct netasync_socket   *sock,
+                        size_t                    bufLen,
+                        netasync_stream_callback *cb,
+                        void                     *clientData)
+{
+   size_t size = 1024;
+
+   ASSERT(sock->magic == SOCK_MAGIC);
+   ASSERT(sock->err == 0);
+   ASSERT(sock->recvBuf == NULL);
+   ASSERT(sock->streamCb == NULL);
+   ASSERT(cb);
+
+   while (size < bufLen) {
+      size *= 2;
+   }
+
+   sock->ring            = safe_malloc(size);
+   sock->ringSize        = size;
+   sock->ringInitSize    = size;
+   sock->ringHead        = 0;
+   sock->ringLen         = 0;
+   sock->ringScratch     = NULL;
+   sock->ringScratchSize = 0;
+   sock->streamCb        = cb;
+   sock->streamCbData    = clientData;
+
+   if (sock->recvArmed == 0) {
+      poll_callback_device(netasync.poll, sock->fd,
+                           1,  /* read */
+                           0,  /* !write */
+                           1,  /* permanent */
+                           netasync_receive_cb, sock);
+      sock->recvArmed = 1;
+   }
+   return 0;
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -966,13 +1312,30 @@ netasync_receive_cb(void *clientData)
    size_t numRead = 0;
 
    ASSERT(sock->magic == SOCK_MAGIC);
-   ASSERT(sock->recvBuf);
+   ASSERT(sock->recvArmed);
+
+   if (sock->streamCb) {
+      netasync_stream_read(sock);
+      return;
+   }
+
+   /*
+    * The read interest outlives each receive request. If data shows up
+    * while nobody is receiving, park the socket until the next
+    * netasync_receive() instead of spinning on a readable fd.
+    */
+   if (sock->recvBuf == NULL) {
+      LOG(1, (LGPFX" %s: readable but no receive pending\n", sock->hostname));
+      netasync_receive_stop(sock);
+      return;
+   }
 
    while (TRUE) {
       size_t numBytesToRead = sock->recvBufLen - sock->recvBufIdx;
       ssize_t len;
 
       len = read(sock->fd, sock->recvBuf + sock->recvBufIdx, numBytesToRead);
+      netasync.numReadCalls++;
       if (len < 0) {
          int res = errno;
          if (res == EAGAIN) {
@@ -1008,7 +1371,10 @@ netasync_receive_cb(void *clientData)
       void *recvCbData = sock->recvCbData;
       void *buf = sock->recvBuf + sock->recvBufIdx - numRead;
 
-      netasync_receive_stop(sock);
+      /*
+       * Keep the fd registered: the callback usually posts the next
+       * receive right away and only swaps the target buffer.
+       */
       netasync_receive_reset(sock);
 
       recvCb(sock, buf, numRead, recvCbData);
@@ -1050,11 +1416,14 @@ netasync_receive(struct netasync_socket *sock,
    sock->recvCbData  = clientData;
    sock->recvPartial = partial;
 
-   poll_callback_device(netasync.poll, sock->fd,
-                        1,  /* read */
-                        0,  /* !write */
-                        1,  /* permanent */
-                        netasync_receive_cb, sock);
+   if (sock->recvArmed == 0) {
+      poll_callback_device(netasync.poll, sock->fd,
+                           1,  /* read */
+                           0,  /* !write */
+                           1,  /* permanent */
+                           netasync_receive_cb, sock);
+      sock->recvArmed = 1;
+   }
    return 0;
 }
 
@@ -1062,75 +1431,171 @@ netasync_receive(struct netasync_socket *sock,
 /*
  *-------------------------------------------------------------------------
  *
- * netasync_send_ctx --
+ * netasync_send_ctx_free --
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-netasync_send_ctx(struct netasync_socket   *sock,
-                  struct netasync_send_ctx *ctx)
+netasync_send_ctx_free(struct netasync_send_ctx *ctx)
 {
+   if (ctx->shared) {
+      buff_shared_unref(ctx->shared);
+   } else {
+      free((void*)ctx->buf_orig);
+   }
+   memset(ctx, 0xff, sizeof *ctx);
+   free(ctx);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_send_writev --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static ssize_t
+netasync_send_writev(struct netasync_socket *sock)
+{
+   struct iovec iov[SEND_MAX_IOV];
+   struct netasync_send_ctx *ctx;
+   int n = 0;
+
+   for (ctx = sock->sendCtxList; ctx && n < SEND_MAX_IOV; ctx = ctx->next) {
+      ASSERT(ctx->magic == CTX_MAGIC);
+      iov[n].iov_base = (void *)ctx->buf;
+      iov[n].iov_len  = ctx->len;
+      n++;
+   }
+
+   netasync.numWriteCalls++;
+
+   return writev(sock->fd, iov, n);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_send_queue --
+ *
+ *      Hands as much of the send queue as possible to a single writev(2).
+ *      Every buffer fully written is released and its callback invoked, in
+ *      order. Whatever is left waits for the socket to be writable again.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_send_queue(struct netasync_socket *sock)
+{
+   struct netasync_send_ctx *ctx;
+   size_t left;
    ssize_t res;
 
    ASSERT(sock->magic == SOCK_MAGIC);
-   ASSERT(ctx);
+   ASSERT(sock->sendCtxList);
    ASSERT(sock->err == 0);
 
-   static int count;
-   count++;
-   if ((count % 37) == 0) {
-      NOT_TESTED_ONCE();
-      res = 0;
-      goto next;
-   }
-
-   res = write(sock->fd, ctx->buf, ctx->len);
-   if (res == -1 && errno == EAGAIN) {
-      NOT_TESTED_ONCE();
+   res = netasync_send_writev(sock);
+   if (res == -1 && (errno == EAGAIN || errno == EINTR)) {
       res = 0;
    }
-next:
    if (res < 0) {
       sock->err = errno;
-      Warning(LGPFX" %s: write(2) failed: %s (%d).\n",
+      Warning(LGPFX" %s: writev(2) failed: %s (%d).\n",
               sock->hostname, strerror(sock->err), sock->err);
       print_backtrace();
       ASSERT(sock->err != EBADF);
       netasync_fire_errorhandler(sock);
       return;
-   } else {
-      ctx->buf = (uint8*)ctx->buf + res;
-      ctx->len -= res;
-      netasync.sent += res;
    }
+   netasync.sent += res;
+
+   LOG(2, (LGPFX" %s: wrote %zd bytes\n", sock->hostname, res));
 
-   if (ctx->len == 0 || sock->err != 0) {
-      netasync_callback *callback   = ctx->callback;
-      void              *clientData = ctx->clientData;
+   left = res;
+   while (sock->sendCtxList) {
+      netasync_callback *callback;
+      void *clientData;
+      size_t len;
+
+      ctx = sock->sendCtxList;
+      len = MIN(left, ctx->len);
+      ctx->buf  = (uint8*)ctx->buf + len;
+      ctx->len -= len;
+      left     -= len;
+
+      if (ctx->len > 0) {
+         break;
+      }
 
       ASSERT(ctx->callback);
+      callback   = ctx->callback;
+      clientData = ctx->clientData;
 
       sock->sendCtxList = ctx->next;
-      ctx->magic = -1;
-      free((void*)ctx->buf_orig);
-      free(ctx);
       if (sock->sendCtxList == NULL) {
          sock->sendCtxTail = &sock->sendCtxList;
       }
+      netasync_send_ctx_free(ctx);
 
-      ctx = sock->sendCtxList;
+      /*
+       * The callback may queue more data: netasync_send() then arms the
+       * write callback, and the new buffers were not part of this write.
+       */
       callback(sock, clientData, sock->err);
    }
+   ASSERT(left == 0);
 
    ASSERT(sock->err == 0);
-   if (ctx) {
-      ASSERT(ctx->magic == CTX_MAGIC);
-      poll_callback_device(netasync.poll, sock->fd,
-                           0,  /* read */
-                           1,  /* write */
-                           0,  /* permanent */
-                           netasync_send_ready_cb, sock);
+   if (sock->sendCtxList) {
+      netasync_send_arm(sock);
+   }
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_send_flush --
+ *
+ *      Writes what's queued right away rather than from the poll loop, for
+ *      a caller about to keep the loop busy for a while. Callbacks and
+ *      errors are still left to the poll loop.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+netasync_send_flush(struct netasync_socket *sock)
+{
+   struct netasync_send_ctx *ctx;
+   ssize_t res;
+
+   ASSERT(sock->magic == SOCK_MAGIC);
+
+   if (sock->err != 0 || sock->sendCtxList == NULL) {
+      return;
+   }
+
+   res = netasync_send_writev(sock);
+   if (res <= 0) {
+      return;
+   }
+   netasync.sent += res;
+
+   LOG(2, (LGPFX" %s: flushed %zd bytes\n", sock->hostname, res));
+
+   for (ctx = sock->sendCtxList; ctx && res > 0; ctx = ctx->next) {
+      size_t len = MIN((size_t)res, ctx->len);
+
+      ctx->buf  = (uint8*)ctx->buf + len;
+      ctx->len -= len;
+      res      -= len;
    }
 }
 
@@ -1151,27 +1616,28 @@ netasync_send_ready_cb(void *clientData)
    ASSERT(sock->sendCtxList->magic == CTX_MAGIC);
    ASSERT(sock->magic == SOCK_MAGIC);
 
-   netasync_send_ctx(sock, sock->sendCtxList);
+   sock->sendArmed = 0;
+   netasync_send_queue(sock);
 }
 
 
 /*
  *-------------------------------------------------------------------------
  *
- * netasync_create --
+ * netasync_send_int --
  *
  *-------------------------------------------------------------------------
  */
 
-int
-netasync_send(struct netasync_socket *sock,
-              const void             *buf,
-              size_t                  len,
-              netasync_callback      *callback,
-              void                   *clientData)
+static int
+netasync_send_int(struct netasync_socket *sock,
+                  const void             *buf,
+                  size_t                  len,
+                  struct buff_shared     *shared,
+                  netasync_callback      *callback,
+                  void                   *clientData)
 {
    struct netasync_send_ctx *ctx;
-   bool newSend;
 
    ASSERT(sock);
    ASSERT(sock->connect_async == 0);
@@ -1184,6 +1650,7 @@ netasync_send(struct netasync_socket *sock,
    ctx = safe_malloc(sizeof *ctx);
    ctx->magic      = CTX_MAGIC;
    ctx->buf_orig   = buf;
+   ctx->shared     = shared;
    ctx->buf        = buf;
    ctx->len        = len;
    ctx->clientData = clientData;
@@ -1192,28 +1659,66 @@ netasync_send(struct netasync_socket *sock,
 
    ASSERT(sock->sendCtxTail);
 
-   newSend = sock->sendCtxList == NULL;
-
    *sock->sendCtxTail = ctx;
    sock->sendCtxTail = &ctx->next;
+   netasync.numMsgSent++;
 
-   if (newSend) {
-      /*
-       * Yeah, not exactly ideal, but this avoids having to implement some sort
-       * of ref-counting scheme so that'll have to do for now.
-       */
-      //netasync_send_ctx(sock, ctx);
-      poll_callback_device(netasync.poll, sock->fd,
-                           0,  /* read */
-                           1,  /* write */
-                           0,  /* permanent */
-                           netasync_send_ready_cb, sock);
-   }
+   /*
+    * The write itself is deferred to the poll loop: this keeps callbacks
+    * from running under netasync_send(), and whatever else is queued in
+    * the meantime goes out in the same writev(2).
+    */
+   netasync_send_arm(sock);
 
    return sock->err;
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_send --
+ *
+ *      Takes ownership of 'buf'.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+int
+netasync_send(struct netasync_socket *sock,
+              const void             *buf,
+              size_t                  len,
+              netasync_callback      *callback,
+              void                   *clientData)
+{
+   return netasync_send_int(sock, buf, len, NULL, callback, clientData);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_send_shared --
+ *
+ *      Same as netasync_send() but sends straight from a shared message.
+ *      The socket holds a reference until the send completes.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+int
+netasync_send_shared(struct netasync_socket *sock,
+                     struct buff_shared     *buf,
+                     netasync_callback      *callback,
+                     void                   *clientData)
+{
+   ASSERT(buf);
+
+   return netasync_send_int(sock, buf->base, buf->len, buff_shared_ref(buf),
+                            callback, clientData);
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -1230,9 +1735,7 @@ netasync_free_send_buf(struct netasync_socket *sock)
    while (ctx) {
       struct netasync_send_ctx *next = ctx->next;
 
-      free((void*)ctx->buf_orig);
-      memset(ctx, 0xff, sizeof *ctx);
-      free(ctx);
+      netasync_send_ctx_free(ctx);
       ctx = next;
    }
 }
@@ -1290,16 +1793,18 @@ netasync_close(struct netasync_socket *sock)
       netasync_free_send_buf(sock);
       netasync_send_stop(sock);
    }
-   if (sock->connect_timeout) {
+   if (sock->connect_timeout.entry) {
       netasync_timeout_stop(sock);
    }
    if (sock->connect_async) {
       netasync_connect_stop(sock);
    }
-   if (sock->recvCb) {
+   if (sock->recvArmed) {
       netasync_receive_stop(sock);
-      netasync_receive_reset(sock);
    }
+   netasync_receive_reset(sock);
+   free(sock->ring);
+   free(sock->ringScratch);
    if (sock->fd > 0) {
       close(sock->fd);
       sock->fd = -1;
@@ -1309,3 +1814,248 @@ netasync_close(struct netasync_socket *sock)
    memset(sock, 0xff, sizeof *sock);
    free(sock);
 }
+
+
+#define NETASYNC_BENCH_MSG_LEN   64
+
+struct netasync_bench {
+   struct netasync_socket *sock;
+   int                     peerFd;
+   uint32                  numMsgs;
+   uint32                  numRecv;
+   uint32                  numRearm;    // receives that found the fd disarmed
+   bool                    parked;
+   uint8                   hdr[4];
+   uint8                   payload[NETASYNC_BENCH_MSG_LEN];
+   volatile int           *stop;
+   int                     exit;
+};
+
+static void netasync_bench_hdr_cb(struct netasync_socket *sock, void *buf,
+                                  size_t len, void *clientData);
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_bench_send --
+ *
+ *      Writes a length-prefixed message on the other end of the pair.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_bench_send(struct netasync_bench *b,
+                    uint8 tag)
+{
+   uint8 msg[4 + NETASYNC_BENCH_MSG_LEN];
+   uint32 len = NETASYNC_BENCH_MSG_LEN;
+   ssize_t res;
+
+   memcpy(msg, &len, sizeof len);
+   memset(msg + 4, tag, NETASYNC_BENCH_MSG_LEN);
+   res = write(b->peerFd, msg, sizeof msg);
+   ASSERT(res == sizeof msg);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_bench_recv --
+ *
+ *      Posts the receive for the next header and records whether the read
+ *      interest had to be registered again.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_bench_recv(struct netasync_bench *b)
+{
+   b->numRearm += b->sock->recvArmed == 0;
+   netasync_receive(b->sock, b->hdr, sizeof b->hdr, 0,
+                    netasync_bench_hdr_cb, b);
+   ASSERT(b->sock->recvArmed);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_bench_park_cb --
+ *
+ *      A message showed up while no receive was pending: the socket must
+ *      have been parked instead of spinning on the readable fd. The next
+ *      receive picks the message up.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_bench_park_cb(void *clientData)
+{
+   struct netasync_bench *b = clientData;
+
+   ASSERT(b->sock->recvArmed == 0);
+   b->parked = 1;
+   netasync_bench_recv(b);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_bench_payload_cb --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_bench_payload_cb(struct netasync_socket *sock,
+                          void *buf,
+                          size_t len,
+                          void *clientData)
+{
+   struct netasync_bench *b = clientData;
+
+   ASSERT(len == NETASYNC_BENCH_MSG_LEN);
+   ASSERT(b->payload[0] == (uint8)b->numRecv);
+   ASSERT(b->payload[len - 1] == (uint8)b->numRecv);
+
+   b->numRecv++;
+   if (b->numRecv < b->numMsgs && *b->stop == 0) {
+      netasync_bench_send(b, b->numRecv);
+      netasync_bench_recv(b);
+      return;
+   }
+
+   netasync_bench_send(b, b->numRecv);
+   poll_callback_time(netasync.poll, 20 * 1000, 0 /* !permanent */,
+                      netasync_bench_park_cb, b);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_bench_hdr_cb --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_bench_hdr_cb(struct netasync_socket *sock,
+                      void *buf,
+                      size_t len,
+                      void *clientData)
+{
+   struct netasync_bench *b = clientData;
+   uint32 msgLen;
+
+   ASSERT(len == sizeof b->hdr);
+   memcpy(&msgLen, b->hdr, sizeof msgLen);
+   ASSERT(msgLen == NETASYNC_BENCH_MSG_LEN);
+
+   if (b->parked) {
+      b->exit = 1;
+      return;
+   }
+   b->numRearm += sock->recvArmed == 0;
+   netasync_receive(sock, b->payload, msgLen, 0, netasync_bench_payload_cb, b);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_bench_error_cb --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_bench_error_cb(struct netasync_socket *sock,
+                        void *clientData,
+                        int err)
+{
+   struct netasync_bench *b = clientData;
+
+   Warning(LGPFX" bench socket error: %s (%d)\n", strerror(err), err);
+   b->exit = 1;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_bench --
+ *
+ *      Ping-pongs numMsgs length-prefixed messages over a socketpair, each
+ *      one read as a header then a payload. The read interest is expected to
+ *      stay registered across the whole exchange. A last message is sent
+ *      with no receive pending to check that the socket gets parked.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+netasync_bench(uint32 numMsgs,
+               volatile int *stop)
+{
+   struct netasync_bench b;
+   struct poll_loop *pollSaved;
+   struct poll_loop *poll;
+   uint64 numReadCalls;
+   char *latStr;
+   mtime_t ts;
+   int fds[2];
+   int res;
+
+   res = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+   if (res != 0) {
+      Warning(LGPFX" socketpair failed: %s\n", strerror(errno));
+      return;
+   }
+
+   pollSaved = netasync.poll;
+   poll = poll_create(NULL);
+   netasync.poll = poll;
+
+   memset(&b, 0, sizeof b);
+   b.sock     = netasync_create();
+   b.peerFd   = fds[1];
+   b.numMsgs  = numMsgs;
+   b.stop     = stop;
+
+   b.sock->fd       = fds[0];
+   b.sock->hostname = safe_strdup("bench");
+   netasync_socket_nonblock(b.sock);
+   netasync_set_errorhandler(b.sock, netasync_bench_error_cb, &b);
+
+   numReadCalls = netasync.numReadCalls;
+   ts = time_get();
+
+   netasync_bench_send(&b, 0);
+   netasync_bench_recv(&b);
+   poll_runloop(poll, &b.exit);
+
+   ts = time_get() - ts;
+   numReadCalls = netasync.numReadCalls - numReadCalls;
+
+   ASSERT(*stop || b.parked);
+   ASSERT(b.numRearm == 1 + b.parked);
+
+   latStr = print_latency(ts);
+   Warning(LGPFX" %u msgs in %s -- %.0f msg/sec, %.2f reads/msg, "
+           "%u read registrations\n", b.numRecv, latStr,
+           b.numRecv * 1000.0 * 1000.0 / MAX(ts, 1),
+           (double)numReadCalls / MAX(b.numRecv, 1), b.numRearm);
+   free(latStr);
+
+   netasync_close(b.sock);
+   close(b.peerFd);
+   poll_destroy(poll);
+   netasync.poll = pollSaved;
+}
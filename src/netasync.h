@@ -8,10 +8,13 @@
 #include "poll.h"
 
 struct netasync_socket;
+struct buff_shared;
 
 typedef void (netasync_callback)(struct netasync_socket *socket,
                                  void *clientdata, int err);
 
+typedef void (netasync_stream_callback)(struct netasync_socket *socket,
+                                        void *clientdata);
 typedef void (netasync_recv_callback)(struct netasync_socket *socket,
                                       void *buf,
                                       size_t len,
@@ -34,11 +37,25 @@ int netasync_receive(struct netasync_socket *sock,
                      netasync_recv_callback *callback,
                      void *clientData);
 
+int netasync_receive_stream(struct netasync_socket *sock,
+                            size_t bufLen,
+                            netasync_stream_callback *callback,
+                            void *clientData);
+size_t netasync_stream_avail(const struct netasync_socket *sock);
+const void *netasync_stream_peek(struct netasync_socket *sock, size_t len);
+void netasync_stream_consume(struct netasync_socket *sock, size_t len);
+void netasync_stream_reserve(struct netasync_socket *sock, size_t len);
+
 int netasync_send(struct netasync_socket *sock,
                   const void *buf,
                   size_t len,
                   netasync_callback *cb,
                   void *clientData);
+int netasync_send_shared(struct netasync_socket *sock,
+                         struct buff_shared *buf,
+                         netasync_callback *cb,
+                         void *clientData);
+void netasync_send_flush(struct netasync_socket *sock);
 
 int netasync_resolve(const char *hostname,
                      uint16 port,
@@ -58,4 +75,6 @@ void
 netasync_use_socks(struct netasync_socket *sock,
                    const char *hostname, short port);
 
+void netasync_bench(uint32 numMsgs, volatile int *stop);
+
 #endif /* __NETASYNC_H__ */
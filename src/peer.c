@@ -61,7 +61,9 @@ static int verbose = 0;
  *      Since we have an updated set of headers we can send a getdata for
  *      a batch of blocks to the peer. We should then receive a merkleblock msg
  *      per per block requested, each of which being followed by the relevant
- *      TXs as per the bloom-filter.
+ *      TXs as per the bloom-filter. Each getdata is followed by a ping whose
+ *      pong tells us the peer is done with the batch. The batches are spread
+ *      over all the peers we're connected to, cf. blksync.c.
  *
  *                       /---------\
  *                       | getdata |<-------------\
@@ -79,6 +81,12 @@ static int verbose = 0;
 
 #define PEER_MAGIC      0xbadf00d0badf00d
 
+/*
+ * Initial size of the per-peer receive ring. It grows on demand for the
+ * occasional large message (headers, blocks).
+ */
+#define PEER_RECV_BUF_SIZE      (32 * 1024)
+
 struct peer {
    uint64                  magic;
    char                    name[32];
@@ -86,18 +94,18 @@ struct peer {
    struct sockaddr_in      saddr;
    struct netasync_socket *sock;
    struct circlist_item    item;
-   struct buff             recvBuf;
+   struct buff             recvBuf;   // view into the receive ring
    struct buff            *sendBuf;
 
    uint256                 last_merkle_block;
 
    mtime_t                 last_ts;
+   mtime_t                 connect_ts;
    uint64                  pingNonce;
    bool                    connected;
    bool                    got_version;
    bool                    got_verack;
 
-   bool                    recvMsgHdr;
    btc_msg_header          msgHdr;
 
    uint32                  startingHeight;
@@ -112,8 +120,7 @@ struct peer {
       CIRCLIST_CONTAINER(_li, struct peer, item)
 
 
-static void peer_receive_cb(struct netasync_socket *sock,
-                            void *buf, size_t bufLen, void *clientData);
+static void peer_receive_cb(struct netasync_socket *sock, void *clientData);
 
 
 /*
@@ -170,6 +177,29 @@ peer_name(const struct peer *peer)
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_send_log --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peer_send_log(const struct peer *peer,
+              enum btc_msg_type type,
+              size_t len)
+{
+   peergroup_send_stats_inc(type);
+
+   if (type != BTC_MSG_PING) {
+      Log(LGPFX" %s: %15s -- sending  %-12s: %zu bytes.\n",
+          peer->name, peer->clientStr, btcmsg_type_to_str(type),
+          len);
+   }
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -185,8 +215,6 @@ peer_send_msg(struct peer *peer,
    const void *buf;
    size_t len;
 
-   peergroup_send_stats_inc(type);
-
    ASSERT(peer->sendBuf);
 
    buf = buff_base(peer->sendBuf);
@@ -195,16 +223,33 @@ peer_send_msg(struct peer *peer,
    free(peer->sendBuf);
    peer->sendBuf = NULL;
 
-   if (type != BTC_MSG_PING) {
-      Log(LGPFX" %s: %15s -- sending  %-12s: %zu bytes.\n",
-          peer->name, peer->clientStr, btcmsg_type_to_str(type),
-          len);
-   }
+   peer_send_log(peer, type, len);
 
    return netasync_send(peer->sock, buf, len, peer_send_cb, peer);
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_send_shared --
+ *
+ *      Sends a message that may be queued on other peers as well.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peer_send_shared(struct peer *peer,
+                 enum btc_msg_type type,
+                 struct buff_shared *msg)
+{
+   peer_send_log(peer, type, msg->len);
+
+   return netasync_send_shared(peer->sock, msg, peer_send_cb, peer);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -238,11 +283,16 @@ peer_send_getblocks(struct peer *peer)
  *
  * peer_send_getheaders --
  *
+ *      Without 'from', the locator is built from the block-store. 'stop' is
+ *      optional.
+ *
  *------------------------------------------------------------------------
  */
 
 int
-peer_send_getheaders(struct peer *peer)
+peer_send_getheaders(struct peer *peer,
+                     const uint256 *from,
+                     const uint256 *stop)
 {
    uint256 *hashes = NULL;
    int num = 0;
@@ -250,16 +300,31 @@ peer_send_getheaders(struct peer *peer)
    int res;
 
    blockstore_get_genesis(btc->blockStore, &genesis);
-   blockstore_get_locator_hashes(btc->blockStore, &hashes, &num);
+   if (from) {
+      hashes = safe_malloc(sizeof *hashes);
+      hashes[0] = *from;
+      num = 1;
+   } else {
+      blockstore_get_locator_hashes(btc->blockStore, &hashes, &num);
+   }
 
-   res = btcmsg_craft_getheaders(num > 0 ? hashes : NULL, num, &genesis, &peer->sendBuf);
+   res = btcmsg_craft_getheaders(num > 0 ? hashes : NULL, num, &genesis, stop,
+                                 &peer->sendBuf);
    free(hashes);
    if (res) {
       NOT_TESTED();
       return res;
    }
 
-   return peer_send_msg(peer, BTC_MSG_GETHEADERS);
+   res = peer_send_msg(peer, BTC_MSG_GETHEADERS);
+
+   /*
+    * We're usually about to process the previous batch of headers: don't
+    * let the request wait for that.
+    */
+   netasync_send_flush(peer->sock);
+
+   return res;
 }
 
 
@@ -318,6 +383,63 @@ peer_send_getdata(struct peer *peer,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_send_filtered_getdata --
+ *
+ *      Requests a batch of filtered blocks, followed by a ping: the pong
+ *      carrying 'nonce' comes back once the peer is done with the batch.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+peer_send_filtered_getdata(struct peer *peer,
+                           const uint256 *hash,
+                           int numHash,
+                           uint64 nonce)
+{
+   int res;
+
+   res = peer_send_getdata(peer, INV_TYPE_MSG_FILTERED_BLOCK, hash, numHash);
+   if (res) {
+      return res;
+   }
+   res = btcmsg_craft_ping(peer->protversion, nonce, &peer->sendBuf);
+   if (res) {
+      return res;
+   }
+   return peer_send_msg(peer, BTC_MSG_PING);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_send_getdata_inv --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peer_send_getdata_inv(struct peer *peer,
+                      const btc_msg_inv *inv,
+                      int numInv)
+{
+   int res;
+
+   ASSERT(numInv);
+   ASSERT(numInv <= BTC_MSG_GETDATA_MAX_ENTRIES);
+
+   res = btcmsg_craft_getdata_inv(&peer->sendBuf, inv, numInv);
+   if (res == 0) {
+      res = peer_send_msg(peer, BTC_MSG_GETDATA);
+   }
+   return res;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -381,6 +503,8 @@ peer_handshake_ok(struct peer *peer)
       return res;
    }
 
+   addrbook_mark_good(btc->book, peer->paddr, time_get() - peer->connect_ts);
+
    /* the below should always be true */
    ASSERT(peer->protversion >= BTC_PROTO_ADDR_W_TIME);
 
@@ -435,15 +559,17 @@ peer_destroy(struct circlist_item *li,
    peer->paddr->connected = 0;
    peer->connected = 0;
 
-   if (peer_remove_addr(err)) {
+   if (peer_remove_addr(err) && addrbook_can_evict(peer->paddr)) {
       addrbook_remove_entry(btc->book, peer->paddr);
       free(peer->paddr);
       peer->paddr = NULL;
    }
 
+   peergroup_inflight_release_peer(btc->peerGroup, peer);
+   peergroup_hdrsync_remove_peer(btc->peerGroup, peer);
+   peergroup_blksync_remove_peer(btc->peerGroup, peer);
    peergroup_dequeue_peerlist(&peer->item);
    netasync_close(peer->sock);
-   buff_free_base(&peer->recvBuf);
    buff_free(peer->sendBuf);
    free(peer->hostname);
    free(peer->clientStr);
@@ -575,7 +701,24 @@ peer_send_ping(struct peer *peer)
 static int
 peer_handle_notfound(struct peer *peer)
 {
-   return btcmsg_parse_notfound(&peer->recvBuf);
+   btc_msg_inv *inv;
+   int num;
+   int res;
+   int i;
+
+   res = btcmsg_parse_notfound(&peer->recvBuf, &inv, &num);
+   if (res) {
+      return res;
+   }
+   /*
+    * The peer won't deliver these: let whoever announces them next fetch them.
+    */
+   for (i = 0; i < num; i++) {
+      peergroup_inflight_notfound(btc->peerGroup, peer, &inv[i].hash);
+   }
+   free(inv);
+
+   return 0;
 }
 
 
@@ -619,17 +762,16 @@ peer_handle_getdata(struct peer *peer)
    }
 
    for (i = 0; i < n; i++) {
-      struct buff *buf = NULL;
+      struct buff_shared *msg = NULL;
 
       switch (inv[i].type) {
       case INV_TYPE_MSG_TX:
-         res = peergroup_lookup_broadcast_tx(btc->peerGroup, &inv[i].hash, &buf);
-         if (res != 0 || buf == NULL) {
+         res = peergroup_lookup_broadcast_tx(btc->peerGroup, &inv[i].hash, &msg);
+         if (res != 0 || msg == NULL) {
             break;
          }
-         btcmsg_craft_tx(buf, &peer->sendBuf);
-         buff_free(buf);
-         res = peer_send_msg(peer, BTC_MSG_TX);
+         res = peer_send_shared(peer, BTC_MSG_TX, msg);
+         buff_shared_unref(msg);
          if (res) {
             goto exit;
          }
@@ -678,13 +820,18 @@ static int
 peer_handle_tx(struct peer *peer)
 {
    const uint8 *buf;
+   uint256 txHash;
    size_t len;
    int res;
 
    buf = buff_base(&peer->recvBuf);
    len = buff_maxlen(&peer->recvBuf);
 
-   res = wallet_handle_tx(btc->wallet, &peer->last_merkle_block, buf, len);
+   hash256_calc(buf, len, &txHash);
+   peergroup_inflight_done(btc->peerGroup, &txHash);
+
+   res = peergroup_handle_tx(peer, &peer->last_merkle_block, &txHash,
+                             buf, len);
    ASSERT(res == 0);
 
    return res;
@@ -711,6 +858,8 @@ peer_handle_merkleblock(struct peer *peer)
       return res;
    }
 
+   peergroup_inflight_done(btc->peerGroup, &blk->blkHash);
+
    res = peergroup_handle_merkleblock(peer, blk);
    if (res == 0) {
       memcpy(&peer->last_merkle_block, &blk->blkHash, sizeof blk->blkHash);
@@ -784,7 +933,7 @@ peer_handle_headers(struct peer *peer)
       return res;
    }
 
-   res = peergroup_handle_headers(peer, peer->startingHeight, headers, n);
+   res = peergroup_handle_headers(peer, headers, n);
    free(headers);
    return res;
 }
@@ -808,6 +957,9 @@ peer_handle_pong(struct peer *peer)
    if (res) {
       return res;
    }
+   if (peergroup_handle_pong(peer, nonce)) {
+      return 0;
+   }
    if (nonce != peer->pingNonce - 1) {
       Log(LGPFX" %s: received ping nonce %#llx instead of %#llx.\n",
           peer->name, nonce, peer->pingNonce - 1);
@@ -855,13 +1007,14 @@ static int
 peer_handle_inv(struct peer *peer)
 {
    btc_msg_inv *inv = NULL;
-   uint256 *hash;
-   uint8 *type;
+   btc_msg_inv *req;
    char hashStr[80];
-   int numHash = 0;
+   bool ready = bitc_state_ready();
+   int numReq = 0;
    int numtx = 0;
    int numblk = 0;
    int numfblk = 0;
+   int numBusy = 0;
    int n = 0;
    int res;
    int i;
@@ -870,22 +1023,20 @@ peer_handle_inv(struct peer *peer)
    if (res) {
       return res;
    }
-   hash = safe_malloc(n * sizeof *hash);
-   type = safe_malloc(n * sizeof *type);
+   req = safe_malloc(n * sizeof *req);
 
    for (i = 0; i < n; i++) {
-      bool s;
+      enum btc_inv_type type;
 
       switch (inv[i].type) {
       case INV_TYPE_MSG_BLOCK:
          numblk++;
-         s = blockstore_is_block_known(btc->blockStore, &inv[i].hash);
-         if (s == 0) {
-            uint256_snprintf_reverse(hashStr, sizeof hashStr, &inv[i].hash);
-            Log(LGPFX" %s: inv block %s\n", peer->name, hashStr);
-            hash[numHash] = inv[i].hash;
-            type[numHash++] = INV_TYPE_MSG_FILTERED_BLOCK;
+         if (blockstore_is_block_known(btc->blockStore, &inv[i].hash)) {
+            continue;
          }
+         uint256_snprintf_reverse(hashStr, sizeof hashStr, &inv[i].hash);
+         Log(LGPFX" %s: inv block %s\n", peer->name, hashStr);
+         type = INV_TYPE_MSG_FILTERED_BLOCK;
          break;
       case INV_TYPE_MSG_TX:
          /*
@@ -894,35 +1045,53 @@ peer_handle_inv(struct peer *peer)
           */
          uint256_snprintf_reverse(hashStr, sizeof hashStr, &inv[i].hash);
          Log(LGPFX" %s: matching tx %s\n", peer->name, hashStr);
-         if (!wallet_has_tx(btc->wallet, &inv[i].hash)) {
-            numtx++;
-            hash[numHash] = inv[i].hash;
-            type[numHash++] = INV_TYPE_MSG_TX;
+         if (wallet_has_tx(btc->wallet, &inv[i].hash)) {
+            continue;
          }
+         numtx++;
+         type = INV_TYPE_MSG_TX;
          break;
       case INV_TYPE_MSG_FILTERED_BLOCK:
          numfblk++;
          NOT_TESTED();
          goto exit;
+      default:
+         continue;
       }
+
+      /*
+       * Another peer may have announced the same item a moment ago: only
+       * fetch it once. The claim is only made when we're about to send the
+       * request, otherwise nobody would ever release it.
+       */
+      if (ready) {
+         if (!peergroup_inflight_claim(btc->peerGroup, peer, &inv[i].hash)) {
+            numBusy++;
+            continue;
+         }
+         req[numReq].type = type;
+         req[numReq].hash = inv[i].hash;
+      }
+      numReq++;
    }
-   LOG(1, (LGPFX" %s: handling inv msg: tx=%2d blk=%2d numfblk=%d numHash=%d\n",
-           peer->name, numtx, numblk, numfblk, numHash));
-
-   if (bitc_state_ready()) {
-      for (i = 0; i < numHash; i++) {
-         uint256_snprintf_reverse(hashStr, sizeof hashStr, hash + i);
-         Log(LGPFX" %s: [%d / %d] requesting %s %s\n",
-             peer->name, i, numHash,
-             type[i] == INV_TYPE_MSG_FILTERED_BLOCK ? "block" : "tx",
-             hashStr);
-         res = peer_send_getdata(peer, type[i], hash + i, 1);
+   LOG(1, (LGPFX" %s: handling inv msg: tx=%2d blk=%2d numfblk=%d numReq=%d "
+           "inflight=%d\n", peer->name, numtx, numblk, numfblk, numReq, numBusy));
+
+   if (ready) {
+      /*
+       * A single getdata carries the whole inv, txs and blocks mixed.
+       */
+      for (i = 0; i < numReq && res == 0; i += BTC_MSG_GETDATA_MAX_ENTRIES) {
+         int num = MIN(numReq - i, BTC_MSG_GETDATA_MAX_ENTRIES);
+
+         Log(LGPFX" %s: requesting %d item%s\n",
+             peer->name, num, num > 1 ? "s" : "");
+         res = peer_send_getdata_inv(peer, req + i, num);
       }
    }
 
 exit:
-   free(type);
-   free(hash);
+   free(req);
    free(inv);
    return res;
 }
@@ -1003,36 +1172,6 @@ peer_handle_verack(struct peer *peer)
 }
 
 
-/*
- *------------------------------------------------------------------------
- *
- * peer_handle_msgheader --
- *
- *------------------------------------------------------------------------
- */
-
-static int
-peer_handle_msgheader(struct peer *peer)
-{
-   if (!btcmsg_header_valid(&peer->msgHdr)) {
-      Warning(LGPFX" %s: invalid msg header -- %s\n",
-              peer->name, peer->clientStr);
-      return 1;
-   }
-
-   buff_alloc_base(&peer->recvBuf, peer->msgHdr.payloadLength);
-   peer->recvMsgHdr = 0;
-   if (buff_maxlen(&peer->recvBuf) > 0) {
-      netasync_receive(peer->sock,
-                       buff_base(&peer->recvBuf),
-                       buff_maxlen(&peer->recvBuf),
-                       0 /* full */,
-                       peer_receive_cb, peer);
-   }
-   return 0;
-}
-
-
 /*
  *------------------------------------------------------------------------
  *
@@ -1044,52 +1183,33 @@ peer_handle_msgheader(struct peer *peer)
 static void
 peer_update_timestamp(struct peer *peer)
 {
-   peer->paddr->addr.time = time(NULL);
+   addrbook_mark_seen(btc->book, peer->paddr, time(NULL));
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * peer_receive_cb --
+ * peer_handle_message --
+ *
+ *      Dispatches the message whose header is in peer->msgHdr and whose
+ *      payload is viewed by peer->recvBuf.
  *
  *------------------------------------------------------------------------
  */
 
-static void
-peer_receive_cb(struct netasync_socket *sock,
-                void *buf,
-                size_t bufLen,
-                void *clientData)
+static int
+peer_handle_message(struct peer *peer)
 {
-   struct peer *peer = (struct peer *) clientData;
    enum btc_msg_type msg;
    int res = 0;
 
-   if (peer->magic != PEER_MAGIC) {
-      Panic("XXX\n");
-   }
-   ASSERT(peer->magic == PEER_MAGIC);
-   peer->last_ts = time_get();
-
-   if (bitc_exiting()) {
-      return;
-   }
-
    msg = btcmsg_str_to_type(peer->msgHdr.message);
-   if (peer->recvMsgHdr) {
-      if (peer_handle_msgheader(peer)) {
-         goto exit;
-      }
-      if (buff_maxlen(&peer->recvBuf) > 0) {
-         return;
-      }
-   }
 
    if (!btcmsg_payload_valid(&peer->recvBuf, peer->msgHdr.checksum)) {
       Warning(LGPFX" %s: invalid checksum for '%s'.\n",
               peer->name, btcmsg_type_to_str(msg));
-      goto exit;
+      return 1;
    }
 
    peergroup_recv_stats_inc(msg);
@@ -1105,7 +1225,7 @@ peer_receive_cb(struct netasync_socket *sock,
          Log(LGPFX" %s: failed msg handling: %s (%s) payloadLength=%zu\n",
                  peer->name, btcmsg_type_to_str(msg), peer->clientStr,
                  buff_maxlen(&peer->recvBuf));
-         goto exit;
+         return res;
       }
       goto next;
    }
@@ -1147,16 +1267,76 @@ next:
       Warning(LGPFX" %s: failed msg handling: %s (%s) payloadLength=%zu\n",
               peer->name, btcmsg_type_to_str(msg), peer->clientStr,
               buff_maxlen(&peer->recvBuf));
-      goto exit;
+      return res;
    }
 
    peer_update_timestamp(peer);
-   buff_free_base(&peer->recvBuf);
-   peer->recvMsgHdr = 1;
-   netasync_receive(peer->sock, &peer->msgHdr, sizeof peer->msgHdr,
-                    0 /* full */, peer_receive_cb, peer);
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_receive_cb --
+ *
+ *      Called with whatever the socket had to offer: frames and handles
+ *      every complete message in place. A payload is only copied when it
+ *      straddles the end of the receive ring.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peer_receive_cb(struct netasync_socket *sock,
+                void *clientData)
+{
+   struct peer *peer = (struct peer *) clientData;
+
+   if (peer->magic != PEER_MAGIC) {
+      Panic("XXX\n");
+   }
+   ASSERT(peer->magic == PEER_MAGIC);
+   peer->last_ts = time_get();
+
+   while (bitc_exiting() == 0) {
+      size_t avail = netasync_stream_avail(sock);
+      const uint8 *msg;
+      size_t msgLen;
+      int res;
+
+      if (avail < sizeof peer->msgHdr) {
+         return;
+      }
+      memcpy(&peer->msgHdr, netasync_stream_peek(sock, sizeof peer->msgHdr),
+             sizeof peer->msgHdr);
+
+      if (!btcmsg_header_valid(&peer->msgHdr)) {
+         Warning(LGPFX" %s: invalid msg header -- %s\n",
+                 peer->name, peer->clientStr);
+         goto exit;
+      }
+
+      msgLen = sizeof peer->msgHdr + peer->msgHdr.payloadLength;
+      if (avail < msgLen) {
+         netasync_stream_reserve(sock, msgLen);
+         return;
+      }
+
+      msg = netasync_stream_peek(sock, msgLen);
+      buff_init(&peer->recvBuf, (void *)(msg + sizeof peer->msgHdr),
+                peer->msgHdr.payloadLength);
 
+      res = peer_handle_message(peer);
+
+      buff_init(&peer->recvBuf, NULL, 0);
+      if (res != 0) {
+         goto exit;
+      }
+      netasync_stream_consume(sock, msgLen);
+   }
    return;
+
 exit:
    peer_destroy(&peer->item, EINVAL);
 }
@@ -1188,7 +1368,6 @@ peer_connect_cb(struct netasync_socket *sock,
    }
 
    peer->connected = 1;
-   peer->recvMsgHdr = 1;
 
    Log(LGPFX" %s: connected to %s. sending version msg.\n",
        peer->name, netasync_hostname(sock));
@@ -1196,8 +1375,8 @@ peer_connect_cb(struct netasync_socket *sock,
    /*
     * Setup receiving.
     */
-   netasync_receive(peer->sock, &peer->msgHdr, sizeof peer->msgHdr,
-                    0 /* full */, peer_receive_cb, peer);
+   netasync_receive_stream(peer->sock, PEER_RECV_BUF_SIZE,
+                           peer_receive_cb, peer);
 
    /*
     * Send "version" message.
@@ -1233,6 +1412,7 @@ peer_add(struct peer_addr *paddr,
    ASSERT(paddr->connected == 0);
    paddr->connected = 1;
    paddr->triedalready = 1;
+   addrbook_mark_attempt(btc->book, paddr);
 
    /*
     * IPv4 only.
@@ -1251,6 +1431,7 @@ peer_add(struct peer_addr *paddr,
    if (btc->socks5_proxy) {
       netasync_use_socks(peer->sock, btc->socks5_proxy, btc->socks5_port);
    }
+   peer->connect_ts = time_get();
    netasync_connect(peer->sock, &peer->saddr,
                     15 /* 15 sec connect timeout */,
                     peer_connect_cb, peer);
@@ -1325,7 +1506,7 @@ peer_check_liveness(struct circlist_item *item,
 
 int
 peer_send_inv(struct circlist_item *item,
-              struct buff *buf)
+              struct buff_shared *msg)
 {
    struct peer *peer = GET_PEER(item);
 
@@ -1337,9 +1518,7 @@ peer_send_inv(struct circlist_item *item,
       return 0;
    }
 
-   peer->sendBuf = buff_dup(buf);
-
-   return peer_send_msg(peer, BTC_MSG_INV);
+   return peer_send_shared(peer, BTC_MSG_INV, msg);
 }
 
 
@@ -1355,6 +1534,7 @@ static int
 peer_tx_broadcast(struct peer *peer,
                   const uint256 *hash)
 {
+   struct buff_shared *msgInv;
    struct buff *bufInv;
    char hashStr[80];
    int res;
@@ -1364,8 +1544,9 @@ peer_tx_broadcast(struct peer *peer,
    res = btcmsg_craft_inv(&bufInv, INV_TYPE_MSG_TX, hash, 1);
    ASSERT(res == 0);
 
-   res = peer_send_inv(&peer->item, bufInv);
-   buff_free(bufInv);
+   msgInv = buff_shared_from_buff(bufInv);
+   res = peer_send_inv(&peer->item, msgInv);
+   buff_shared_unref(msgInv);
 
    return res;
 }
@@ -1452,3 +1633,24 @@ peer_on_ready_li(struct circlist_item *li)
 
    return peer_on_ready(peer);
 }
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_download_filtered_blocks_li --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+peer_download_filtered_blocks_li(struct circlist_item *li)
+{
+   struct peer *peer = GET_PEER(li);
+
+   if (peer->got_verack == 0) {
+      return 0;
+   }
+
+   return peergroup_download_filtered_blocks(peer);
+}
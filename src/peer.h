@@ -4,6 +4,8 @@
 #include "basic_defs.h"
 #include "bitc_ui.h"
 
+struct buff_shared;
+
 struct peer_addr;
 struct circlist_item;
 struct peer;
@@ -17,12 +19,16 @@ void peer_destroy(struct circlist_item *li, int err);
 int  peer_getinfo(struct circlist_item *item, struct bitcui_peer *pinfo);
 int  peer_on_ready(struct peer *peer);
 int  peer_on_ready_li(struct circlist_item *li);
+int  peer_download_filtered_blocks_li(struct circlist_item *li);
 
-int peer_send_inv(struct circlist_item *item, struct buff *buf);
-int peer_send_getheaders(struct peer *peer);
+int peer_send_inv(struct circlist_item *item, struct buff_shared *msg);
+int peer_send_getheaders(struct peer *peer, const uint256 *from,
+                         const uint256 *stop);
 int peer_send_getblocks(struct peer *peer);
 int peer_send_mempool(struct peer *peer);
 int peer_send_getdata(struct peer *peer, enum btc_inv_type type,
                       const uint256 *hash, int numHash);
+int peer_send_filtered_getdata(struct peer *peer, const uint256 *hash,
+                               int numHash, uint64 nonce);
 
 #endif /* __PEER_H__ */
@@ -15,13 +15,51 @@
 #include "bitc.h"
 #include "hashtable.h"
 #include "buff.h"
+#include "hdrsync.h"
+#include "blksync.h"
 
 #define LGPFX   "PEERG:"
 
+/*
+ * How long a getdata request is considered to be owned by the peer it was
+ * sent to. Past that delay another peer announcing the same hash may fetch it.
+ */
+#define PEERGROUP_INFLIGHT_TIMEOUT   (30 * 1000 * 1000)  // usec
+
+/*
+ * A getheaders not answered within this delay gets its range reassigned.
+ */
+#define PEERGROUP_HDRSYNC_STALL      (20 * 1000 * 1000)  // usec
+#define PEERGROUP_HDRSYNC_PERIOD     (5 * 1000 * 1000)   // usec
+
+/*
+ * Filtered blocks are fetched in chunks of 500, with up to 2 chunks queued
+ * per peer and at most 32 chunks between the oldest one not yet processed and
+ * the newest one requested.
+ */
+#define PEERGROUP_BLKSYNC_CHUNK      500
+#define PEERGROUP_BLKSYNC_WINDOW     32
+#define PEERGROUP_BLKSYNC_PER_PEER   2
+#define PEERGROUP_BLKSYNC_STALL      (30 * 1000 * 1000)  // usec
+#define PEERGROUP_BLKSYNC_PERIOD     (5 * 1000 * 1000)   // usec
+
 
 struct tx_broadcast {
-   struct buff *buf;     /* tx serialized */
-   time_t       expiry;
+   struct buff_shared *msg;     /* 'tx' message, ready to send */
+   time_t              expiry;
+};
+
+struct inflight_req {
+   const struct peer  *peer;    /* peer the getdata was sent to */
+   mtime_t             ts;
+};
+
+struct inflight_release {
+   const struct peer  *peer;    /* NULL: collect the expired requests */
+   mtime_t             now;
+   uint256            *hashes;
+   int                 num;
+   int                 size;
 };
 
 
@@ -55,7 +93,7 @@ static struct {
 static void
 peergroup_free_tx_broadcast_entry(struct tx_broadcast *txb)
 {
-   buff_free(txb->buf);
+   buff_shared_unref(txb->msg);
    free(txb);
 }
 
@@ -122,24 +160,221 @@ peergroup_stop_broadcast_tx(struct peergroup *pg,
 int
 peergroup_lookup_broadcast_tx(struct peergroup *pg,
                               const uint256 *hash,
-                              struct buff **bufOut)
+                              struct buff_shared **msgOut)
 {
    struct tx_broadcast *txb;
    bool s;
 
-   *bufOut = NULL;
+   *msgOut = NULL;
 
    s = hashtable_lookup(pg->hash_broadcast, hash, sizeof *hash, (void*)&txb);
    if (s == 0) {
       return 0;
    }
 
-   *bufOut = buff_dup(txb->buf);
+   *msgOut = buff_shared_ref(txb->msg);
 
    return 0;
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_inflight_claim --
+ *
+ *      Records that 'peer' is about to request 'hash'. Returns FALSE if the
+ *      same item is already being fetched and the request has not expired.
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+peergroup_inflight_claim(struct peergroup *pg,
+                         const struct peer *peer,
+                         const uint256 *hash)
+{
+   struct inflight_req *req = NULL;
+   mtime_t now = time_get();
+   bool s;
+
+   s = hashtable_lookup(pg->hash_inflight, hash, sizeof *hash, (void*)&req);
+   if (s) {
+      if (now - req->ts < PEERGROUP_INFLIGHT_TIMEOUT) {
+         return 0;
+      }
+      req->peer = peer;
+      req->ts   = now;
+      return 1;
+   }
+
+   req = safe_malloc(sizeof *req);
+   req->peer = peer;
+   req->ts   = now;
+
+   s = hashtable_insert(pg->hash_inflight, hash, sizeof *hash, req);
+   ASSERT(s);
+
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_inflight_done --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peergroup_inflight_done(struct peergroup *pg,
+                        const uint256 *hash)
+{
+   struct inflight_req *req = NULL;
+   bool s;
+
+   s = hashtable_lookup(pg->hash_inflight, hash, sizeof *hash, (void*)&req);
+   if (s == 0) {
+      return;
+   }
+   hashtable_remove(pg->hash_inflight, hash, sizeof *hash);
+   free(req);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_inflight_notfound --
+ *
+ *      'peer' answered our getdata for 'hash' with a notfound. Drop the
+ *      claim if it is still held by this peer.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peergroup_inflight_notfound(struct peergroup *pg,
+                            const struct peer *peer,
+                            const uint256 *hash)
+{
+   struct inflight_req *req = NULL;
+   bool s;
+
+   s = hashtable_lookup(pg->hash_inflight, hash, sizeof *hash, (void*)&req);
+   if (s == 0 || req->peer != peer) {
+      return;
+   }
+   peergroup_inflight_done(pg, hash);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_inflight_release_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_inflight_release_cb(const void *key,
+                              size_t keyLen,
+                              void *cbData,
+                              void *keyData)
+{
+   struct inflight_release *rel = cbData;
+   struct inflight_req *req = keyData;
+
+   ASSERT(keyLen == sizeof(uint256));
+
+   if (rel->peer == NULL) {
+      if (rel->now - req->ts < PEERGROUP_INFLIGHT_TIMEOUT) {
+         return;
+      }
+   } else if (req->peer != rel->peer) {
+      return;
+   }
+   if (rel->num == rel->size) {
+      rel->size = rel->size ? rel->size * 2 : 16;
+      rel->hashes = safe_realloc(rel->hashes, rel->size * sizeof *rel->hashes);
+   }
+   memcpy(rel->hashes + rel->num, key, sizeof(uint256));
+   rel->num++;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_inflight_release_peer --
+ *
+ *      Forgets the requests that were sent to a peer going away, so that
+ *      the next announcement of these items gets them fetched elsewhere.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peergroup_inflight_release_peer(struct peergroup *pg,
+                                const struct peer *peer)
+{
+   struct inflight_release rel;
+   int i;
+
+   if (pg == NULL || hashtable_getnumentries(pg->hash_inflight) == 0) {
+      return;
+   }
+
+   memset(&rel, 0, sizeof rel);
+   rel.peer = peer;
+
+   hashtable_for_each(pg->hash_inflight, peergroup_inflight_release_cb, &rel);
+
+   for (i = 0; i < rel.num; i++) {
+      peergroup_inflight_done(pg, rel.hashes + i);
+   }
+   free(rel.hashes);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_inflight_expire --
+ *
+ *      Drops the requests older than PEERGROUP_INFLIGHT_TIMEOUT: items that
+ *      were never delivered would otherwise keep their entry forever.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_inflight_expire(struct peergroup *pg)
+{
+   struct inflight_release rel;
+   int i;
+
+   if (hashtable_getnumentries(pg->hash_inflight) == 0) {
+      return;
+   }
+
+   memset(&rel, 0, sizeof rel);
+   rel.now = time_get();
+
+   hashtable_for_each(pg->hash_inflight, peergroup_inflight_release_cb, &rel);
+
+   if (rel.num > 0) {
+      Log(LGPFX" expiring %d in-flight requests\n", rel.num);
+   }
+   for (i = 0; i < rel.num; i++) {
+      peergroup_inflight_done(pg, rel.hashes + i);
+   }
+   free(rel.hashes);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -356,6 +591,13 @@ peergroup_download_complete(void)
    }
    peergroup_download_progress();
 
+   /*
+    * Back to one sync per write.
+    */
+   if (wallet_flush(btc->wallet)) {
+      Warning(LGPFX" failed to flush txdb.\n");
+   }
+
    if (btc->updateAndExit) {
       bitc_req_stop();
    } else {
@@ -371,6 +613,8 @@ peergroup_download_complete(void)
  *
  * peergroup_add_block_finalize --
  *
+ *      Called once per block, or once per batch of headers.
+ *
  *------------------------------------------------------------------------
  */
 
@@ -386,8 +630,7 @@ peergroup_add_block_finalize(struct blockstore *bs,
    if (headerOnly == 0) {
       peergroup_set_lastblk(btc->peerGroup, &best_hash);
    }
-   if (bitc_state_ready() || bitc_state_updating_txdb() ||
-       (blockstore_get_height(bs) % 2000) == 0) {
+   if (bitc_state_ready() || bitc_state_updating_txdb() || headerOnly) {
 #ifdef WITHUI
       bitcui_set_last_block_info(&best_hash, blockstore_get_height(bs),
                                  blockstore_get_timestamp(btc->blockStore));
@@ -405,8 +648,7 @@ peergroup_add_block_finalize(struct blockstore *bs,
  */
 
 static void
-peergroup_process_filtered_block(struct peer *peer,
-                                 const btc_msg_merkleblock *blk)
+peergroup_process_filtered_block(const btc_msg_merkleblock *blk)
 {
    struct blockstore *bs = btc->blockStore;
    struct peergroup *pg = btc->peerGroup;
@@ -444,6 +686,202 @@ peergroup_process_filtered_block(struct peer *peer,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_add_headers --
+ *
+ *      'hashes' have been computed and proof-of-work checked by
+ *      hdrsync_hash_headers(): what's left to do is the ordered linking.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_add_headers(const btc_block_header *headers,
+                      const uint256 *hashes,
+                      int n)
+{
+   struct blockstore *bs = btc->blockStore;
+   int numOrphans = 0;
+   int numAdded = 0;
+   int i;
+
+   for (i = 0; i < n; i++) {
+      const btc_block_header *hdr = headers + i;
+      char hashStr[80];
+      bool orphan;
+      bool s;
+
+      s = blockstore_add_header(bs, hdr, hashes + i, &orphan);
+      if (orphan) {
+         numOrphans++;
+         uint256_snprintf_reverse(hashStr, sizeof hashStr, hashes + i);
+#ifdef WITHUI
+         bitcui_set_status("Block %s orphaned (count = %d)", hashStr, numOrphans);
+#endif
+      }
+      if (s) {
+         numAdded++;
+         btc->peerGroup->numHdrFetched++;
+         if (btc->peerGroup->numHdrFetched % 100000 == 0) {
+            Warning(LGPFX" fetched %6d headers out of %d\n",
+                    btc->peerGroup->numHdrFetched, btc->peerGroup->numHdrToFetch);
+         }
+      }
+   }
+
+   /*
+    * One write to the headers file for the whole batch.
+    */
+   if (numAdded > 0) {
+      peergroup_add_block_finalize(bs, TRUE /* header only */);
+   }
+   peergroup_download_progress();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_deliver_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_hdrsync_deliver_cb(const btc_block_header *hdrs,
+                             const uint256 *hashes,
+                             int n,
+                             void *clientData)
+{
+   peergroup_add_headers(hdrs, hashes, n);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_request_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_hdrsync_request_cb(void *peer,
+                             const uint256 *from,
+                             const uint256 *stop,
+                             void *clientData)
+{
+   return peer_send_getheaders(peer, from, stop);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_periodic_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_hdrsync_periodic_cb(void *clientData)
+{
+   struct peergroup *pg = clientData;
+
+   if (bitc_exiting() || pg->hdrSync == NULL) {
+      return;
+   }
+   hdrsync_check_stalls(pg->hdrSync);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_start --
+ *
+ *      Splits the headers left to fetch along the checkpoints so that
+ *      several peers can work on them at the same time.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_hdrsync_start(struct peergroup *pg)
+{
+   uint256 *anchorHashes = NULL;
+   int *anchorHeights = NULL;
+   int numAnchors = 0;
+   int height;
+   uint256 hash;
+
+   ASSERT(pg->hdrSync == NULL);
+
+   while (blockstore_get_checkpoint(numAnchors, &height, &hash)) {
+      anchorHeights = safe_realloc(anchorHeights,
+                                   (numAnchors + 1) * sizeof *anchorHeights);
+      anchorHashes  = safe_realloc(anchorHashes,
+                                   (numAnchors + 1) * sizeof *anchorHashes);
+      anchorHeights[numAnchors] = height;
+      anchorHashes[numAnchors]  = hash;
+      numAnchors++;
+   }
+
+   pg->hdrSync = hdrsync_create(blockstore_get_height(btc->blockStore),
+                                anchorHeights, anchorHashes, numAnchors,
+                                PEERGROUP_HDRSYNC_STALL, btc->pw,
+                                peergroup_hdrsync_request_cb,
+                                peergroup_hdrsync_deliver_cb, pg);
+   pg->hdrSyncTimer = poll_callback_time(btc->poll, PEERGROUP_HDRSYNC_PERIOD,
+                                         1 /* permanent */,
+                                         peergroup_hdrsync_periodic_cb, pg);
+   free(anchorHeights);
+   free(anchorHashes);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_stop --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_hdrsync_stop(struct peergroup *pg)
+{
+   if (pg->hdrSync == NULL) {
+      return;
+   }
+   poll_callback_time_cancel(btc->poll, pg->hdrSyncTimer);
+   pg->hdrSyncTimer.entry = NULL;
+   hdrsync_destroy(pg->hdrSync);
+   pg->hdrSync = NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_remove_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peergroup_hdrsync_remove_peer(struct peergroup *pg,
+                              const struct peer *peer)
+{
+   if (pg == NULL || pg->hdrSync == NULL) {
+      return;
+   }
+   hdrsync_remove_peer(pg->hdrSync, (void *)peer);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -492,7 +930,174 @@ peergroup_download_headers(struct peer *peer,
          free(lagStr);
       }
    }
-   return peer_send_getheaders(peer);
+
+   if (btc->peerGroup->hdrSync == NULL) {
+      peergroup_hdrsync_start(btc->peerGroup);
+   }
+   hdrsync_set_target(btc->peerGroup->hdrSync, btc->peerGroup->heightTarget);
+
+   return hdrsync_add_peer(btc->peerGroup->hdrSync, peer);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_deliver_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_deliver_cb(const btc_msg_merkleblock *blk,
+                             const struct blksync_tx *txs,
+                             int numTx,
+                             void *clientData)
+{
+   uint256 lastTxdb;
+   int res;
+   int i;
+
+   /*
+    * The block and its transactions make it to the txdb at once.
+    */
+   wallet_begin_block(btc->wallet);
+   peergroup_process_filtered_block(blk);
+   wallet_confirm_tx_in_block(btc->wallet, blk);
+
+   for (i = 0; i < numTx; i++) {
+      res = wallet_handle_tx(btc->wallet, &blk->blkHash, txs[i].buf,
+                             txs[i].len);
+      ASSERT(res == 0);
+   }
+   peergroup_get_lastblk(btc->peerGroup, &lastTxdb);
+   res = wallet_commit_block(btc->wallet, &lastTxdb);
+   ASSERT(res == 0);
+
+   peergroup_download_progress();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_request_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_blksync_request_cb(void *peer,
+                             const uint256 *hashes,
+                             int n,
+                             uint64 nonce,
+                             void *clientData)
+{
+   return peer_send_filtered_getdata(peer, hashes, n, nonce);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_periodic_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_periodic_cb(void *clientData)
+{
+   struct peergroup *pg = clientData;
+
+   if (bitc_exiting() || pg->blkSync == NULL) {
+      return;
+   }
+   blksync_check_stalls(pg->blkSync);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_start --
+ *
+ *      Hands the blocks following 'start' to the download manager and puts
+ *      all the peers to work. Returns FALSE if there is nothing to fetch.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+peergroup_blksync_start(struct peergroup *pg,
+                        const uint256 *start)
+{
+   struct circlist_item *li;
+   uint256 *hashes;
+   int n;
+
+   ASSERT(pg->blkSync == NULL);
+
+   blockstore_get_hashes_after(btc->blockStore, start, &hashes, &n);
+   if (n == 0) {
+      return 0;
+   }
+
+   pg->blkSync = blksync_create(hashes, n, PEERGROUP_BLKSYNC_CHUNK,
+                                PEERGROUP_BLKSYNC_WINDOW,
+                                PEERGROUP_BLKSYNC_PER_PEER,
+                                PEERGROUP_BLKSYNC_STALL,
+                                peergroup_blksync_request_cb,
+                                peergroup_blksync_deliver_cb, pg);
+   pg->blkSyncTimer = poll_callback_time(btc->poll, PEERGROUP_BLKSYNC_PERIOD,
+                                         1 /* permanent */,
+                                         peergroup_blksync_periodic_cb, pg);
+   free(hashes);
+
+   CIRCLIST_SCAN(li, pg->peer_list) {
+      peer_download_filtered_blocks_li(li);
+   }
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_stop --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_stop(struct peergroup *pg)
+{
+   if (pg->blkSync == NULL) {
+      return;
+   }
+   poll_callback_time_cancel(btc->poll, pg->blkSyncTimer);
+   pg->blkSyncTimer.entry = NULL;
+   blksync_destroy(pg->blkSync);
+   pg->blkSync = NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_remove_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peergroup_blksync_remove_peer(struct peergroup *pg,
+                              const struct peer *peer)
+{
+   if (pg == NULL || pg->blkSync == NULL) {
+      return;
+   }
+   blksync_remove_peer(pg->blkSync, (void *)peer);
 }
 
 
@@ -513,11 +1118,8 @@ peergroup_download_filtered_blocks(struct peer *peer)
    uint256 walletHash;
    uint256 lastHashStore;
    uint256 startHash;
-   uint256 *nextHash;
    uint64 birth;
    bool first;
-   int res = 0;
-   int n;
 
    if (btc->state != BITC_STATE_UPDATE_HEADERS &&
        btc->state != BITC_STATE_UPDATE_TXDB) {
@@ -526,6 +1128,11 @@ peergroup_download_filtered_blocks(struct peer *peer)
    ASSERT(btc->state == BITC_STATE_UPDATE_HEADERS ||
           btc->state == BITC_STATE_UPDATE_TXDB);
 
+   if (btc->peerGroup->blkSync) {
+      blksync_add_peer(btc->peerGroup->blkSync, peer);
+      return 0;
+   }
+
    first = btc->state == BITC_STATE_UPDATE_HEADERS;
 
    if (first && btc->peerGroup->numHdrToFetch > 0) {
@@ -550,7 +1157,15 @@ peergroup_download_filtered_blocks(struct peer *peer)
     */
    birth = wallet_get_birth(btc->wallet);
    blockstore_get_hash_from_birth(bs, birth, &walletHash);
-   peergroup_get_lastblk(btc->peerGroup, &lastHashStore);
+
+   /*
+    * The txdb records its last block along with the transactions: it is
+    * more reliable than the config file, only written on exit.
+    */
+   if (!wallet_get_lastblk(btc->wallet, &lastHashStore) ||
+       !blockstore_is_block_known(bs, &lastHashStore)) {
+      peergroup_get_lastblk(btc->peerGroup, &lastHashStore);
+   }
 
    /*
     * Get the youngest of the two.
@@ -570,21 +1185,13 @@ peergroup_download_filtered_blocks(struct peer *peer)
    Log(LGPFX" downloading %d filtered block%s..\n",
        btc->peerGroup->numToFetch,
        btc->peerGroup->numToFetch > 1 ? "s" : "");
-   blockstore_get_next_hashes(bs, &startHash, &nextHash, &n);
 
    peergroup_download_progress();
 
-   if (n >= 1) {
-      btc->peerGroup->lastFilteredBlockReq = nextHash[n - 1];
-
-      res = peer_send_getdata(peer, INV_TYPE_MSG_FILTERED_BLOCK,
-                              nextHash, n);
-      ASSERT(res == 0);
-   } else {
+   if (!peergroup_blksync_start(btc->peerGroup, &startHash)) {
       peergroup_download_complete();
    }
-   free(nextHash);
-   return res;
+   return 0;
 }
 
 
@@ -593,40 +1200,39 @@ peergroup_download_filtered_blocks(struct peer *peer)
  *
  * peergroup_download_filtered_blocks_continue --
  *
+ *      Once the download manager is done: more blocks may have shown up
+ *      in the meantime.
+ *
  *------------------------------------------------------------------------
  */
 
-int
+static int
 peergroup_download_filtered_blocks_continue(struct peer *peer)
 {
    uint256 best_hash;
    uint256 lastTxdb;
-   int res = 0;
 
    ASSERT(btc->state == BITC_STATE_UPDATE_TXDB);
 
+   if (btc->peerGroup->blkSync == NULL ||
+       !blksync_is_complete(btc->peerGroup->blkSync)) {
+      return 0;
+   }
+   peergroup_blksync_stop(btc->peerGroup);
+
    peergroup_download_progress();
    blockstore_get_best_hash(btc->blockStore, &best_hash);
    peergroup_get_lastblk(btc->peerGroup, &lastTxdb);
 
    if (uint256_issame(&lastTxdb, &best_hash)) {
       peergroup_download_complete();
-   } else if (uint256_issame(&lastTxdb, &btc->peerGroup->lastFilteredBlockReq)) {
-      uint256 *nextHash;
-      int n;
-
-      blockstore_get_next_hashes(btc->blockStore, &lastTxdb, &nextHash, &n);
-
-      Log(LGPFX" %s: querying %d blocks: %u processed out of %d\n",
-          peer_name(peer), n, btc->peerGroup->numFetched, btc->peerGroup->numToFetch);
+      return 0;
+   }
 
-      ASSERT(n > 0);
-      btc->peerGroup->lastFilteredBlockReq = nextHash[n - 1];
+   Log(LGPFX" %s: %u processed out of %d, fetching the rest.\n",
+       peer_name(peer), btc->peerGroup->numFetched, btc->peerGroup->numToFetch);
 
-      res = peer_send_getdata(peer, INV_TYPE_MSG_FILTERED_BLOCK, nextHash, n);
-      free(nextHash);
-   }
-   return res;
+   return peergroup_download_filtered_blocks(peer);
 }
 
 
@@ -759,22 +1365,10 @@ peergroup_refill(bool init)
       struct peer_addr *paddr;
 
       numTried++;
-      paddr = addrbook_get_rand_addr(btc->book);
+      paddr = addrbook_select_peer(btc->book);
       if (paddr == NULL) {
-         NOT_TESTED();
-         return;
-      }
-
-      if (paddr->triedalready) {
-         continue;
-      }
-      if ((paddr->addr.services & BTC_SERVICE_NODE_NETWORK) == 0) {
-         continue;
-      }
-
-      if (paddr->connected) {
          /* we may have better luck next time */
-         continue;
+         break;
       }
       peergroup_add_peer(paddr);
    }
@@ -838,6 +1432,7 @@ peergroup_periodic_cb(void *clientData)
    }
    peergroup_refill(FALSE);
    peergroup_check_liveness();
+   peergroup_inflight_expire(btc->peerGroup);
 }
 
 
@@ -869,7 +1464,8 @@ peergroup_init(struct config *config,
    pg->minActiveInit = minPeersInit;
 
    memset(pg->lastBlk.data, 0, sizeof(uint256));
-   pg->hash_broadcast = hashtable_create();
+   pg->hash_broadcast = hashtable_create_fixed(sizeof(uint256));
+   pg->hash_inflight  = hashtable_create_fixed(sizeof(uint256));
 
    hashStr = config_getstring(config, NULL, "peergroup.lastblk");
    if (hashStr) {
@@ -1076,8 +1672,12 @@ peergroup_exit(struct peergroup *pg)
 
    hashtable_clear_with_callback(pg->hash_broadcast, peergroup_free_tx_broadcast_cb);
    hashtable_destroy(pg->hash_broadcast);
+   peergroup_hdrsync_stop(pg);
+   peergroup_blksync_stop(pg);
    peergroup_print_stats(pg);
    peergroup_destroy_peers();
+   hashtable_clear_with_free(pg->hash_inflight);
+   hashtable_destroy(pg->hash_inflight);
    free(btc->peerGroup);
    btc->peerGroup = NULL;
 }
@@ -1136,52 +1736,39 @@ peergroup_handle_handshake_ok(struct peer *peer,
 
 int
 peergroup_handle_headers(struct peer            *peer,
-                         int                     peerStartingHeight,
                          const btc_block_header *headers,
                          int                     n)
 {
-   struct blockstore *bs = btc->blockStore;
-   int numOrphans = 0;
-   int height;
-   int i;
-
-   for (i = 0; i < n; i++) {
-      const btc_block_header *hdr = headers + i;
-      char hashStr[80];
-      uint256 hash;
-      bool orphan;
-      bool s;
-
-      hash256_calc(hdr, sizeof *hdr, &hash);
-      uint256_snprintf_reverse(hashStr, sizeof hashStr, &hash);
+   struct peergroup *pg = btc->peerGroup;
+   int res;
 
-      s = blockstore_add_header(bs, hdr, &hash, &orphan);
-      if (orphan) {
-         numOrphans++;
-#ifdef WITHUI
-         bitcui_set_status("Block %s orphaned (count = %d)", hashStr, numOrphans);
-#endif
-      }
-      if (s) {
-         btc->peerGroup->numHdrFetched++;
-         if (btc->peerGroup->numHdrFetched % 100000 == 0) {
-            Warning(LGPFX" fetched %6d headers out of %d\n",
-                    btc->peerGroup->numHdrFetched, btc->peerGroup->numHdrToFetch);
-         }
-         peergroup_add_block_finalize(bs, TRUE /* header ony */);
+   if (pg->hdrSync == NULL) {
+      /*
+       * Unsolicited, or a late answer once the headers are synchronized.
+       */
+      uint256 *hashes = safe_malloc(MAX(n, 1) * sizeof *hashes);
+      int numValid;
+
+      numValid = hdrsync_hash_headers(btc->pw, headers, hashes, n);
+      if (numValid < n) {
+         Log(LGPFX" %s: header #%d fails proof-of-work.\n",
+             peer_name(peer), numValid);
       }
+      peergroup_add_headers(headers, hashes, numValid);
+      free(hashes);
+      return 0;
    }
 
-   peergroup_download_progress();
-   height = blockstore_get_height(bs);
+   ASSERT(btc->state == BITC_STATE_UPDATE_HEADERS);
 
-   if (height < peerStartingHeight) {
-      ASSERT(btc->state == BITC_STATE_UPDATE_HEADERS);
-      return peer_send_getheaders(peer);
-   } else if (height >= btc->peerGroup->heightTarget) {
-      return peergroup_download_filtered_blocks(peer);
+   res = hdrsync_handle_headers(pg->hdrSync, peer, headers, n);
+   if (res || !hdrsync_is_complete(pg->hdrSync)) {
+      return res;
    }
-   return 0;
+
+   peergroup_hdrsync_stop(pg);
+
+   return peergroup_download_filtered_blocks(peer);
 }
 
 
@@ -1195,14 +1782,14 @@ peergroup_handle_headers(struct peer            *peer,
 
 static int
 peergroup_broadcast_inv(struct peergroup *pg,
-                        struct buff *bufInv)
+                        struct buff_shared *msgInv)
 {
    struct circlist_item *next;
    struct circlist_item *li;
    int res = 0;
 
    CIRCLIST_SCAN_SAFE(li, next, pg->peer_list) {
-      res = peer_send_inv(li, bufInv);
+      res = peer_send_inv(li, msgInv);
       if (res) {
          Warning(LGPFX" %s: failed to send inv: %s (%d)\n",
                  peer_name_li(li), strerror(res), res);
@@ -1227,16 +1814,18 @@ peergroup_add_tx_broadcast_hash(struct peergroup  *pg,
                                 const uint256     *hash)
 {
    struct tx_broadcast *txb;
+   struct buff *msg;
    bool s;
 
+   btcmsg_craft_tx(buf, &msg);
+
    txb = safe_malloc(sizeof *txb);
-   txb->buf    = buff_dup(buf);
+   txb->msg    = buff_shared_from_buff(msg);
    txb->expiry = expiry;
 
    s = hashtable_insert(pg->hash_broadcast, hash, sizeof *hash, txb);
    if (s == 0) {
-      buff_free(txb->buf);
-      free(txb);
+      peergroup_free_tx_broadcast_entry(txb);
    }
 }
 
@@ -1253,14 +1842,19 @@ static int
 peergroup_tx_broadcast(struct peergroup *pg,
                        const uint256 *hash)
 {
+   struct buff_shared *msgInv;
    struct buff *bufInv;
    int res;
 
    res = btcmsg_craft_inv(&bufInv, INV_TYPE_MSG_TX, hash, 1);
    ASSERT(res == 0);
 
-   res = peergroup_broadcast_inv(pg, bufInv);
-   buff_free(bufInv);
+   /*
+    * Serialized once, sent to every peer from the same buffer.
+    */
+   msgInv = buff_shared_from_buff(bufInv);
+   res = peergroup_broadcast_inv(pg, msgInv);
+   buff_shared_unref(msgInv);
 
    return res;
 }
@@ -1342,11 +1936,30 @@ int
 peergroup_handle_merkleblock(struct peer *peer,
                              const btc_msg_merkleblock *blk)
 {
+   struct peergroup *pg = btc->peerGroup;
+   bool s = 0;
+
    ASSERT(btc->state == BITC_STATE_READY ||
           btc->state == BITC_STATE_UPDATE_TXDB);
 
-   peergroup_process_filtered_block(peer, blk);
-   wallet_confirm_tx_in_block(btc->wallet, blk);
+   if (pg->blkSync) {
+      s = blksync_handle_merkleblock(pg->blkSync, peer, blk);
+   }
+   if (s == 0) {
+      uint256 lastTxdb;
+      int res;
+
+      /*
+       * The transactions of this block are still to come, while those of
+       * the previous one are in: that's the one recorded in the txdb.
+       */
+      peergroup_get_lastblk(pg, &lastTxdb);
+      wallet_begin_block(btc->wallet);
+      peergroup_process_filtered_block(blk);
+      wallet_confirm_tx_in_block(btc->wallet, blk);
+      res = wallet_commit_block(btc->wallet, &lastTxdb);
+      ASSERT(res == 0);
+   }
 
    if (btc->state == BITC_STATE_READY) {
       return 0;
@@ -1356,3 +1969,61 @@ peergroup_handle_merkleblock(struct peer *peer,
 
    return peergroup_download_filtered_blocks_continue(peer);
 }
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_handle_tx --
+ *
+ *      'blkHash' is the last merkleblock received from this peer.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+peergroup_handle_tx(struct peer *peer,
+                    const uint256 *blkHash,
+                    const uint256 *txHash,
+                    const uint8 *buf,
+                    size_t len)
+{
+   struct peergroup *pg = btc->peerGroup;
+
+   if (pg->blkSync == NULL ||
+       !blksync_handle_tx(pg->blkSync, peer, txHash, buf, len)) {
+      return wallet_handle_tx(btc->wallet, blkHash, buf, len);
+   }
+
+   ASSERT(btc->state == BITC_STATE_UPDATE_TXDB);
+
+   return peergroup_download_filtered_blocks_continue(peer);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_handle_pong --
+ *
+ *      Returns TRUE if the pong was for the download manager.
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+peergroup_handle_pong(struct peer *peer,
+                      uint64 nonce)
+{
+   struct peergroup *pg = btc->peerGroup;
+
+   if (pg->blkSync == NULL ||
+       !blksync_handle_pong(pg->blkSync, peer, nonce)) {
+      return 0;
+   }
+
+   ASSERT(btc->state == BITC_STATE_UPDATE_TXDB);
+
+   peergroup_download_filtered_blocks_continue(peer);
+   return 1;
+}
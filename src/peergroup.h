@@ -3,6 +3,11 @@
 
 #include "basic_defs.h"
 #include "bitc-defs.h"
+#include "poll.h"
+
+struct blksync;
+struct buff_shared;
+struct hdrsync;
 
 struct peer;
 struct config;
@@ -12,12 +17,17 @@ struct peergroup {
    struct circlist_item *peer_list;
 
    uint32                peerSequence;
-   uint256               lastFilteredBlockReq;
 
    bool                  configNeedWrite;
    uint256               lastBlk;
 
    struct hashtable     *hash_broadcast;
+   struct hashtable     *hash_inflight;
+
+   struct hdrsync       *hdrSync;
+   struct poll_timer     hdrSyncTimer;
+   struct blksync       *blkSync;
+   struct poll_timer     blkSyncTimer;
 
    int                   numFetched;
    int                   numToFetch;
@@ -49,12 +59,27 @@ void peergroup_queue_peerlist(struct circlist_item *li);
 
 int peergroup_handle_handshake_ok(struct peer *peer, int peerStartingHeight);
 int peergroup_handle_merkleblock(struct peer *peer, const btc_msg_merkleblock *blk);
+int peergroup_handle_tx(struct peer *peer, const uint256 *blkHash,
+                        const uint256 *txHash, const uint8 *buf, size_t len);
+bool peergroup_handle_pong(struct peer *peer, uint64 nonce);
+int peergroup_download_filtered_blocks(struct peer *peer);
 void peergroup_handle_addr(struct peer *peer, btc_msg_address **addrs,
                           size_t numAddrs);
 int peergroup_lookup_broadcast_tx(struct peergroup *pg, const uint256 *hash,
-                                  struct buff **bufOut);
+                                  struct buff_shared **msgOut);
 void peergroup_stop_broadcast_tx(struct peergroup *pg, const uint256 *hash);
-int peergroup_handle_headers(struct peer *peer, int peerStartingHeight,
+bool peergroup_inflight_claim(struct peergroup *pg, const struct peer *peer,
+                              const uint256 *hash);
+void peergroup_inflight_done(struct peergroup *pg, const uint256 *hash);
+void peergroup_inflight_notfound(struct peergroup *pg, const struct peer *peer,
+                                 const uint256 *hash);
+void peergroup_inflight_release_peer(struct peergroup *pg,
+                                     const struct peer *peer);
+void peergroup_hdrsync_remove_peer(struct peergroup *pg,
+                                   const struct peer *peer);
+void peergroup_blksync_remove_peer(struct peergroup *pg,
+                                   const struct peer *peer);
+int peergroup_handle_headers(struct peer *peer,
                              const btc_block_header *headers, int n);
 int peergroup_new_tx_broadcast(struct peergroup *pg, const struct buff *buf,
                                mtime_t expiry, const uint256 *hash);
@@ -7,11 +7,16 @@
 #include <sys/poll.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "basic_defs.h"
 #include "util.h"
 #include "circlist.h"
 #include "hashtable.h"
+#include "config.h"
 #include "poll.h"
 
 #define LGPFX   "POLL:"
@@ -25,6 +30,7 @@ struct poll_entry {
    bool                 permanent;
    bool                 queued;
    int                  refCount;
+   uint64               gen;
    enum poll_type       type;
    union {
       struct {
@@ -36,6 +42,8 @@ struct poll_entry {
       struct {
          mtime_t        expiry;
          mtime_t        delay;
+         uint64         seq;
+         uint32         heapIdx;
       } t;
    } u;
 };
@@ -43,8 +51,34 @@ struct poll_entry {
 #define GET_ENTRY(_li) \
       CIRCLIST_CONTAINER((_li), struct poll_entry, item);
 
+#define POLL_HEAP_NONE  ((uint32)-1)
+
+#define POLL_EPOLL_MAX_EVENTS   256
+
+/*
+ * epoll interest of a single fd: at most one entry waits for it to become
+ * readable and one for it to become writeable, possibly the same entry.
+ */
+
+struct poll_fd {
+   struct poll_entry      *rd;
+   struct poll_entry      *wr;
+   uint32                  events;
+};
+
+/*
+ * Time entries live in a binary min-heap ordered by (expiry, seq). The
+ * sequence number keeps entries with the same expiry in FIFO order, as they
+ * were with the sorted list. Each entry records its slot in the heap so that
+ * it can be cancelled without searching for it.
+ */
+
 struct poll_loop {
-   struct circlist_item   *list_time;
+   struct poll_entry     **heap;
+   uint32                  heapLen;
+   uint32                  heapSize;
+   uint64                  timeSeq;
+
    struct circlist_item   *list_device;
    struct circlist_item   *list_free;
 
@@ -57,16 +91,44 @@ struct poll_loop {
    struct pollfd          *poll_fds;
 
    bool                    use_poll;
+
+   /*
+    * With epoll the interest set lives in the kernel and is only updated
+    * when a device callback is added or removed. list_device is still
+    * maintained so that we can fall back to poll(2).
+    */
+   bool                    use_epoll;
+   int                     epoll_fd;
+   int                     epoll_nready;
+   struct epoll_event     *epoll_events;
+   struct poll_fd         *fds;
+   int                     fdsSize;
 };
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_time_before --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static inline bool
+poll_time_before(const struct poll_entry *a,
+                 const struct poll_entry *b)
+{
+   return a->u.t.expiry < b->u.t.expiry ||
+          (a->u.t.expiry == b->u.t.expiry && a->u.t.seq < b->u.t.seq);
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
  * poll_check_time_queue_order --
  *
- *      This assumes that only a single function will register for
- *      notifications on an fd.
+ *      Verifies the heap property and the back-pointers of each entry.
  *
  *-------------------------------------------------------------------------
  */
@@ -74,15 +136,16 @@ struct poll_loop {
 static void
 poll_check_time_queue_order(const struct poll_loop *poll)
 {
-   struct circlist_item *li;
-   mtime_t last = 0;
+   uint32 i;
 
    ASSERT(poll);
 
-   CIRCLIST_SCAN(li, poll->list_time) {
-      struct poll_entry *e = GET_ENTRY(li);
-      ASSERT(last <= e->u.t.expiry);
-      last = e->u.t.expiry;
+   for (i = 0; i < poll->heapLen; i++) {
+      const struct poll_entry *e = poll->heap[i];
+
+      ASSERT(e->type == POLL_CB_TIME);
+      ASSERT(e->u.t.heapIdx == i);
+      ASSERT(i == 0 || !poll_time_before(e, poll->heap[(i - 1) / 2]));
    }
 }
 
@@ -158,7 +221,10 @@ poll_entry_get(struct poll_loop *poll)
    struct circlist_item *li = poll->list_free;
 
    if (circlist_empty(li)) {
-      return safe_malloc(sizeof(struct poll_entry));
+      struct poll_entry *e = safe_malloc(sizeof *e);
+
+      e->gen = 0;
+      return e;
    } else {
       circlist_delete_item(&poll->list_free, li);
       return GET_ENTRY(li);
@@ -182,6 +248,7 @@ poll_entry_put(struct poll_loop *poll,
    ASSERT(e);
 
    e->type = POLL_CB_NONE;
+   e->gen++;
    circlist_queue_item(&poll->list_free, &e->item);
 }
 
@@ -298,6 +365,85 @@ poll_free_entries_on_list(struct poll_loop *poll,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_heap_set --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static inline void
+poll_heap_set(struct poll_loop *poll,
+              uint32 idx,
+              struct poll_entry *e)
+{
+   poll->heap[idx] = e;
+   e->u.t.heapIdx = idx;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_heap_sift_up --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_heap_sift_up(struct poll_loop *poll,
+                  uint32 idx)
+{
+   struct poll_entry *e = poll->heap[idx];
+
+   while (idx > 0) {
+      uint32 parent = (idx - 1) / 2;
+
+      if (!poll_time_before(e, poll->heap[parent])) {
+         break;
+      }
+      poll_heap_set(poll, idx, poll->heap[parent]);
+      idx = parent;
+   }
+   poll_heap_set(poll, idx, e);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_heap_sift_down --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_heap_sift_down(struct poll_loop *poll,
+                    uint32 idx)
+{
+   struct poll_entry *e = poll->heap[idx];
+
+   while (1) {
+      uint32 child = 2 * idx + 1;
+
+      if (child >= poll->heapLen) {
+         break;
+      }
+      if (child + 1 < poll->heapLen &&
+          poll_time_before(poll->heap[child + 1], poll->heap[child])) {
+         child++;
+      }
+      if (!poll_time_before(poll->heap[child], e)) {
+         break;
+      }
+      poll_heap_set(poll, idx, poll->heap[child]);
+      idx = child;
+   }
+   poll_heap_set(poll, idx, e);
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -314,44 +460,64 @@ poll_insert_time(struct poll_loop *poll,
    ASSERT(poll && entry);
    ASSERT(entry->type == POLL_CB_TIME);
    ASSERT(entry->refCount > 0);
+   ASSERT(entry->u.t.heapIdx == POLL_HEAP_NONE);
 
    entry->queued = 1;
 
-   if (circlist_empty(poll->list_time)) {
-      circlist_queue_item(&poll->list_time, &entry->item);
-   } else {
-      struct circlist_item *li;
-      struct poll_entry *e;
-      bool done = 0;
-
-      e = GET_ENTRY(poll->list_time);
-      if (entry->u.t.expiry < e->u.t.expiry) {
-         circlist_push_item(&poll->list_time, &entry->item);
-      } else {
-         CIRCLIST_SCAN(li, poll->list_time) {
-            e = GET_ENTRY(li);
-
-            if (entry->u.t.expiry < e->u.t.expiry) {
-               circlist_queue_item(&li, &entry->item);
-               done = 1;
-               break;
-            }
-         }
-         if (done == 0) {
-            circlist_queue_item(&poll->list_time, &entry->item);
-         }
-      }
+   if (poll->heapLen == poll->heapSize) {
+      poll->heapSize = MAX(64, 2 * poll->heapSize);
+      poll->heap = safe_realloc(poll->heap,
+                                poll->heapSize * sizeof *poll->heap);
    }
+   entry->u.t.seq = poll->timeSeq++;
+   poll_heap_set(poll, poll->heapLen, entry);
+   poll->heapLen++;
+   poll_heap_sift_up(poll, entry->u.t.heapIdx);
+
    /*
     * Check the order of the time queue once in a while.
     */
    count++;
-   if ((count % 32) == 0) {
+   if ((count % 1024) == 0) {
       poll_check_time_queue_order(poll);
    }
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_remove_time --
+ *
+ *      Takes an entry out of the heap: the last entry is moved into its
+ *      slot and then sifted whichever way restores the heap order.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_remove_time(struct poll_loop *poll,
+                 struct poll_entry *e)
+{
+   uint32 idx = e->u.t.heapIdx;
+
+   ASSERT(e->type == POLL_CB_TIME);
+   ASSERT(idx < poll->heapLen);
+   ASSERT(poll->heap[idx] == e);
+
+   poll->heapLen--;
+   if (idx != poll->heapLen) {
+      struct poll_entry *last = poll->heap[poll->heapLen];
+
+      poll_heap_set(poll, idx, last);
+      poll_heap_sift_up(poll, idx);
+      poll_heap_sift_down(poll, last->u.t.heapIdx);
+   }
+   poll->heap[poll->heapLen] = NULL;
+   e->u.t.heapIdx = POLL_HEAP_NONE;
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -375,18 +541,221 @@ poll_get_max_fds(void)
 }
 
 
+#ifdef __linux__
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_epoll_init --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_epoll_init(struct poll_loop *poll)
+{
+   poll->fds          = NULL;
+   poll->fdsSize      = 0;
+   poll->epoll_nready = 0;
+   poll->epoll_fd     = epoll_create1(EPOLL_CLOEXEC);
+   poll->use_epoll    = poll->epoll_fd >= 0;
+
+   if (poll->epoll_fd < 0) {
+      Warning(LGPFX" epoll_create1 failed: %s\n", strerror(errno));
+      poll->epoll_events = NULL;
+      return;
+   }
+   poll->epoll_events = safe_malloc(POLL_EPOLL_MAX_EVENTS *
+                                    sizeof *poll->epoll_events);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_epoll_disable --
+ *
+ *      Drops the epoll instance. The device list is still complete so the
+ *      loop simply carries on with poll(2) or select(2).
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_epoll_disable(struct poll_loop *poll)
+{
+   if (poll->epoll_fd >= 0) {
+      close(poll->epoll_fd);
+   }
+   free(poll->epoll_events);
+   free(poll->fds);
+   poll->epoll_events = NULL;
+   poll->fds          = NULL;
+   poll->fdsSize      = 0;
+   poll->epoll_nready = 0;
+   poll->epoll_fd     = -1;
+   poll->use_epoll    = 0;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_epoll_ctl --
+ *
+ *      Brings the kernel interest set of 'fd' in line with its entries.
+ *      Returns 0 on success or the errno of the failed epoll_ctl: the caller
+ *      is then expected to stop using epoll.
+ *
+ *      A closed fd silently leaves the epoll set and its number may then be
+ *      reused: hence the ENOENT/EEXIST retries.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+poll_epoll_ctl(struct poll_loop *poll,
+               int fd)
+{
+   struct poll_fd *pfd = poll->fds + fd;
+   struct epoll_event ev;
+   uint32 events;
+   int res;
+   int op;
+
+   events = (pfd->rd ? EPOLLIN : 0) | (pfd->wr ? EPOLLOUT : 0);
+   if (events == pfd->events) {
+      return 0;
+   }
+
+   memset(&ev, 0, sizeof ev);
+   ev.events  = events;
+   ev.data.fd = fd;
+
+   if (events == 0) {
+      res = epoll_ctl(poll->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+      if (res == -1 && errno != ENOENT && errno != EBADF) {
+         Warning(LGPFX" epoll_ctl(DEL, fd=%d) failed: %s\n",
+                 fd, strerror(errno));
+      }
+      pfd->events = 0;
+      return 0;
+   }
+
+   op = pfd->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+   res = epoll_ctl(poll->epoll_fd, op, fd, &ev);
+   if (res == -1 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+      res = epoll_ctl(poll->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+   } else if (res == -1 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+      res = epoll_ctl(poll->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+   }
+   if (res == -1) {
+      int err = errno;
+
+      if (err == EPERM) {
+         Log(LGPFX" fd=%d does not support epoll\n", fd);
+      } else {
+         Warning(LGPFX" epoll_ctl(fd=%d, events=%#x) failed: %s\n",
+                 fd, events, strerror(err));
+      }
+      return err;
+   }
+   pfd->events = events;
+
+   return 0;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_epoll_set_interest --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+poll_epoll_set_interest(struct poll_loop *poll,
+                        struct poll_entry *e,
+                        bool add)
+{
+   struct poll_fd *pfd;
+   int fd = e->u.d.fd;
+
+   ASSERT(e->type == POLL_CB_DEVICE);
+   ASSERT(fd >= 0);
+
+   if (fd >= poll->fdsSize) {
+      int size = MAX(64, poll->fdsSize);
+
+      while (size <= fd) {
+         size *= 2;
+      }
+      poll->fds = safe_realloc(poll->fds, size * sizeof *poll->fds);
+      memset(poll->fds + poll->fdsSize, 0,
+             (size - poll->fdsSize) * sizeof *poll->fds);
+      poll->fdsSize = size;
+   }
+   pfd = poll->fds + fd;
+
+   if (e->u.d.readable) {
+      ASSERT(pfd->rd == (add ? NULL : e));
+      pfd->rd = add ? e : NULL;
+   }
+   if (e->u.d.writeable) {
+      ASSERT(pfd->wr == (add ? NULL : e));
+      pfd->wr = add ? e : NULL;
+   }
+   return poll_epoll_ctl(poll, fd);
+}
+
+#else /* !__linux__ */
+
+static void
+poll_epoll_init(struct poll_loop *poll)
+{
+   poll->fds          = NULL;
+   poll->fdsSize      = 0;
+   poll->epoll_nready = 0;
+   poll->epoll_events = NULL;
+   poll->epoll_fd     = -1;
+   poll->use_epoll    = 0;
+}
+
+static void
+poll_epoll_disable(struct poll_loop *poll)
+{
+   ASSERT(poll->use_epoll == 0);
+}
+
+static int
+poll_epoll_set_interest(struct poll_loop *poll,
+                        struct poll_entry *e,
+                        bool add)
+{
+   NOT_REACHED();
+   return 0;
+}
+
+#endif /* __linux__ */
+
+
 /*
  *-------------------------------------------------------------------------
  *
  * poll_create --
  *
+ *      'poll.backend' selects the mechanism: "epoll" (default on linux),
+ *      "poll" or "select". 'config' may be NULL.
+ *
  *-------------------------------------------------------------------------
  */
 
 struct poll_loop *
-poll_create(void)
+poll_create(struct config *config)
 {
    struct poll_loop *poll;
+   char *backend;
 
    poll = safe_malloc(sizeof *poll);
 
@@ -395,9 +764,20 @@ poll_create(void)
 
    poll->list_free       = NULL;
    poll->list_device     = NULL;
-   poll->list_time       = NULL;
+   poll->heap            = NULL;
+   poll->heapLen         = 0;
+   poll->heapSize        = 0;
+   poll->timeSeq         = 0;
    poll->use_poll        = 1;
 
+   backend = config ? config_getstring(config, "epoll", "poll.backend")
+                    : safe_strdup("epoll");
+   if (strcmp(backend, "select") == 0) {
+      poll->use_poll = 0;
+   } else if (strcmp(backend, "poll") != 0 && strcmp(backend, "epoll") != 0) {
+      Warning(LGPFX" unknown poll.backend '%s'\n", backend);
+   }
+
 #ifdef __APPLE__
    poll->use_poll     = 1; // XXX
 #endif
@@ -410,6 +790,13 @@ poll_create(void)
    if (poll->use_poll) {
       poll->poll_fds = safe_malloc(poll->poll_max_fds * sizeof(struct pollfd));
    }
+   poll_epoll_init(poll);
+   if (poll->use_epoll && strcmp(backend, "epoll") != 0) {
+      poll_epoll_disable(poll);
+   }
+   free(backend);
+   Log(LGPFX" using %s\n",
+       poll->use_epoll ? "epoll" : poll->use_poll ? "poll" : "select");
 
    return poll;
 }
@@ -427,15 +814,17 @@ void
 poll_destroy(struct poll_loop *poll)
 {
    ASSERT(poll->list_device == NULL);
-   ASSERT(poll->list_time == NULL);
+   ASSERT(poll->heapLen == 0);
 
    poll_free_entries_on_list(poll, &poll->list_free);
    poll_free_entries_on_list(poll, &poll->list_device);
-   poll_free_entries_on_list(poll, &poll->list_time);
+   free(poll->heap);
 
    hashtable_destroy(poll->hash);
    poll->hash = NULL;
 
+   poll_epoll_disable(poll);
+
    free(poll->poll_fds);
 
    FD_ZERO(&poll->fds_rd);
@@ -605,15 +994,12 @@ poll_device_select(struct poll_loop *poll,
 static mtime_t
 poll_get_next_expiry(const struct poll_loop *poll)
 {
-   struct poll_entry *e;
-
    ASSERT(poll);
 
-   if (circlist_empty(poll->list_time)) {
+   if (poll->heapLen == 0) {
       return 0;
    }
-   e = GET_ENTRY(poll->list_time);
-   return e->u.t.expiry;
+   return poll->heap[0]->u.t.expiry;
 }
 
 
@@ -676,50 +1062,48 @@ poll_entry_active(const struct poll_loop *poll,
 /*
  *-------------------------------------------------------------------------
  *
- * poll_run_device_queue --
+ * poll_device_dequeue --
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-poll_run_device_queue(struct poll_loop *poll)
+poll_device_dequeue(struct poll_loop *poll,
+                    struct poll_entry *e)
 {
-   struct poll_entry *queue[poll->poll_max_fds * 2];
-   struct circlist_item *li;
-   int n = 0;
-   int i;
-
-   /*
-    * Calling a callback may modify the state of the poll entries and the
-    * linked-list itself. We thus need to linearize the list before calling
-    * each entry and take a reference on each entry.
-    */
-
-   CIRCLIST_SCAN(li, poll->list_device) {
-      struct poll_entry *e = GET_ENTRY(li);
-
-      ASSERT(e->type == POLL_CB_DEVICE);
-
-      if (poll_entry_active(poll, e)) {
-         queue[n++] = e;
-         poll_entry_ref(e);
-      }
+   poll_entry_remove_from_hashtable(poll, e);
+   poll_entry_dequeue(&poll->list_device, e);
+   if (poll->use_epoll && poll_epoll_set_interest(poll, e, 0 /* remove */)) {
+      poll_epoll_disable(poll);
    }
+}
 
 
-   /*
-    * For each entry that had activity on their respective fd, we need to call
-    * the associated callback but also dequeue it if it was not a periodic
-    * entry.
-    */
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_fire_device_queue --
+ *
+ *      For each entry that had activity on their respective fd, we need to
+ *      call the associated callback but also dequeue it if it was not a
+ *      periodic entry. Each entry of 'queue' holds a reference.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_fire_device_queue(struct poll_loop *poll,
+                       struct poll_entry **queue,
+                       int n)
+{
+   int i;
 
    for (i = 0; i < n; i++) {
       struct poll_entry *e = queue[i];
 
       if (e->queued) {
          if (e->permanent == 0) {
-            poll_entry_remove_from_hashtable(poll, e);
-            poll_entry_dequeue(&poll->list_device, e);
+            poll_device_dequeue(poll, e);
             poll_entry_unref(poll, &e);
             ASSERT(e);
          }
@@ -733,22 +1117,160 @@ poll_run_device_queue(struct poll_loop *poll)
 /*
  *-------------------------------------------------------------------------
  *
- * poll_get_next_expired --
+ * poll_run_device_queue --
  *
  *-------------------------------------------------------------------------
  */
 
-static struct poll_entry *
-poll_get_next_expired(struct poll_loop *poll,
-                      mtime_t now)
+static void
+poll_run_device_queue(struct poll_loop *poll)
 {
-   struct poll_entry *e;
+   struct poll_entry *queue[poll->poll_max_fds * 2];
+   struct circlist_item *li;
+   int n = 0;
+
+   /*
+    * Calling a callback may modify the state of the poll entries and the
+    * linked-list itself. We thus need to linearize the list before calling
+    * each entry and take a reference on each entry.
+    */
+
+   CIRCLIST_SCAN(li, poll->list_device) {
+      struct poll_entry *e = GET_ENTRY(li);
+
+      ASSERT(e->type == POLL_CB_DEVICE);
+
+      if (poll_entry_active(poll, e)) {
+         queue[n++] = e;
+         poll_entry_ref(e);
+      }
+   }
+
+   poll_fire_device_queue(poll, queue, n);
+}
+
+
+#ifdef __linux__
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_device_epoll --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_device_epoll(struct poll_loop *poll,
+                  mtime_t deadline)
+{
+   int s;
+
+   do {
+      mtime_t now = time_get();
+      int timeoutMsec;
+
+      if (deadline == 0) {
+         timeoutMsec = 1000; // Wake up once per sec
+      } else if (deadline <= now) {
+         timeoutMsec = 0;
+      } else {
+         timeoutMsec = (deadline - now + 999) / 1000;
+      }
+
+      LOG(1, (LGPFX" epoll sleeping for %u msec\n", timeoutMsec));
+      s = epoll_wait(poll->epoll_fd, poll->epoll_events,
+                     POLL_EPOLL_MAX_EVENTS, timeoutMsec);
+   } while (s == -1 && errno == EINTR);
+
+   if (s == -1) {
+      s = errno;
+      Warning(LGPFX" Failed to epoll_wait(2): %s (%d)\n", strerror(s), s);
+      NOT_REACHED();
+   }
+   poll->epoll_nready = s;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_run_epoll_queue --
+ *
+ *      Only looks at the fds reported by epoll_wait(). Errors and hang-ups
+ *      are handed to both the reader and the writer: they are the ones who
+ *      will find out what happened.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_run_epoll_queue(struct poll_loop *poll)
+{
+   struct poll_entry *queue[POLL_EPOLL_MAX_EVENTS * 2];
+   int n = 0;
+   int i;
+
+   for (i = 0; i < poll->epoll_nready; i++) {
+      uint32 events = poll->epoll_events[i].events;
+      int fd = poll->epoll_events[i].data.fd;
+      struct poll_fd *pfd;
+
+      ASSERT(fd < poll->fdsSize);
+      pfd = poll->fds + fd;
+
+      if (pfd->rd && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+         queue[n++] = pfd->rd;
+         poll_entry_ref(pfd->rd);
+      }
+      if (pfd->wr && pfd->wr != pfd->rd &&
+          (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+         queue[n++] = pfd->wr;
+         poll_entry_ref(pfd->wr);
+      }
+   }
+   poll->epoll_nready = 0;
+
+   poll_fire_device_queue(poll, queue, n);
+}
+
+#else /* !__linux__ */
+
+static void
+poll_device_epoll(struct poll_loop *poll,
+                  mtime_t deadline)
+{
+   NOT_REACHED();
+}
+
+static void
+poll_run_epoll_queue(struct poll_loop *poll)
+{
+   NOT_REACHED();
+}
 
-   if (circlist_empty(poll->list_time)) {
+#endif /* __linux__ */
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_get_next_expired --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static struct poll_entry *
+poll_get_next_expired(struct poll_loop *poll,
+                      mtime_t now)
+{
+   struct poll_entry *e;
+
+   if (poll->heapLen == 0) {
       return NULL;
    }
 
-   e = GET_ENTRY(poll->list_time);
+   e = poll->heap[0];
 
    if (e->u.t.expiry <= now) {
       return e;
@@ -797,11 +1319,16 @@ poll_run_time_queue(struct poll_loop *poll)
       }
 
       poll_entry_ref(e);
-      poll_entry_dequeue(&poll->list_time, e);
+      poll_remove_time(poll, e);
       poll_entry_fire(e);
       poll_entry_unref(poll, &e);
-      ASSERT(e->refCount > 0);
 
+      /*
+       * The callback may have cancelled its own entry.
+       */
+      if (e == NULL) {
+         continue;
+      }
       if (e->permanent == 0) {
          poll_entry_unref(poll, &e);
          ASSERT(e == NULL);
@@ -825,7 +1352,9 @@ static void
 poll_dopoll_device(struct poll_loop *poll,
                    mtime_t deadline)
 {
-   if (poll->use_poll) {
+   if (poll->use_epoll) {
+      poll_device_epoll(poll, deadline);
+   } else if (poll->use_poll) {
       poll_device_poll(poll, deadline);
    } else {
       poll_device_select(poll, deadline);
@@ -861,7 +1390,11 @@ poll_runloop(struct poll_loop *poll,
       if (*exitPtr != 0) {
          break;
       }
-      poll_run_device_queue(poll);
+      if (poll->use_epoll) {
+         poll_run_epoll_queue(poll);
+      } else {
+         poll_run_device_queue(poll);
+      }
    } while (*exitPtr == 0);
 }
 
@@ -890,6 +1423,15 @@ poll_insert_device(struct poll_loop *poll,
 
    circlist_queue_item(&poll->list_device, &e->item);
    e->queued = 1;
+
+   /*
+    * The device list is complete regardless: if the kernel refuses the fd,
+    * keep servicing it with poll(2).
+    */
+   if (poll->use_epoll && poll_epoll_set_interest(poll, e, 1 /* add */)) {
+      Log(LGPFX" falling back to poll(2)\n");
+      poll_epoll_disable(poll);
+   }
 }
 
 
@@ -901,13 +1443,14 @@ poll_insert_device(struct poll_loop *poll,
  *-------------------------------------------------------------------------
  */
 
-void
+struct poll_timer
 poll_callback_time(struct poll_loop *poll,
 		   mtime_t delayUsec,
 		   bool permanent,
 		   pollcallback_fun *callback,
 		   void *callbackData)
 {
+   struct poll_timer handle;
    struct poll_entry *e;
 
    ASSERT(poll);
@@ -923,12 +1466,18 @@ poll_callback_time(struct poll_loop *poll,
    e->permanent    = permanent;
    e->refCount     = 0;
    e->u.t.delay      = delayUsec;
+   e->u.t.heapIdx    = POLL_HEAP_NONE;
 
    circlist_init_item(&e->item);
 
    poll_entry_ref(e);
    poll_recalc_expiry(e);
    poll_insert_time(poll, e);
+
+   handle.entry = e;
+   handle.gen   = e->gen;
+
+   return handle;
 }
 
 
@@ -975,6 +1524,36 @@ poll_callback_device(struct poll_loop *poll,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_entry_cancel_time --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static bool
+poll_entry_cancel_time(struct poll_loop *poll,
+                       struct poll_entry *e)
+{
+   ASSERT(e->type == POLL_CB_TIME);
+
+   LOG(1, (LGPFX" %s: cancelling TIME CB fun=%p data=%p.\n",
+       __FUNCTION__, e->callback, e->callbackData));
+
+   if (e->queued == 0) {
+      return 0;
+   }
+   e->queued = 0;
+   if (e->u.t.heapIdx != POLL_HEAP_NONE) {
+      poll_remove_time(poll, e);
+   }
+   poll_entry_unref(poll, &e);
+
+   return 1;
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -989,24 +1568,18 @@ poll_callback_time_remove(struct poll_loop *poll,
                           pollcallback_fun callback,
                           void *callbackData)
 {
-   struct circlist_item **list;
-   struct circlist_item *li;
+   uint32 i;
 
    LOG(1, (LGPFX" %s: unregistering TIME CB fun=%p data=%p.\n",
        __FUNCTION__, callback, callbackData));
 
-   list = &poll->list_time;
-
-   CIRCLIST_SCAN(li, *list) {
-      struct poll_entry *e = GET_ENTRY(li);
+   for (i = 0; i < poll->heapLen; i++) {
+      struct poll_entry *e = poll->heap[i];
 
       if (e->callback     == callback &&
           e->callbackData == callbackData &&
           e->permanent    == permanent) {
-         e->queued = 0;
-         poll_entry_dequeue(&poll->list_time, e);
-         poll_entry_unref(poll, &e);
-         return 1;
+         return poll_entry_cancel_time(poll, e);
       }
    }
 
@@ -1014,6 +1587,37 @@ poll_callback_time_remove(struct poll_loop *poll,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_callback_time_cancel --
+ *
+ *      Cancels a time callback through the handle returned by
+ *      poll_callback_time(). Returns FALSE if the callback already ran, or
+ *      was already cancelled. A callback may cancel itself from within its
+ *      callback.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+bool
+poll_callback_time_cancel(struct poll_loop *poll,
+                          struct poll_timer handle)
+{
+   struct poll_entry *e = handle.entry;
+
+   ASSERT(poll);
+   ASSERT(e);
+
+   if (e->gen != handle.gen) {
+      LOG(1, (LGPFX" %s: stale handle %p gen=%llu/%llu.\n",
+              __FUNCTION__, e, handle.gen, e->gen));
+      return 0;
+   }
+   return poll_entry_cancel_time(poll, e);
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -1057,9 +1661,341 @@ poll_callback_device_remove(struct poll_loop *poll,
 
    e->queued = 0;
 
-   poll_entry_remove_from_hashtable(poll, e);
-   poll_entry_dequeue(&poll->list_device, e);
+   poll_device_dequeue(poll, e);
    poll_entry_unref(poll, &e);
 
    return 1;
 }
+
+
+struct poll_bench {
+   uint32             numFired;
+   uint32             numExpected;
+   mtime_t            maxLate;
+   int                exit;
+};
+
+struct poll_bench_timer {
+   struct poll_bench *bench;
+   struct poll_timer  handle;
+   mtime_t            expiry;
+};
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_bench_cb --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_bench_cb(void *clientData)
+{
+   struct poll_bench_timer *t = clientData;
+   struct poll_bench *b = t->bench;
+
+   b->maxLate = MAX(b->maxLate, time_get() - t->expiry);
+   t->handle.entry = NULL;
+   b->numFired++;
+   if (b->numFired == b->numExpected) {
+      b->exit = 1;
+   }
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_bench_arm --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_bench_arm(struct poll_loop *poll,
+               struct poll_bench_timer *t)
+{
+   mtime_t delay = 20 * 1000 + random() % (200 * 1000);
+
+   t->expiry = time_get() + delay;
+   t->handle = poll_callback_time(poll, delay, 0 /* !permanent */,
+                                  poll_bench_cb, t);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_bench_timers --
+ *
+ *      Arms numTimers one-shot timers, re-arms half of them the way
+ *      netasync does for its connect timeouts, cancels another quarter and
+ *      lets the rest fire.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_bench_timers(uint32 numTimers)
+{
+   struct poll_bench_timer *timers;
+   struct poll_timer stale;
+   struct poll_bench bench;
+   struct poll_loop *poll;
+   uint32 heapLen;
+   bool s;
+   mtime_t tsInsert;
+   mtime_t tsRearm;
+   mtime_t tsCancel;
+   mtime_t ts;
+   char *insertStr;
+   char *rearmStr;
+   char *cancelStr;
+   char *lateStr;
+   uint32 i;
+
+   poll = poll_create(NULL);
+   timers = safe_calloc(numTimers, sizeof *timers);
+
+   bench.numFired    = 0;
+   bench.numExpected = 0;
+   bench.maxLate     = 0;
+   bench.exit        = 0;
+
+   ts = time_get();
+   for (i = 0; i < numTimers; i++) {
+      timers[i].bench = &bench;
+      poll_bench_arm(poll, timers + i);
+   }
+   tsInsert = time_get() - ts;
+
+   ts = time_get();
+   for (i = 1; i < numTimers; i += 2) {
+      s = poll_callback_time_cancel(poll, timers[i].handle);
+      ASSERT(s);
+      poll_bench_arm(poll, timers + i);
+   }
+   tsRearm = time_get() - ts;
+
+   ts = time_get();
+   for (i = 0; i < numTimers; i += 4) {
+      s = poll_callback_time_cancel(poll, timers[i].handle);
+      ASSERT(s);
+      timers[i].handle.entry = NULL;
+   }
+   tsCancel = time_get() - ts;
+
+   /*
+    * A stale handle must not cancel whichever timer now uses its entry.
+    */
+   poll_bench_arm(poll, timers + 0);
+   stale.entry = timers[0].handle.entry;
+   stale.gen   = timers[0].handle.gen - 1;
+   heapLen = poll->heapLen;
+   s = poll_callback_time_cancel(poll, stale);
+   ASSERT(s == 0);
+   ASSERT(poll->heapLen == heapLen);
+
+   poll_check_time_queue_order(poll);
+
+   bench.numExpected = poll->heapLen;
+   poll_runloop(poll, &bench.exit);
+   ASSERT(bench.numFired == bench.numExpected);
+
+   for (i = 0; i < numTimers; i++) {
+      ASSERT(timers[i].handle.entry == NULL);
+   }
+
+   insertStr = print_latency(tsInsert);
+   rearmStr  = print_latency(tsRearm);
+   cancelStr = print_latency(tsCancel);
+   lateStr   = print_latency(bench.maxLate);
+
+   Warning(LGPFX" %u timers: insert %s, cancel+rearm %u: %s, cancel %u: %s\n",
+           numTimers, insertStr, numTimers / 2, rearmStr,
+           (numTimers + 3) / 4, cancelStr);
+   Warning(LGPFX" %u timers fired, max lateness %s\n",
+           bench.numFired, lateStr);
+
+   free(insertStr);
+   free(rearmStr);
+   free(cancelStr);
+   free(lateStr);
+   free(timers);
+   poll_destroy(poll);
+}
+
+
+struct poll_bench_dev {
+   int                fd[2];
+   uint32             count;
+   uint32             target;
+   int                exit;
+};
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_bench_idle_cb --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_bench_idle_cb(void *clientData)
+{
+   NOT_REACHED();
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_bench_busy_cb --
+ *
+ *      Consumes the byte that made the socket readable and sends another
+ *      one, so that exactly one fd is ready on each pass of the loop.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_bench_busy_cb(void *clientData)
+{
+   struct poll_bench_dev *dev = clientData;
+   ssize_t res;
+   uint8 c;
+
+   res = read(dev->fd[0], &c, 1);
+   ASSERT(res == 1);
+
+   dev->count++;
+   if (dev->count == dev->target) {
+      dev->exit = 1;
+      return;
+   }
+   res = write(dev->fd[1], &c, 1);
+   ASSERT(res == 1);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_bench_devices --
+ *
+ *      Cost of a loop wakeup with numIdle sockets registered for reading
+ *      that never become ready, and a single busy one.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static mtime_t
+poll_bench_devices(uint32 numIdle,
+                   uint32 numWakeups,
+                   bool useEpoll)
+{
+   struct poll_bench_dev busy;
+   struct poll_loop *poll;
+   int (*idle)[2];
+   mtime_t ts;
+   uint32 i;
+   uint8 c = 0;
+   int res;
+
+   poll = poll_create(NULL);
+   if (!useEpoll) {
+      poll_epoll_disable(poll);
+   }
+
+   idle = safe_calloc(numIdle, sizeof *idle);
+   for (i = 0; i < numIdle; i++) {
+      res = socketpair(AF_UNIX, SOCK_STREAM, 0, idle[i]);
+      ASSERT(res == 0);
+      poll_callback_device(poll, idle[i][0], 1, 0, 1 /* permanent */,
+                           poll_bench_idle_cb, NULL);
+   }
+
+   res = socketpair(AF_UNIX, SOCK_STREAM, 0, busy.fd);
+   ASSERT(res == 0);
+   busy.count  = 0;
+   busy.target = numWakeups;
+   busy.exit   = 0;
+   poll_callback_device(poll, busy.fd[0], 1, 0, 1 /* permanent */,
+                        poll_bench_busy_cb, &busy);
+
+   ts = time_get();
+   res = write(busy.fd[1], &c, 1);
+   ASSERT(res == 1);
+   poll_runloop(poll, &busy.exit);
+   ts = time_get() - ts;
+
+   ASSERT(busy.count == numWakeups);
+
+   poll_callback_device_remove(poll, busy.fd[0], 1, 0, 1,
+                               poll_bench_busy_cb, &busy);
+   close(busy.fd[0]);
+   close(busy.fd[1]);
+   for (i = 0; i < numIdle; i++) {
+      poll_callback_device_remove(poll, idle[i][0], 1, 0, 1,
+                                  poll_bench_idle_cb, NULL);
+      close(idle[i][0]);
+      close(idle[i][1]);
+   }
+   free(idle);
+   poll_destroy(poll);
+
+   return ts;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_bench --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+poll_bench(uint32 numTimers,
+           uint32 numIdleFds,
+           volatile int *stop)
+{
+   uint32 numWakeups = 10000;
+   struct rlimit lim;
+   int res;
+
+   if (*stop) {
+      return;
+   }
+   poll_bench_timers(numTimers);
+
+   res = getrlimit(RLIMIT_NOFILE, &lim);
+   ASSERT(res == 0);
+   if (lim.rlim_cur < 2 * numIdleFds + 64) {
+      lim.rlim_cur = MIN(lim.rlim_max, 2 * numIdleFds + 64);
+      setrlimit(RLIMIT_NOFILE, &lim);
+   }
+   numIdleFds = MIN(numIdleFds, (poll_get_max_fds() - 64) / 2);
+
+   if (*stop == 0) {
+      mtime_t tsPoll = poll_bench_devices(numIdleFds, numWakeups, 0);
+
+      Warning(LGPFX" %u idle fds + 1 busy, %u wakeups: poll %.1f "
+              "usec/wakeup\n",
+              numIdleFds, numWakeups, (double)tsPoll / numWakeups);
+   }
+#ifdef __linux__
+   if (*stop == 0) {
+      mtime_t tsEpoll = poll_bench_devices(numIdleFds, numWakeups, 1);
+
+      Warning(LGPFX" %u idle fds + 1 busy, %u wakeups: epoll %.1f "
+              "usec/wakeup\n",
+              numIdleFds, numWakeups, (double)tsEpoll / numWakeups);
+   }
+#endif
+}
@@ -10,9 +10,20 @@ enum poll_type {
 };
 
 struct poll_loop;
+struct config;
+struct poll_entry;
 typedef void (pollcallback_fun)(void *clientdata);
 
-struct poll_loop *poll_create(void);
+/*
+ * Handle on a time callback. Entries are recycled: 'gen' tells whether the
+ * entry is still the one the handle was given for.
+ */
+struct poll_timer {
+   struct poll_entry   *entry;
+   uint64               gen;
+};
+
+struct poll_loop *poll_create(struct config *config);
 void poll_destroy(struct poll_loop *poll);
 void poll_runloop(struct poll_loop *poll, volatile int *exit);
 
@@ -31,11 +42,16 @@ poll_callback_time_remove(struct poll_loop *poll,
                           pollcallback_fun callback,
                           void *callbackData);
 
-void poll_callback_time(struct poll_loop *poll,
-			mtime_t delayUsec,
-			bool periodic,
-			pollcallback_fun func,
-			void *clientData);
+bool
+poll_callback_time_cancel(struct poll_loop *poll,
+                          struct poll_timer handle);
+
+struct poll_timer
+poll_callback_time(struct poll_loop *poll,
+                   mtime_t delayUsec,
+                   bool periodic,
+                   pollcallback_fun func,
+                   void *clientData);
 
 void poll_callback_device(struct poll_loop *poll,
 			  int fd,
@@ -45,4 +61,6 @@ void poll_callback_device(struct poll_loop *poll,
 			  pollcallback_fun func,
 			  void *clientData);
 
+void poll_bench(uint32 numTimers, uint32 numIdleFds, volatile int *stop);
+
 #endif /* __POLL_H__ */
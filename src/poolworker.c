@@ -25,6 +25,26 @@ struct poolworker_job {
 #define GET_JOB(_li) \
    CIRCLIST_CONTAINER(_li, struct poolworker_job, item);
 
+/*
+ * A range split in slices, shared by the caller and the jobs helping it. The
+ * jobs may only get to run once the caller is done: the last one to let go
+ * of it frees it.
+ */
+struct poolworker_slices {
+   poolworker_slice_func *func;
+   void                  *clientData;
+   int                    num;
+   int                    sliceSize;
+   uint32                 numSlices;
+   atomic_uint32          next;
+   atomic_uint32          numDone;
+   atomic_uint32          refCount;
+   pthread_mutex_t        lock;
+   pthread_cond_t         cond;
+};
+
+static void poolworker_slices_cb(void *clientData);
+
 struct poolworker_state {
    atomic_uint32         numRunning;
    atomic_uint32         exit;
@@ -227,6 +247,18 @@ poolworker_destroy(struct poolworker_state *pw)
       }
    }
 
+   /*
+    * Helpers queued by poolworker_run_slices() may not have run yet: their
+    * caller is long done and all they have left to do is let go of it.
+    */
+   while (!circlist_empty(pw->jobs_req)) {
+      struct poolworker_job *job = poolworker_dequeue_job(&pw->jobs_req);
+
+      ASSERT(job->func == poolworker_slices_cb);
+      poolworker_execute_job(job);
+      poolworker_destroy_job(job);
+   }
+
    ASSERT(pw->jobs_active == NULL);
    ASSERT(pw->jobs_req == NULL);
 
@@ -307,3 +339,146 @@ poolworker_queue_work(struct poolworker_state *pw,
    pthread_cond_signal(&pw->cond_req);
 }
 
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * poolworker_get_num_threads --
+ *
+ *---------------------------------------------------------------------
+ */
+
+int
+poolworker_get_num_threads(const struct poolworker_state *pw)
+{
+   return atomic_read(&pw->numRunning);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * poolworker_slices_release --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+poolworker_slices_release(struct poolworker_slices *sl)
+{
+   if (atomic_dec_and_test(&sl->refCount) == 0) {
+      return;
+   }
+   pthread_cond_destroy(&sl->cond);
+   pthread_mutex_destroy(&sl->lock);
+   free(sl);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * poolworker_slices_process --
+ *
+ *      Grabs slices until there are none left.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+poolworker_slices_process(struct poolworker_slices *sl)
+{
+   uint32 i;
+
+   while ((i = atomic_add_return(&sl->next, 1) - 1) < sl->numSlices) {
+      int start = i * sl->sliceSize;
+
+      sl->func(sl->clientData, start, MIN(sl->num, start + sl->sliceSize));
+
+      if (atomic_add_return(&sl->numDone, 1) == sl->numSlices) {
+         pthread_mutex_lock(&sl->lock);
+         pthread_cond_signal(&sl->cond);
+         pthread_mutex_unlock(&sl->lock);
+      }
+   }
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * poolworker_slices_cb --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+poolworker_slices_cb(void *clientData)
+{
+   struct poolworker_slices *sl = clientData;
+
+   poolworker_slices_process(sl);
+   poolworker_slices_release(sl);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * poolworker_run_slices --
+ *
+ *      Calls 'func' on [0, num) split in slices of 'sliceSize', with up to
+ *      'numHelpers' jobs of the pool working along with the caller. Returns
+ *      once every slice is done. The caller processes slices too, so this
+ *      does not wait behind whatever else the pool is busy with.
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+poolworker_run_slices(struct poolworker_state *pw,
+                      int numHelpers,
+                      int num,
+                      int sliceSize,
+                      poolworker_slice_func *func,
+                      void *clientData)
+{
+   struct poolworker_slices *sl;
+   int i;
+
+   ASSERT(sliceSize > 0);
+
+   if (num <= 0) {
+      return;
+   }
+
+   sl = safe_calloc(1, sizeof *sl);
+   sl->func       = func;
+   sl->clientData = clientData;
+   sl->num        = num;
+   sl->sliceSize  = sliceSize;
+   sl->numSlices  = (num + sliceSize - 1) / sliceSize;
+
+   numHelpers = pw ? MIN(numHelpers, (int)sl->numSlices - 1) : 0;
+   numHelpers = MAX(numHelpers, 0);
+
+   atomic_write(&sl->next, 0);
+   atomic_write(&sl->numDone, 0);
+   atomic_write(&sl->refCount, 1 + numHelpers);
+   pthread_mutex_init(&sl->lock, NULL);
+   pthread_cond_init(&sl->cond, NULL);
+
+   for (i = 0; i < numHelpers; i++) {
+      poolworker_queue_work(pw, poolworker_slices_cb, sl);
+   }
+
+   poolworker_slices_process(sl);
+
+   pthread_mutex_lock(&sl->lock);
+   while (atomic_read(&sl->numDone) != sl->numSlices) {
+      pthread_cond_wait(&sl->cond, &sl->lock);
+   }
+   pthread_mutex_unlock(&sl->lock);
+
+   poolworker_slices_release(sl);
+}
@@ -4,6 +4,7 @@
 struct poolworker_state;
 
 typedef void (poolworker_func)(void *clientData);
+typedef void (poolworker_slice_func)(void *clientData, int start, int end);
 
 struct poolworker_state * poolworker_create(int numThreads);
 void poolworker_destroy(struct poolworker_state *pw);
@@ -12,5 +13,9 @@ void poolworker_wait_for_one_cmp(struct poolworker_state *pw);
 
 void poolworker_queue_work(struct poolworker_state *pw,
                            poolworker_func *func, void *clientData);
+int  poolworker_get_num_threads(const struct poolworker_state *pw);
+void poolworker_run_slices(struct poolworker_state *pw, int numHelpers,
+                           int num, int sliceSize,
+                           poolworker_slice_func *func, void *clientData);
 
 #endif /* __POOLWORKER_H__ */
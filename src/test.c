@@ -12,9 +12,15 @@
 #include "bitc.h"
 #include "serialize.h"
 #include "block-store.h"
+#include "addrbook.h"
+#include "poll.h"
+#include "netasync.h"
 #include "crypt.h"
 #include "hashtable.h"
 #include "poolworker.h"
+#include "hdrsync.h"
+#include "blksync.h"
+#include "txdb.h"
 #include "test.h"
 
 #define LGPFX "TEST:"
@@ -206,6 +212,111 @@ bitc_hashtable_test(void)
 }
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_blockstore_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_blockstore_test(void)
+{
+   blockstore_bench(200000, &btc->stop);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_addrbook_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_addrbook_test(void)
+{
+   addrbook_bench(&btc->stop);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_poll_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_poll_test(void)
+{
+   poll_bench(10000, 1000, &btc->stop);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_netasync_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_netasync_test(void)
+{
+   netasync_bench(100000, &btc->stop);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_hdrsync_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_hdrsync_test(void)
+{
+   hdrsync_bench(200000, &btc->stop);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_blksync_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_blksync_test(void)
+{
+   blksync_bench(100000, &btc->stop);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_txdb_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_txdb_test(void)
+{
+   txdb_bench(50000, &btc->stop);
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -217,6 +328,13 @@ bitc_hashtable_test(void)
 int
 bitc_test(const char *str)
 {
+   bool bstore;
+   bool timer;
+   bool anet;
+   bool hsync;
+   bool bsync;
+   bool tdb;
+   bool addr;
    bool pool;
    bool crypt;
    bool hash;
@@ -228,12 +346,28 @@ bitc_test(const char *str)
    tx    = str && strcmp(str, "tx") == 0;
    crypt = str && strcmp(str, "crypt") == 0;
    pool  = str && strcmp(str, "pool") == 0;
-
-   if (crypt == 0 && tx == 0 && hash == 0 && pool == 0) {
+   bstore = str && strcmp(str, "blockstore") == 0;
+   addr  = str && strcmp(str, "addrbook") == 0;
+   timer = str && strcmp(str, "poll") == 0;
+   anet  = str && strcmp(str, "netasync") == 0;
+   hsync = str && strcmp(str, "hdrsync") == 0;
+   bsync = str && strcmp(str, "blksync") == 0;
+   tdb   = str && strcmp(str, "txdb") == 0;
+
+   if (crypt == 0 && tx == 0 && hash == 0 && pool == 0 && bstore == 0 &&
+       addr == 0 && timer == 0 && anet == 0 && hsync == 0 && bsync == 0 &&
+       tdb == 0) {
       crypt = 1;
       tx = 1;
       pool = 1;
       hash = 1;
+      bstore = 1;
+      addr = 1;
+      timer = 1;
+      anet = 1;
+      hsync = 1;
+      bsync = 1;
+      tdb = 1;
    }
 
    if (hash) {
@@ -248,6 +382,27 @@ bitc_test(const char *str)
    if (pool) {
       bitc_pool_test();
    }
+   if (bstore) {
+      bitc_blockstore_test();
+   }
+   if (addr) {
+      bitc_addrbook_test();
+   }
+   if (timer) {
+      bitc_poll_test();
+   }
+   if (anet) {
+      bitc_netasync_test();
+   }
+   if (hsync) {
+      bitc_hdrsync_test();
+   }
+   if (bsync) {
+      bitc_blksync_test();
+   }
+   if (tdb) {
+      bitc_txdb_test();
+   }
 
    return 0;
 }
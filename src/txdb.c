@@ -2,9 +2,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <limits.h>
+#include <unistd.h>
 #include <leveldb/c.h>
 
 #include "txdb.h"
+#include "circlist.h"
 #include "util.h"
 #include "config.h"
 #include "hashtable.h"
@@ -42,6 +44,19 @@ static int verbose;
  * Once the tx is accepted by the network, we adjust 2 things:
  *  - blkHash is no longer 0.
  *  - expiry is set to 0.
+ *
+ * The record lives under /tx/<seq>/<txHash>. A second entry /txh/<txHash>
+ * holds the key of the record, so that finding it from the hash alone does
+ * not take a scan of the whole DB. Both are written in the same batch.
+ *
+ * While a merkleblock is processed, all the writes go to a single batch
+ * committed along with /lastblk, the last block whose transactions are all
+ * in the DB: one sync per block, and the DB never reflects half a block.
+ *
+ * During the initial rescan, the group-commit mode keeps the batch open
+ * across blocks until it is large or old enough, or until the rescan is
+ * over. After a crash, the rescan resumes from the /lastblk that made it
+ * to disk.
  */
 
 struct tx_ser_data {
@@ -52,11 +67,22 @@ struct tx_ser_data {
 };
 
 
+/*
+ * A tx is kept in its serialized form, in the same allocation as its entry:
+ * 'off' holds the offsets in 'buf' of each txi followed by each txo. The
+ * inputs and outputs are only parsed when needed, cf. txdb_tx_get_txi() and
+ * txdb_tx_get_txo().
+ */
+
 struct tx_entry {
-   btc_msg_tx   tx;
    uint256      blkHash;
    uint64       timestamp;
    bool         relevant;
+   uint32       in_count;
+   uint32       out_count;
+   uint32       len;
+   uint8       *buf;
+   uint32       off[];
 };
 
 
@@ -66,6 +92,38 @@ struct tx_ser_key {
 };
 
 
+/*
+ * The tx that turn out not to be relevant to the wallet are only
+ * remembered by their hash, so that we don't fetch and parse them again.
+ * They live in an LRU bounded by "txdb.seenCacheKB".
+ */
+
+struct tx_seen {
+   uint256               txHash;
+   struct circlist_item  item;
+};
+
+#define GET_SEEN(_li) \
+   CIRCLIST_CONTAINER(_li, struct tx_seen, item)
+
+/*
+ * With room for the slack of the hashtable, which may be less than half
+ * full.
+ */
+#define TXDB_SEEN_ENTRY_COST \
+   (sizeof(struct tx_seen) + 3 * (sizeof(void *) + sizeof(uint256)))
+
+
+/*
+ * A tx record put in the pending batch, where leveldb_get() can't see it.
+ */
+
+struct tx_pending {
+   struct buff *key;
+   struct buff *val;
+};
+
+
 struct txo_entry {
    uint256      txHash;
    uint256      blkHash;
@@ -77,10 +135,20 @@ struct txo_entry {
 };
 
 
+struct txo_sort_entry {
+   time_t            ts;
+   struct txo_entry *txo;
+};
+
+
 
 struct txdb {
-   struct hashtable       *hash_tx;  /* key'd by txHash */
+   struct hashtable       *hash_tx;  /* relevant tx, key'd by txHash */
    struct hashtable       *hash_txo;
+   struct hashtable       *hash_seen;
+   struct circlist_item   *seen_lru; /* least recently seen first */
+   uint32                  seenMax;
+   uint64                  numSeenEvicted;
    uint64                  tx_seq;
 
    char                   *path;
@@ -88,8 +156,22 @@ struct txdb {
    leveldb_options_t      *db_opts;
    leveldb_readoptions_t  *rd_opts;
    leveldb_writeoptions_t *wr_opts;
+   leveldb_writebatch_t   *batch;    /* writes not yet on disk */
+   struct hashtable       *hash_pending; /* tx records in 'batch' */
+   bool                    inBlock;
+   uint256                 lastBlk;
+   uint64                  numWrites;
+
+   bool                    groupCommit;
+   size_t                  groupMaxBytes;
+   mtime_t                 groupMaxAge;
+   size_t                  batchBytes;
+   mtime_t                 batchTS;
+   uint32                  batchBlocks;
 };
 
+#define TXDB_LASTBLK_KEY "/lastblk"
+
 static struct txdb *theTxdb;
 
 static int
@@ -168,6 +250,132 @@ txdb_print_coins(const struct txdb *txdb,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_seen_touch --
+ *
+ *      Returns TRUE if the tx is in the LRU, now as its most recent entry.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+txdb_seen_touch(struct txdb *txdb,
+                const uint256 *txHash)
+{
+   struct tx_seen *seen;
+
+   if (!hashtable_lookup(txdb->hash_seen, txHash, sizeof *txHash,
+                         (void *)&seen)) {
+      return 0;
+   }
+   circlist_delete_item(&txdb->seen_lru, &seen->item);
+   circlist_queue_item(&txdb->seen_lru, &seen->item);
+
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_seen_remove --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_seen_remove(struct txdb *txdb,
+                 const uint256 *txHash)
+{
+   struct tx_seen *seen;
+   bool s;
+
+   if (!hashtable_lookup(txdb->hash_seen, txHash, sizeof *txHash,
+                         (void *)&seen)) {
+      return;
+   }
+   circlist_delete_item(&txdb->seen_lru, &seen->item);
+   s = hashtable_remove(txdb->hash_seen, txHash, sizeof *txHash);
+   ASSERT(s);
+   free(seen);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_seen_add --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_seen_add(struct txdb *txdb,
+              const uint256 *txHash)
+{
+   struct tx_seen *seen;
+   bool s;
+
+   if (txdb->seenMax == 0 || txdb_seen_touch(txdb, txHash)) {
+      return;
+   }
+
+   while (hashtable_getnumentries(txdb->hash_seen) >= txdb->seenMax) {
+      struct tx_seen *old = GET_SEEN(CIRCLIST_FIRST(txdb->seen_lru));
+
+      txdb_seen_remove(txdb, &old->txHash);
+      txdb->numSeenEvicted++;
+   }
+
+   seen = safe_malloc(sizeof *seen);
+   memcpy(&seen->txHash, txHash, sizeof *txHash);
+   circlist_init_item(&seen->item);
+   circlist_queue_item(&txdb->seen_lru, &seen->item);
+
+   s = hashtable_insert(txdb->hash_seen, txHash, sizeof *txHash, seen);
+   ASSERT(s);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_seen_memsize --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static uint64
+txdb_seen_memsize(const struct txdb *txdb)
+{
+   return hashtable_getmemsize(txdb->hash_seen) +
+          hashtable_getnumentries(txdb->hash_seen) * sizeof(struct tx_seen);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_print_stats --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_print_stats(const struct txdb *txdb)
+{
+   Log(LGPFX" %u relevant tx, %llu writes.\n",
+       hashtable_getnumentries(txdb->hash_tx), txdb->numWrites);
+   Log(LGPFX" %u/%u non-relevant tx seen: %llu KB, %llu evicted.\n",
+       hashtable_getnumentries(txdb->hash_seen), txdb->seenMax,
+       txdb_seen_memsize(txdb) / 1024, txdb->numSeenEvicted);
+   hashtable_printstats(txdb->hash_tx, "tx");
+   hashtable_printstats(txdb->hash_seen, "seen");
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -179,11 +387,154 @@ txdb_print_coins(const struct txdb *txdb,
 static void
 txdb_free_tx_entry(struct tx_entry *txe)
 {
-   btc_msg_tx_free(&txe->tx);
    free(txe);
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_tx_index --
+ *
+ *      Walks a serialized tx to count its inputs and outputs and, if 'off'
+ *      is not NULL, to record where each of them starts. Returns non-zero
+ *      if the tx is malformed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+txdb_tx_index(const uint8 *buf,
+              size_t       len,
+              uint32      *off,
+              uint32      *inCount,
+              uint32      *outCount)
+{
+   struct buff b;
+   uint64 count;
+   uint64 scriptLen;
+   uint32 i;
+   int res;
+
+   if (len > UINT_MAX) {
+      return 1;
+   }
+   buff_init(&b, (void *)buf, len);
+
+   res  = buff_skip(&b, sizeof(uint32)); /* version */
+   res |= deserialize_varint(&b, &count);
+   if (res || count > buff_space_left(&b)) {
+      return 1;
+   }
+   *inCount = count;
+
+   for (i = 0; i < *inCount; i++) {
+      if (off) {
+         off[i] = buff_curlen(&b);
+      }
+      res  = buff_skip(&b, sizeof(uint256) + sizeof(uint32));
+      res |= deserialize_varint(&b, &scriptLen);
+      if (res || scriptLen > buff_space_left(&b)) {
+         return 1;
+      }
+      res  = buff_skip(&b, scriptLen);
+      res |= buff_skip(&b, sizeof(uint32)); /* sequence */
+      if (res) {
+         return 1;
+      }
+   }
+
+   res = deserialize_varint(&b, &count);
+   if (res || count > buff_space_left(&b)) {
+      return 1;
+   }
+   *outCount = count;
+
+   for (i = 0; i < *outCount; i++) {
+      if (off) {
+         off[*inCount + i] = buff_curlen(&b);
+      }
+      res  = buff_skip(&b, sizeof(uint64));
+      res |= deserialize_varint(&b, &scriptLen);
+      if (res || scriptLen > buff_space_left(&b)) {
+         return 1;
+      }
+      res = buff_skip(&b, scriptLen);
+      if (res) {
+         return 1;
+      }
+   }
+
+   res = buff_skip(&b, sizeof(uint32)); /* lock_time */
+
+   return res || buff_space_left(&b) != 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_tx_get_txi --
+ *
+ *      The scriptSig points into the tx entry and must not be freed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_tx_get_txi(const struct tx_entry *txe,
+                uint32                 idx,
+                btc_msg_tx_in         *txi)
+{
+   struct buff b;
+   int res;
+
+   ASSERT(idx < txe->in_count);
+
+   buff_init(&b, txe->buf + txe->off[idx], txe->len - txe->off[idx]);
+
+   res  = deserialize_uint256(&b, &txi->prevTxHash);
+   res |= deserialize_uint32(&b, &txi->prevTxOutIdx);
+   res |= deserialize_varint(&b, &txi->scriptLength);
+   txi->scriptSig = buff_curptr(&b);
+   res |= buff_skip(&b, txi->scriptLength);
+   res |= deserialize_uint32(&b, &txi->sequence);
+   ASSERT(res == 0);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_tx_get_txo --
+ *
+ *      The scriptPubKey points into the tx entry and must not be freed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_tx_get_txo(const struct tx_entry *txe,
+                uint32                 idx,
+                btc_msg_tx_out        *txo)
+{
+   uint32 off;
+   struct buff b;
+   int res;
+
+   ASSERT(idx < txe->out_count);
+
+   off = txe->off[txe->in_count + idx];
+   buff_init(&b, txe->buf + off, txe->len - off);
+
+   res  = deserialize_uint64(&b, &txo->value);
+   res |= deserialize_varint(&b, &txo->scriptLength);
+   txo->scriptPubKey = buff_curptr(&b);
+   ASSERT(res == 0);
+   ASSERT(txo->scriptLength <= buff_space_left(&b));
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -232,21 +583,22 @@ txdb_hashtable_free_txo_entry(const void *key,
  */
 
 static uint64
-txdb_get_tx_credit(const btc_msg_tx *tx)
+txdb_get_tx_credit(const struct tx_entry *txe)
 {
    uint64 credit;
-   int i;
+   uint32 i;
 
    credit = 0;
-   for (i = 0; i < tx->out_count; i++) {
-      const btc_msg_tx_out *txo = tx->tx_out + i;
+   for (i = 0; i < txe->out_count; i++) {
+      btc_msg_tx_out txo;
       uint160 addr;
 
-      if (script_parse_pubkey_hash(txo->scriptPubKey, txo->scriptLength, &addr)
+      txdb_tx_get_txo(txe, i, &txo);
+      if (script_parse_pubkey_hash(txo.scriptPubKey, txo.scriptLength, &addr)
          || !wallet_is_pubkey_hash160_mine(btc->wallet, &addr)) {
          continue;
       }
-      credit += txo->value;
+      credit += txo.value;
    }
    return credit;
 }
@@ -291,17 +643,18 @@ txdb_lookup_txo(const uint256 *txHash,
  */
 
 static uint64
-txdb_get_tx_debit(const btc_msg_tx *tx)
+txdb_get_tx_debit(const struct tx_entry *txe)
 {
    uint64 debit;
-   int i;
+   uint32 i;
 
    debit = 0;
-   for (i = 0; i < tx->in_count; i++) {
-      const btc_msg_tx_in *txi = tx->tx_in + i;
+   for (i = 0; i < txe->in_count; i++) {
       struct txo_entry *txo_entry;
+      btc_msg_tx_in txi;
 
-      txo_entry = txdb_lookup_txo(&txi->prevTxHash, txi->prevTxOutIdx);
+      txdb_tx_get_txi(txe, i, &txi);
+      txo_entry = txdb_lookup_txo(&txi.prevTxHash, txi.prevTxOutIdx);
       if (txo_entry == NULL) {
          continue;
       }
@@ -314,6 +667,185 @@ txdb_get_tx_debit(const btc_msg_tx *tx)
 }
 
 
+static int txdb_batch_flush(struct txdb *txdb);
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_pending_free --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_pending_free(const void *key,
+                  size_t      keyLen,
+                  void       *clientData)
+{
+   struct tx_pending *pend = clientData;
+
+   buff_free(pend->key);
+   buff_free(pend->val);
+   free(pend);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_pending_set --
+ *
+ *      Records that the tx record 'key' -> 'val' is in the pending batch.
+ *      Takes ownership of both buffers.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_pending_set(struct txdb   *txdb,
+                 const uint256 *txHash,
+                 struct buff   *key,
+                 struct buff   *val)
+{
+   struct tx_pending *pend;
+
+   if (hashtable_lookup(txdb->hash_pending, txHash, sizeof *txHash,
+                        (void *)&pend)) {
+      buff_free(pend->key);
+      buff_free(pend->val);
+   } else {
+      bool s;
+
+      pend = safe_malloc(sizeof *pend);
+      s = hashtable_insert(txdb->hash_pending, txHash, sizeof *txHash, pend);
+      ASSERT(s);
+   }
+   pend->key = key;
+   pend->val = val;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_batch_get --
+ *
+ *      Within a block, the batch shared by the whole block, or by the whole
+ *      group in group-commit mode. Otherwise a batch of its own, written
+ *      right away: what the pending batch holds is written first so that
+ *      the writes keep their order.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static leveldb_writebatch_t *
+txdb_batch_get(struct txdb *txdb)
+{
+   if (txdb->inBlock) {
+      ASSERT(txdb->batch);
+      return txdb->batch;
+   }
+   if (txdb->batch) {
+      txdb_batch_flush(txdb);
+   }
+   return leveldb_writebatch_create();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_batch_put --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_batch_put(struct txdb *txdb,
+               leveldb_writebatch_t *batch,
+               const void *key,
+               size_t klen,
+               const void *val,
+               size_t vlen)
+{
+   leveldb_writebatch_put(batch, key, klen, val, vlen);
+   if (batch == txdb->batch) {
+      txdb->batchBytes += klen + vlen;
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_batch_write --
+ *
+ *      Writes 'batch' unless it is the pending one, in which case this
+ *      waits for txdb_commit_block() or txdb_flush().
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+txdb_batch_write(struct txdb *txdb,
+                 leveldb_writebatch_t *batch)
+{
+   char *err = NULL;
+
+   if (batch == txdb->batch) {
+      return 0;
+   }
+
+   leveldb_write(txdb->db, txdb->wr_opts, batch, &err);
+   leveldb_writebatch_destroy(batch);
+   txdb->numWrites++;
+
+   if (err) {
+      Warning(LGPFX" failed to write batch: %s\n", err);
+      free(err);
+      return 1;
+   }
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_batch_flush --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+txdb_batch_flush(struct txdb *txdb)
+{
+   leveldb_writebatch_t *batch = txdb->batch;
+   int res;
+
+   if (batch == NULL) {
+      return 0;
+   }
+   if (txdb->batchBlocks > 1) {
+      LOG(1, (LGPFX" flushing %u blocks, %zu bytes.\n",
+              txdb->batchBlocks, txdb->batchBytes));
+   }
+
+   txdb->batch       = NULL;
+   txdb->batchBytes  = 0;
+   txdb->batchBlocks = 0;
+   res = txdb_batch_write(txdb, batch);
+   hashtable_clear_with_callback(txdb->hash_pending, txdb_pending_free);
+
+   if (txdb->inBlock) {
+      txdb->batch   = leveldb_writebatch_create();
+      txdb->batchTS = time_get();
+   }
+   return res;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -342,11 +874,38 @@ txdb_serialize_tx_key(uint64 tx_seq,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_serialize_txh_key --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct buff *
+txdb_serialize_txh_key(const char *hashStr)
+{
+   struct buff *buf;
+   char str[256];
+
+   ASSERT(hashStr);
+
+   buf = buff_alloc();
+
+   snprintf(str, sizeof str, "/txh/%s", hashStr);
+   serialize_bytes(buf, str, strlen(str) + 1); /* include terminal '\0' */
+
+   return buf;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
  * txdb_deserialize_tx_key --
  *
+ *      Returns NULL if the key is malformed.
+ *
  *------------------------------------------------------------------------
  */
 
@@ -355,18 +914,30 @@ txdb_deserialize_tx_key(const void *key,
                         size_t klen)
 {
    struct tx_ser_key *tx;
+   char keyStr[128];
    char hashStr[80];
    bool s;
    int n;
 
    ASSERT(key);
 
+   /*
+    * leveldb keys are not NUL-terminated.
+    */
+   if (klen >= sizeof keyStr) {
+      return NULL;
+   }
+   memcpy(keyStr, key, klen);
+   keyStr[klen] = '\0';
+
    tx = safe_calloc(1, sizeof *tx);
 
-   n = sscanf(key, "/tx/%010llu/%s", &tx->seq, hashStr);
-   ASSERT(n == 2);
-   s = uint256_from_str(hashStr, &tx->txHash);
-   ASSERT(s);
+   n = sscanf(keyStr, "/tx/%010llu/%79s", &tx->seq, hashStr);
+   s = n == 2 && uint256_from_str(hashStr, &tx->txHash);
+   if (s == 0) {
+      free(tx);
+      return NULL;
+   }
 
    return tx;
 }
@@ -474,7 +1045,8 @@ txdb_has_tx(const struct txdb *txdb,
    ASSERT(hash);
    ASSERT(txdb);
 
-   return txdb_get_tx_entry(txdb, hash) != NULL;
+   return txdb_get_tx_entry(txdb, hash) != NULL ||
+          hashtable_lookup(txdb->hash_seen, hash, sizeof *hash, NULL);
 }
 
 
@@ -550,11 +1122,11 @@ exit:
  */
 
 static void
-txdb_process_tx_entry(struct txdb      *txdb,
-                      const uint256    *txHash,
-                      const uint256    *blkHash,
-                      const btc_msg_tx *tx,
-                      bool             *relevant)
+txdb_process_tx_entry(struct txdb     *txdb,
+                      const uint256   *txHash,
+                      const uint256   *blkHash,
+                      struct tx_entry *txe,
+                      bool            *relevant)
 {
    struct txo_entry *txo_entry;
    char hashStr[80];
@@ -571,13 +1143,15 @@ txdb_process_tx_entry(struct txdb      *txdb,
     * Look at all the tx referred to by the inputs. If any of these match
     * a txo for the wallet keys, we have a debit.
     */
-   for (i = 0; i < tx->in_count; i++) {
-      const btc_msg_tx_in *txi = tx->tx_in + i;
+   for (i = 0; i < txe->in_count; i++) {
+      btc_msg_tx_in txi;
+
       /*
        * Look to see if the txi refers to one of our coins (a known txo). If
        * so, we need to mark it as spent.
        */
-      txo_entry = txdb_lookup_txo(&txi->prevTxHash, txi->prevTxOutIdx);
+      txdb_tx_get_txi(txe, i, &txi);
+      txo_entry = txdb_lookup_txo(&txi.prevTxHash, txi.prevTxOutIdx);
       if (txo_entry == NULL) {
          continue;
       }
@@ -590,12 +1164,13 @@ txdb_process_tx_entry(struct txdb      *txdb,
    /*
     * Analyze all the txo to see if any credit our addresses.
     */
-   for (i = 0; i < tx->out_count; i++) {
+   for (i = 0; i < txe->out_count; i++) {
       char key[32 + 4]; // txHash + txo_idx
-      const btc_msg_tx_out *txo = tx->tx_out + i;
+      btc_msg_tx_out txo;
       uint160 pub_key;
 
-      if (script_parse_pubkey_hash(txo->scriptPubKey, txo->scriptLength, &pub_key)
+      txdb_tx_get_txo(txe, i, &txo);
+      if (script_parse_pubkey_hash(txo.scriptPubKey, txo.scriptLength, &pub_key)
           || !wallet_is_pubkey_hash160_mine(btc->wallet, &pub_key)) {
          continue;
       }
@@ -606,7 +1181,7 @@ txdb_process_tx_entry(struct txdb      *txdb,
 
       txo_entry = safe_malloc(sizeof *txo_entry);
       txo_entry->spent     = 0;
-      txo_entry->value     = txo->value;
+      txo_entry->value     = txo.value;
       txo_entry->btc_addr  = b58_pubkey_from_uint160(&pub_key);
       txo_entry->outIdx    = i;
       txo_entry->spendable = wallet_is_pubkey_spendable(btc->wallet, &pub_key);
@@ -704,8 +1279,55 @@ txdb_remove_from_hashtable(struct txdb      *txdb,
    uint256_snprintf_reverse(hashStr, sizeof hashStr, txHash);
 
    s = hashtable_remove(txdb->hash_tx, txHash, sizeof *txHash);
-   Warning(LGPFX" %s removed from hash_tx: %d (count=%u)\n",
-           hashStr, s, hashtable_getnumentries(txdb->hash_tx));
+   LOG(1, (LGPFX" %s removed from hash_tx: %d (count=%u)\n",
+           hashStr, s, hashtable_getnumentries(txdb->hash_tx)));
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_tx_entry_alloc --
+ *
+ *      Builds an entry holding a copy of the raw tx and the offsets of its
+ *      inputs and outputs. Returns NULL if the tx cannot be parsed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct tx_entry *
+txdb_tx_entry_alloc(const void *buf,
+                    size_t      len)
+{
+   struct tx_entry *txe;
+   uint32 inCount;
+   uint32 outCount;
+   size_t offLen;
+   int res;
+
+   res = txdb_tx_index(buf, len, NULL, &inCount, &outCount);
+   if (res) {
+      return NULL;
+   }
+
+   /*
+    * One allocation for the entry, the offsets table and the raw tx.
+    */
+   offLen = ((size_t)inCount + outCount) * sizeof txe->off[0];
+   txe = safe_malloc(sizeof *txe + offLen + len);
+   memset(&txe->blkHash, 0, sizeof txe->blkHash);
+   txe->timestamp = 0;
+   txe->relevant  = 0;
+   txe->in_count  = inCount;
+   txe->out_count = outCount;
+   txe->len       = len;
+   txe->buf       = (uint8 *)txe->off + offLen;
+   memcpy(txe->buf, buf, len);
+
+   res = txdb_tx_index(txe->buf, len, txe->off, &inCount, &outCount);
+   ASSERT(res == 0);
+
+   return txe;
 }
 
 
@@ -727,24 +1349,20 @@ txdb_add_to_hashtable(struct txdb      *txdb,
                       struct tx_entry **txePtr)
 {
    struct tx_entry *txe;
-   struct buff b;
-   int res;
    bool s;
 
-   buff_init(&b, (char *)buf, len);
+   txe = txdb_tx_entry_alloc(buf, len);
+   if (txe == NULL) {
+      Warning(LGPFX" failed to parse tx of %zu bytes.\n", len);
+      return 1;
+   }
 
-   txe = safe_malloc(sizeof *txe);
    if (blkHash) {
       memcpy(&txe->blkHash, blkHash, sizeof *blkHash);
-   } else {
-      memset(&txe->blkHash, 0, sizeof txe->blkHash);
    }
    txe->relevant = 0; /* for now */
    txe->timestamp = timestamp; // only really useful for 'relevant' ones.
 
-   res = deserialize_tx(&b, &txe->tx);
-   ASSERT(res == 0);
-
    s = hashtable_insert(txdb->hash_tx, txHash, sizeof *txHash, txe);
    ASSERT(s);
 
@@ -818,6 +1436,7 @@ txdb_load_tx(struct txdb *txdb,
    txk = txdb_deserialize_tx_key(key, klen);
    txd = txdb_deserialize_tx_data(val, vlen);
 
+   ASSERT(txk);
    ASSERT(txdb->tx_seq == txk->seq);
    txdb->tx_seq++;
 
@@ -868,6 +1487,70 @@ txdb_load_tx(struct txdb *txdb,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_build_index --
+ *
+ *      DBs written before /txh/ existed: index all the tx records in one
+ *      batch.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+txdb_build_index(struct txdb *txdb)
+{
+   leveldb_writebatch_t *batch;
+   leveldb_iterator_t *iter;
+   char *err = NULL;
+   uint32 n = 0;
+
+   batch = leveldb_writebatch_create();
+   iter = leveldb_create_iterator(txdb->db, txdb->rd_opts);
+   leveldb_iter_seek(iter, "/tx/", 4);
+
+   while (leveldb_iter_valid(iter)) {
+      struct tx_ser_key *txk;
+      struct buff *bufi;
+      char hashStr[80];
+      const char *key;
+      size_t klen;
+
+      key = leveldb_iter_key(iter, &klen);
+      if (klen <= 4 || strncmp(key, "/tx/", 4) != 0) {
+         break;
+      }
+      txk = txdb_deserialize_tx_key(key, klen);
+      if (txk == NULL) {
+         Warning(LGPFX" skipping malformed tx key '%.*s'\n", (int)klen, key);
+         leveldb_iter_next(iter);
+         continue;
+      }
+      uint256_snprintf_reverse(hashStr, sizeof hashStr, &txk->txHash);
+      bufi = txdb_serialize_txh_key(hashStr);
+      leveldb_writebatch_put(batch, buff_base(bufi), buff_curlen(bufi),
+                             key, klen);
+      buff_free(bufi);
+      free(txk);
+      n++;
+
+      leveldb_iter_next(iter);
+   }
+   leveldb_iter_destroy(iter);
+
+   leveldb_write(txdb->db, txdb->wr_opts, batch, &err);
+   leveldb_writebatch_destroy(batch);
+   if (err) {
+      Warning(LGPFX" failed to index tx records: %s\n", err);
+      free(err);
+      return 1;
+   }
+   Log(LGPFX" indexed %u tx records.\n", n);
+   return 0;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -883,13 +1566,22 @@ txdb_open(struct config *config,
 {
    leveldb_iterator_t* iter;
    struct txdb *txdb;
+   uint64 numIndexed = 0;
    int res;
 
    txdb = safe_calloc(1, sizeof *txdb);
-   txdb->hash_txo = hashtable_create(); /* index all interesting txos */
-   txdb->hash_tx  = hashtable_create(); /* all TX brought to our attention */
+   txdb->hash_txo = hashtable_create_fixed(32 + 4); /* index all interesting txos */
+   txdb->hash_tx  = hashtable_create_fixed(sizeof(uint256)); /* all relevant TX */
+   txdb->hash_seen = hashtable_create_fixed(sizeof(uint256));
+   txdb->hash_pending = hashtable_create_fixed(sizeof(uint256));
    txdb->path     = txdb_get_db_path(config);
    txdb->tx_seq   = 0;
+   txdb->seenMax  = config_getint64(config, 4096, "txdb.seenCacheKB") * 1024
+                    / TXDB_SEEN_ENTRY_COST;
+
+   txdb->groupCommit   = config_getbool(config, TRUE, "txdb.groupCommit");
+   txdb->groupMaxBytes = config_getint64(config, 4096, "txdb.groupCommitKB") * 1024;
+   txdb->groupMaxAge   = config_getint64(config, 5000, "txdb.groupCommitMsec") * 1000;
 
    theTxdb = txdb;
 
@@ -928,12 +1620,26 @@ txdb_open(struct config *config,
       if (klen > 4 && strncmp(key, "/tx/", 4) == 0) {
          res = txdb_load_tx(txdb, key, klen, val, vlen);
          ASSERT(res == 0);
+      } else if (klen > 5 && strncmp(key, "/txh/", 5) == 0) {
+         numIndexed++;
+      } else if (klen == sizeof TXDB_LASTBLK_KEY &&
+                 memcmp(key, TXDB_LASTBLK_KEY, klen) == 0 &&
+                 vlen == sizeof txdb->lastBlk) {
+         memcpy(&txdb->lastBlk, val, vlen);
       }
 
       leveldb_iter_next(iter);
    }
    leveldb_iter_destroy(iter);
 
+   if (btc->stop == 0 && numIndexed != txdb->tx_seq) {
+      res = txdb_build_index(txdb);
+      if (res) {
+         *errStr = "failed to index tx DB";
+         goto error;
+      }
+   }
+
    txdb_export_tx_info(txdb);
    txdb_print_coins(txdb, 1);
 
@@ -951,54 +1657,256 @@ error:
 /*
  *------------------------------------------------------------------------
  *
- * txdb_save_tx --
+ * txdb_save_tx --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+txdb_save_tx(struct txdb   *txdb,
+             const uint256 *blkHash,
+             const uint256 *txHash,
+             mtime_t        timestamp,
+             const uint8   *buf,
+             size_t         len)
+{
+   leveldb_writebatch_t *batch;
+   struct tx_ser_data txdata;
+   struct buff *bufd;
+   struct buff *bufk;
+   struct buff *bufi;
+   char hashStr[80];
+   int res;
+
+   memset(&txdata, 0, sizeof txdata);
+
+   if (blkHash) {
+      memcpy(&txdata.blkHash, blkHash, sizeof *blkHash);
+   }
+
+   txdata.buf       = (uint8 *)buf;
+   txdata.len       = len;
+   txdata.timestamp = timestamp;
+
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, txHash);
+   bufk = txdb_serialize_tx_key(txdb->tx_seq, hashStr);
+   bufd = txdb_serialize_tx_data(&txdata);
+   bufi = txdb_serialize_txh_key(hashStr);
+
+   batch = txdb_batch_get(txdb);
+   txdb_batch_put(txdb, batch, buff_base(bufk), buff_curlen(bufk),
+                  buff_base(bufd), buff_curlen(bufd));
+   txdb_batch_put(txdb, batch, buff_base(bufi), buff_curlen(bufi),
+                  buff_base(bufk), buff_curlen(bufk));
+   if (batch == txdb->batch) {
+      txdb_pending_set(txdb, txHash, bufk, bufd);
+      bufk = NULL;
+      bufd = NULL;
+   }
+   res = txdb_batch_write(txdb, batch);
+
+   buff_free(bufk);
+   buff_free(bufd);
+   buff_free(bufi);
+
+   if (res) {
+      Warning(LGPFX" failed to save tx %s\n", hashStr);
+   }
+
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_set_tx_blkhash --
+ *
+ *      Lookup the serialized entry for this transaction through the /txh/
+ *      index and set 'blkHash'.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+txdb_set_tx_blkhash(struct txdb   *txdb,
+                    const uint256 *txHash,
+                    const uint256 *blkHash)
+{
+   leveldb_writebatch_t *batch;
+   struct tx_ser_data *txdata;
+   struct tx_pending *pend;
+   struct buff *bufi;
+   struct buff *buf;
+   char hashStr[80];
+   char *err = NULL;
+   char *key = NULL;
+   char *val = NULL;
+   size_t klen;
+   size_t vlen;
+   int res;
+
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, txHash);
+
+   /*
+    * First, as this may write what is pending.
+    */
+   batch = txdb_batch_get(txdb);
+
+   if (hashtable_lookup(txdb->hash_pending, txHash, sizeof *txHash,
+                        (void *)&pend)) {
+      klen = buff_curlen(pend->key);
+      vlen = buff_curlen(pend->val);
+      key  = safe_malloc(klen);
+      val  = safe_malloc(vlen);
+      memcpy(key, buff_base(pend->key), klen);
+      memcpy(val, buff_base(pend->val), vlen);
+   } else {
+      bufi = txdb_serialize_txh_key(hashStr);
+      key = leveldb_get(txdb->db, txdb->rd_opts,
+                        buff_base(bufi), buff_curlen(bufi), &klen, &err);
+      buff_free(bufi);
+      if (err == NULL && key != NULL) {
+         val = leveldb_get(txdb->db, txdb->rd_opts, key, klen, &vlen, &err);
+      }
+   }
+   if (err || val == NULL) {
+      Warning(LGPFX" failed to lookup tx %s: %s\n",
+              hashStr, err ? err : "not found");
+      if (batch != txdb->batch) {
+         leveldb_writebatch_destroy(batch);
+      }
+      free(err);
+      free(key);
+      return 1;
+   }
+
+   txdata = txdb_deserialize_tx_data(val, vlen);
+   ASSERT(uint256_iszero(&txdata->blkHash));
+   ASSERT(txdata->timestamp != 0);
+   memcpy(&txdata->blkHash, blkHash, sizeof *blkHash);
+
+   buf = txdb_serialize_tx_data(txdata);
+
+   txdb_batch_put(txdb, batch, key, klen, buff_base(buf), buff_curlen(buf));
+   if (batch == txdb->batch) {
+      struct buff *bufk = buff_alloc();
+
+      buff_copy_to(bufk, key, klen);
+      txdb_pending_set(txdb, txHash, bufk, buf);
+      buf = NULL;
+   }
+   res = txdb_batch_write(txdb, batch);
+   buff_free(buf);
+   if (res) {
+      Warning(LGPFX" failed to write tx entry %s\n", hashStr);
+   }
+
+   free(txdata->buf);
+   free(txdata);
+   free(key);
+   free(val);
+
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_begin_block --
+ *
+ *      Starts grouping the writes until txdb_commit_block().
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+txdb_begin_block(struct txdb *txdb)
+{
+   ASSERT(txdb->inBlock == 0);
+
+   txdb->inBlock = 1;
+   if (txdb->batch == NULL) {
+      txdb->batch   = leveldb_writebatch_create();
+      txdb->batchTS = time_get();
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_commit_block --
+ *
+ *      Writes the batch started by txdb_begin_block() along with 'lastBlk',
+ *      the last block whose transactions are all in the DB. In group-commit
+ *      mode, the write may be deferred to a later block.
  *
  *------------------------------------------------------------------------
  */
 
-static int
-txdb_save_tx(struct txdb   *txdb,
-             const uint256 *blkHash,
-             const uint256 *txHash,
-             mtime_t        timestamp,
-             const uint8   *buf,
-             size_t         len)
+int
+txdb_commit_block(struct txdb   *txdb,
+                  const uint256 *lastBlk)
 {
-   struct tx_ser_data txdata;
-   struct buff *bufd;
-   struct buff *bufk;
-   char hashStr[80];
-   char *err;
-
-   err = NULL;
-   memset(&txdata, 0, sizeof txdata);
+   ASSERT(txdb->inBlock);
+   ASSERT(txdb->batch);
+
+   txdb->inBlock = 0;
+   txdb->batchBlocks++;
+   if (!uint256_iszero(lastBlk)) {
+      txdb_batch_put(txdb, txdb->batch, TXDB_LASTBLK_KEY,
+                     sizeof TXDB_LASTBLK_KEY, /* include '\0' */
+                     lastBlk->data, sizeof *lastBlk);
+      memcpy(&txdb->lastBlk, lastBlk, sizeof *lastBlk);
+   }
 
-   if (blkHash) {
-      memcpy(&txdata.blkHash, blkHash, sizeof *blkHash);
+   if (txdb->groupCommit && bitc_state_updating_txdb() &&
+       txdb->batchBytes < txdb->groupMaxBytes &&
+       time_get() - txdb->batchTS < txdb->groupMaxAge) {
+      return 0;
    }
+   return txdb_batch_flush(txdb);
+}
 
-   txdata.buf       = (uint8 *)buf;
-   txdata.len       = len;
-   txdata.timestamp = timestamp;
 
-   uint256_snprintf_reverse(hashStr, sizeof hashStr, txHash);
-   bufk = txdb_serialize_tx_key(txdb->tx_seq, hashStr);
-   bufd = txdb_serialize_tx_data(&txdata);
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_flush --
+ *
+ *      Writes what group-commit mode has left pending.
+ *
+ *------------------------------------------------------------------------
+ */
 
-   leveldb_put(txdb->db, txdb->wr_opts,
-               buff_base(bufk), buff_curlen(bufk),
-               buff_base(bufd), buff_curlen(bufd),
-               &err);
+int
+txdb_flush(struct txdb *txdb)
+{
+   ASSERT(txdb->inBlock == 0);
 
-   buff_free(bufk);
-   buff_free(bufd);
+   return txdb_batch_flush(txdb);
+}
 
-   if (err) {
-      Warning(LGPFX" failed to save tx %s: %s\n", hashStr, err);
-      free(err);
-   }
 
-   return err != NULL;
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_get_lastblk --
+ *
+ *      Returns FALSE if no block was ever committed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+txdb_get_lastblk(const struct txdb *txdb,
+                 uint256 *hash)
+{
+   memcpy(hash, &txdb->lastBlk, sizeof *hash);
+
+   return !uint256_iszero(hash);
 }
 
 
@@ -1007,8 +1915,6 @@ txdb_save_tx(struct txdb   *txdb,
  *
  * txdb_confirm_one_tx --
  *
- *      Lookup the serialized entry for this transaction and set 'blkHash'.
- *
  *------------------------------------------------------------------------
  */
 
@@ -1017,7 +1923,6 @@ txdb_confirm_one_tx(struct txdb   *txdb,
                     const uint256 *blkHash,
                     const uint256 *txHash)
 {
-   leveldb_iterator_t *iter;
    struct tx_entry *txe;
    char bkHashStr[80];
    char txHashStr[80];
@@ -1027,14 +1932,13 @@ txdb_confirm_one_tx(struct txdb   *txdb,
 
    txe = txdb_get_tx_entry(txdb, txHash);
    if (txe == NULL) {
+      /*
+       * Not relevant: no need to remember it past its confirmation.
+       */
+      txdb_seen_remove(txdb, txHash);
       return;
    }
-
-   if (txe->relevant == 0) {
-      txdb_remove_from_hashtable(txdb, txHash);
-      NOT_TESTED();
-      return;
-   }
+   ASSERT(txe->relevant);
 
    if (!uint256_iszero(&txe->blkHash)) {
       /*
@@ -1053,55 +1957,8 @@ txdb_confirm_one_tx(struct txdb   *txdb,
    uint256_snprintf_reverse(txHashStr, sizeof txHashStr, txHash);
    Warning(LGPFX" %s confirmed in %s\n", txHashStr, bkHashStr);
 
-   NOT_TESTED();
-
-   iter = leveldb_create_iterator(txdb->db, txdb->rd_opts);
-   leveldb_iter_seek_to_first(iter);
-
-   while (leveldb_iter_valid(iter)) {
-      struct tx_ser_key *txkey;
-      struct tx_ser_data *txdata;
-      struct buff *buf;
-      const char *key;
-      const char *val;
-      size_t klen;
-      size_t vlen;
-      char *err = NULL;
-
-      key = leveldb_iter_key(iter, &klen);
-      txkey = txdb_deserialize_tx_key(key, klen);
-
-      if (txkey == NULL || uint256_issame(txHash, &txkey->txHash) == 0) {
-         free(txkey);
-         leveldb_iter_next(iter);
-         continue;
-      }
-
-      NOT_TESTED();
-
-      val = leveldb_iter_value(iter, &vlen);
-      txdata = txdb_deserialize_tx_data(val, vlen);
-      ASSERT(uint256_iszero(&txdata->blkHash));
-      ASSERT(txdata->timestamp != 0);
-      memcpy(&txdata->blkHash, blkHash, sizeof *blkHash);
-
-      buf = txdb_serialize_tx_data(txdata);
-
-      leveldb_put(txdb->db, txdb->wr_opts, key, klen,
-                  buff_base(buf), buff_curlen(buf), &err);
-      buff_free(buf);
-      if (err) {
-         Warning(LGPFX" failed to write tx entry: %s\n", err);
-      }
-
-      txdb_export_tx_info(txdb);
-
-      free(txkey);
-      free(txdata->buf);
-      free(txdata);
-      break;
-   }
-   leveldb_iter_destroy(iter);
+   txdb_set_tx_blkhash(txdb, txHash, blkHash);
+   txdb_export_tx_info(txdb);
 }
 
 
@@ -1143,10 +2000,13 @@ txdb_remember_tx(struct txdb   *txdb,
    }
 
    uint256_snprintf_reverse(hashStr, sizeof hashStr, txHash);
-   txdb_process_tx_entry(txdb, txHash, blkHash, &txe->tx, &txe->relevant);
+   txdb_process_tx_entry(txdb, txHash, blkHash, txe, &txe->relevant);
    if (txe->relevant == 0) {
-      Warning(LGPFX" tx %s not relevant (%u)\n",
-              hashStr, hashtable_getnumentries(txdb->hash_tx));
+      txdb_remove_from_hashtable(txdb, txHash);
+      txdb_seen_add(txdb, txHash);
+      LOG(1, (LGPFX" tx %s not relevant (%u seen, %llu KB)\n",
+              hashStr, hashtable_getnumentries(txdb->hash_seen),
+              txdb_seen_memsize(txdb) / 1024));
       return 0;
    }
 
@@ -1167,7 +2027,7 @@ txdb_remember_tx(struct txdb   *txdb,
 
    txdb_export_tx_info(txdb);
    if (bitc_state_ready()) {
-      int64 value = txdb_get_tx_credit(&txe->tx) - txdb_get_tx_debit(&txe->tx);
+      int64 value = txdb_get_tx_credit(txe) - txdb_get_tx_debit(txe);
 
 #ifdef WITHUI
       bitcui_set_status("New payment %s: %.8f BTC",
@@ -1206,7 +2066,8 @@ txdb_handle_tx(struct txdb   *txdb,
    *relevant = 0;
    hash256_calc(buf, len, &txHash);
 
-   txKnown = txdb_has_tx(txdb, &txHash);
+   txKnown = txdb_get_tx_entry(txdb, &txHash) != NULL ||
+             txdb_seen_touch(txdb, &txHash);
 
    if (!uint256_iszero(blkHash)) {
       txdb_confirm_one_tx(txdb, blkHash, &txHash);
@@ -1302,7 +2163,7 @@ txdb_sign_tx_inputs(struct txdb *txdb,
 
    for (i = 0; i < tx->in_count; i++) {
       struct btc_msg_tx_in *txi = tx->tx_in + i;
-      struct btc_msg_tx_out *txoFrom;
+      struct btc_msg_tx_out txoFrom;
       struct tx_entry *txe;
       int res;
       bool s;
@@ -1311,12 +2172,11 @@ txdb_sign_tx_inputs(struct txdb *txdb,
                            sizeof txi->prevTxHash, (void *)&txe);
       ASSERT(s);
 
-      ASSERT(txi->prevTxOutIdx < txe->tx.out_count);
-      txoFrom = txe->tx.tx_out + txi->prevTxOutIdx;
+      txdb_tx_get_txo(txe, txi->prevTxOutIdx, &txoFrom);
 
       Warning(LGPFX" -- signing input #%u\n", i);
 
-      res = script_sign(btc->wallet, txoFrom, tx, i, SIGHASH_ALL);
+      res = script_sign(btc->wallet, &txoFrom, tx, i, SIGHASH_ALL);
       ASSERT(res == 0);
    }
 }
@@ -1334,25 +2194,20 @@ static int
 txdb_txo_entry_compare_cb(const void *e0,
                           const void *e1)
 {
-   struct txo_entry *txo0 = (struct txo_entry *)e0;
-   struct txo_entry *txo1 = (struct txo_entry *)e1;
-   time_t t0;
-   time_t t1;
-
-   t0 = blockstore_get_block_timestamp(btc->blockStore, &txo0->blkHash);
-   t1 = blockstore_get_block_timestamp(btc->blockStore, &txo1->blkHash);
+   const struct txo_sort_entry *s0 = (const struct txo_sort_entry *)e0;
+   const struct txo_sort_entry *s1 = (const struct txo_sort_entry *)e1;
 
    /*
     * If 2 txos are from the same tx, sort by outIdx.
     */
-   if (t0 == t1) {
-      if (txo0->outIdx == txo1->outIdx) {
+   if (s0->ts == s1->ts) {
+      if (s0->txo->outIdx == s1->txo->outIdx) {
          return 0;
       }
-      return txo0->outIdx > txo1->outIdx ? 1 : -1;
+      return s0->txo->outIdx > s1->txo->outIdx ? 1 : -1;
    }
 
-   return t0 > t1 ? 1 : -1;
+   return s0->ts > s1->ts ? 1 : -1;
 }
 
 
@@ -1367,17 +2222,40 @@ txdb_txo_entry_compare_cb(const void *e0,
 static struct txo_entry *
 txdb_get_coins_sorted(struct txdb *txdb)
 {
+   struct txo_sort_entry *keys;
+   struct txo_entry *sorted;
    struct txo_entry *ptr = NULL;
    int n;
+   int i;
+
+   n = hashtable_getnumentries(txdb->hash_txo);
+   if (n == 0) {
+      return NULL;
+   }
 
    hashtable_linearize(txdb->hash_txo, sizeof(struct txo_entry), (void*)&ptr);
    ASSERT(ptr);
 
-   n = hashtable_getnumentries(txdb->hash_txo);
+   /*
+    * Look up each block timestamp once instead of twice per comparison.
+    */
+   keys = safe_malloc(n * sizeof *keys);
+   for (i = 0; i < n; i++) {
+      keys[i].ts  = blockstore_get_block_timestamp(btc->blockStore,
+                                                   &ptr[i].blkHash);
+      keys[i].txo = ptr + i;
+   }
 
-   qsort(ptr, n, sizeof *ptr, txdb_txo_entry_compare_cb);
+   qsort(keys, n, sizeof *keys, txdb_txo_entry_compare_cb);
 
-   return ptr;
+   sorted = safe_malloc(n * sizeof *sorted);
+   for (i = 0; i < n; i++) {
+      memcpy(sorted + i, keys[i].txo, sizeof *sorted);
+   }
+   free(keys);
+   free(ptr);
+
+   return sorted;
 }
 
 
@@ -1562,7 +2440,15 @@ txdb_close(struct txdb *txdb)
       return;
    }
 
+   if (txdb->batch) {
+      if (txdb->inBlock == 0) {
+         txdb_batch_flush(txdb);
+      } else {
+         leveldb_writebatch_destroy(txdb->batch);
+      }
+   }
    if (txdb->db) {
+      txdb_print_stats(txdb);
       leveldb_close(txdb->db);
    }
    leveldb_options_destroy(txdb->db_opts);
@@ -1575,6 +2461,12 @@ txdb_close(struct txdb *txdb)
    hashtable_clear_with_callback(txdb->hash_tx, txdb_hashtable_free_tx_entry);
    hashtable_destroy(txdb->hash_tx);
 
+   hashtable_clear_with_free(txdb->hash_seen);
+   hashtable_destroy(txdb->hash_seen);
+
+   hashtable_clear_with_callback(txdb->hash_pending, txdb_pending_free);
+   hashtable_destroy(txdb->hash_pending);
+
    free(txdb->path);
    memset(txdb, 0, sizeof *txdb);
    free(txdb);
@@ -1615,8 +2507,8 @@ txdb_export_tx_cb(const void *key,
 
    ASSERT(keyLen == sizeof(uint256));
    memcpy(&txi->txHash, key, keyLen);
-   txi->value  = txdb_get_tx_credit(&txe->tx);
-   txi->value -= txdb_get_tx_debit(&txe->tx);
+   txi->value  = txdb_get_tx_credit(txe);
+   txi->value -= txdb_get_tx_debit(txe);
 
    txi->blockHeight = -1;
    if (!uint256_iszero(&txe->blkHash)) {
@@ -1706,3 +2598,367 @@ txdb_export_tx_info(struct txdb *txdb)
    bitcui_set_tx_info(tx_num, tx_info);
 #endif
 }
+
+
+/*
+ * Benchmark: the confirmation pass of a rescan, over a wallet of 'numTx'
+ * records kept in a scratch DB. Every tx is confirmed through the /txh/
+ * index. A sample is also looked up the way it used to be, by walking the
+ * records until the key matches. Then a rescan adding a few tx per block,
+ * with one write per tx, one per block, or in group-commit mode.
+ */
+
+#define TXDB_BENCH_TX_LEN       250
+#define TXDB_BENCH_SCAN_SAMPLE  100
+#define TXDB_BENCH_BLOCKS       2000
+#define TXDB_BENCH_TX_PER_BLOCK 4
+#define TXDB_BENCH_PARSE_IN     2
+#define TXDB_BENCH_PARSE_OUT    2
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_bench_scan --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+txdb_bench_scan(struct txdb   *txdb,
+                const uint256 *txHash)
+{
+   leveldb_iterator_t *iter;
+   bool found = 0;
+
+   iter = leveldb_create_iterator(txdb->db, txdb->rd_opts);
+   leveldb_iter_seek(iter, "/tx/", 4);
+
+   while (found == 0 && leveldb_iter_valid(iter)) {
+      struct tx_ser_key *txkey;
+      const char *key;
+      size_t klen;
+
+      key = leveldb_iter_key(iter, &klen);
+      if (klen <= 4 || strncmp(key, "/tx/", 4) != 0) {
+         break;
+      }
+      txkey = txdb_deserialize_tx_key(key, klen);
+      if (txkey != NULL && uint256_issame(txHash, &txkey->txHash)) {
+         struct tx_ser_data *txdata;
+         const char *val;
+         size_t vlen;
+
+         val = leveldb_iter_value(iter, &vlen);
+         txdata = txdb_deserialize_tx_data(val, vlen);
+         free(txdata->buf);
+         free(txdata);
+         found = 1;
+      }
+      free(txkey);
+      leveldb_iter_next(iter);
+   }
+   leveldb_iter_destroy(iter);
+
+   return found;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_bench_blocks --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_bench_blocks(struct txdb *txdb,
+                  bool grouped,
+                  bool groupCommit,
+                  volatile int *stop)
+{
+   enum bitc_state state = btc->state;
+   uint8 buf[TXDB_BENCH_TX_LEN];
+   uint64 numWrites = txdb->numWrites;
+   uint32 numBlocks = 0;
+   mtime_t ts;
+   char *str;
+   uint32 i;
+   int res;
+
+   txdb->groupCommit = groupCommit;
+   btc->state = BITC_STATE_UPDATE_TXDB;
+
+   ts = time_get();
+   for (i = 0; *stop == 0 && i < TXDB_BENCH_BLOCKS; i++) {
+      uint256 blkHash;
+      uint32 j;
+
+      memset(&blkHash, 0, sizeof blkHash);
+      memcpy(blkHash.data, &i, sizeof i);
+      blkHash.data[31] = 0xb2 + grouped + groupCommit;
+
+      if (grouped) {
+         txdb_begin_block(txdb);
+      }
+      for (j = 0; j < TXDB_BENCH_TX_PER_BLOCK; j++) {
+         uint256 txHash;
+         uint32 k;
+
+         for (k = 0; k < sizeof buf; k++) {
+            buf[k] = random();
+         }
+         hash256_calc(buf, sizeof buf, &txHash);
+
+         /*
+          * The first one is seen unconfirmed first: its record has to be
+          * found wherever it is.
+          */
+         res = txdb_save_tx(txdb, j == 0 ? NULL : &blkHash, &txHash,
+                            1231006505 + i, buf, sizeof buf);
+         ASSERT(res == 0);
+         txdb->tx_seq++;
+         if (j == 0) {
+            res = txdb_set_tx_blkhash(txdb, &txHash, &blkHash);
+            ASSERT(res == 0);
+         }
+      }
+      if (grouped) {
+         res = txdb_commit_block(txdb, &blkHash);
+         ASSERT(res == 0);
+      }
+      numBlocks++;
+   }
+   res = txdb_flush(txdb);
+   ASSERT(res == 0);
+   ts = time_get() - ts;
+
+   btc->state = state;
+   txdb->groupCommit = 0;
+
+   str = print_latency(ts);
+   Warning(LGPFX" %u blocks of %u tx, %s: %s -- %.0f blocks/sec,"
+           " %llu writes\n", numBlocks, TXDB_BENCH_TX_PER_BLOCK,
+           groupCommit ? "group commit       " :
+           grouped     ? "one write per block" : "one write per tx   ", str,
+           numBlocks * 1000.0 * 1000.0 / MAX(ts, 1),
+           txdb->numWrites - numWrites);
+   free(str);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_bench_parse --
+ *
+ *      Compares a full deserialize_tx() with the indexed tx entry, for a
+ *      typical tx with 2 inputs and 2 outputs.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+txdb_bench_parse(uint32        numTx,
+                 volatile int *stop)
+{
+   btc_msg_tx_in txIn[TXDB_BENCH_PARSE_IN];
+   btc_msg_tx_out txOut[TXDB_BENCH_PARSE_OUT];
+   uint8 scriptSig[107];
+   uint8 scriptPubKey[25];
+   uint8 raw[1024];
+   btc_msg_tx tx;
+   struct buff b;
+   uint64 sum[2] = { 0, 0 };
+   mtime_t ts[2];
+   uint32 i;
+   int res;
+
+   memset(scriptSig, 0x5a, sizeof scriptSig);
+   memset(scriptPubKey, 0xa5, sizeof scriptPubKey);
+   memset(&tx, 0, sizeof tx);
+   tx.version   = 1;
+   tx.in_count  = TXDB_BENCH_PARSE_IN;
+   tx.tx_in     = txIn;
+   tx.out_count = TXDB_BENCH_PARSE_OUT;
+   tx.tx_out    = txOut;
+   for (i = 0; i < TXDB_BENCH_PARSE_IN; i++) {
+      memset(&txIn[i].prevTxHash, i + 1, sizeof txIn[i].prevTxHash);
+      txIn[i].prevTxOutIdx = i;
+      txIn[i].scriptLength = sizeof scriptSig;
+      txIn[i].scriptSig    = scriptSig;
+      txIn[i].sequence     = UINT_MAX;
+   }
+   for (i = 0; i < TXDB_BENCH_PARSE_OUT; i++) {
+      txOut[i].value        = ONE_BTC * (i + 1);
+      txOut[i].scriptLength = sizeof scriptPubKey;
+      txOut[i].scriptPubKey = scriptPubKey;
+   }
+   buff_init(&b, raw, sizeof raw);
+   res = serialize_tx(&b, &tx);
+   ASSERT(res == 0);
+
+   ts[0] = time_get();
+   for (i = 0; *stop == 0 && i < numTx; i++) {
+      struct buff b2;
+      btc_msg_tx tx2;
+      uint32 j;
+
+      buff_init(&b2, raw, buff_curlen(&b));
+      res = deserialize_tx(&b2, &tx2);
+      ASSERT(res == 0);
+      for (j = 0; j < tx2.out_count; j++) {
+         sum[0] += tx2.tx_out[j].value + tx2.tx_out[j].scriptPubKey[0];
+      }
+      btc_msg_tx_free(&tx2);
+   }
+   ts[0] = time_get() - ts[0];
+
+   ts[1] = time_get();
+   for (i = 0; *stop == 0 && i < numTx; i++) {
+      struct tx_entry *txe;
+      uint32 j;
+
+      txe = txdb_tx_entry_alloc(raw, buff_curlen(&b));
+      ASSERT(txe);
+      for (j = 0; j < txe->out_count; j++) {
+         btc_msg_tx_out txo;
+
+         txdb_tx_get_txo(txe, j, &txo);
+         sum[1] += txo.value + txo.scriptPubKey[0];
+      }
+      txdb_free_tx_entry(txe);
+   }
+   ts[1] = time_get() - ts[1];
+
+   ASSERT(*stop || sum[0] == sum[1]);
+   Warning(LGPFX" %u tx of %zu bytes: deserialize_tx %.0f tx/sec, %u allocs/tx\n",
+           numTx, buff_curlen(&b), numTx * 1000.0 * 1000.0 / MAX(ts[0], 1),
+           2 + TXDB_BENCH_PARSE_IN + TXDB_BENCH_PARSE_OUT);
+   Warning(LGPFX" %u tx of %zu bytes: indexed entry  %.0f tx/sec, 1 alloc/tx\n",
+           numTx, buff_curlen(&b), numTx * 1000.0 * 1000.0 / MAX(ts[1], 1));
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_bench --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+txdb_bench(uint32 numTx,
+           volatile int *stop)
+{
+   leveldb_options_t *options;
+   struct txdb *txdb;
+   uint256 *hashes;
+   uint256 blkHash;
+   uint8 buf[TXDB_BENCH_TX_LEN];
+   char *err = NULL;
+   char *path;
+   uint32 numScanned = 0;
+   uint32 numDone = 0;
+   mtime_t ts;
+   char *str;
+   uint32 i;
+   int res;
+
+   txdb = safe_calloc(1, sizeof *txdb);
+   txdb->hash_txo = hashtable_create_fixed(32 + 4);
+   txdb->hash_tx  = hashtable_create_fixed(sizeof(uint256));
+   txdb->hash_seen = hashtable_create_fixed(sizeof(uint256));
+   txdb->hash_pending = hashtable_create_fixed(sizeof(uint256));
+   txdb->groupMaxBytes = 4096 * 1024;
+   txdb->groupMaxAge   = 5000 * 1000;
+   path = safe_asprintf("/tmp/bitc-txdb-bench-%u", (uint32)getpid());
+   txdb->path = safe_strdup(path);
+
+   res = txdb_open_db(txdb);
+   ASSERT(res == 0);
+
+   Warning(LGPFX" writing %u tx records.\n", numTx);
+
+   hashes = safe_malloc(numTx * sizeof *hashes);
+   memset(&blkHash, 0xb1, sizeof blkHash);
+
+   leveldb_writeoptions_set_sync(txdb->wr_opts, 0);
+   for (i = 0; *stop == 0 && i < numTx; i++) {
+      uint32 j;
+
+      for (j = 0; j < sizeof buf; j++) {
+         buf[j] = random();
+      }
+      hash256_calc(buf, sizeof buf, hashes + i);
+      res = txdb_save_tx(txdb, NULL, hashes + i, 1231006505 + i, buf,
+                         sizeof buf);
+      ASSERT(res == 0);
+      txdb->tx_seq++;
+   }
+   leveldb_writeoptions_set_sync(txdb->wr_opts, 1);
+
+   ts = time_get();
+   for (i = 0; *stop == 0 && i < numTx; i++) {
+      res = txdb_set_tx_blkhash(txdb, hashes + i, &blkHash);
+      ASSERT(res == 0);
+      numDone++;
+   }
+   ts = time_get() - ts;
+   str = print_latency(ts);
+   Warning(LGPFX" %u tx records: %u confirmed via index in %s"
+           " -- %.0f tx/sec\n", numTx, numDone, str,
+           numDone * 1000.0 * 1000.0 / MAX(ts, 1));
+   free(str);
+
+   ts = time_get();
+   for (i = 0; *stop == 0 && i < MIN(numTx, TXDB_BENCH_SCAN_SAMPLE); i++) {
+      bool s;
+
+      s = txdb_bench_scan(txdb, hashes + random() % numTx);
+      ASSERT(s);
+      numScanned++;
+   }
+   ts = time_get() - ts;
+   str = print_latency(ts);
+   Warning(LGPFX" %u tx records: %u looked up via full scan in %s"
+           " -- %.1f tx/sec\n", numTx, numScanned, str,
+           numScanned * 1000.0 * 1000.0 / MAX(ts, 1));
+   free(str);
+
+   txdb_bench_blocks(txdb, 0, 0 /* per tx */, stop);
+   txdb_bench_blocks(txdb, 1, 0 /* per block */, stop);
+   txdb_bench_blocks(txdb, 1, 1 /* group commit */, stop);
+   txdb_bench_parse(numTx * 10, stop);
+
+   /*
+    * Push all the hashes through an LRU sized for a quarter of them.
+    */
+   txdb->seenMax = MAX(numTx / 4, 1);
+   ts = time_get();
+   for (i = 0; *stop == 0 && i < numTx; i++) {
+      txdb_seen_add(txdb, hashes + i);
+   }
+   ts = time_get() - ts;
+   ASSERT(*stop || hashtable_getnumentries(txdb->hash_seen) == txdb->seenMax);
+   ASSERT(*stop || txdb_has_tx(txdb, hashes + numTx - 1));
+   str = print_latency(ts);
+   Warning(LGPFX" %u non-relevant tx seen in %s -- %u kept in %llu KB,"
+           " %llu evicted\n", i, str, hashtable_getnumentries(txdb->hash_seen),
+           txdb_seen_memsize(txdb) / 1024, txdb->numSeenEvicted);
+   free(str);
+
+   free(hashes);
+   txdb_close(txdb);
+
+   options = leveldb_options_create();
+   leveldb_destroy_db(options, path, &err);
+   leveldb_options_destroy(options);
+   if (err) {
+      Warning(LGPFX" failed to destroy DB %s: %s\n", path, err);
+      free(err);
+   }
+   free(path);
+}
@@ -21,5 +21,10 @@ void txdb_export_tx_info(struct txdb *txdb);
 uint64 txdb_get_balance(struct txdb *txdb);
 void txdb_confirm_one_tx(struct txdb *txdb, const uint256 *blkHash,
                          const uint256 *txHash);
+void txdb_begin_block(struct txdb *txdb);
+int  txdb_commit_block(struct txdb *txdb, const uint256 *lastBlk);
+int  txdb_flush(struct txdb *txdb);
+bool txdb_get_lastblk(const struct txdb *txdb, uint256 *hash);
+void txdb_bench(uint32 numTx, volatile int *stop);
 
 #endif /* __TXDB_H__ */
@@ -847,7 +847,7 @@ wallet_open_file(struct config      *config,
 
    wallet = safe_calloc(1, sizeof *wallet);
    wallet->filename   = wallet_get_filename();
-   wallet->hash_keys  = hashtable_create();
+   wallet->hash_keys  = hashtable_create_fixed(sizeof(uint160));
    wallet->pass       = pass;
    wallet->ckey_store = secure_alloc(sizeof *wallet->ckey);
    wallet->ckey       = (struct crypt_key *)wallet->ckey_store->buf;
@@ -1213,6 +1213,70 @@ wallet_confirm_tx_in_block(struct wallet *wallet,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * wallet_begin_block --
+ *
+ *      The txdb updates up to wallet_commit_block() are written at once.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+wallet_begin_block(struct wallet *wallet)
+{
+   txdb_begin_block(wallet->txdb);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * wallet_commit_block --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+wallet_commit_block(struct wallet *wallet,
+                    const uint256 *lastBlk)
+{
+   return txdb_commit_block(wallet->txdb, lastBlk);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * wallet_flush --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+wallet_flush(struct wallet *wallet)
+{
+   return txdb_flush(wallet->txdb);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * wallet_get_lastblk --
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+wallet_get_lastblk(const struct wallet *wallet,
+                   uint256 *hash)
+{
+   return txdb_get_lastblk(wallet->txdb, hash);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -35,6 +35,10 @@ bool wallet_is_pubkey_hash160_mine(const struct wallet *wallet, const uint160 *p
 bool wallet_is_pubkey_spendable(const struct wallet *wallet, const uint160 *pub_key);
 int  wallet_craft_tx(struct wallet *wlt, const struct btc_tx_desc *tx_desc, btc_msg_tx *tx);
 void wallet_confirm_tx_in_block(struct wallet *wallet, const btc_msg_merkleblock *blk);
+void wallet_begin_block(struct wallet *wallet);
+int  wallet_commit_block(struct wallet *wallet, const uint256 *lastBlk);
+int  wallet_flush(struct wallet *wallet);
+bool wallet_get_lastblk(const struct wallet *wallet, uint256 *hash);
 struct key * wallet_lookup_pubkey(const struct wallet *wallet, const uint160 *pub_key);
 bool wallet_verify(struct secure_area *pass, enum wallet_state *wlt_state);
 int wallet_encrypt(struct wallet *wallet, struct secure_area *pass);